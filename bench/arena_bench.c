@@ -0,0 +1,78 @@
+// arena_alloc and Push throughput.
+
+#include <stdlib.h>
+
+#include "arena.h"
+#include "bench.h"
+
+static void alloc_fixed(ssize size) {
+  int64_t n = bench_scaled(1 << 22);
+  ssize cap = (ssize)n * (size + 16);
+  byte *heap = malloc((size_t)cap);
+  Bench b = bench_new("arena_alloc", "size=%td", size);
+  while (bench_trial(&b)) {
+    Arena a = newarena(&(byte *){heap}, cap);
+    bench_clock(&b);
+    uint64_t sum = 0;
+    for (int64_t i = 0; i < n; i++) {
+      byte *p = arena_alloc(&a, size, 8, 1, NOINIT);
+      sum += (uintptr_t)p;
+    }
+    bench_done(&b, n, 0);
+    bench_sink(sum);
+  }
+  free(heap);
+}
+
+static void alloc_chained(ssize size) {
+  int64_t n = bench_scaled(1 << 22);
+  Bench b = bench_new("arena_alloc", "size=%td,chained", size);
+  while (bench_trial(&b)) {
+    ArenaChain chain = {0};
+    Arena a = newchain(&chain, 1 << 20);
+    bench_clock(&b);
+    uint64_t sum = 0;
+    for (int64_t i = 0; i < n; i++) {
+      byte *p = arena_alloc(&a, size, 8, 1, NOINIT);
+      sum += (uintptr_t)p;
+    }
+    bench_done(&b, n, 0);
+    bench_sink(sum);
+    arena_release(&a);
+  }
+}
+
+// Push one element at a time into a slice that grows from empty, alone in
+// its arena so that it grows in place, and interleaved with another slice so
+// that growing has to copy.
+static void push(bool interleaved) {
+  int64_t n = bench_scaled(1 << 24);
+  ssize cap = (ssize)n * 8 * 6;
+  byte *heap = malloc((size_t)cap);
+  Bench b = bench_new("arena_push", "elem=8%s", interleaved ? ",interleaved" : "");
+  while (bench_trial(&b)) {
+    Arena a = newarena(&(byte *){heap}, cap);
+    struct {
+      int64_t *data;
+      ssize len;
+      ssize cap;
+    } s = {0}, t = {0};
+    bench_clock(&b);
+    for (int64_t i = 0; i < n; i++) {
+      *Push(&s, &a) = i;
+      if (interleaved && (i & 1023) == 0) *Push(&t, &a) = i;
+    }
+    bench_done(&b, n, n * 8);
+    bench_sink((uint64_t)s.data[n - 1] + (uint64_t)t.len);
+  }
+  free(heap);
+}
+
+void bench_arena(void) {
+  alloc_fixed(16);
+  alloc_fixed(64);
+  alloc_fixed(256);
+  alloc_chained(64);
+  push(false);
+  push(true);
+}
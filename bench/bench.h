@@ -0,0 +1,78 @@
+// Benchmark harness. Every result is printed as one JSON object per line, so
+// the output of two commits can be diffed or loaded into anything.
+//
+// BENCH_TRIALS   number of timed trials of each case, def: 5
+// BENCH_SCALE    multiplier of the default workload sizes, def: 1
+//
+// Rates are derived from the fastest trial.
+
+/** Usage:
+
+  Bench b = bench_new("thing_insert", "size=%d", size);
+  while (bench_trial(&b)) {
+    setup();             // not timed
+    bench_clock(&b);
+    for (...) work();
+    bench_done(&b, ops, bytes);
+    teardown();          // not timed
+  }
+
+*/
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BENCH_MAXTRIALS 32
+
+typedef struct Bench Bench;
+struct Bench {
+  const char *name;
+  char params[96];
+  int trials;
+  int trial;
+  int64_t start;
+  int64_t ops;    // operations of the last trial
+  int64_t bytes;  // bytes processed by the last trial, if it is a throughput
+  int64_t ns[BENCH_MAXTRIALS];
+};
+
+Bench bench_new(const char *name, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Returns true while trials remain, printing the result after the last one.
+bool bench_trial(Bench *b);
+
+// Starts timing the current trial.
+void bench_clock(Bench *b);
+
+// Stops timing the current trial, which did ops operations over bytes.
+void bench_done(Bench *b, int64_t ops, int64_t bytes);
+
+// Monotonic nanoseconds.
+int64_t bench_now(void);
+
+// Scales a default workload size by BENCH_SCALE, never below 1.
+int64_t bench_scaled(int64_t n);
+
+// Keeps results alive so that the work producing them is not optimized away.
+void bench_sink(uint64_t v);
+
+// Deterministic PRNG shared by the suites, splitmix64.
+static inline uint64_t bench_rand(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  return z ^ (z >> 31);
+}
+
+void bench_arena(void);
+void bench_json(void);
+void bench_neco(void);
+void bench_bgen(void);
+void bench_verstable(void);
+
+#endif
@@ -0,0 +1,125 @@
+// bgen insert, lookup and iteration at several fanouts.
+
+#include <stdlib.h>
+
+#include "bench.h"
+
+#define BGEN_NAME bt16
+#define BGEN_TYPE uint64_t
+#define BGEN_FANOUT 16
+#define BGEN_LESS return a < b;
+#define BGEN_NUMERIC
+#include "bgen.h"
+
+#define BGEN_NAME bt32
+#define BGEN_TYPE uint64_t
+#define BGEN_FANOUT 32
+#define BGEN_LESS return a < b;
+#define BGEN_NUMERIC
+#include "bgen.h"
+
+#define BGEN_NAME bt64
+#define BGEN_TYPE uint64_t
+#define BGEN_FANOUT 64
+#define BGEN_LESS return a < b;
+#define BGEN_NUMERIC
+#include "bgen.h"
+
+#define BGEN_NAME bt128
+#define BGEN_TYPE uint64_t
+#define BGEN_FANOUT 128
+#define BGEN_LESS return a < b;
+#define BGEN_NUMERIC
+#include "bgen.h"
+
+static bool sum_item(uint64_t item, void *udata) {
+  *(uint64_t *)udata += item;
+  return true;
+}
+
+// Keys are inserted in random order and looked up in a different random
+// order, so that lookups do not follow the insertion path. Misses are odd
+// keys, which are never inserted.
+#define BENCH_BTREE(bt, fanout)                                                       \
+  static void bench_##bt(const uint64_t *keys, const uint64_t *probe, int64_t n) {    \
+    struct bt *root = 0;                                                              \
+    Bench b = bench_new("bgen_insert", "fanout=%d,items=%lld", fanout, (long long)n); \
+    while (bench_trial(&b)) {                                                         \
+      bt##_clear(&root, 0);                                                           \
+      bench_clock(&b);                                                                \
+      for (int64_t i = 0; i < n; i++) bt##_insert(&root, keys[i], 0, 0);              \
+      bench_done(&b, n, 0);                                                           \
+    }                                                                                 \
+    b = bench_new("bgen_get", "fanout=%d,items=%lld,hit", fanout, (long long)n);      \
+    while (bench_trial(&b)) {                                                         \
+      uint64_t found = 0;                                                             \
+      bench_clock(&b);                                                                \
+      for (int64_t i = 0; i < n; i++) {                                               \
+        found += bt##_get(&root, probe[i], 0, 0) == bt##_FOUND;                       \
+      }                                                                               \
+      bench_done(&b, n, 0);                                                           \
+      bench_sink(found);                                                              \
+    }                                                                                 \
+    b = bench_new("bgen_get", "fanout=%d,items=%lld,miss", fanout, (long long)n);     \
+    while (bench_trial(&b)) {                                                         \
+      uint64_t found = 0;                                                             \
+      bench_clock(&b);                                                                \
+      for (int64_t i = 0; i < n; i++) {                                               \
+        found += bt##_get(&root, probe[i] | 1, 0, 0) == bt##_FOUND;                   \
+      }                                                                               \
+      bench_done(&b, n, 0);                                                           \
+      bench_sink(found);                                                              \
+    }                                                                                 \
+    b = bench_new("bgen_scan", "fanout=%d,items=%lld", fanout, (long long)n);         \
+    while (bench_trial(&b)) {                                                         \
+      uint64_t sum = 0;                                                               \
+      bench_clock(&b);                                                                \
+      bt##_scan(&root, sum_item, &sum);                                               \
+      bench_done(&b, n, n * (int64_t)sizeof(uint64_t));                               \
+      bench_sink(sum);                                                                \
+    }                                                                                 \
+    b = bench_new("bgen_iter", "fanout=%d,items=%lld", fanout, (long long)n);         \
+    while (bench_trial(&b)) {                                                         \
+      uint64_t sum = 0, item;                                                         \
+      bench_clock(&b);                                                                \
+      struct bt##_iter *iter;                                                         \
+      bt##_iter_init(&root, &iter, 0);                                                \
+      for (bt##_iter_scan(iter); bt##_iter_valid(iter); bt##_iter_next(iter)) {       \
+        bt##_iter_item(iter, &item);                                                  \
+        sum += item;                                                                  \
+      }                                                                               \
+      bt##_iter_release(iter);                                                        \
+      bench_done(&b, n, n * (int64_t)sizeof(uint64_t));                               \
+      bench_sink(sum);                                                                \
+    }                                                                                 \
+    bt##_clear(&root, 0);                                                             \
+  }
+
+BENCH_BTREE(bt16, 16)
+BENCH_BTREE(bt32, 32)
+BENCH_BTREE(bt64, 64)
+BENCH_BTREE(bt128, 128)
+
+static void shuffle(uint64_t *a, int64_t n, uint64_t seed) {
+  for (int64_t i = n - 1; i > 0; i--) {
+    int64_t j = (int64_t)(bench_rand(&seed) % (uint64_t)(i + 1));
+    uint64_t t = a[i];
+    a[i] = a[j];
+    a[j] = t;
+  }
+}
+
+void bench_bgen(void) {
+  int64_t n = bench_scaled(1 << 20);
+  uint64_t *keys = malloc((size_t)n * sizeof(*keys));
+  uint64_t *probe = malloc((size_t)n * sizeof(*probe));
+  for (int64_t i = 0; i < n; i++) keys[i] = probe[i] = (uint64_t)i * 2;
+  shuffle(keys, n, 1);
+  shuffle(probe, n, 2);
+  bench_bt16(keys, probe, n);
+  bench_bt32(keys, probe, n);
+  bench_bt64(keys, probe, n);
+  bench_bt128(keys, probe, n);
+  free(keys);
+  free(probe);
+}
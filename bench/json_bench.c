@@ -0,0 +1,192 @@
+// json_validn and json_getn throughput.
+//
+// The built-in corpora are generated to resemble common documents: API
+// records with nested objects, coordinate arrays full of floats, and chat
+// messages with long escaped and non-ASCII strings. Real documents can be
+// measured too by listing them in BENCH_JSON, separated by colons.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "json.h"
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} Buf;
+
+static void buf_printf(Buf *b, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void buf_printf(Buf *b, const char *fmt, ...) {
+  for (;;) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, args);
+    va_end(args);
+    if (n >= 0 && (size_t)n < b->cap - b->len) {
+      b->len += (size_t)n;
+      return;
+    }
+    b->cap = b->cap ? b->cap * 2 : 1 << 16;
+    b->data = realloc(b->data, b->cap);
+    if (!b->data) abort();
+  }
+}
+
+static const char *words[] = {"lorem", "ipsum", "dolor", "sit", "amet", "consectetur",
+                              "adipiscing", "elit", "sed", "do", "eiusmod", "tempor"};
+
+// Every corpus is an object whose last member is "meta", so that getting
+// "meta.count" has to walk the whole document.
+static Buf make_records(size_t target) {
+  Buf b = {0};
+  uint64_t rng = 1;
+  buf_printf(&b, "{\"items\":[");
+  int n = 0;
+  while (b.len < target) {
+    uint64_t r = bench_rand(&rng);
+    buf_printf(&b,
+               "%s{\"id\":%d,\"name\":\"user_%d\",\"email\":\"user%d@example.com\","
+               "\"active\":%s,\"score\":%.4f,\"created\":\"2024-%02d-%02dT10:%02d:00Z\","
+               "\"tags\":[\"%s\",\"%s\",\"%s\"],"
+               "\"address\":{\"street\":\"%d %s St\",\"city\":\"%s\",\"zip\":\"%05d\","
+               "\"geo\":{\"lat\":%.6f,\"lng\":%.6f}},\"friends\":[%d,%d,%d,%d],\"manager\":null}",
+               n ? "," : "", n, n, n, r & 1 ? "true" : "false", (double)(r % 100000) / 1000,
+               (int)(r % 12) + 1, (int)(r % 28) + 1, (int)(r % 60), words[r % 12],
+               words[(r >> 8) % 12], words[(r >> 16) % 12], (int)(r % 9999), words[(r >> 24) % 12],
+               words[(r >> 32) % 12], (int)(r % 100000), (double)(r % 180000) / 1000 - 90,
+               (double)(r % 360000) / 1000 - 180, (int)(r % 1000), (int)(r >> 10) % 1000,
+               (int)(r >> 20) % 1000, (int)(r >> 30) % 1000);
+    n++;
+  }
+  buf_printf(&b, "],\"meta\":{\"count\":%d}}", n);
+  return b;
+}
+
+static Buf make_numbers(size_t target) {
+  Buf b = {0};
+  uint64_t rng = 2;
+  buf_printf(&b, "{\"type\":\"MultiLineString\",\"coordinates\":[");
+  int n = 0;
+  while (b.len < target) {
+    buf_printf(&b, "%s[", n ? "," : "");
+    for (int i = 0; i < 64; i++) {
+      uint64_t r = bench_rand(&rng);
+      buf_printf(&b, "%s[%.14g,%.14g]", i ? "," : "", -65.61361 - (double)(r & 0xffff) / 1e6,
+                 43.42027 + (double)(r >> 48) / 1e6);
+    }
+    buf_printf(&b, "]");
+    n++;
+  }
+  buf_printf(&b, "],\"meta\":{\"count\":%d}}", n);
+  return b;
+}
+
+static Buf make_text(size_t target) {
+  Buf b = {0};
+  uint64_t rng = 3;
+  buf_printf(&b, "{\"messages\":[");
+  int n = 0;
+  while (b.len < target) {
+    buf_printf(&b, "%s{\"id\":\"%016llx\",\"user\":\"%s\",\"text\":\"", n ? "," : "",
+               (unsigned long long)bench_rand(&rng), words[n % 12]);
+    int nwords = 20 + (int)(bench_rand(&rng) % 80);
+    for (int i = 0; i < nwords; i++) {
+      uint64_t r = bench_rand(&rng);
+      switch (r % 16) {
+        case 0: buf_printf(&b, "\\\"%s\\\" ", words[(r >> 8) % 12]); break;
+        case 1: buf_printf(&b, "\\n"); break;
+        case 2: buf_printf(&b, "caf\xc3\xa9 "); break;
+        case 3: buf_printf(&b, "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e "); break;
+        case 4: buf_printf(&b, "\\u00e9\\ud83d\\ude00 "); break;
+        default: buf_printf(&b, "%s ", words[(r >> 8) % 12]); break;
+      }
+    }
+    buf_printf(&b, "\",\"reactions\":%d}", (int)(bench_rand(&rng) % 50));
+    n++;
+  }
+  buf_printf(&b, "],\"meta\":{\"count\":%d}}", n);
+  return b;
+}
+
+static Buf load_file(const char *path) {
+  Buf b = {0};
+  FILE *f = fopen(path, "rb");
+  if (!f) return b;
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  b.data = malloc((size_t)size + 1);
+  if (b.data && fread(b.data, 1, (size_t)size, f) == (size_t)size) {
+    b.len = (size_t)size;
+    b.data[b.len] = 0;
+  } else {
+    free(b.data);
+    b.data = 0;
+  }
+  fclose(f);
+  return b;
+}
+
+static void run_corpus(const char *corpus, Buf *doc, const char *path) {
+  int64_t reps = bench_scaled(8);
+  Bench b = bench_new("json_validn", "corpus=%s,size=%zu", corpus, doc->len);
+  while (bench_trial(&b)) {
+    bench_clock(&b);
+    uint64_t ok = 0;
+    for (int64_t i = 0; i < reps; i++) ok += json_validn(doc->data, doc->len);
+    bench_done(&b, reps, reps * (int64_t)doc->len);
+    bench_sink(ok);
+  }
+  if (!path) return;
+  b = bench_new("json_getn", "corpus=%s,size=%zu,path=%s", corpus, doc->len, path);
+  while (bench_trial(&b)) {
+    bench_clock(&b);
+    uint64_t sum = 0;
+    for (int64_t i = 0; i < reps; i++) {
+      sum += (uint64_t)json_int64(json_getn(doc->data, doc->len, path));
+    }
+    bench_done(&b, reps, reps * (int64_t)doc->len);
+    bench_sink(sum);
+  }
+}
+
+void bench_json(void) {
+  size_t target = (size_t)bench_scaled(16 << 20);
+  struct {
+    const char *name;
+    Buf (*make)(size_t);
+  } corpora[] = {
+      {"records", make_records},
+      {"numbers", make_numbers},
+      {"text", make_text},
+  };
+  for (size_t i = 0; i < sizeof(corpora) / sizeof(*corpora); i++) {
+    Buf doc = corpora[i].make(target);
+    if (!json_validn(doc.data, doc.len)) {
+      fprintf(stderr, "bench: generated %s corpus is invalid\n", corpora[i].name);
+      abort();
+    }
+    run_corpus(corpora[i].name, &doc, "meta.count");
+    free(doc.data);
+  }
+
+  const char *env = getenv("BENCH_JSON");
+  if (!env) return;
+  char *paths = strdup(env);
+  for (char *path = strtok(paths, ":"); path; path = strtok(0, ":")) {
+    Buf doc = load_file(path);
+    if (!doc.data) {
+      fprintf(stderr, "bench: cannot read %s\n", path);
+      continue;
+    }
+    const char *name = strrchr(path, '/');
+    run_corpus(name ? name + 1 : path, &doc, 0);
+    free(doc.data);
+  }
+  free(paths);
+}
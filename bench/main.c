@@ -0,0 +1,119 @@
+// Runs the benchmark suites whose names contain one of the arguments, or all
+// of them without arguments.
+//
+//   build/bench/main               # everything
+//   build/bench/main json neco    # only the json and neco suites
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+
+#ifndef BENCH_COMMIT
+#define BENCH_COMMIT ""
+#endif
+
+static const struct {
+  const char *name;
+  void (*run)(void);
+} suites[] = {
+    {"arena", bench_arena},
+    {"json", bench_json},
+    {"neco", bench_neco},
+    {"bgen", bench_bgen},
+    {"verstable", bench_verstable},
+};
+
+static int trials = 5;
+static double scale = 1;
+static volatile uint64_t sink;
+
+int64_t bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int64_t bench_scaled(int64_t n) {
+  int64_t scaled = (int64_t)((double)n * scale);
+  return scaled > 0 ? scaled : 1;
+}
+
+void bench_sink(uint64_t v) { sink += v; }
+
+Bench bench_new(const char *name, const char *fmt, ...) {
+  Bench b = {.name = name, .trials = trials, .trial = -1};
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(b.params, sizeof(b.params), fmt, args);
+  va_end(args);
+  return b;
+}
+
+void bench_clock(Bench *b) { b->start = bench_now(); }
+
+void bench_done(Bench *b, int64_t ops, int64_t bytes) {
+  b->ns[b->trial] = bench_now() - b->start;
+  b->ops = ops;
+  b->bytes = bytes;
+}
+
+static int cmp_i64(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static void report(Bench *b) {
+  int64_t ns[BENCH_MAXTRIALS];
+  memcpy(ns, b->ns, sizeof(ns));
+  qsort(ns, (size_t)b->trials, sizeof(*ns), cmp_i64);
+  int64_t best = ns[0] > 0 ? ns[0] : 1;
+  double secs = (double)best / 1e9;
+  printf("{\"bench\":\"%s\",\"params\":\"%s\",\"ops\":%lld,\"bytes\":%lld,"
+         "\"trials\":%d,\"ns_min\":%lld,\"ns_median\":%lld,"
+         "\"ns_per_op\":%.3f,\"ops_per_sec\":%.0f",
+         b->name, b->params, (long long)b->ops, (long long)b->bytes,
+         b->trials, (long long)ns[0], (long long)ns[b->trials / 2],
+         (double)best / (double)(b->ops > 0 ? b->ops : 1),
+         (double)b->ops / secs);
+  if (b->bytes > 0) printf(",\"gb_per_sec\":%.3f", (double)b->bytes / secs / 1e9);
+  printf("}\n");
+  fflush(stdout);
+}
+
+bool bench_trial(Bench *b) {
+  if (++b->trial < b->trials) return true;
+  report(b);
+  return false;
+}
+
+static bool selected(const char *name, int argc, char **argv) {
+  if (argc < 2) return true;
+  for (int i = 1; i < argc; i++) {
+    if (strstr(name, argv[i])) return true;
+  }
+  return false;
+}
+
+int main(int argc, char **argv) {
+  const char *env = getenv("BENCH_TRIALS");
+  if (env) trials = atoi(env);
+  if (trials < 1) trials = 1;
+  if (trials > BENCH_MAXTRIALS) trials = BENCH_MAXTRIALS;
+  env = getenv("BENCH_SCALE");
+  if (env) scale = atof(env);
+  if (scale <= 0) scale = 1;
+
+  printf("{\"meta\":{\"commit\":\"%s\",\"compiler\":\"%s\",\"trials\":%d,"
+         "\"scale\":%g,\"time\":%lld}}\n",
+         BENCH_COMMIT, __VERSION__, trials, scale, (long long)time(NULL));
+  fflush(stdout);
+
+  for (size_t i = 0; i < sizeof(suites) / sizeof(*suites); i++) {
+    if (selected(suites[i].name, argc, argv)) suites[i].run();
+  }
+  return 0;
+}
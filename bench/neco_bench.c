@@ -0,0 +1,174 @@
+// neco channel latency and echo-server connection rate.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "neco.h"
+
+static void pong(int argc, void *argv[]) {
+  neco_chan *ping = argv[0], *pong = argv[1];
+  int64_t v;
+  while (neco_chan_recv(ping, &v) == NECO_OK && v >= 0) neco_chan_send(pong, &v);
+}
+
+static void pingpong(int argc, void *argv[]) {
+  size_t capacity = *(size_t *)argv[0];
+  int64_t n = bench_scaled(1 << 20);
+  Bench b = bench_new("neco_chan_pingpong", "capacity=%zu", capacity);
+  while (bench_trial(&b)) {
+    neco_chan *ping, *pong_;
+    neco_chan_make(&ping, sizeof(int64_t), capacity);
+    neco_chan_make(&pong_, sizeof(int64_t), capacity);
+    neco_start(pong, 2, ping, pong_);
+    bench_clock(&b);
+    uint64_t sum = 0;
+    for (int64_t i = 0; i < n; i++) {
+      int64_t v = i;
+      neco_chan_send(ping, &v);
+      neco_chan_recv(pong_, &v);
+      sum += (uint64_t)v;
+    }
+    bench_done(&b, n, 0);
+    bench_sink(sum);
+    int64_t stop = -1;
+    neco_chan_send(ping, &stop);
+    neco_chan_release(ping);
+    neco_chan_release(pong_);
+  }
+}
+
+static void consume(int argc, void *argv[]) {
+  neco_chan *ch = argv[0];
+  neco_waitgroup *wg = argv[1];
+  int64_t v;
+  uint64_t sum = 0;
+  while (neco_chan_recv(ch, &v) == NECO_OK && v >= 0) sum += (uint64_t)v;
+  bench_sink(sum);
+  neco_waitgroup_done(wg);
+}
+
+// One producer hands every message to each of k consumers, each on its own
+// unbuffered channel, so an operation is one delivered message.
+static void fanout(int argc, void *argv[]) {
+  int k = *(int *)argv[0];
+  int64_t n = bench_scaled((1 << 20) / k);
+  neco_chan *chans[64];
+  Bench b = bench_new("neco_chan_fanout", "consumers=%d", k);
+  while (bench_trial(&b)) {
+    neco_waitgroup wg;
+    neco_waitgroup_init(&wg);
+    neco_waitgroup_add(&wg, k);
+    for (int j = 0; j < k; j++) {
+      neco_chan_make(&chans[j], sizeof(int64_t), 0);
+      neco_start(consume, 2, chans[j], &wg);
+    }
+    bench_clock(&b);
+    for (int64_t i = 0; i < n; i++) {
+      for (int j = 0; j < k; j++) neco_chan_send(chans[j], &i);
+    }
+    int64_t stop = -1;
+    for (int j = 0; j < k; j++) neco_chan_send(chans[j], &stop);
+    neco_waitgroup_wait(&wg);
+    bench_done(&b, n * k, 0);
+    for (int j = 0; j < k; j++) neco_chan_release(chans[j]);
+  }
+}
+
+#define ECHO_SIZE 64
+
+static void echo(int argc, void *argv[]) {
+  int fd = *(int *)argv[0];
+  char buf[ECHO_SIZE];
+  ssize_t n;
+  while ((n = neco_read(fd, buf, sizeof(buf))) > 0) {
+    if (neco_write(fd, buf, (size_t)n) != n) break;
+  }
+  close(fd);
+}
+
+static void server(int argc, void *argv[]) {
+  int ln = *(int *)argv[0];
+  for (;;) {
+    int fd = neco_accept(ln, 0, 0);
+    if (fd < 0) break;
+    neco_start(echo, 1, &fd);
+  }
+}
+
+// Each connection sends one message and waits for its echo before closing.
+static void client(int argc, void *argv[]) {
+  const char *addr = argv[0];
+  int64_t conns = *(int64_t *)argv[1];
+  neco_waitgroup *wg = argv[2];
+  int64_t *failed = argv[3];
+  char msg[ECHO_SIZE] = {0}, buf[ECHO_SIZE];
+  for (int64_t i = 0; i < conns; i++) {
+    int fd = neco_dial("tcp", addr);
+    if (fd < 0) {
+      (*failed)++;
+      continue;
+    }
+    size_t got = 0;
+    if (neco_write(fd, msg, sizeof(msg)) == sizeof(msg)) {
+      ssize_t n;
+      while (got < sizeof(buf) && (n = neco_read(fd, buf + got, sizeof(buf) - got)) > 0) {
+        got += (size_t)n;
+      }
+    }
+    if (got != sizeof(buf)) (*failed)++;
+    close(fd);
+  }
+  neco_waitgroup_done(wg);
+}
+
+static void echoserver(int argc, void *argv[]) {
+  int nclients = *(int *)argv[0];
+  int ln = neco_serve("tcp", "127.0.0.1:0");
+  if (ln < 0) {
+    fprintf(stderr, "bench: neco_serve: %s\n", neco_strerror(ln));
+    return;
+  }
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+  getsockname(ln, (struct sockaddr *)&sin, &len);
+  char addr[32];
+  snprintf(addr, sizeof(addr), "127.0.0.1:%d", ntohs(sin.sin_port));
+  neco_start(server, 1, &ln);
+  int64_t serverid = neco_lastid();
+
+  int64_t per = bench_scaled(20000) / nclients;
+  per = per > 0 ? per : 1;
+  Bench b = bench_new("neco_echo_connect", "clients=%d,msg=%d", nclients, ECHO_SIZE);
+  while (bench_trial(&b)) {
+    neco_waitgroup wg;
+    neco_waitgroup_init(&wg);
+    neco_waitgroup_add(&wg, nclients);
+    int64_t failed = 0;
+    bench_clock(&b);
+    for (int i = 0; i < nclients; i++) neco_start(client, 4, addr, &per, &wg, &failed);
+    neco_waitgroup_wait(&wg);
+    bench_done(&b, per * nclients - failed, 0);
+    if (failed) fprintf(stderr, "bench: %lld echo connections failed\n", (long long)failed);
+  }
+  neco_cancel(serverid);
+  close(ln);
+}
+
+void bench_neco(void) {
+  size_t capacities[] = {0, 64};
+  for (size_t i = 0; i < sizeof(capacities) / sizeof(*capacities); i++) {
+    neco_start(pingpong, 1, &capacities[i]);
+  }
+  int consumers[] = {1, 8, 64};
+  for (size_t i = 0; i < sizeof(consumers) / sizeof(*consumers); i++) {
+    neco_start(fanout, 1, &consumers[i]);
+  }
+  int clients[] = {1, 16};
+  for (size_t i = 0; i < sizeof(clients) / sizeof(*clients); i++) {
+    neco_start(echoserver, 1, &clients[i]);
+  }
+}
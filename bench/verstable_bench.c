@@ -0,0 +1,62 @@
+// verstable hit and miss lookups at several load factors.
+
+#include <stdlib.h>
+
+#include "bench.h"
+
+#define NAME u64map
+#define KEY_TY uint64_t
+#define VAL_TY uint64_t
+#include "verstable.h"
+
+// Every table has the same bucket count and is filled to the given fraction
+// of it, so lookups hit progressively longer chains at the same memory size.
+static void lookups(size_t buckets, double load, const uint64_t *keys,
+                    const uint64_t *misses) {
+  u64map table;
+  u64map_init(&table);
+  u64map_reserve(&table, (size_t)((double)buckets * 0.875));
+  buckets = u64map_bucket_count(&table);
+  int64_t n = (int64_t)((double)buckets * load);
+  for (int64_t i = 0; i < n; i++) u64map_insert(&table, keys[i], (uint64_t)i);
+  load = (double)u64map_size(&table) / (double)u64map_bucket_count(&table);
+
+  const struct {
+    const char *name;
+    const uint64_t *keys;
+  } cases[] = {{"hit", keys}, {"miss", misses}};
+  for (size_t c = 0; c < sizeof(cases) / sizeof(*cases); c++) {
+    const uint64_t *probe = cases[c].keys;
+    Bench b = bench_new("verstable_get", "load=%.3f,buckets=%zu,%s", load, buckets, cases[c].name);
+    while (bench_trial(&b)) {
+      uint64_t sum = 0;
+      bench_clock(&b);
+      for (int64_t i = 0; i < n; i++) {
+        u64map_itr itr = u64map_get(&table, probe[i]);
+        if (!u64map_is_end(itr)) sum += itr.data->val;
+      }
+      bench_done(&b, n, 0);
+      bench_sink(sum);
+    }
+  }
+  u64map_cleanup(&table);
+}
+
+void bench_verstable(void) {
+  size_t buckets = 8;
+  while (buckets < (size_t)bench_scaled(1 << 21)) buckets *= 2;
+  uint64_t *keys = malloc(buckets * sizeof(*keys));
+  uint64_t *misses = malloc(buckets * sizeof(*misses));
+  uint64_t rng = 1;
+  // Hits are even and misses odd, so a miss can never be found.
+  for (size_t i = 0; i < buckets; i++) {
+    keys[i] = bench_rand(&rng) & ~(uint64_t)1;
+    misses[i] = bench_rand(&rng) | 1;
+  }
+  double loads[] = {0.25, 0.5, 0.75, 0.875};
+  for (size_t i = 0; i < sizeof(loads) / sizeof(*loads); i++) {
+    lookups(buckets, loads[i], keys, misses);
+  }
+  free(keys);
+  free(misses);
+}
@@ -20,6 +20,15 @@
 #include <assert.h>
 #endif
 
+#if __has_include(<sys/mman.h>)
+#include <sys/mman.h>
+#include <unistd.h>
+#define ARENA_MMAP
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#endif
+
 #ifdef __GNUC__
 static void autofree_impl(void *p) { free(*((void **)p)); }
 #define autofree __attribute__((__cleanup__(autofree_impl)))
@@ -39,17 +48,83 @@ static void autofree_impl(void *p) { free(*((void **)p)); }
 typedef ptrdiff_t ssize;
 typedef unsigned char byte;
 
+// Counters of every arena sharing them. inuse and peak have the resolution
+// of arena_rewind() and ARENA_PUSH scopes.
+typedef struct ArenaStats ArenaStats;
+struct ArenaStats {
+  ssize allocs;     // successful allocations
+  ssize bytes;      // bytes handed out, padding excluded
+  ssize padding;    // bytes wasted on alignment
+  ssize inuse;      // bytes handed out and not rewound, padding included
+  ssize peak;       // high-water mark of inuse
+  ssize grows;      // slice_grow calls
+  ssize copies;     // slice_grow calls that had to move the slice
+  ssize copied;     // bytes moved by those copies
+  ssize maxcopy;    // largest single copy
+  const char *maxcopysite;  // Push() site of the largest copy
+};
+
+typedef struct ArenaBlock ArenaBlock;
+struct ArenaBlock {
+  ArenaBlock *next;
+  ssize size;
+  byte *cursor;  // of a scratch that moved here from its parent's end
+};
+
+// Backing store of a chained arena. The owner's cursor and the end of the
+// current block live here, so every copy of the arena sees a new block.
+typedef struct ArenaChain ArenaChain;
+struct ArenaChain {
+  byte *beg;
+  byte *end;
+  ArenaBlock *blocks;
+  ArenaBlock *spare;
+  ssize blocksize;
+  void *(*alloc)(ssize size, void *ctx);
+  void (*free)(void *ptr, ssize size, void *ctx);
+  void *ctx;
+  ArenaStats stats;
+};
+
 typedef struct Arena Arena;
 struct Arena {
   byte **beg;
   byte *end;
   void **jmpbuf;
   Arena *parent;
+  ArenaChain *chain;
+  ArenaStats *stats;
+};
+
+// Region of a mapped arena, its cursor lives here.
+typedef struct ArenaMap ArenaMap;
+struct ArenaMap {
+  byte *beg;
+  byte *base;
+  ssize size;
+};
+
+enum {
+  ARENA_HUGETLB = 1 << 0,    // MAP_HUGETLB, plain pages if none are reserved
+  ARENA_HUGEPAGES = 1 << 1,  // transparent huge pages, MADV_HUGEPAGE
+  ARENA_PREFAULT = 1 << 2,   // fault every page in up front
+};
+
+typedef struct ArenaMark ArenaMark;
+struct ArenaMark {
+  byte **beg;
+  byte *pos;
+  byte *end;
+  Arena *parent;
+  ArenaBlock *blocks;
+  ArenaStats *stats;
+  ssize inuse;
 };
 
 enum {
   SOFTFAIL = 1 << 0,
   NOINIT = 1 << 1,
+  NOGROW = 1 << 2,
 };
 
 /** Usage:
@@ -68,8 +143,45 @@ enum {
   thing *y = New(&scratch, thing);
   thing *z = helper(scratch);
 
+  ArenaMark m = arena_mark(&scratch);
+  ...
+  arena_rewind(&scratch, m);
+
   free(heap);
 
+  Chained mode grows by pulling blocks from chain.alloc (malloc by default):
+
+  ArenaChain chain = {0};
+  Arena arena = newchain(&chain, 1 << 20);
+  ...
+  arena_reset(&arena);    // keep blocks for reuse
+  arena_release(&arena);  // give blocks back to chain.free
+
+  Large arenas can be mapped directly, optionally on huge pages, prefaulted
+  and bound to a NUMA node (-1 for any):
+
+  ArenaMap map = {0};
+  Arena big = newmapped(&map, 4L << 30, ARENA_HUGEPAGES | ARENA_PREFAULT, 0);
+  ...
+  arena_map_reset(&big, &map, 64 << 20);  // keep 64MB resident
+  arena_unmap(&map);
+
+  Objects of one size that come and go, like tree nodes, can be recycled
+  through a pool on top of any arena:
+
+  Pool nodes = newpool(&arena, sizeof(node), _Alignof(node));
+  node *n = pool_alloc(&nodes, 0);
+  pool_free(&nodes, n);
+  ...
+  arena_reset(&arena);  // frees every node at once
+  pool_reset(&nodes);
+
+  Counters are kept by whatever ArenaStats the arena points to, chained
+  arenas point at chain.stats:
+
+  ArenaStats stats = {0};
+  global.stats = &stats;
+
 */
 
 #define New(...)                       ARENA_NEWX(__VA_ARGS__, ARENA_NEW4, ARENA_NEW3, ARENA_NEW2)(__VA_ARGS__)
@@ -85,20 +197,63 @@ enum {
     !a_->jmpbuf || setjmp(a_->jmpbuf);                                         \
   })
 
+#ifdef __GNUC__
+#define ARENA_POP __attribute__((__cleanup__(arena_pop_impl)))
+#else
+#define ARENA_POP
+#endif
+
 #define ARENA_PUSH(NAME)                                                       \
   Arena NAME_##__LINE__ = NAME;                                                \
   Arena NAME = NAME_##__LINE__;                                                \
-  NAME.beg = &(byte *) { *(NAME_##__LINE__).beg }
+  arena_sync(&NAME);                                                           \
+  NAME.beg = &(byte *) { *(NAME_##__LINE__).beg };                             \
+  ArenaMark ARENA_POP NAME_##__LINE__##_mark = arena_mark(&NAME)
+
+#define ARENA_STR_(X) #X
+#define ARENA_STR(X) ARENA_STR_(X)
+#define ARENA_SITE __FILE__ ":" ARENA_STR(__LINE__)
+
+#ifndef ARENA_SLICE_MIN
+#define ARENA_SLICE_MIN 16
+#endif
 
 #define Push(S, A)                                                             \
   ({                                                                           \
     __typeof__(S) s_ = (S);                                                    \
     if (s_->len >= s_->cap) {                                                  \
-      slice_grow(s_, sizeof(*s_->data), _Alignof(__typeof__(*s_->data)), (A)); \
+      slice_reserve(s_, sizeof(*s_->data), _Alignof(__typeof__(*s_->data)),    \
+                    (A), 1, 0, ARENA_SITE);                                    \
     }                                                                          \
     s_->data + s_->len++;                                                      \
   })
 
+// Reserve(s, arena, n [, flags]) makes room for n more elements up front.
+#define Reserve(...)                       ARENA_RESERVEX(__VA_ARGS__, ARENA_RESERVE4, ARENA_RESERVE3)(__VA_ARGS__)
+#define ARENA_RESERVEX(a, b, c, d, e, ...) e
+#define ARENA_RESERVE3(S, A, N)            ARENA_RESERVE4(S, A, N, 0)
+#define ARENA_RESERVE4(S, A, N, F)                                             \
+  ({                                                                           \
+    __typeof__(S) s_ = (S);                                                    \
+    slice_reserve(s_, sizeof(*s_->data), _Alignof(__typeof__(*s_->data)),      \
+                  (A), (N), (F), ARENA_SITE);                                  \
+  })
+
+// PushN(s, arena, n [, flags]) appends n elements and returns the first,
+// or NULL on a SOFTFAIL. Pass NOINIT when they are about to be overwritten.
+#define PushN(...)                         ARENA_PUSHNX(__VA_ARGS__, ARENA_PUSHN4, ARENA_PUSHN3)(__VA_ARGS__)
+#define ARENA_PUSHNX(a, b, c, d, e, ...)   e
+#define ARENA_PUSHN3(S, A, N)              ARENA_PUSHN4(S, A, N, 0)
+#define ARENA_PUSHN4(S, A, N, F)                                               \
+  ({                                                                           \
+    __typeof__(S) s_ = (S);                                                    \
+    ssize n_ = (N);                                                            \
+    slice_reserve(s_, sizeof(*s_->data), _Alignof(__typeof__(*s_->data)),      \
+                  (A), n_, (F), ARENA_SITE)                                    \
+        ? (s_->len += n_, s_->data + s_->len - n_)                             \
+        : 0;                                                                   \
+  })
+
 #ifdef LOGGING
 #  define ARENA_LOG(A)                                                         \
      fprintf(stderr, "%s:%d: Arena " #A "\tbeg=%ld->%ld end=%ld diff=%ld\n",   \
@@ -118,33 +273,112 @@ static inline Arena newarena(byte **mem, ssize size) {
   return a;
 }
 
+static void *arena_chain_malloc(ssize size, void *ctx) { return malloc(size); }
+static void arena_chain_free(void *ptr, ssize size, void *ctx) { free(ptr); }
+
+static inline Arena newchain(ArenaChain *c, ssize blocksize) {
+  if (!c->alloc) {
+    c->alloc = arena_chain_malloc;
+    c->free = arena_chain_free;
+  }
+  c->blocksize = blocksize;
+
+  Arena a = {0};
+  a.beg = &c->beg;
+  a.end = c->end;
+  a.chain = c;
+  a.stats = &c->stats;
+  return a;
+}
+
 static inline bool isscratch(Arena *a) {
   return !!a->parent;
 }
 
+// Does this arena bump the chain's own cursor (owner) or its end (scratch)?
+static inline bool ischained(Arena *a) {
+  return a->chain && (a->beg == &a->chain->beg || a->beg == &a->chain->end);
+}
+
+// Refresh a chain owner's end, which goes stale when a copy pulls a block.
+static inline void arena_sync(Arena *a) {
+  if (a->chain && a->beg == &a->chain->beg) a->end = a->chain->end;
+}
+
 static inline Arena getscratch(Arena *a) {
   if (isscratch(a)) return *a;
 
+  arena_sync(a);
   Arena scratch = {0};
-  scratch.beg = &a->end;
+  scratch.beg = ischained(a) ? &a->chain->end : &a->end;
   scratch.end = *a->beg;
   scratch.jmpbuf = a->jmpbuf;
   scratch.parent = a;
+  scratch.chain = a->chain;
+  scratch.stats = a->stats;
   return scratch;
 }
 
+// Link a block with room for need bytes, reusing a spare one if possible.
+// Owners and scratches of the chain move to it together; private cursors
+// (ARENA_PUSH copies) move alone and stop deriving their end from a parent.
+// A scratch of such a copy bumps the copy's end, so it takes its cursor
+// along into the block rather than writing the new block into that end.
+static inline bool arena_chain_grow(Arena *a, ssize need) {
+  ArenaChain *c = a->chain;
+  if (need > PTRDIFF_MAX - (ssize)sizeof(ArenaBlock)) return false;
+  ssize size = need + sizeof(ArenaBlock);
+  if (size < c->blocksize) size = c->blocksize;
+
+  ArenaBlock *b = 0;
+  for (ArenaBlock **p = &c->spare; *p; p = &(*p)->next) {
+    if ((*p)->size >= size) {
+      b = *p;
+      *p = b->next;
+      break;
+    }
+  }
+  if (!b) {
+    b = c->alloc(size, c->ctx);
+    if (!b) return false;
+    b->size = size;
+  }
+  b->next = c->blocks;
+  c->blocks = b;
+
+  byte *beg = (byte *)(b + 1);
+  byte *end = (byte *)b + b->size;
+  if (ischained(a)) {
+    c->beg = beg;
+    c->end = end;
+  } else {
+    if (a->parent && a->beg == &a->parent->end) {
+      b->cursor = beg;
+      a->beg = &b->cursor;
+    } else {
+      *a->beg = beg;
+    }
+    a->parent = 0;
+  }
+  a->end = end;
+  return true;
+}
+
 static inline void *arena_alloc(Arena *a, ssize size, ssize align, ssize count, unsigned flags) {
   Arena *arena = a;
   assert(arena);
   byte *ret = 0;
 
+retry:
   if (isscratch(a)) {
     byte *newend = *a->parent->beg;
     if (*a->beg > newend) {
       a->end = newend;
     } else {
-      goto oomjmp;
+      goto oom;
     }
+  } else {
+    arena_sync(a);
   }
 
   int is_forward = *a->beg < a->end;
@@ -152,7 +386,7 @@ static inline void *arena_alloc(Arena *a, ssize size, ssize align, ssize count,
   ssize padding = (is_forward ? -1 : 1) * (uintptr_t)*a->beg & (align - 1);
   bool oom = count > (avail - padding) / size;
   if (oom) {
-    goto oomjmp;
+    goto oom;
   }
 
   // Calculate new position
@@ -161,9 +395,22 @@ static inline void *arena_alloc(Arena *a, ssize size, ssize align, ssize count,
   *a->beg += offset;
   ret = is_forward ? (*a->beg - total_size) : *a->beg;
 
+  if (a->stats) {
+    ArenaStats *st = a->stats;
+    st->allocs++;
+    st->bytes += total_size;
+    st->padding += padding;
+    st->inuse += padding + total_size;
+    if (st->inuse > st->peak) st->peak = st->inuse;
+  }
+
   return flags & NOINIT ? ret : memset(ret, 0, total_size);
 
-oomjmp:
+oom:
+  if (a->chain && !(flags & NOGROW) && count <= (PTRDIFF_MAX - align) / size
+      && arena_chain_grow(a, size * count + align)) {
+    goto retry;
+  }
   if (flags & SOFTFAIL || !a->jmpbuf) return NULL;
 #ifndef OOM
   longjmp(a->jmpbuf, 1);
@@ -172,34 +419,288 @@ oomjmp:
 #endif
 }
 
-static inline void slice_grow(void *slice, ssize size, ssize align, Arena *a) {
+// Make room for n more elements. Capacity at least doubles, in place when
+// the slice is the last allocation of the arena. Only the new tail beyond len
+// is zeroed, and not even that with NOINIT.
+static inline bool slice_reserve(void *slice, ssize size, ssize align, Arena *a,
+                                 ssize n, unsigned flags, const char *site) {
   struct {
     void *data;
     ssize len;
     ssize cap;
   } replica;
   memcpy(&replica, slice, sizeof(replica));
+  if (replica.cap - replica.len >= n) return true;
+  arena_sync(a);
+
+  ssize need = replica.len + n;
+  ssize cap = replica.cap < PTRDIFF_MAX / 2 ? replica.cap * 2 : need;
+  if (cap < need) cap = need;
+  if (cap < ARENA_SLICE_MIN) cap = ARENA_SLICE_MIN;
+
+  bool inplace = replica.cap
+              && (*a->beg < a->end)          // bump upwards
+              && ((uintptr_t)replica.data == // grow in place
+                  (uintptr_t)*a->beg - size * replica.cap);
+  if (inplace && !arena_alloc(a, size, 1, cap - replica.cap, flags | SOFTFAIL | NOGROW)) {
+    cap = need;
+    inplace = arena_alloc(a, size, 1, cap - replica.cap, flags | SOFTFAIL | NOGROW);
+  }
 
-  const int grow = 16;
-
-  if (!replica.cap) {
-    replica.cap = grow;
-    replica.data = arena_alloc(a, size, align, replica.cap, 0);
-  } else if ((*a->beg < a->end)          // bump upwards
-          && ((uintptr_t)replica.data == // grow in place
-              (uintptr_t)*a->beg - size * replica.cap)) {
-    arena_alloc(a, size, 1, grow, 0);
-    replica.cap += grow;
-  } else {
-    replica.cap += replica.cap / 2;     // grow by 1.5
-    void *dest = arena_alloc(a, size, align, replica.cap, 0);
-    void *src = replica.data;
+  if (!inplace) {
+    byte *dest = arena_alloc(a, size, align, cap, flags | NOINIT);
+    if (!dest) return false;
     ssize len = size * replica.len;
-    memcpy(dest, src, len);
+    if (len) memcpy(dest, replica.data, len);
+    if (!(flags & NOINIT)) memset(dest + len, 0, size * (cap - replica.len));
+    if (replica.cap && a->stats) {
+      ArenaStats *st = a->stats;
+      st->copies++;
+      st->copied += len;
+      if (len > st->maxcopy) {
+        st->maxcopy = len;
+        st->maxcopysite = site;
+      }
+    }
     replica.data = dest;
   }
+  replica.cap = cap;
+  if (a->stats) a->stats->grows++;
 
   memcpy(slice, &replica, sizeof(replica));
+  return true;
+}
+
+static inline void slice_grow(void *slice, ssize size, ssize align, Arena *a) {
+  slice_reserve(slice, size, align, a, 1, 0, 0);
+}
+
+// Remember the arena's position, scratch arenas included.
+static inline ArenaMark arena_mark(Arena *a) {
+  arena_sync(a);
+  ArenaMark m = {0};
+  m.beg = a->beg;
+  if (ischained(a)) {
+    m.pos = a->chain->beg;
+    m.end = a->chain->end;
+    m.blocks = a->chain->blocks;
+  } else {
+    m.pos = *a->beg;
+    m.end = a->end;
+  }
+  m.parent = a->parent;
+  m.stats = a->stats;
+  m.inuse = a->stats ? a->stats->inuse : 0;
+  return m;
+}
+
+// Free everything the arena allocated since the mark, the allocations of its
+// scratch included. A chained arena that pulled blocks since then recycles
+// them.
+static inline void arena_rewind(Arena *a, ArenaMark m) {
+  assert(m.beg == a->beg || a->chain);
+  if (ischained(a)) {
+    ArenaChain *c = a->chain;
+    bool grown = c->blocks != m.blocks;
+    while (c->blocks != m.blocks) {
+      ArenaBlock *b = c->blocks;
+      c->blocks = b->next;
+      b->next = c->spare;
+      c->spare = b;
+    }
+    // Rewinding the owner rewinds the end its scratch bumps too, as without
+    // a chain. Recycled blocks take both cursors back.
+    if (grown || a->beg == &c->beg) c->beg = m.pos;
+    c->end = m.end;
+    arena_sync(a);
+  } else {
+    // A scratch that moved into a block of its own since the mark goes back
+    // to bumping its parent's end.
+    if (a->beg != m.beg) {
+      a->beg = m.beg;
+      a->parent = m.parent;
+    }
+    *a->beg = m.pos;
+    if (!isscratch(a)) a->end = m.end;
+  }
+  if (m.stats) m.stats->inuse = m.inuse;
+}
+
+static void arena_pop_impl(ArenaMark *m) {
+  if (m->stats) m->stats->inuse = m->inuse;
+}
+
+// Recycle every block of a chained arena; the largest becomes current.
+static inline void arena_reset(Arena *a) {
+  ArenaChain *c = a->chain;
+  assert(c);
+  while (c->blocks) {
+    ArenaBlock *b = c->blocks;
+    c->blocks = b->next;
+    b->next = c->spare;
+    c->spare = b;
+  }
+  c->beg = c->end = 0;
+  c->stats.inuse = 0;
+  ssize max = 0;
+  for (ArenaBlock *b = c->spare; b; b = b->next) {
+    if (b->size > max) max = b->size;
+  }
+  Arena owner = newchain(c, c->blocksize);
+  if (max) arena_chain_grow(&owner, max - sizeof(ArenaBlock));
+  a->end = c->end;
+}
+
+// Hand every block of a chained arena back to the backing allocator.
+static inline void arena_release(Arena *a) {
+  ArenaChain *c = a->chain;
+  assert(c);
+  ArenaBlock *lists[] = {c->blocks, c->spare};
+  for (int i = 0; i < 2; i++) {
+    for (ArenaBlock *b = lists[i], *next; b; b = next) {
+      next = b->next;
+      c->free(b, b->size, c->ctx);
+    }
+  }
+  c->blocks = c->spare = 0;
+  c->beg = c->end = 0;
+  c->stats.inuse = 0;
+  a->end = 0;
+}
+
+#ifdef ARENA_MMAP
+#define ARENA_HUGESIZE ((ssize)2 << 20)
+
+static inline ssize arena_pagesize(unsigned flags) {
+  return flags & (ARENA_HUGETLB | ARENA_HUGEPAGES) ? ARENA_HUGESIZE : sysconf(_SC_PAGESIZE);
+}
+
+// Map size bytes (rounded up to the page size) of anonymous memory.
+static inline void *arena_mmap(ssize size, unsigned flags, int node) {
+  int prot = PROT_READ | PROT_WRITE;
+  int mflags = MAP_PRIVATE | MAP_ANONYMOUS;
+  ssize page = arena_pagesize(flags);
+  size = (size + page - 1) & -page;
+  bool prefault = flags & ARENA_PREFAULT;
+#ifdef MAP_POPULATE
+  // mbind has to come before the first touch
+  if (prefault && node < 0) {
+    mflags |= MAP_POPULATE;
+    prefault = false;
+  }
+#endif
+
+  byte *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (flags & ARENA_HUGETLB) p = mmap(0, size, prot, mflags | MAP_HUGETLB, -1, 0);
+#endif
+  if (p == MAP_FAILED && flags & ARENA_HUGEPAGES) {
+    // over-map to align the region to a huge page
+    byte *raw = mmap(0, size + page, prot, mflags, -1, 0);
+    if (raw != MAP_FAILED) {
+      p = (byte *)(((uintptr_t)raw + page - 1) & -(uintptr_t)page);
+      if (p > raw) munmap(raw, p - raw);
+      munmap(p + size, raw + page - p);
+    }
+  }
+  if (p == MAP_FAILED) p = mmap(0, size, prot, mflags, -1, 0);
+  if (p == MAP_FAILED) return 0;
+
+#ifdef MADV_HUGEPAGE
+  if (flags & ARENA_HUGEPAGES) madvise(p, size, MADV_HUGEPAGE);
+#endif
+#if defined(__linux__) && defined(SYS_mbind)
+  if (node >= 0 && node < 64) {
+    unsigned long mask = 1UL << node;
+    syscall(SYS_mbind, p, size, 2 /* MPOL_BIND */, &mask, 65, 0);
+  }
+#endif
+#ifdef MADV_POPULATE_WRITE
+  if (prefault && !madvise(p, size, MADV_POPULATE_WRITE)) prefault = false;
+#endif
+  if (prefault) {
+    for (ssize i = 0; i < size; i += sysconf(_SC_PAGESIZE)) p[i] = 0;
+  }
+  return p;
+}
+
+static void *arena_chain_mmap(ssize size, void *ctx) {
+  return arena_mmap(size, ctx ? *(unsigned *)ctx : 0, -1);
+}
+
+static void arena_chain_munmap(void *ptr, ssize size, void *ctx) {
+  ssize page = arena_pagesize(ctx ? *(unsigned *)ctx : 0);
+  munmap(ptr, (size + page - 1) & -page);
+}
+
+// An arena on its own mapping. Pages are committed as they are touched,
+// unless ARENA_PREFAULT is given. A node >= 0 binds them to that NUMA node.
+static inline Arena newmapped(ArenaMap *m, ssize size, unsigned flags, int node) {
+  ssize page = arena_pagesize(flags);
+  m->size = (size + page - 1) & -page;
+  m->base = arena_mmap(m->size, flags, node);
+  if (!m->base) m->size = 0;
+  m->beg = m->base;
+  return newarena(&m->beg, m->size);
+}
+
+// Empty a mapped arena and give its pages past the first keep bytes back to
+// the OS, so a long-lived arena does not hold on to its peak RSS.
+static inline void arena_map_reset(Arena *a, ArenaMap *m, ssize keep) {
+  assert(a->beg == &m->beg);
+  ssize page = sysconf(_SC_PAGESIZE);
+  keep = keep < m->size ? (keep + page - 1) & -page : m->size;
+  if (keep < m->size) madvise(m->base + keep, m->size - keep, MADV_DONTNEED);
+  m->beg = m->base;
+  a->end = m->base + m->size;
+  if (a->stats) a->stats->inuse = 0;
+}
+
+static inline void arena_unmap(ArenaMap *m) {
+  if (m->base) munmap(m->base, m->size);
+  m->beg = m->base = 0;
+  m->size = 0;
+}
+#endif
+
+// Fixed size objects carved out of an arena. Freed objects are put on a
+// free list and handed out again before the arena is asked for more. The
+// memory still belongs to the arena, so after rewinding, resetting or
+// releasing it the pool must be emptied with pool_reset().
+typedef struct Pool Pool;
+struct Pool {
+  Arena *arena;
+  ssize size;
+  ssize align;
+  void *free;
+};
+
+static inline Pool newpool(Arena *a, ssize size, ssize align) {
+  Pool p = {0};
+  p.arena = a;
+  p.size = size < (ssize)sizeof(void *) ? (ssize)sizeof(void *) : size;
+  p.align = align < (ssize)_Alignof(void *) ? (ssize)_Alignof(void *) : align;
+  p.size = (p.size + p.align - 1) & -p.align;
+  return p;
+}
+
+// Takes the same flags as arena_alloc, SOFTFAIL returns NULL when out of
+// memory instead of jumping.
+static inline void *pool_alloc(Pool *p, unsigned flags) {
+  void *ptr = p->free;
+  if (!ptr) return arena_alloc(p->arena, p->size, p->align, 1, flags);
+  p->free = *(void **)ptr;
+  return flags & NOINIT ? ptr : memset(ptr, 0, p->size);
+}
+
+static inline void pool_free(Pool *p, void *ptr) {
+  if (!ptr) return;
+  *(void **)ptr = p->free;
+  p->free = ptr;
+}
+
+static inline void pool_reset(Pool *p) {
+  p->free = 0;
 }
 
 #define MAX_ALIGN _Alignof(max_align_t)
@@ -223,9 +724,9 @@ static byte *arena_realloc(Arena *a, void *old_p, ssize old_sz, ssize sz, unsign
   if (!old_p) return arena_alloc(a, sz, MAX_ALIGN, 1, flags);
 
   // grow in place
-  if((*a->beg < a->end) && (uintptr_t)old_p == (uintptr_t)*a->beg - old_sz) {
-    void *p = arena_alloc(a, sz - old_sz, 1, 1, flags);
-    assert(p - old_p == old_sz);
+  arena_sync(a);
+  if((*a->beg < a->end) && (uintptr_t)old_p == (uintptr_t)*a->beg - old_sz
+     && arena_alloc(a, sz - old_sz, 1, 1, flags | SOFTFAIL | NOGROW)) {
     return old_p;
   }
 
@@ -30,6 +30,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
 // The internal item type. This is used as both the value type and the key
@@ -108,6 +109,38 @@
 #endif
 #endif
 
+// Nodes can have their own allocator using BGEN_NODEMALLOC and BGEN_NODEFREE,
+// which otherwise default to BGEN_MALLOC and BGEN_FREE. Both are provided
+// 'isleaf', 'size' and 'udata', and BGEN_NODEFREE is also provided 'ptr'.
+// Every leaf is the same size, as is every branch, so these are a good fit
+// for a fixed size pool, such as the Pool in arena.h:
+//
+//     struct pools { Arena *arena; Pool leaves, branches; };
+//
+//     static void *node_malloc(struct pools *p, bool isleaf, size_t size) {
+//         Pool *pool = isleaf ? &p->leaves : &p->branches;
+//         if (!pool->size) {
+//             *pool = newpool(p->arena, size, MAX_ALIGN);
+//         }
+//         return pool_alloc(pool, SOFTFAIL | NOINIT);
+//     }
+//
+//     static void node_free(struct pools *p, bool isleaf, void *ptr) {
+//         pool_free(isleaf ? &p->leaves : &p->branches, ptr);
+//     }
+//
+//     #define BGEN_NODEMALLOC return node_malloc(udata, isleaf, size);
+//     #define BGEN_NODEFREE   node_free(udata, isleaf, ptr);
+//
+// When the pools are not shared with other trees, and no BGEN_ITEMFREE is
+// needed, the whole tree can then be dropped at once by resetting the arena
+// instead of calling clear.
+#if defined(BGEN_NODEMALLOC) != defined(BGEN_NODEFREE)
+#error \
+BGEN_NODEMALLOC and BGEN_NODEFREE must be defined together. \
+Visit https://github.com/tidwall/bgen for more information.
+#endif
+
 #ifndef BGEN_EXTERN
 #ifdef BGEN_HEADER
 #define BGEN_EXTERN extern
@@ -159,10 +192,40 @@ Visit https://github.com/tidwall/bgen for more information.
 #undef BGEN_PATHHINT
 #endif
 
+// Numeric keys allow for a branchless in-node search.
+// Define BGEN_NUMERIC when the key (the item itself, or item.key when
+// BGEN_KEYED is used) is a plain integer or floating point type that is
+// ordered by the standard '<' operator, e.g. BGEN_LESS is 'return a < b;'.
+// Nodes are then searched by counting the items that are less than the key,
+// which has no data-dependent branches and which compilers will often
+// vectorize. Large nodes are first narrowed with a branchless binary search.
+// This replaces both BGEN_BSEARCH and BGEN_PATHHINT. Floating point keys must
+// never be NaN.
+#ifdef BGEN_NUMERIC
+#ifdef BGEN_NOORDER
+#error \
+BGEN_NUMERIC is not allowed when BGEN_NOORDER is defined. \
+Visit https://github.com/tidwall/bgen for more information.
+#endif
+#undef BGEN_PATHHINT
+#ifdef BGEN_KEYED
+#define BGEN_NUMTYPE BGEN_KEYTYPE
+#define BGEN_NUMOF(item) ((item).key)
+#else
+#define BGEN_NUMTYPE BGEN_TYPE
+#define BGEN_NUMOF(item) (item)
+#endif
+// Nodes with this many items or fewer are searched by counting alone.
+#ifndef BGEN_NUMCOUNTMAX
+#define BGEN_NUMCOUNTMAX 64
+#endif
+#endif
+
 // Convenient aliases to common types
 #define BGEN_NODE struct BGEN_NAME
 #define BGEN_ITEM BGEN_TYPE
 #define BGEN_ITER struct BGEN_API(iter)
+#define BGEN_EPOCH struct BGEN_API(epoch)
 #define BGEN_SNODE struct BGEN_SYM(snode)
 #define BGEN_RECT struct BGEN_SYM(rect)
 
@@ -202,6 +265,7 @@ enum BGEN_API(status) {
 
 BGEN_NODE;
 BGEN_ITER;
+BGEN_EPOCH;
 
 BGEN_EXTERN int BGEN_API(get)(BGEN_NODE **root, BGEN_ITEM key,
     BGEN_ITEM *item_out, void *udata);
@@ -226,6 +290,14 @@ BGEN_EXTERN int BGEN_API(push_front)(BGEN_NODE **root, BGEN_ITEM item,
 BGEN_EXTERN int BGEN_API(push_back)(BGEN_NODE **root, BGEN_ITEM item,
     void *udata);
 
+// Bulk operations on sorted items
+BGEN_EXTERN int BGEN_API(load_sorted)(BGEN_NODE **root, BGEN_ITEM *items,
+    size_t count, void *udata);
+BGEN_EXTERN int BGEN_API(insert_batch)(BGEN_NODE **root, BGEN_ITEM *items,
+    size_t count, size_t *ninserted, void *udata);
+BGEN_EXTERN int BGEN_API(delete_batch)(BGEN_NODE **root, BGEN_ITEM *keys,
+    size_t count, size_t *ndeleted, void *udata);
+
 BGEN_EXTERN int BGEN_API(copy)(BGEN_NODE **root, BGEN_NODE **newroot,
     void *udata);
 BGEN_EXTERN int BGEN_API(clone)(BGEN_NODE **root, BGEN_NODE **newroot,
@@ -233,6 +305,15 @@ BGEN_EXTERN int BGEN_API(clone)(BGEN_NODE **root, BGEN_NODE **newroot,
 BGEN_EXTERN int BGEN_API(compare)(BGEN_ITEM a, BGEN_ITEM b, void *udata);
 BGEN_EXTERN bool BGEN_API(less)(BGEN_ITEM a, BGEN_ITEM b, void *udata);
 
+// Snapshots published by one writer to many reader threads
+BGEN_EXTERN BGEN_EPOCH *BGEN_API(epoch_new)(int nreaders, void *udata);
+BGEN_EXTERN void BGEN_API(epoch_free)(BGEN_EPOCH *epoch, void *udata);
+BGEN_EXTERN int BGEN_API(epoch_publish)(BGEN_EPOCH *epoch, BGEN_NODE **root,
+    void *udata);
+BGEN_EXTERN size_t BGEN_API(epoch_reclaim)(BGEN_EPOCH *epoch, void *udata);
+BGEN_EXTERN BGEN_NODE *BGEN_API(epoch_enter)(BGEN_EPOCH *epoch, int reader);
+BGEN_EXTERN void BGEN_API(epoch_leave)(BGEN_EPOCH *epoch, int reader);
+
 // Optimized for counted B-trees (works with indexes) (rank=index_of,
 // select=get_at)
 BGEN_EXTERN int BGEN_API(insert_at)(BGEN_NODE **root, size_t index,
@@ -366,6 +447,26 @@ static void BGEN_SYM(free)(void *ptr, void *udata) {
     BGEN_FREE
 }
 
+static void *BGEN_SYM(node_malloc)(bool isleaf, size_t size, void *udata) {
+    (void)isleaf, (void)size, (void)udata;
+#ifdef BGEN_NODEMALLOC
+    BGEN_NODEMALLOC
+#else
+    return BGEN_SYM(malloc)(size, udata);
+#endif
+}
+
+static void BGEN_SYM(node_dealloc)(void *ptr, bool isleaf, size_t size,
+    void *udata)
+{
+    (void)ptr, (void)isleaf, (void)size, (void)udata;
+#ifdef BGEN_NODEFREE
+    BGEN_NODEFREE
+#else
+    BGEN_SYM(free)(ptr, udata);
+#endif
+}
+
 #ifdef BGEN_LESS
 #ifdef BGEN_COMPARE
 #error \
@@ -500,11 +601,11 @@ static void BGEN_SYM(rc_init)(BGEN_SYM(rc_t) *rc) {
     *rc = 0;
 }
 static void BGEN_SYM(rc_retain)(BGEN_SYM(rc_t) *rc) {
-    *rc++;
+    (*rc)++;
 }
 static bool BGEN_SYM(rc_release)(BGEN_SYM(rc_t) *rc) {
-    *rc--;
-    return *rc == 1;
+    (*rc)--;
+    return *rc == 0;
 }
 static bool BGEN_SYM(rc_shared)(BGEN_SYM(rc_t) *rc) {
     return *rc > 1;
@@ -641,8 +742,8 @@ static int BGEN_SYM(feat_dims)(void) {
 
 static BGEN_NODE *BGEN_SYM(alloc_node)(bool isleaf, void *udata) {
     void *ptr = isleaf ? 
-        BGEN_SYM(malloc)(offsetof(BGEN_NODE, children), udata) :
-        BGEN_SYM(malloc)(sizeof(BGEN_NODE), udata);
+        BGEN_SYM(node_malloc)(true, offsetof(BGEN_NODE, children), udata) :
+        BGEN_SYM(node_malloc)(false, sizeof(BGEN_NODE), udata);
     if (!ptr) {
         return 0;
     }
@@ -657,6 +758,12 @@ static BGEN_NODE *BGEN_SYM(alloc_node)(bool isleaf, void *udata) {
     return node;
 }
 
+static void BGEN_SYM(dealloc_node)(BGEN_NODE *node, void *udata) {
+    bool isleaf = node->isleaf;
+    BGEN_SYM(node_dealloc)(node, isleaf,
+        isleaf ? offsetof(BGEN_NODE, children) : sizeof(BGEN_NODE), udata);
+}
+
 // returns the number of items in a node by counting, recursively
 static size_t BGEN_SYM(deepcount)(BGEN_NODE *node) {
     size_t count = (size_t)node->len;
@@ -913,7 +1020,7 @@ static void BGEN_SYM(node_free)(BGEN_NODE *node, void *udata) {
     for (int i = 0; i < node->len; i++) {
         BGEN_SYM(item_free)(node->items[i], udata);
     }
-    BGEN_SYM(free)(node, udata);
+    BGEN_SYM(dealloc_node)(node, udata);
 }
 
 /// Free the tree!
@@ -924,6 +1031,34 @@ static void BGEN_SYM(clear)(BGEN_NODE **root, void *udata) {
     }
 }
 
+#ifdef BGEN_NUMERIC
+BGEN_INLINE
+static int BGEN_SYM(search_count)(BGEN_ITEM *items, int nitems, BGEN_ITEM key,
+    int *found)
+{
+    // Branchless search for numeric keys. The items before 'i' are always
+    // less than the key and the items at 'i+n' and after never are.
+    BGEN_NUMTYPE k = BGEN_NUMOF(key);
+    int i = 0;
+    int n = nitems;
+    while (n > BGEN_NUMCOUNTMAX) {
+        int half = n / 2;
+        i += (BGEN_NUMOF(items[i+half]) < k) * half;
+        n -= half;
+    }
+    // Count what remains. There is no early exit, which allows the compiler
+    // to vectorize the compares (gcc and clang do at -O3).
+    BGEN_ITEM *base = items+i;
+    int count = 0;
+    for (int j = 0; j < n; j++) {
+        count += BGEN_NUMOF(base[j]) < k;
+    }
+    i += count;
+    *found = i < nitems && !(k < BGEN_NUMOF(items[i]));
+    return i;
+}
+#endif
+
 #ifdef BGEN_BSEARCH
 BGEN_INLINE
 static int BGEN_SYM(search_bsearch)(BGEN_ITEM *items, int nitems,
@@ -1001,7 +1136,10 @@ static int BGEN_SYM(search_linear)(BGEN_ITEM *items, int nitems, BGEN_ITEM key,
 static int BGEN_SYM(search)(BGEN_NODE *node, BGEN_ITEM key, void *udata,
     int *found, int depth)
 {
-#ifndef BGEN_PATHHINT
+#if defined(BGEN_NUMERIC)
+    (void)depth, (void)udata; // not used
+    return BGEN_SYM(search_count)(node->items, node->len, key, found);
+#elif !defined(BGEN_PATHHINT)
     (void)depth; // not used
 #ifdef BGEN_BSEARCH
     return BGEN_SYM(search_bsearch)(node->items, node->len, key, udata, found);
@@ -1222,7 +1360,7 @@ fail:
             BGEN_SYM(node_free)(node2->children[i], udata);
         }
     }
-    BGEN_SYM(free)(node2, udata);
+    BGEN_SYM(dealloc_node)(node2, udata);
     return 0;
 }
 
@@ -2069,7 +2207,7 @@ static bool BGEN_SYM(split_root)(BGEN_NODE **root, void *udata) {
     newroot->children[0] = *root;
     newroot->children[1] = BGEN_SYM(split)(*root, &newroot->items[0], udata);
     if (!newroot->children[1]) {
-        BGEN_SYM(free)(newroot, udata);
+        BGEN_SYM(dealloc_node)(newroot, udata);
         return false;
     }
 #ifdef BGEN_COUNTED
@@ -2591,7 +2729,7 @@ static void BGEN_SYM(rebalance)(BGEN_NODE *node, int i, void *udata) {
 #ifdef BGEN_COUNTED
         size_t count = node->counts[i] + 1 + node->counts[i+1];
 #endif
-        BGEN_SYM(free)(right, udata);
+        BGEN_SYM(dealloc_node)(right, udata);
         BGEN_SYM(shift_left)(node, i, 1, true);
 #ifdef BGEN_COUNTED
         node->counts[i] = count;
@@ -2783,7 +2921,7 @@ static int BGEN_SYM(delete0)(BGEN_NODE **root, int act, BGEN_ITEM key,
     if ((*root)->len == 0) {
         BGEN_NODE *old_root = *root;
         *root = (*root)->isleaf ? 0 : (*root)->children[0];
-        BGEN_SYM(free)(old_root, udata);
+        BGEN_SYM(dealloc_node)(old_root, udata);
     }
     return BGEN_DELETED;
 }
@@ -2898,7 +3036,7 @@ static int BGEN_SYM(delete_fastpath)(BGEN_NODE **root, BGEN_ITEM key,
             #ifdef BGEN_COUNTED
                     size_t count = parent->counts[i] + 1 + parent->counts[i+1];
             #endif
-                    BGEN_SYM(free)(right, udata);
+                    BGEN_SYM(dealloc_node)(right, udata);
                     BGEN_SYM(shift_left)(parent, i, 1, true);
             #ifdef BGEN_COUNTED
                     parent->counts[i] = count;
@@ -3540,6 +3678,350 @@ static int BGEN_SYM(insert_at)(BGEN_NODE **root, size_t index, BGEN_ITEM item,
     return BGEN_SYM(insert0)(root, BGEN_INSAT, index, item, 0, udata);
 }
 
+// Returns the most items that a tree of the provided height can hold.
+static size_t BGEN_SYM(load_cap)(int height) {
+    size_t cap = BGEN_MAXITEMS;
+    for (int h = 1; h < height; h++) {
+        if (cap > (SIZE_MAX - BGEN_MAXITEMS) / (BGEN_MAXITEMS+1)) {
+            return SIZE_MAX;
+        }
+        cap = cap * (BGEN_MAXITEMS+1) + BGEN_MAXITEMS;
+    }
+    return cap;
+}
+
+// Frees the nodes of a partially loaded tree without freeing the items.
+static void BGEN_SYM(load_release)(BGEN_NODE *node, int nchildren, 
+    void *udata)
+{
+    for (int i = 0; i < nchildren; i++) {
+        BGEN_NODE *child = node->children[i];
+        BGEN_SYM(load_release)(child, child->isleaf ? 0 : child->len+1, udata);
+    }
+    BGEN_SYM(dealloc_node)(node, udata);
+}
+
+// Builds a subtree of the provided height from sorted items. Each branch
+// uses as few children as possible and spreads the items evenly between
+// them, so every node is as full as the item count allows and never below
+// the minimum.
+static BGEN_NODE *BGEN_SYM(load_node)(BGEN_ITEM *items, size_t count, 
+    int height, void *udata)
+{
+    BGEN_NODE *node = BGEN_SYM(alloc_node)(height == 1, udata);
+    if (!node) {
+        return 0;
+    }
+    node->height = height;
+    if (height == 1) {
+        for (size_t i = 0; i < count; i++) {
+            node->items[i] = items[i];
+        }
+        node->len = count;
+        return node;
+    }
+    size_t ccap = BGEN_SYM(load_cap)(height-1);
+    size_t nchildren = count / (ccap+1) + 1;
+    size_t avail = count - (nchildren-1);
+    size_t pos = 0;
+    for (size_t i = 0; i < nchildren; i++) {
+        size_t ccount = avail / nchildren + (i < avail % nchildren);
+        BGEN_NODE *child = BGEN_SYM(load_node)(items+pos, ccount, height-1, 
+            udata);
+        if (!child) {
+            BGEN_SYM(load_release)(node, (int)i, udata);
+            return 0;
+        }
+        node->children[i] = child;
+#ifdef BGEN_COUNTED
+        node->counts[i] = ccount;
+#endif
+        pos += ccount;
+        if (i < nchildren-1) {
+            node->items[i] = items[pos++];
+        }
+    }
+    node->len = nchildren-1;
+#ifdef BGEN_SPATIAL
+    for (int i = 0; i <= node->len; i++) {
+        node->rects[i] = BGEN_SYM(rect_calc)(node, i, udata);
+    }
+#endif
+    return node;
+}
+
+static int BGEN_SYM(insert_batch)(BGEN_NODE **root, BGEN_ITEM *items, 
+    size_t count, size_t *ninserted, void *udata);
+
+// Builds a tree from sorted items in O(n), with packed nodes. 
+// If the tree is not empty then this is the same as insert_batch.
+// returns INSERTED, OUTOFORDER, or NOMEM
+static int BGEN_SYM(load_sorted)(BGEN_NODE **root, BGEN_ITEM *items, 
+    size_t count, void *udata)
+{
+    if (*root) {
+        return BGEN_SYM(insert_batch)(root, items, count, 0, udata);
+    }
+#ifndef BGEN_NOORDER
+    for (size_t i = 1; i < count; i++) {
+        if (!BGEN_SYM(less)(items[i-1], items[i], udata)) {
+            return BGEN_OUTOFORDER;
+        }
+    }
+#endif
+    if (count == 0) {
+        return BGEN_INSERTED;
+    }
+    int height = 1;
+    while (BGEN_SYM(load_cap)(height) < count) {
+        height++;
+    }
+    BGEN_NODE *node = BGEN_SYM(load_node)(items, count, height, udata);
+    if (!node) {
+        return BGEN_NOMEM;
+    }
+    *root = node;
+    return BGEN_INSERTED;
+}
+
+#ifndef BGEN_NOORDER
+// Descends to the leaf for key, cow'ing the path. Returns the leaf, or NULL
+// if the key was found in a branch. The path, and the nearest branch item to
+// the right of the leaf, are returned. Sets *nomem on failure.
+static BGEN_NODE *BGEN_SYM(batch_descend)(BGEN_NODE **root, BGEN_ITEM key,
+    BGEN_NODE **path, short *idxs, int *depth, BGEN_ITEM **bound, 
+    bool *nomem, void *udata)
+{
+    *nomem = false;
+    *bound = 0;
+    *depth = 0;
+    if (!BGEN_SYM(cow)(root, udata)) {
+        *nomem = true;
+        return 0;
+    }
+    BGEN_NODE *node = *root;
+    while (!node->isleaf) {
+        int found;
+        int i = BGEN_SYM(search)(node, key, udata, &found, *depth);
+        if (found) {
+            return 0;
+        }
+        if (i < node->len) {
+            *bound = &node->items[i];
+        }
+        if (!BGEN_SYM(cow)(&node->children[i], udata)) {
+            *nomem = true;
+            return 0;
+        }
+        path[*depth] = node;
+        idxs[*depth] = i;
+        (*depth)++;
+        node = node->children[i];
+    }
+    return node;
+}
+
+// Updates the counts and rectangles on a path after a leaf changed.
+static void BGEN_SYM(batch_fixpath)(BGEN_NODE **path, short *idxs, int depth,
+    int delta, void *udata)
+{
+    (void)path, (void)idxs, (void)depth, (void)delta, (void)udata;
+#ifdef BGEN_COUNTED
+    for (int i = 0; i < depth; i++) {
+        path[i]->counts[idxs[i]] += (size_t)delta;
+    }
+#endif
+#ifdef BGEN_SPATIAL
+    for (int i = depth-1; i >= 0; i--) {
+        path[i]->rects[idxs[i]] = BGEN_SYM(rect_calc)(path[i], idxs[i], udata);
+    }
+#endif
+}
+
+// Inserts as many of the sorted items as belong to, and fit into, the leaf
+// that holds items[0], using a single descent. Returns the number of items
+// consumed, which is zero when items[0] needs the standard insert.
+static size_t BGEN_SYM(insert_run)(BGEN_NODE **root, BGEN_ITEM *items, 
+    size_t count, size_t *ninserted, bool *nomem, void *udata)
+{
+    BGEN_NODE *path[BGEN_MAXHEIGHT];
+    short idxs[BGEN_MAXHEIGHT];
+    BGEN_ITEM *bound;
+    int depth;
+    BGEN_NODE *node = BGEN_SYM(batch_descend)(root, items[0], path, idxs, 
+        &depth, &bound, nomem, udata);
+    if (!node) {
+        return 0;
+    }
+    int found;
+    int i = BGEN_SYM(search)(node, items[0], udata, &found, depth);
+    size_t n = 0;
+    int inserted = 0;
+    while (n < count) {
+        if (bound && !BGEN_SYM(less)(items[n], *bound, udata)) {
+            break;
+        }
+        while (i < node->len && BGEN_SYM(less)(node->items[i], items[n], 
+            udata))
+        {
+            i++;
+        }
+        if (i < node->len && !BGEN_SYM(less)(items[n], node->items[i], udata)){
+            node->items[i] = items[n];
+        } else if (node->len == BGEN_MAXITEMS) {
+            break;
+        } else {
+            BGEN_SYM(shift_right)(node, i, 1);
+            node->items[i] = items[n];
+            inserted++;
+        }
+        i++;
+        n++;
+    }
+    if (n > 0) {
+        BGEN_SYM(batch_fixpath)(path, idxs, depth, inserted, udata);
+        *ninserted += (size_t)inserted;
+    }
+    return n;
+}
+
+// Deletes as many of the sorted keys as belong to the leaf that holds 
+// keys[0], without letting the leaf drop below its minimum, using a single
+// descent. Keys that are not in the tree are skipped. Returns the number of
+// keys consumed, which is zero when keys[0] needs the standard delete.
+static size_t BGEN_SYM(delete_run)(BGEN_NODE **root, BGEN_ITEM *keys, 
+    size_t count, size_t *ndeleted, bool *nomem, void *udata)
+{
+    BGEN_NODE *path[BGEN_MAXHEIGHT];
+    short idxs[BGEN_MAXHEIGHT];
+    BGEN_ITEM *bound;
+    int depth;
+    BGEN_NODE *node = BGEN_SYM(batch_descend)(root, keys[0], path, idxs, 
+        &depth, &bound, nomem, udata);
+    if (!node) {
+        return 0;
+    }
+    int minlen = depth == 0 ? 1 : BGEN_MINITEMS;
+    int found;
+    int i = BGEN_SYM(search)(node, keys[0], udata, &found, depth);
+    size_t n = 0;
+    int deleted = 0;
+    while (n < count) {
+        if (bound && !BGEN_SYM(less)(keys[n], *bound, udata)) {
+            break;
+        }
+        while (i < node->len && BGEN_SYM(less)(node->items[i], keys[n], 
+            udata))
+        {
+            i++;
+        }
+        if (i < node->len && !BGEN_SYM(less)(keys[n], node->items[i], udata)){
+            if (node->len == minlen) {
+                break;
+            }
+            BGEN_SYM(shift_left)(node, i, 1, false);
+            deleted++;
+        }
+        n++;
+    }
+    if (n > 0) {
+        BGEN_SYM(batch_fixpath)(path, idxs, depth, -deleted, udata);
+        *ndeleted += (size_t)deleted;
+    }
+    return n;
+}
+#endif
+
+// Inserts sorted items, handling every run of items that land in the same
+// leaf with one descent. Items that match existing items replace them.
+// The number of new items is added to ninserted, if provided.
+// On NOMEM the items before the failure have been inserted.
+// returns INSERTED, OUTOFORDER, NOMEM, or UNSUPPORTED
+static int BGEN_SYM(insert_batch)(BGEN_NODE **root, BGEN_ITEM *items, 
+    size_t count, size_t *ninserted, void *udata)
+{
+#ifdef BGEN_NOORDER
+    (void)root, (void)items, (void)count, (void)ninserted, (void)udata;
+    return BGEN_UNSUPPORTED;
+#else
+    size_t spare = 0;
+    ninserted = ninserted ? ninserted : &spare;
+    if (!*root) {
+        int ret = BGEN_SYM(load_sorted)(root, items, count, udata);
+        if (ret == BGEN_INSERTED) {
+            *ninserted += count;
+        }
+        return ret;
+    }
+    for (size_t i = 1; i < count; i++) {
+        if (!BGEN_SYM(less)(items[i-1], items[i], udata)) {
+            return BGEN_OUTOFORDER;
+        }
+    }
+    size_t i = 0;
+    while (i < count) {
+        bool nomem;
+        size_t n = BGEN_SYM(insert_run)(root, items+i, count-i, ninserted, 
+            &nomem, udata);
+        if (nomem) {
+            return BGEN_NOMEM;
+        }
+        if (n == 0) {
+            int ret = BGEN_SYM(insert)(root, items[i], 0, udata);
+            if (ret == BGEN_NOMEM) {
+                return ret;
+            }
+            *ninserted += ret == BGEN_INSERTED;
+            n = 1;
+        }
+        i += n;
+    }
+    return BGEN_INSERTED;
+#endif
+}
+
+// Deletes the items matching sorted keys, handling every run of keys that
+// land in the same leaf with one descent. Keys that are not found are 
+// ignored. Like delete, the deleted items are not freed.
+// The number of deleted items is added to ndeleted, if provided.
+// On NOMEM the keys before the failure have been deleted.
+// returns DELETED, OUTOFORDER, NOMEM, or UNSUPPORTED
+static int BGEN_SYM(delete_batch)(BGEN_NODE **root, BGEN_ITEM *keys, 
+    size_t count, size_t *ndeleted, void *udata)
+{
+#ifdef BGEN_NOORDER
+    (void)root, (void)keys, (void)count, (void)ndeleted, (void)udata;
+    return BGEN_UNSUPPORTED;
+#else
+    size_t spare = 0;
+    ndeleted = ndeleted ? ndeleted : &spare;
+    for (size_t i = 1; i < count; i++) {
+        if (!BGEN_SYM(less)(keys[i-1], keys[i], udata)) {
+            return BGEN_OUTOFORDER;
+        }
+    }
+    size_t i = 0;
+    while (i < count && *root) {
+        bool nomem;
+        size_t n = BGEN_SYM(delete_run)(root, keys+i, count-i, ndeleted, 
+            &nomem, udata);
+        if (nomem) {
+            return BGEN_NOMEM;
+        }
+        if (n == 0) {
+            int ret = BGEN_SYM(delete)(root, keys[i], 0, udata);
+            if (ret == BGEN_NOMEM) {
+                return ret;
+            }
+            *ndeleted += ret == BGEN_DELETED;
+            n = 1;
+        }
+        i += n;
+    }
+    return BGEN_DELETED;
+#endif
+}
+
 static int BGEN_SYM(copy)(BGEN_NODE **root, BGEN_NODE **newroot, void *udata) {
     if (!*root) {
         if (newroot) {
@@ -3572,6 +4054,185 @@ static int BGEN_SYM(clone)(BGEN_NODE **root, BGEN_NODE **newroot, void *udata) {
     return BGEN_COPIED;
 }
 
+// Epoch based snapshots let many reader threads share the versions of a tree
+// that a single writer publishes. A published version is a clone, so it's
+// never changed, and readers only announce which epoch they entered in, which
+// means no reference counts are touched while reading. Versions replaced by
+// a later publish are freed by the writer once no reader can still see them.
+#ifndef BGEN_NOATOMICS
+
+#include <stdatomic.h>
+
+struct BGEN_SYM(retired) {
+    BGEN_NODE *root;
+    size_t epoch;    // readers at or before this epoch may still see it
+};
+
+// Each reader slot is padded to a cache line so readers don't contend.
+struct BGEN_SYM(reader) {
+    atomic_size_t epoch; // zero when not reading
+    char pad[64-sizeof(atomic_size_t)];
+};
+
+BGEN_EPOCH {
+    _Atomic(BGEN_NODE*) root; // most recently published version
+    atomic_size_t epoch;
+    struct BGEN_SYM(retired) *retired;
+    size_t nretired;
+    size_t cap;
+    int nreaders;
+    struct BGEN_SYM(reader) readers[];
+};
+
+// Create a publisher with nreaders reader slots.
+// Returns NULL when out of memory.
+static BGEN_EPOCH *BGEN_SYM(epoch_new)(int nreaders, void *udata) {
+    if (nreaders < 1) {
+        return 0;
+    }
+    size_t size = sizeof(BGEN_EPOCH) + 
+        sizeof(struct BGEN_SYM(reader))*(size_t)nreaders;
+    BGEN_EPOCH *epoch = BGEN_SYM(malloc)(size, udata);
+    if (!epoch) {
+        return 0;
+    }
+    atomic_init(&epoch->root, 0);
+    atomic_init(&epoch->epoch, 1);
+    epoch->retired = 0;
+    epoch->nretired = 0;
+    epoch->cap = 0;
+    epoch->nreaders = nreaders;
+    for (int i = 0; i < nreaders; i++) {
+        atomic_init(&epoch->readers[i].epoch, 0);
+    }
+    return epoch;
+}
+
+// Free the retired versions that no reader can see anymore. Writer only, as
+// the nodes go back to the writer's allocator.
+// Returns the number of versions still waiting on readers.
+static size_t BGEN_SYM(epoch_reclaim)(BGEN_EPOCH *epoch, void *udata) {
+    size_t min = SIZE_MAX;
+    for (int i = 0; i < epoch->nreaders; i++) {
+        size_t e = atomic_load(&epoch->readers[i].epoch);
+        if (e && e < min) {
+            min = e;
+        }
+    }
+    // Retired versions are in epoch order.
+    size_t n = 0;
+    while (n < epoch->nretired && epoch->retired[n].epoch < min) {
+        BGEN_SYM(clear)(&epoch->retired[n].root, udata);
+        n++;
+    }
+    if (n > 0) {
+        epoch->nretired -= n;
+        for (size_t i = 0; i < epoch->nretired; i++) {
+            epoch->retired[i] = epoch->retired[n+i];
+        }
+    }
+    return epoch->nretired;
+}
+
+// Make a clone of the tree the version that readers get, and retire the
+// previous one. The clone is cheap with BGEN_COW, otherwise it's a full copy.
+// Writer only. Returns COPIED or NOMEM
+static int BGEN_SYM(epoch_publish)(BGEN_EPOCH *epoch, BGEN_NODE **root,
+    void *udata)
+{
+    if (epoch->nretired == epoch->cap) {
+        size_t cap = epoch->cap == 0 ? 8 : epoch->cap*2;
+        struct BGEN_SYM(retired) *retired = BGEN_SYM(malloc)(
+            sizeof(struct BGEN_SYM(retired))*cap, udata);
+        if (!retired) {
+            return BGEN_NOMEM;
+        }
+        for (size_t i = 0; i < epoch->nretired; i++) {
+            retired[i] = epoch->retired[i];
+        }
+        if (epoch->retired) {
+            BGEN_SYM(free)(epoch->retired, udata);
+        }
+        epoch->retired = retired;
+        epoch->cap = cap;
+    }
+    BGEN_NODE *newroot = 0;
+    if (BGEN_SYM(clone)(root, &newroot, udata) != BGEN_COPIED) {
+        return BGEN_NOMEM;
+    }
+    // Readers that enter after the epoch is bumped are sure to see the new
+    // version, so the old one is only visible up to the current epoch.
+    BGEN_NODE *old = atomic_exchange(&epoch->root, newroot);
+    size_t e = atomic_fetch_add(&epoch->epoch, 1);
+    if (old) {
+        epoch->retired[epoch->nretired].root = old;
+        epoch->retired[epoch->nretired].epoch = e;
+        epoch->nretired++;
+    }
+    BGEN_SYM(epoch_reclaim)(epoch, udata);
+    return BGEN_COPIED;
+}
+
+// Start reading using a reader slot that no other thread is using.
+// Returns the published root, which is valid until epoch_leave, and which
+// must only be used with operations that don't change the tree.
+static BGEN_NODE *BGEN_SYM(epoch_enter)(BGEN_EPOCH *epoch, int reader) {
+    // Announce the epoch before loading, pairs with publish and reclaim.
+    size_t e = atomic_load(&epoch->epoch);
+    atomic_store(&epoch->readers[reader].epoch, e);
+    return atomic_load(&epoch->root);
+}
+
+static void BGEN_SYM(epoch_leave)(BGEN_EPOCH *epoch, int reader) {
+    atomic_store_explicit(&epoch->readers[reader].epoch, 0,
+        __ATOMIC_RELEASE);
+}
+
+// Free the publisher and all of its versions. No readers may be left.
+static void BGEN_SYM(epoch_free)(BGEN_EPOCH *epoch, void *udata) {
+    for (size_t i = 0; i < epoch->nretired; i++) {
+        BGEN_SYM(clear)(&epoch->retired[i].root, udata);
+    }
+    if (epoch->retired) {
+        BGEN_SYM(free)(epoch->retired, udata);
+    }
+    BGEN_NODE *root = atomic_load(&epoch->root);
+    BGEN_SYM(clear)(&root, udata);
+    BGEN_SYM(free)(epoch, udata);
+}
+
+#else
+
+// Snapshot readers need atomics.
+BGEN_EPOCH { int unused; };
+
+static BGEN_EPOCH *BGEN_SYM(epoch_new)(int nreaders, void *udata) {
+    (void)nreaders, (void)udata;
+    return 0;
+}
+static size_t BGEN_SYM(epoch_reclaim)(BGEN_EPOCH *epoch, void *udata) {
+    (void)epoch, (void)udata;
+    return 0;
+}
+static int BGEN_SYM(epoch_publish)(BGEN_EPOCH *epoch, BGEN_NODE **root,
+    void *udata)
+{
+    (void)epoch, (void)root, (void)udata;
+    return BGEN_UNSUPPORTED;
+}
+static BGEN_NODE *BGEN_SYM(epoch_enter)(BGEN_EPOCH *epoch, int reader) {
+    (void)epoch, (void)reader;
+    return 0;
+}
+static void BGEN_SYM(epoch_leave)(BGEN_EPOCH *epoch, int reader) {
+    (void)epoch, (void)reader;
+}
+static void BGEN_SYM(epoch_free)(BGEN_EPOCH *epoch, void *udata) {
+    (void)epoch, (void)udata;
+}
+
+#endif
+
 #ifdef BGEN_SPATIAL
 
 // The nearby scanner is a kNN operation that uses a heap-based priority queue.
@@ -4675,8 +5336,17 @@ static inline void BGEN_SYM(all_sym_calls)(void) {
     (void)BGEN_SYM(pop_back);
     (void)BGEN_SYM(push_front);
     (void)BGEN_SYM(push_back);
+    (void)BGEN_SYM(load_sorted);
+    (void)BGEN_SYM(insert_batch);
+    (void)BGEN_SYM(delete_batch);
     (void)BGEN_SYM(copy);
     (void)BGEN_SYM(clone);
+    (void)BGEN_SYM(epoch_new);
+    (void)BGEN_SYM(epoch_free);
+    (void)BGEN_SYM(epoch_publish);
+    (void)BGEN_SYM(epoch_reclaim);
+    (void)BGEN_SYM(epoch_enter);
+    (void)BGEN_SYM(epoch_leave);
     (void)BGEN_SYM(compare);
     (void)BGEN_SYM(less);
     (void)BGEN_SYM(iter_init);
@@ -4754,8 +5424,17 @@ static inline void BGEN_SYM(all_api_calls)(void) {
     (void)BGEN_API(pop_back);
     (void)BGEN_API(push_front);
     (void)BGEN_API(push_back);
+    (void)BGEN_API(load_sorted);
+    (void)BGEN_API(insert_batch);
+    (void)BGEN_API(delete_batch);
     (void)BGEN_API(copy);
     (void)BGEN_API(clone);
+    (void)BGEN_API(epoch_new);
+    (void)BGEN_API(epoch_free);
+    (void)BGEN_API(epoch_publish);
+    (void)BGEN_API(epoch_reclaim);
+    (void)BGEN_API(epoch_enter);
+    (void)BGEN_API(epoch_leave);
     (void)BGEN_API(compare);
     (void)BGEN_API(less);
     (void)BGEN_API(iter_init);
@@ -4955,6 +5634,24 @@ int BGEN_API(push_back)(BGEN_NODE **root, BGEN_ITEM item, void *udata) {
     return BGEN_SYM(push_back)(root, item, udata);
 }
 
+int BGEN_API(load_sorted)(BGEN_NODE **root, BGEN_ITEM *items, size_t count,
+    void *udata)
+{
+    return BGEN_SYM(load_sorted)(root, items, count, udata);
+}
+
+int BGEN_API(insert_batch)(BGEN_NODE **root, BGEN_ITEM *items, size_t count,
+    size_t *ninserted, void *udata)
+{
+    return BGEN_SYM(insert_batch)(root, items, count, ninserted, udata);
+}
+
+int BGEN_API(delete_batch)(BGEN_NODE **root, BGEN_ITEM *keys, size_t count,
+    size_t *ndeleted, void *udata)
+{
+    return BGEN_SYM(delete_batch)(root, keys, count, ndeleted, udata);
+}
+
 int BGEN_API(insert_at)(BGEN_NODE **root, size_t index, BGEN_ITEM item,
     void *udata)
 {
@@ -4969,6 +5666,32 @@ int BGEN_API(clone)(BGEN_NODE **root, BGEN_NODE **newroot, void *udata) {
     return BGEN_SYM(clone)(root, newroot, udata);
 }
 
+BGEN_EPOCH *BGEN_API(epoch_new)(int nreaders, void *udata) {
+    return BGEN_SYM(epoch_new)(nreaders, udata);
+}
+
+void BGEN_API(epoch_free)(BGEN_EPOCH *epoch, void *udata) {
+    BGEN_SYM(epoch_free)(epoch, udata);
+}
+
+int BGEN_API(epoch_publish)(BGEN_EPOCH *epoch, BGEN_NODE **root,
+    void *udata)
+{
+    return BGEN_SYM(epoch_publish)(epoch, root, udata);
+}
+
+size_t BGEN_API(epoch_reclaim)(BGEN_EPOCH *epoch, void *udata) {
+    return BGEN_SYM(epoch_reclaim)(epoch, udata);
+}
+
+BGEN_NODE *BGEN_API(epoch_enter)(BGEN_EPOCH *epoch, int reader) {
+    return BGEN_SYM(epoch_enter)(epoch, reader);
+}
+
+void BGEN_API(epoch_leave)(BGEN_EPOCH *epoch, int reader) {
+    BGEN_SYM(epoch_leave)(epoch, reader);
+}
+
 int BGEN_API(compare)(BGEN_ITEM a, BGEN_ITEM b, void *udata) {
     return BGEN_SYM(compare)(a, b, udata);
 }
@@ -5225,6 +5948,9 @@ void BGEN_API(rect)(BGEN_NODE **root, BGEN_RTYPE min[BGEN_DIMS],
 #undef BGEN_FANOUT
 #undef BGEN_INLINE
 #undef BGEN_ITER
+#undef BGEN_EPOCH
+#undef BGEN_NODEMALLOC
+#undef BGEN_NODEFREE
 #undef BGEN_LESS
 #undef BGEN_NAME
 #undef BGEN_COMPARE
@@ -5232,4 +5958,8 @@ void BGEN_API(rect)(BGEN_NODE **root, BGEN_RTYPE min[BGEN_DIMS],
 #undef BGEN_FOUND
 #undef BGEN_INSAT
 #undef BGEN_MAYBELESSEQUAL
+#undef BGEN_NUMERIC
+#undef BGEN_NUMTYPE
+#undef BGEN_NUMOF
+#undef BGEN_NUMCOUNTMAX
 #undef BGEN_SOURCE
@@ -0,0 +1,328 @@
+// Intrusive object cache: a verstable index over elements that are linked,
+// through an embedded struct cache_node, on a list.h recency list. Elements
+// are charged a cost against a budget, and the coldest are evicted when the
+// budget is exceeded.
+//
+// In the default LRU mode a hit moves the element to the hot end of the list.
+// With CACHE_CLOCK a hit only sets the element's referenced flag, and
+// eviction gives flagged elements a second chance instead, so the read path
+// writes nothing but the element it returns.
+
+/** Usage:
+
+  struct obj {
+    uint64_t id;
+    struct cache_node node;
+    ...
+  };
+
+  static size_t obj_cost(struct obj *o) { return sizeof *o + o->len; }
+  static void obj_evict(struct obj *o, void *udata) { ... }
+
+  #define CACHE_NAME     obj_cache
+  #define CACHE_TY       struct obj
+  #define CACHE_KEY_TY   uint64_t
+  #define CACHE_KEY      id            // key member of CACHE_TY
+  #define CACHE_NODE     node          // struct cache_node member of CACHE_TY
+  #define CACHE_CLOCK                  // optional, second chance instead of LRU
+  #define CACHE_COST_FN  obj_cost      // optional, every element costs 1
+  #define CACHE_EVICT_FN obj_evict     // optional, called as an element leaves
+  #define CACHE_HASH_FN  ...           // optional, as verstable's HASH_FN
+  #define CACHE_CMPR_FN  ...           // optional, as verstable's CMPR_FN
+  #include "cache.h"
+
+  obj_cache c;
+  obj_cache_init(&c, 64 << 20, NULL);  // or obj_cache_init_pool with arena.h
+
+  struct obj *o = obj_cache_get(&c, id);
+  if (!o) {
+    o = obj_cache_alloc(&c);
+    o->id = id;
+    ...
+    if (!obj_cache_insert(&c, o)) obj_cache_free(&c, o);
+  }
+
+  struct obj *pos;
+  list_for_each_entry(pos, &c.list, node.link) { ... }  // coldest first
+
+  obj_cache_cleanup(&c);
+
+  The cache owns every element it holds, so elements must come from
+  obj_cache_alloc. An element leaves the cache when it is evicted, erased,
+  replaced by an element with the same key, cleared or cleaned up; it is
+  first passed to CACHE_EVICT_FN and its memory then goes back to the
+  allocator, so pointers returned by obj_cache_get are only good until the
+  next call that may insert or evict.
+*/
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "list.h"
+
+struct cache_node {
+  struct list_head link;  // position on the recency list
+  size_t cost;            // charged against the budget while cached
+  bool referenced;        // CLOCK mode, set by hits since the last sweep
+};
+
+#define CACHE_CAT0(a, b) a##b
+#define CACHE_CAT(a, b) CACHE_CAT0(a, b)
+
+#endif
+
+// Including the header without CACHE_NAME only declares struct cache_node.
+#ifdef CACHE_NAME
+
+#ifndef CACHE_TY
+#error CACHE_TY must be defined
+#endif
+#ifndef CACHE_KEY_TY
+#error CACHE_KEY_TY must be defined
+#endif
+#ifndef CACHE_KEY
+#error CACHE_KEY must be defined
+#endif
+#ifndef CACHE_NODE
+#error CACHE_NODE must be defined
+#endif
+
+#define CACHE_SYM(name) CACHE_CAT(CACHE_NAME, name)
+#define CACHE_INDEX CACHE_SYM(_index)
+#define CACHE_ELEM(n) container_of(n, CACHE_TY, CACHE_NODE)
+
+// The index owns nothing but pointers and rehashes as it grows, so it uses
+// the heap even when arena.h is around.
+#pragma push_macro("ARENA_H")
+#undef ARENA_H
+#define NAME CACHE_INDEX
+#define KEY_TY CACHE_KEY_TY
+#define VAL_TY CACHE_TY *
+#ifdef CACHE_HASH_FN
+#define HASH_FN CACHE_HASH_FN
+#endif
+#ifdef CACHE_CMPR_FN
+#define CMPR_FN CACHE_CMPR_FN
+#endif
+#include "verstable.h"
+#pragma pop_macro("ARENA_H")
+
+typedef struct {
+  CACHE_INDEX index;
+  struct list_head list;  // coldest first
+  size_t budget;          // total cost that the cache may hold
+  size_t used;            // total cost of the cached elements
+  void *udata;            // passed to CACHE_EVICT_FN
+#ifdef ARENA_H
+  Pool pool;              // element storage when created by _init_pool
+#endif
+} CACHE_NAME;
+
+static inline void CACHE_SYM(_init)(CACHE_NAME *c, size_t budget,
+                                    void *udata) {
+  CACHE_SYM(_index_init)(&c->index);
+  INIT_LIST_HEAD(&c->list);
+  c->budget = budget;
+  c->used = 0;
+  c->udata = udata;
+#ifdef ARENA_H
+  c->pool = (Pool){0};
+#endif
+}
+
+#ifdef ARENA_H
+// Same as _init, but elements are carved out of the arena and recycled
+// through a pool rather than coming from malloc.
+static inline void CACHE_SYM(_init_pool)(CACHE_NAME *c, size_t budget,
+                                         Arena *arena, void *udata) {
+  CACHE_SYM(_init)(c, budget, udata);
+  c->pool = newpool(arena, sizeof(CACHE_TY), _Alignof(CACHE_TY));
+}
+#endif
+
+// Returns zeroed storage for an element, or NULL when out of memory.
+static inline CACHE_TY *CACHE_SYM(_alloc)(CACHE_NAME *c) {
+#ifdef ARENA_H
+  if (c->pool.arena) return pool_alloc(&c->pool, SOFTFAIL);
+#endif
+  (void)c;
+  return calloc(1, sizeof(CACHE_TY));
+}
+
+// Returns the storage of an element that is not in the cache.
+static inline void CACHE_SYM(_free)(CACHE_NAME *c, CACHE_TY *e) {
+#ifdef ARENA_H
+  if (c->pool.arena) {
+    pool_free(&c->pool, e);
+    return;
+  }
+#endif
+  (void)c;
+  free(e);
+}
+
+// Hands the elements on a detached list to CACHE_EVICT_FN and frees them.
+// Victims are only released once the cache is consistent again, so the
+// callback may look inside the cache.
+static inline void CACHE_SYM(_release)(CACHE_NAME *c,
+                                       struct list_head *victims) {
+  struct list_head *pos, *n;
+  list_for_each_safe(pos, n, victims) {
+    CACHE_TY *e = CACHE_ELEM(list_entry(pos, struct cache_node, link));
+#ifdef CACHE_EVICT_FN
+    CACHE_EVICT_FN(e, c->udata);
+#endif
+    CACHE_SYM(_free)(c, e);
+  }
+}
+
+// Unlinks cold elements onto victims until the cached cost is at most
+// target, never taking keep. Returns the number of victims.
+static inline size_t CACHE_SYM(_shed)(CACHE_NAME *c, size_t target,
+                                      struct cache_node *keep,
+                                      struct list_head *victims) {
+  size_t count = 0;
+  while (c->used > target && !list_empty(&c->list)) {
+    struct cache_node *n = list_first_entry(&c->list, struct cache_node, link);
+    if (n == keep) {
+      // Only a CLOCK sweep reaches keep with others left: those it gave a
+      // second chance now sit behind keep.
+      if (list_is_singular(&c->list)) break;
+      list_move_tail(&n->link, &c->list);
+      continue;
+    }
+#ifdef CACHE_CLOCK
+    if (n->referenced) {
+      n->referenced = false;
+      list_move_tail(&n->link, &c->list);
+      continue;
+    }
+#endif
+    CACHE_SYM(_index_erase)(&c->index, CACHE_ELEM(n)->CACHE_KEY);
+    list_move_tail(&n->link, victims);
+    c->used -= n->cost;
+    count++;
+  }
+  return count;
+}
+
+// Evicts cold elements until the cached cost is at most target, releasing
+// them as one batch. Returns the number of elements evicted.
+static inline size_t CACHE_SYM(_evict)(CACHE_NAME *c, size_t target) {
+  LIST_HEAD(victims);
+  size_t count = CACHE_SYM(_shed)(c, target, NULL, &victims);
+  CACHE_SYM(_release)(c, &victims);
+  return count;
+}
+
+// Changes the budget, evicting whatever no longer fits.
+static inline void CACHE_SYM(_set_budget)(CACHE_NAME *c, size_t budget) {
+  c->budget = budget;
+  CACHE_SYM(_evict)(c, budget);
+}
+
+// Returns the element with the key and counts the hit, or NULL.
+static inline CACHE_TY *CACHE_SYM(_get)(CACHE_NAME *c, CACHE_KEY_TY key) {
+  CACHE_SYM(_index_itr) itr = CACHE_SYM(_index_get)(&c->index, key);
+  if (CACHE_SYM(_index_is_end)(itr)) return NULL;
+  CACHE_TY *e = itr.data->val;
+#ifdef CACHE_CLOCK
+  if (!e->CACHE_NODE.referenced) e->CACHE_NODE.referenced = true;
+#else
+  list_move_tail(&e->CACHE_NODE.link, &c->list);
+#endif
+  return e;
+}
+
+// Same as _get without counting the hit.
+static inline CACHE_TY *CACHE_SYM(_peek)(CACHE_NAME *c, CACHE_KEY_TY key) {
+  CACHE_SYM(_index_itr) itr = CACHE_SYM(_index_get)(&c->index, key);
+  return CACHE_SYM(_index_is_end)(itr) ? NULL : itr.data->val;
+}
+
+// Takes ownership of e, replacing any element with the same key, and then
+// evicts cold elements until the budget is met. e itself is never evicted
+// here, so an element that costs more than the budget still gets cached
+// alone. Returns false, leaving e to the caller, when out of memory.
+static inline bool CACHE_SYM(_insert)(CACHE_NAME *c, CACHE_TY *e) {
+  CACHE_SYM(_index_itr) itr =
+      CACHE_SYM(_index_get_or_insert)(&c->index, e->CACHE_KEY, e);
+  if (CACHE_SYM(_index_is_end)(itr)) return false;
+
+  LIST_HEAD(victims);
+  if (itr.data->val != e) {
+    CACHE_TY *old = itr.data->val;
+    itr.data->key = e->CACHE_KEY;  // the old key may live inside old
+    itr.data->val = e;
+    list_move_tail(&old->CACHE_NODE.link, &victims);
+    c->used -= old->CACHE_NODE.cost;
+  }
+
+  struct cache_node *n = &e->CACHE_NODE;
+#ifdef CACHE_COST_FN
+  n->cost = CACHE_COST_FN(e);
+#else
+  n->cost = 1;
+#endif
+  n->referenced = false;
+  list_add_tail(&n->link, &c->list);
+  c->used += n->cost;
+
+  CACHE_SYM(_shed)(c, c->budget, n, &victims);
+  CACHE_SYM(_release)(c, &victims);
+  return true;
+}
+
+// Evicts the element with the key. Returns false if there is none.
+static inline bool CACHE_SYM(_erase)(CACHE_NAME *c, CACHE_KEY_TY key) {
+  CACHE_SYM(_index_itr) itr = CACHE_SYM(_index_get)(&c->index, key);
+  if (CACHE_SYM(_index_is_end)(itr)) return false;
+  CACHE_TY *e = itr.data->val;
+  CACHE_SYM(_index_erase_itr)(&c->index, itr);
+  LIST_HEAD(victims);
+  list_move_tail(&e->CACHE_NODE.link, &victims);
+  c->used -= e->CACHE_NODE.cost;
+  CACHE_SYM(_release)(c, &victims);
+  return true;
+}
+
+static inline size_t CACHE_SYM(_size)(CACHE_NAME *c) {
+  return CACHE_SYM(_index_size)(&c->index);
+}
+
+// Evicts every element.
+static inline void CACHE_SYM(_clear)(CACHE_NAME *c) {
+  LIST_HEAD(victims);
+  list_splice_init(&c->list, &victims);
+  CACHE_SYM(_index_clear)(&c->index);
+  c->used = 0;
+  CACHE_SYM(_release)(c, &victims);
+}
+
+// Evicts every element and frees the index. Pooled element storage stays in
+// its arena.
+static inline void CACHE_SYM(_cleanup)(CACHE_NAME *c) {
+  CACHE_SYM(_clear)(c);
+  CACHE_SYM(_index_cleanup)(&c->index);
+}
+
+#undef CACHE_NAME
+#undef CACHE_TY
+#undef CACHE_KEY_TY
+#undef CACHE_KEY
+#undef CACHE_NODE
+#undef CACHE_CLOCK
+#undef CACHE_COST_FN
+#undef CACHE_EVICT_FN
+#undef CACHE_HASH_FN
+#undef CACHE_CMPR_FN
+#undef CACHE_SYM
+#undef CACHE_INDEX
+#undef CACHE_ELEM
+
+#endif
@@ -174,6 +174,216 @@ struct json json_object_getn(struct json json, const char *key, size_t len);
 struct json json_get(const char *json_str, const char *path);
 struct json json_getn(const char *json_str, size_t len, const char *path);
 
+// json_query_compile compiles a set of paths into a query that finds all of
+// them in a single forward pass over a document. The query is read-only once
+// compiled and may be shared between threads. Returns NULL if a path is NULL
+// or ends with a lone backslash, or if out of memory.
+//
+// Paths use the json_get syntax, plus a backslash escapes the character that
+// follows it, so keys may contain dots or any other byte. A component made of
+// digits selects that element of an array, or that key of an object.
+//
+//    const char *paths[] = { "user.id", "tags.0", "notes.special\\.info" };
+//    struct json_query *q = json_query_compile(paths, 3);
+//    struct json res[3];
+//    json_query_execn(q, json_str, len, res);  // res[i] is paths[i]
+//    json_query_free(q);
+//
+struct json_query;
+struct json_query *json_query_compile(const char *const paths[], size_t n);
+void json_query_free(struct json_query *query);
+
+// json_query_count returns the number of paths in the query.
+size_t json_query_count(const struct json_query *query);
+
+// json_query_exec finds every path of the query in json, which may come from
+// json_parse or json_index, and stores them in results in the order the paths
+// were compiled. A path that is not found is stored as an empty json. Returns
+// the number of paths that were found.
+size_t json_query_exec(const struct json_query *query, struct json json,
+    struct json results[]);
+size_t json_query_execn(const struct json_query *query, const char *json_str,
+    size_t len, struct json results[]);
+
+// json_index builds a structural index of the json data in an arena.h arena.
+//
+// The result works with every json function, and is still backed by the same
+// memory as json_str, but json_first, json_next, json_array_get,
+// json_array_count and json_object_get use the index rather than scanning.
+// Array elements are found in constant time and the keys of larger objects
+// are hashed. Anything derived from the result lives as long as both the
+// arena and json_str.
+//
+// If the data is not an object or array, is unterminated or too deep, or the
+// arena runs out of memory, then the plain json_parsen result is returned.
+struct Arena;
+struct json json_index(struct Arena *arena, const char *json_str, size_t len);
+
+// json_indexed returns true if the json is backed by a json_index.
+bool json_indexed(struct json json);
+
+// json_stream is a push parser for data that arrives in chunks, such as
+// newline-delimited json or a very large document read from a socket.
+//
+// Bytes may be fed with any chunk boundaries. They are validated as they
+// arrive and reported to the callback as events:
+//
+//   JSON_STREAM_BEGIN   an object or array starts, shallower than split
+//   JSON_STREAM_KEY     an object key, its value follows
+//   JSON_STREAM_VALUE   a complete value no deeper than split
+//   JSON_STREAM_END     an object or array ends, shallower than split
+//
+// Top-level values are at depth 0, their children at depth 1, and so on.
+// Values at depth split are delivered whole. With a split of 0 each
+// top-level value is a JSON_STREAM_VALUE. With a split of 1 the elements of
+// a huge top-level array arrive one at a time.
+//
+// The only memory used is the buffer passed to json_stream_init, which must
+// hold the largest whole value or key. The json passed to the callback points
+// into that buffer and is only valid during the call. A non-zero return from
+// the callback stops the stream, and is returned from json_stream_feed.
+//
+//    struct json_stream js;
+//    json_stream_init(&js, buf, sizeof(buf));
+//    js.split = 1;
+//    js.callback = on_event;
+//    while ((n = read(fd, chunk, sizeof(chunk))) > 0) {
+//        if (json_stream_feed(&js, chunk, n)) break;
+//    }
+//    rc = json_stream_finish(&js);
+//
+#define JSON_STREAM_MAXDEPTH 1024
+#define JSON_STREAM_INVALID  -100  // invalid json at js.pos
+#define JSON_STREAM_TOOBIG   -101  // value or key exceeds the buffer
+
+enum json_stream_event {
+    JSON_STREAM_VALUE,
+    JSON_STREAM_KEY,
+    JSON_STREAM_BEGIN,
+    JSON_STREAM_END,
+};
+
+struct json_stream {
+    int split;  // depth of values to deliver whole
+    int (*callback)(enum json_stream_event event, struct json json, int depth,
+        void *udata);
+    void *udata;
+    size_t pos; // bytes consumed
+    struct {
+        char *buf;
+        size_t cap;
+        size_t len;
+        size_t tok;
+        int rc;
+        int depth;
+        uint8_t state;
+        uint8_t ttype;
+        bool esc;
+        bool capturing;
+        uint8_t stack[JSON_STREAM_MAXDEPTH/8];
+    } priv;
+};
+
+void json_stream_init(struct json_stream *js, char *buf, size_t cap);
+int json_stream_feed(struct json_stream *js, const void *data, size_t len);
+
+// json_stream_finish ends the stream, returning JSON_STREAM_INVALID if a
+// value is incomplete.
+int json_stream_finish(struct json_stream *js);
+
+// json_stream_read feeds a stream from a Neco stream until end of file, then
+// finishes it. Reading yields to other coroutines. Returns zero, a
+// JSON_STREAM_* error, a NECO_* error, or the non-zero callback result.
+// Requires building json.c with JSON_USENECO.
+struct neco_stream;
+int json_stream_read(struct json_stream *js, struct neco_stream *stream);
+int json_stream_read_dl(struct json_stream *js, struct neco_stream *stream,
+    int64_t deadline);
+
+// json_writer builds json text, escaping strings and formatting numbers as
+// it goes. Output is appended to buf, which is either:
+//
+//   json_writer_init         a fixed buffer. Set flush to have the buffer
+//                            handed to a callback whenever it fills up.
+//   json_writer_init_arena   a slice that grows in an arena.h arena.
+//   json_writer_init_stream  a fixed buffer that is written to a Neco
+//                            stream. Requires building with JSON_USENECO.
+//
+// Calls follow the shape of the document. Inside an object every value is
+// preceded by a json_write_key. Values written at the top level are
+// separated by newlines. Errors are sticky: the first one stops all output
+// and is returned by every later call, including json_writer_finish.
+//
+// Strings are escaped so the output is always valid json. Invalid utf8 is
+// replaced with U+FFFD, as json_escape does. Doubles are written with the
+// fewest digits that read back to the same value, and NaN and infinity are
+// written as null. With indent set, output is pretty printed with that many
+// spaces per level.
+//
+//    struct json_writer w;
+//    json_writer_init_arena(&w, &arena);
+//    json_write_begin_object(&w);
+//    json_write_key(&w, "id");
+//    json_write_int64(&w, 42);
+//    json_write_end_object(&w);
+//    rc = json_writer_finish(&w);  // w.buf.data is "{\"id\":42}"
+//
+#define JSON_WRITER_MAXDEPTH 1024
+#define JSON_WRITER_FULL     -102  // out of buffer or arena memory
+#define JSON_WRITER_MISUSE   -103  // call out of place, or too deep
+
+struct json_writer {
+    int indent; // spaces per level, or zero for compact output
+    int (*flush)(const char *data, size_t len, void *udata);
+    void *udata;
+    size_t pos; // bytes handed to flush
+    struct {
+        char *data;
+        ptrdiff_t len;
+        ptrdiff_t cap;
+    } buf;      // output that has not been flushed
+    struct {
+        struct Arena *arena;
+        int rc;
+        int depth;
+        bool first;
+        bool key;
+        bool stream;
+        uint8_t stack[JSON_WRITER_MAXDEPTH/8];
+    } priv;
+};
+
+void json_writer_init(struct json_writer *w, char *buf, size_t cap);
+void json_writer_init_arena(struct json_writer *w, struct Arena *arena);
+void json_writer_init_stream(struct json_writer *w, char *buf, size_t cap,
+    struct neco_stream *stream);
+
+// json_writer_flush hands the buffered output to flush. For a writer from
+// json_writer_init_stream the Neco stream is flushed too.
+int json_writer_flush(struct json_writer *w);
+
+// json_writer_finish checks that the document is complete and flushes it.
+// Output that stays in buf, because there is no flush callback, is null
+// terminated. Returns zero, a JSON_WRITER_* error, or the flush error.
+int json_writer_finish(struct json_writer *w);
+
+int json_write_begin_object(struct json_writer *w);
+int json_write_end_object(struct json_writer *w);
+int json_write_begin_array(struct json_writer *w);
+int json_write_end_array(struct json_writer *w);
+int json_write_key(struct json_writer *w, const char *key);
+int json_write_keyn(struct json_writer *w, const char *key, size_t len);
+int json_write_string(struct json_writer *w, const char *str);
+int json_write_stringn(struct json_writer *w, const char *str, size_t len);
+int json_write_int64(struct json_writer *w, int64_t x);
+int json_write_uint64(struct json_writer *w, uint64_t x);
+int json_write_double(struct json_writer *w, double x);
+int json_write_bool(struct json_writer *w, bool x);
+int json_write_null(struct json_writer *w);
+
+// json_write_json copies a value from json_parse or json_index as is.
+int json_write_json(struct json_writer *w, struct json json);
+
 // json_double returns a json's double value.
 double json_double(struct json json);
 
@@ -186,6 +396,14 @@ int64_t json_int64(struct json json);
 // json_uint64 returns a json's uint64 value.
 uint64_t json_uint64(struct json json);
 
+// json_array_doubles decodes the elements of a json array into vals, as
+// json_double would, and json_array_int64s does the same as json_int64.
+//
+// Returns the number of elements in the array. If that is greater than n,
+// then only the first n were decoded.
+size_t json_array_doubles(struct json json, double *vals, size_t n);
+size_t json_array_int64s(struct json json, int64_t *vals, size_t n);
+
 // json_bool returns a json's boolean value.
 bool json_bool(struct json json);
 
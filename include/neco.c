@@ -11,7 +11,7 @@
 // Compilation options
 ////////////////////////////////////////////////////////////////////////////////
 
-NECO_STACKSIZE       // Size of each stack
+NECO_STACKSIZE       // Default size of each stack, rounded to a size class
 NECO_DEFCAP          // Default stack_group capacity
 NECO_MAXCAP          // Max stack_group capacity
 NECO_GAPSIZE         // Size of gap (guard) pages
@@ -19,6 +19,12 @@ NECO_SIGSTKSZ        // Size of signal stack on main thread
 NECO_BURST           // Number of read attempts before waiting, def: disabled
 NECO_MAXWORKERS      // Max number of worker threads, def: 64
 NECO_MAXIOWORKERS    // Max number of io threads, def: 2
+NECO_ARENABLOCK      // Size of each pooled arena block, def: 65536
+NECO_ARENAPOOL       // Max arena blocks pooled per thread, def: 64
+NECO_URINGSIZE       // Number of io_uring submission entries, def: 256
+NECO_TRACESIZE       // Number of events in each runtime's trace ring, def: 16384
+NECO_DNSTTL          // Seconds that resolved host names are cached, def: 30
+NECO_DNSCACHESIZE    // Max cached host names per thread, def: 256
 
 // Additional options that activate features
 
@@ -33,6 +39,12 @@ NECO_USEREADWORKERS   // Use read workers, disabled by default
 NECO_USEWRITEWORKERS  // Use write workers, enabled by default on Linux
 NECO_NOREADWORKERS    // Disable all read workers
 NECO_NOWRITEWORKERS   // Disable all write workers
+NECO_USEARENAS        // Give coroutines and worker jobs a pooled arena.h arena
+NECO_USEURING         // Use io_uring for file and socket io on Linux
+NECO_NOTIMERWHEEL     // Keep all deadlines in the ordered deadline queue
+NECO_USEMETRICS       // Collect runtime counters and latency histograms
+NECO_USETRACE         // Record scheduling events in a ring, implies metrics
+NECO_NODNSCACHE       // Do not cache or coalesce host name lookups
 */
 
 // Windows and Webassembly have limited features.
@@ -57,6 +69,12 @@ NECO_NOWRITEWORKERS   // Disable all write workers
 #define DEF_MAXRINGSIZE   32
 #define DEF_MAXIOWORKERS  2
 #endif
+#define DEF_ARENABLOCK    65536
+#define DEF_ARENAPOOL     64
+#define DEF_URINGSIZE     256
+#define DEF_TRACESIZE     16384
+#define DEF_DNSTTL        30
+#define DEF_DNSCACHESIZE  256
 
 #ifdef __linux__
 #ifndef NECO_USEWRITEWORKERS
@@ -91,6 +109,41 @@ NECO_NOWRITEWORKERS   // Disable all write workers
 #ifndef NECO_MAXIOWORKERS
 #define NECO_MAXIOWORKERS DEF_MAXIOWORKERS
 #endif
+#ifndef NECO_ARENABLOCK
+#define NECO_ARENABLOCK DEF_ARENABLOCK
+#endif
+#ifndef NECO_ARENAPOOL
+#define NECO_ARENAPOOL DEF_ARENAPOOL
+#endif
+#ifndef NECO_URINGSIZE
+#define NECO_URINGSIZE DEF_URINGSIZE
+#endif
+#ifndef NECO_TRACESIZE
+#define NECO_TRACESIZE DEF_TRACESIZE
+#endif
+#ifndef NECO_DNSTTL
+#define NECO_DNSTTL DEF_DNSTTL
+#endif
+#ifndef NECO_DNSCACHESIZE
+#define NECO_DNSCACHESIZE DEF_DNSCACHESIZE
+#endif
+
+#if defined(NECO_USETRACE) && !defined(NECO_USEMETRICS)
+#define NECO_USEMETRICS
+#endif
+
+#ifdef NECO_USEMETRICS
+// Scheduling hooks for the embedded sco and worker, which are otherwise
+// compiled to nothing.
+static void metrics_onready(void *udata);
+static void metrics_onswitch(void *udata);
+#define SCO_ONREADY(udata) metrics_onready(udata)
+#define SCO_ONSWITCH(udata) metrics_onswitch(udata)
+#ifndef NECO_NOWORKERS
+static void metrics_onsubmit(int queued);
+#define WORKER_ONSUBMIT(queued) metrics_onsubmit(queued)
+#endif
+#endif
 
 #ifdef NECO_TESTING
 #if NECO_BURST <= 0
@@ -160,6 +213,15 @@ NECO_NOWRITEWORKERS   // Disable all write workers
 
 // Coroutine scheduler
 
+// Called with the udata of a coroutine that becomes runnable, and of the
+// coroutine about to run or NULL when switching back to main.
+#ifndef SCO_ONREADY
+#define SCO_ONREADY(udata) ((void)0)
+#endif
+#ifndef SCO_ONSWITCH
+#define SCO_ONSWITCH(udata) ((void)0)
+#endif
+
 #include <stdatomic.h>
 #include <stdbool.h>
 
@@ -1976,6 +2038,7 @@ static void sco_list_push_back(struct sco_list *list, struct sco *co) {
 static void sco_return_to_main(bool final) {
     sco_cur = NULL;
     sco_exit_to_main_requested = false;
+    SCO_ONSWITCH(NULL);
     llco_switch(0, final);
 }
 
@@ -1999,6 +2062,7 @@ static void sco_switch(bool resumed_from_main, bool final) {
     }
     sco_cur = sco_list_pop_front(&sco_runners);
     sco_nrunners--;
+    SCO_ONSWITCH(sco_cur->udata);
     llco_switch(sco_cur->llco, final);
 }
 
@@ -2017,8 +2081,10 @@ static void sco_entry(void *udata) {
         // continue running the started coroutine.
         sco_list_push_back(&sco_runners, sco_cur);
         sco_nrunners++;
+        SCO_ONREADY(sco_cur->udata);
     }
     sco_cur = co;
+    SCO_ONSWITCH(udata);
     if (sco_user_entry) {
         sco_user_entry(udata);
     }
@@ -2058,6 +2124,7 @@ void sco_yield(void) {
     if (sco_cur) {
         sco_list_push_back(&sco_yielders, sco_cur);
         sco_nyielders++;
+        SCO_ONREADY(sco_cur->udata);
         sco_switch(false, false);
     }
 }
@@ -2086,6 +2153,7 @@ void sco_resume(int64_t id) {
             co->next = co;
             sco_list_push_back(&sco_yielders, co);
             sco_nyielders++;
+            SCO_ONREADY(co->udata);
             sco_yield();
         }
     }
@@ -2237,7 +2305,7 @@ struct stack_opts {
     bool onlymalloc;
 };
 struct stack { char _[32]; };
-struct stack_mgr { char _[320]; };
+struct stack_mgr { char _[16384]; };
 #endif
 
 #ifndef STACK_API
@@ -2264,6 +2332,26 @@ struct stack_freed {
     struct stack_group *group;
 };
 
+// Stacks come in size classes from 16 KB to 512 MB, four for each power of
+// two, such as 64, 80, 96 and 112 KB. A size is rounded up by less than a
+// quarter. Each class has its own groups and its own free list, so stacks of
+// different sizes are never mixed up in the same mmap.
+#define STACK_MINSHIFT  14
+#define STACK_MAXSHIFT  29
+#define STACK_STEPS     4
+#define STACK_NCLASSES  ((STACK_MAXSHIFT-STACK_MINSHIFT)*STACK_STEPS+1)
+#define STACK_MINSIZE   ((size_t)1 << STACK_MINSHIFT)
+#define STACK_MAXSIZE   ((size_t)1 << STACK_MAXSHIFT)
+
+struct stack_class {
+    struct stack_group gendcaps[2];
+    struct stack_group *group_head;
+    struct stack_group *group_tail;
+    struct stack_freed fendcaps[2];
+    struct stack_freed *free_head;
+    struct stack_freed *free_tail;
+};
+
 struct stack_mgr0 {
     size_t pagesz;
     size_t stacksz;
@@ -2274,12 +2362,7 @@ struct stack_mgr0 {
     bool nostackfreelist;
     bool nopagerelease;
     bool onlymalloc;
-    struct stack_group gendcaps[2];
-    struct stack_group *group_head;
-    struct stack_group *group_tail;
-    struct stack_freed fendcaps[2];
-    struct stack_freed *free_head;
-    struct stack_freed *free_tail;
+    struct stack_class classes[STACK_NCLASSES];
 };
 
 struct stack0 {
@@ -2299,12 +2382,36 @@ static size_t stack_align_size(size_t size, size_t boundary) {
            size;
 }
 
+// Returns the size class for a stack size, which is rounded up to the next
+// class size, or -1 if the size is too large.
+static int stack_class_index(size_t stacksz) {
+    if (stacksz <= STACK_MINSIZE) {
+        return 0;
+    } else if (stacksz > STACK_MAXSIZE) {
+        return -1;
+    }
+    // Find the power of two below the size, then the step above it.
+    int shift = STACK_MINSHIFT;
+    while (((size_t)1 << (shift+1)) < stacksz) {
+        shift++;
+    }
+    size_t base = (size_t)1 << shift;
+    size_t step = base / STACK_STEPS;
+    int k = (int)((stacksz - base + step - 1) / step);
+    return (shift-STACK_MINSHIFT)*STACK_STEPS + k;
+}
+
+static size_t stack_class_size(int i) {
+    size_t base = (size_t)1 << (STACK_MINSHIFT + i/STACK_STEPS);
+    return base + base / STACK_STEPS * (size_t)(i%STACK_STEPS);
+}
+
 #ifndef _WIN32
 
 // allocate memory using mmap. Used primarily for stack group memory.
 static void *stack_mmap_alloc(size_t size) {
     void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
-        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     if (addr == MAP_FAILED || addr == NULL) {
         return NULL;
     }
@@ -2383,22 +2490,23 @@ static struct stack_group *stack_freed_remove(struct stack_freed *stack) {
     return group;
 }
 
-// push a stack_group to the end of the manager group list.
-static void stack_push_group(struct stack_mgr0 *mgr, struct stack_group *group)
+// push a stack_group to the end of the class group list.
+static void stack_push_group(struct stack_class *class, 
+    struct stack_group *group)
 {
-    mgr->group_tail->prev->next = group;
-    group->prev = mgr->group_tail->prev;
-    group->next = mgr->group_tail;
-    mgr->group_tail->prev = group;
+    class->group_tail->prev->next = group;
+    group->prev = class->group_tail->prev;
+    group->next = class->group_tail;
+    class->group_tail->prev = group;
 }
 
-static void stack_push_freed_stack(struct stack_mgr0 *mgr, 
+static void stack_push_freed_stack(struct stack_class *class, 
     struct stack_freed *stack, struct stack_group *group)
 {
-    mgr->free_tail->prev->next = stack;
-    stack->prev = mgr->free_tail->prev;
-    stack->next = mgr->free_tail;
-    mgr->free_tail->prev = stack;
+    class->free_tail->prev->next = stack;
+    stack->prev = class->free_tail->prev;
+    stack->next = class->free_tail;
+    class->free_tail->prev = stack;
     stack->group = group;
 }
 #endif
@@ -2412,7 +2520,8 @@ static void stack_mgr_init_(struct stack_mgr0 *mgr, struct stack_opts *opts) {
     size_t pagesz = (size_t)sysconf(_SC_PAGESIZE);
 #endif
     size_t stacksz = opts && opts->stacksz ? opts->stacksz : 8388608;
-    stacksz = stack_align_size(stacksz, pagesz);
+    int i = stack_class_index(stack_align_size(stacksz, pagesz));
+    stacksz = stack_class_size(i < 0 ? STACK_NCLASSES-1 : i);
     memset(mgr, 0, sizeof(struct stack_mgr0));
     mgr->stacksz = stacksz;
     mgr->defcap = opts && opts->defcap ? opts->defcap : 4;
@@ -2423,15 +2532,18 @@ static void stack_mgr_init_(struct stack_mgr0 *mgr, struct stack_opts *opts) {
     mgr->nopagerelease = opts && opts->nopagerelease;
     mgr->onlymalloc = opts && opts->onlymalloc;
     mgr->pagesz = pagesz;
-    mgr->group_head = &mgr->gendcaps[0];
-    mgr->group_tail = &mgr->gendcaps[1];
-    mgr->group_head->next = mgr->group_tail;
-    mgr->group_tail->prev = mgr->group_head;
-    if (!mgr->nostackfreelist) {
-        mgr->free_head = &mgr->fendcaps[0];
-        mgr->free_tail = &mgr->fendcaps[1];
-        mgr->free_head->next = mgr->free_tail;
-        mgr->free_tail->prev = mgr->free_head;
+    for (i = 0; i < STACK_NCLASSES; i++) {
+        struct stack_class *class = &mgr->classes[i];
+        class->group_head = &class->gendcaps[0];
+        class->group_tail = &class->gendcaps[1];
+        class->group_head->next = class->group_tail;
+        class->group_tail->prev = class->group_head;
+        if (!mgr->nostackfreelist) {
+            class->free_head = &class->fendcaps[0];
+            class->free_tail = &class->fendcaps[1];
+            class->free_head->next = class->free_tail;
+            class->free_tail->prev = class->free_head;
+        }
     }
 #ifdef _WIN32
     mgr->onlymalloc = true;
@@ -2446,11 +2558,14 @@ void stack_mgr_init(struct stack_mgr *mgr, struct stack_opts *opts) {
 
 static void stack_mgr_destroy_(struct stack_mgr0 *mgr) {
 #ifndef _WIN32
-    struct stack_group *group = mgr->group_head->next;
-    while (group != mgr->group_tail) {
-        struct stack_group *next = group->next;
-        stack_group_free(group);
-        group = next;
+    for (int i = 0; i < STACK_NCLASSES; i++) {
+        struct stack_class *class = &mgr->classes[i];
+        struct stack_group *group = class->group_head->next;
+        while (group != class->group_tail) {
+            struct stack_group *next = group->next;
+            stack_group_free(group);
+            group = next;
+        }
     }
 #endif
     memset(mgr, 0, sizeof(struct stack_mgr0));
@@ -2477,42 +2592,66 @@ static void stack_release_group(struct stack_group *group, bool nofreelist) {
 }
 #endif
 
-static int stack_get_(struct stack_mgr0 *mgr, struct stack0 *stack) {
+// Returns the actual size of the stack that stack_get() will provide for
+// the requested size, or zero if too large. Zero requests the default size.
+static size_t stack_request_size_(struct stack_mgr0 *mgr, size_t stacksz) {
+    if (stacksz == 0) {
+        return mgr->stacksz;
+    }
+    int i = stack_class_index(stack_align_size(stacksz, mgr->pagesz));
+    return i < 0 ? 0 : stack_class_size(i);
+}
+
+STACK_API
+size_t stack_request_size(struct stack_mgr *mgr, size_t stacksz) {
+    return stack_request_size_((void*)mgr, stacksz);
+}
+
+static int stack_get_(struct stack_mgr0 *mgr, struct stack0 *stack, 
+    size_t stacksz)
+{
+    stacksz = stack_request_size_(mgr, stacksz);
+    if (stacksz == 0) {
+        return -1;
+    }
     if (mgr->onlymalloc) {
-        void *addr = malloc(mgr->stacksz);
+        void *addr = malloc(stacksz);
         if (!addr) {
             return -1;
         }
         stack->addr = addr;
-        stack->size = mgr->stacksz;
+        stack->size = stacksz;
         stack->group = 0;
         return 0;
     }
 #ifndef _WIN32
+    struct stack_class *class = &mgr->classes[stack_class_index(stacksz)];
     struct stack_group *group;
     if (!mgr->nostackfreelist) {
-        struct stack_freed *fstack = mgr->free_tail->prev;
-        if (fstack != mgr->free_head) {
+        struct stack_freed *fstack = class->free_tail->prev;
+        if (fstack != class->free_head) {
             group = stack_freed_remove(fstack);
             group->use++;
             stack->addr = fstack;
-            stack->size = mgr->stacksz;
+            stack->size = stacksz;
             stack->group = group;
             return 0;
         }
     }
-    group = mgr->group_tail->prev;
+    group = class->group_tail->prev;
     if (group->pos == group->cap) {
         size_t cap = group->cap ? group->cap * 2 : mgr->defcap;
         if (cap > mgr->maxcap) {
             cap = mgr->maxcap;
         }
-        group = stack_group_new(mgr->stacksz, mgr->pagesz, cap, mgr->gapsz, 
+        // Small stacks get gaps no larger than themselves.
+        size_t gapsz = mgr->gapsz < stacksz ? mgr->gapsz : stacksz;
+        group = stack_group_new(stacksz, mgr->pagesz, cap, gapsz, 
             mgr->useguards);
         if (!group) {
             return -1;
         }
-        stack_push_group(mgr, group);
+        stack_push_group(class, group);
     }
     char *addr = group->stack0 + (group->stacksz+group->gapsz) * group->pos;
     if (group->guards) {
@@ -2542,15 +2681,15 @@ static int stack_get_(struct stack_mgr0 *mgr, struct stack0 *stack) {
     group->pos++;
     group->use++;
     stack->addr = addr;
-    stack->size = mgr->stacksz;
+    stack->size = stacksz;
     stack->group = group;
 #endif
     return 0;
 }
 
 STACK_API
-int stack_get(struct stack_mgr *mgr, struct stack *stack) {
-    return stack_get_((void*)mgr, (void*)stack);
+int stack_get(struct stack_mgr *mgr, struct stack *stack, size_t stacksz) {
+    return stack_get_((void*)mgr, (void*)stack, stacksz);
 }
 
 static void stack_put_(struct stack_mgr0 *mgr, struct stack0 *stack) {
@@ -2565,16 +2704,18 @@ static void stack_put_(struct stack_mgr0 *mgr, struct stack0 *stack) {
         char *stack0 = addr;
         size_t stacksz = group->stacksz;
         if (!mgr->nostackfreelist) {
-            // The first page does not need to be released.
+            // The first page does not need to be released. Neither does the
+            // last one, which is where the next coroutine will start.
             stack0 += group->pagesz;
-            stacksz -= group->pagesz;
+            stacksz = stacksz > group->pagesz * 2 ? 
+                stacksz - group->pagesz * 2 : 0;
         }
         if (stacksz > 0) {
-            // Re-mmap the pages that encompass the stack. The MAP_FIXED option
-            // releases the pages back to the operating system. Yet the entire
-            // stack will still exists in the processes virtual memory.
-            mmap(stack0, stacksz, PROT_READ | PROT_WRITE, 
-                MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            // Drop the pages that the coroutine dirtied. They go back to the 
+            // operating system and read as zeros when touched again, while
+            // the stack stays in the processes virtual memory. Unlike 
+            // re-mmapping the range this does not split the group mapping.
+            madvise(stack0, stacksz, MADV_DONTNEED);
         }
     }
     group->use--;
@@ -2583,7 +2724,8 @@ static void stack_put_(struct stack_mgr0 *mgr, struct stack0 *stack) {
         // This will cause the first page of the stack to being paged into
         // process memory, thus using up at least page_size of data per linked
         // stack.
-        stack_push_freed_stack(mgr, addr, group);
+        stack_push_freed_stack(&mgr->classes[stack_class_index(group->stacksz)],
+            addr, group);
     }
     if (group->use == 0) {
         // There are no more stacks in use for this group that belongs to the 
@@ -2617,6 +2759,47 @@ STACK_API
 void *stack_addr(struct stack *stack) {
     return stack_addr_((void*)stack);
 }
+
+// Returns the number of bytes, rounded to pages, between the top of the 
+// stack and the deepest page that is resident in memory. Stacks grow down
+// and their released pages are not resident, so this is the most the 
+// stack has used since it was last released.
+static size_t stack_highwater_(struct stack_mgr0 *mgr, struct stack0 *stack) {
+#ifndef _WIN32
+    if (!stack->group) {
+        // Heap stacks cannot be measured.
+        return stack->size;
+    }
+    size_t pagesz = stack->group->pagesz;
+    size_t npages = stack->size / pagesz;
+    // The first page holds the free list link, so it is always resident.
+    size_t i = mgr->nostackfreelist ? 0 : 1;
+    unsigned char vec[256];
+    while (i < npages) {
+        size_t n = npages - i < sizeof(vec) ? npages - i : sizeof(vec);
+        if (mincore((char*)stack->addr + i * pagesz, n * pagesz, 
+            (void*)vec) == -1)
+        {
+            return stack->size;
+        }
+        for (size_t j = 0; j < n; j++) {
+            if (vec[j] & 1) {
+                return (npages - i - j) * pagesz;
+            }
+        }
+        i += n;
+    }
+    return 0;
+#else
+    (void)mgr;
+    return stack->size;
+#endif
+}
+
+STACK_API
+size_t stack_highwater(struct stack_mgr *mgr, struct stack *stack) {
+    return stack_highwater_((void*)mgr, (void*)stack);
+}
 // END stack.c
 
 #ifndef NECO_NOWORKERS
@@ -2641,6 +2824,11 @@ void *stack_addr(struct stack *stack) {
 #define WORKER_API
 #endif
 
+// Called with the length of the thread queue after each submitted entry.
+#ifndef WORKER_ONSUBMIT
+#define WORKER_ONSUBMIT(queued) ((void)0)
+#endif
+
 #define WORKER_DEF_TIMEOUT INT64_C(1000000000) // one second
 #define WORKER_DEF_MAX_THREADS 2
 #define WORKER_DEF_MAX_THREAD_ENTRIES 32
@@ -2752,6 +2940,11 @@ struct worker *worker_new(struct worker_opts *opts) {
     return worker;
 }
 
+#ifdef NECO_USEARENAS
+static void thread_arena_reset(void);
+static void thread_arena_release(void);
+#endif
+
 static void *worker_entry(void *arg) {
     // printf("thread created\n");
     struct worker_thread *thread = arg;
@@ -2767,6 +2960,9 @@ static void *worker_entry(void *arg) {
             pthread_mutex_unlock(&thread->mu);
             if (entry.work) {
                 entry.work(entry.udata);
+#ifdef NECO_USEARENAS
+                thread_arena_reset();
+#endif
             }
             pthread_mutex_lock(&thread->mu);
         }
@@ -2784,6 +2980,9 @@ static void *worker_entry(void *arg) {
         }
     }
     pthread_mutex_unlock(&thread->mu);
+#ifdef NECO_USEARENAS
+    thread_arena_release();
+#endif
     // printf("thread ended\n");
     return NULL;
 }
@@ -2818,6 +3017,7 @@ bool worker_submit(struct worker *worker, int64_t pin, void(*work)(void *udata),
         thread->entries[pos].work = work;
         thread->entries[pos].udata = udata;
         thread->len++;
+        WORKER_ONSUBMIT(thread->len);
         if (!thread->th) {
             int ret = pthread_create(&thread->th, 0, worker_entry, thread);
             if (ret == -1) {
@@ -2863,14 +3063,38 @@ bool worker_submit(struct worker *worker, int64_t pin, void(*work)(void *udata),
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <dlfcn.h>
 #include <sys/syscall.h>
 #endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include <pthread.h>
 
 
 #include "neco.h"
 
+#ifdef NECO_USEARENAS
+// The LOGGING mode of debug.h implements uprintf, which belongs to the
+// program's own translation unit and not to this one. Neco keeps its own
+// assert and setjmp.
+#pragma push_macro("LOGGING")
+#pragma push_macro("assert")
+#pragma push_macro("setjmp")
+#pragma push_macro("longjmp")
+#undef LOGGING
+#undef assert
+#undef setjmp
+#undef longjmp
+#include "arena.h"
+#pragma pop_macro("longjmp")
+#pragma pop_macro("setjmp")
+#pragma pop_macro("assert")
+#pragma pop_macro("LOGGING")
+#endif
+
 #if defined(__FreeBSD__) || defined(__APPLE__)
 #include <sys/event.h>
 #define NECO_POLL_KQUEUE
@@ -2878,6 +3102,11 @@ bool worker_submit(struct worker *worker, int64_t pin, void(*work)(void *udata),
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
 #define NECO_POLL_EPOLL
+#ifdef NECO_USEURING
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+#define NECO_POLL_URING
+#endif
 #elif defined(__EMSCRIPTEN__) || defined(_WIN32) || defined(__COSMOCC__)
 // #warning Webassembly has no polling
 #define NECO_POLL_DISABLED
@@ -2886,6 +3115,13 @@ bool worker_submit(struct worker *worker, int64_t pin, void(*work)(void *udata),
 #error Platform not supported
 #endif
 
+// Cached lookups are handed out as copies that the caller releases with the
+// libc freeaddrinfo(), so the copies must use the same layout as the libc,
+// which is only known for glibc and FreeBSD.
+#if !defined(__GLIBC__) && !defined(__FreeBSD__) && !defined(NECO_NODNSCACHE)
+#define NECO_NODNSCACHE
+#endif
+
 #ifdef _WIN32
 #ifndef SIGUSR1
 #define SIGUSR1 30      /* user defined signal 1 */
@@ -3259,6 +3495,84 @@ struct cleanup {
     struct cleanup *next;
 };
 
+#ifdef NECO_USEARENAS
+////////////////////////////////////////////////////////////////////////////////
+// arena_pool - A thread-local pool of arena blocks. Every coroutine and
+// worker job gets a chained arena that draws its blocks from the pool of the
+// thread it runs on, and returns them in bulk when it's done.
+////////////////////////////////////////////////////////////////////////////////
+
+struct arena_pool {
+    ArenaBlock *blocks;
+    int nblocks;
+};
+
+static __thread struct arena_pool arena_pool = { 0 };
+
+static void *arena_pool_alloc(ssize size, void *ctx) {
+    (void)ctx;
+    if (size == NECO_ARENABLOCK && arena_pool.blocks) {
+        ArenaBlock *block = arena_pool.blocks;
+        arena_pool.blocks = block->next;
+        arena_pool.nblocks--;
+        return block;
+    }
+    return malloc0((size_t)size);
+}
+
+static void arena_pool_free(void *ptr, ssize size, void *ctx) {
+    (void)ctx;
+    if (size == NECO_ARENABLOCK && arena_pool.nblocks < NECO_ARENAPOOL) {
+        ArenaBlock *block = ptr;
+        block->next = arena_pool.blocks;
+        arena_pool.blocks = block;
+        arena_pool.nblocks++;
+        return;
+    }
+    free0(ptr);
+}
+
+static void arena_pool_drain(void) {
+    while (arena_pool.blocks) {
+        ArenaBlock *block = arena_pool.blocks;
+        arena_pool.blocks = block->next;
+        free0(block);
+    }
+    arena_pool.nblocks = 0;
+}
+
+static Arena arena_pool_make(ArenaChain *chain) {
+    *chain = (ArenaChain) {
+        .alloc = arena_pool_alloc,
+        .free = arena_pool_free,
+    };
+    return newchain(chain, NECO_ARENABLOCK);
+}
+
+// The arena of a thread that is not running a coroutine, such as a worker.
+static __thread ArenaChain thread_arenachain = { 0 };
+static __thread Arena thread_arena = { 0 };
+
+static Arena *thread_arena_get(void) {
+    if (!thread_arena.chain) {
+        thread_arena = arena_pool_make(&thread_arenachain);
+    }
+    return &thread_arena;
+}
+
+// Worker jobs get a fresh arena each, their blocks stay with the thread.
+static void thread_arena_reset(void) {
+    if (thread_arena.chain) {
+        arena_release(&thread_arena);
+    }
+}
+
+static void thread_arena_release(void) {
+    thread_arena_reset();
+    arena_pool_drain();
+}
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 // colist - The standard queue type that is just a doubly linked list storing
 // the highest priority coroutine at the head and lowest at the tail.
@@ -3347,6 +3661,14 @@ struct coroutine {
     char *cmsg;                   // channel message data from sender
     bool cclosed;                 // channel closed by sender
 
+    struct runtime *xrt;          // runtime, while waiting on a shared object
+    struct coroutine *xnext;      // next in a list of cross-thread wakeups
+    atomic_int xstate;            // XIDLE, XWAITING or XWOKEN
+    char *xcase;                  // select-case message from shared channels
+    size_t xcasecap;              // capacity of xcase
+    struct neco_chan *xcasechan;  // shared channel that xcase came from
+    bool xcaseok;                 // select-case 'closed' result for xcasechan
+
     uint32_t sigwatch;            // coroutine is watching these signals (mask)
     uint32_t sigmask;             // coroutine wait mask and result
 
@@ -3361,6 +3683,15 @@ struct coroutine {
 
     struct neco_chan *gen;        // self generator (actually a channel)
 
+#ifdef NECO_USEMETRICS
+    int64_t readyts;              // when the coroutine became runnable
+#endif
+
+#ifdef NECO_USEARENAS
+    ArenaChain arenachain;        // blocks from the thread's arena pool
+    Arena arena;                  // released in bulk by coexit
+#endif
+
     // For the rt->all comap, which stores all active coroutines
     AAT_FIELDS(struct coroutine,  all_left, all_right, all_level)
 
@@ -3368,6 +3699,13 @@ struct coroutine {
     int64_t deadline;
     AAT_FIELDS(struct coroutine, dl_left, dl_right, dl_level)
 
+    // Timer wheel node, used instead of the dl fields for deadlines that are
+    // at least a tick away
+    struct coroutine *tw_next;
+    struct coroutine **tw_pprev;
+    uint8_t tw_level;
+    uint8_t tw_slot;
+
     // File event node
     int evfd;
     enum evkind evkind;
@@ -3566,6 +3904,28 @@ int neco_gai_lasterr(void) {
 // used by another thread. 
 static atomic_int_fast64_t next_runtime_id = 1;
 
+////////////////////////////////////////////////////////////////////////////////
+// timerwheel - A hashed hierarchical timing wheel for deadlines.
+// Arming and disarming are O(1), which matters because most deadlines are
+// disarmed long before they expire. Each level has 64 slots, and each slot
+// of a level spans all 64 slots of the level below it. The first level ticks
+// about every millisecond and the four levels span almost five hours. Later
+// deadlines are parked in the last slot and rehashed when they cascade down.
+// Deadlines less than a tick out use the precise dlqueue instead.
+////////////////////////////////////////////////////////////////////////////////
+
+#define TW_TICK   20  // tick is 1<<20 nanoseconds, about 1 ms
+#define TW_BITS   6
+#define TW_SLOTS  (1<<TW_BITS)
+#define TW_LEVELS 4
+
+struct timerwheel {
+    int64_t tick;                  // last tick processed
+    size_t count;                  // number of armed coroutines
+    uint64_t used[TW_LEVELS];      // bitmap of occupied slots
+    struct coroutine *slots[TW_LEVELS][TW_SLOTS];
+};
+
 // The neco runtime
 struct runtime {
     int64_t id;                    // unique runtime identifier
@@ -3575,6 +3935,7 @@ struct runtime {
     struct comap all;              // all running coroutines.
     struct coroutine *deadlines;   // paused coroutines (aat root)
     size_t ndeadlines;             // total number of paused coroutines
+    struct timerwheel timers;      // paused coroutines with coarse deadlines
     size_t ntotal;                 // total number of coroutines ever created
     size_t nsleepers;
     size_t nlocked;
@@ -3598,6 +3959,10 @@ struct runtime {
 
     int qfd;                       // queue file descriptor (epoll or kqueue)
     int64_t qfdcreated;            // when the queue was created
+#ifdef NECO_POLL_URING
+    struct uring *uring;           // io_uring, replaces qfd when available
+    bool uringoff;                 // io_uring is unavailable on this system
+#endif
 
     // zerochan pool (reusables)
     struct neco_chan **zchanpool;  // pool of zero sized channels
@@ -3629,14 +3994,52 @@ struct runtime {
     size_t niowaiters;
 #endif
 
+    // Coroutines waiting on shared objects, which other threads may wake
+    size_t nxwaiters;              // number of coroutines waiting
+    bool xdraining;                // the xdrain coroutine is running
+    int xfds[2];                   // pipe that wakes xdrain, made on first use
+    pthread_mutex_t xmu;           // guards xwoken and xsleeping
+    struct coroutine *xwoken;      // woken by other threads, to be resumed
+    bool xsleeping;                // xdrain is waiting on the pipe
+    struct coroutine *xpending;    // woken by this thread, to be handed over
+
     unsigned int burstcount;
+
+#ifdef NECO_USEMETRICS
+    neco_metrics metrics;
+#endif
+#ifdef NECO_USETRACE
+    struct trace *trace;           // ring of the most recent trace events
+#endif
+#ifndef NECO_NODNSCACHE
+    struct dns_entry *dnshead;     // cached host names, most recent first
+    struct dns_entry *dnstail;
+    size_t ndns;
+#endif
 };
 
 #define RUNTIME_DEFAULTS (struct runtime) { 0 }
 
 static __thread struct runtime *rt = NULL;
 
+#ifndef NECO_NODNSCACHE
+static void dns_release(void);
+#endif
+
 static void rt_release(void) {
+#ifndef NECO_NODNSCACHE
+    dns_release();
+#endif
+#ifdef NECO_USETRACE
+    if (rt->trace) {
+        free0(rt->trace);
+    }
+#endif
+    if (rt->xfds[0]) {
+        close(rt->xfds[0]);
+        close(rt->xfds[1]);
+    }
+    pthread_mutex_destroy(&rt->xmu);
     free0(rt);
     rt = NULL;
 }
@@ -3646,6 +4049,114 @@ static struct coroutine *coself(void) {
     return (struct coroutine*)sco_udata();
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// metrics and tracing
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef NECO_USETRACE
+struct trace {
+    size_t pos;      // next slot to write
+    size_t len;      // number of events in the ring
+    neco_trace_event events[NECO_TRACESIZE];
+};
+
+// Adds an event, overwriting the oldest one when the ring is full.
+static void trace_push(int kind, int64_t ts, int64_t id, int64_t arg) {
+    struct trace *trace = rt->trace;
+    if (!trace) {
+        return;
+    }
+    trace->events[trace->pos] = (neco_trace_event) {
+        .ts = ts,
+        .id = id,
+        .arg = arg,
+        .kind = kind,
+        .rtid = (int32_t)rt->id,
+    };
+    trace->pos = trace->pos+1 == NECO_TRACESIZE ? 0 : trace->pos+1;
+    if (trace->len < NECO_TRACESIZE) {
+        trace->len++;
+    }
+}
+#else
+#define trace_push(kind, ts, id, arg) ((void)0)
+#endif
+
+#ifdef NECO_USEMETRICS
+#define METRIC_INC(name) (rt->metrics.name++)
+#define METRIC_ADD(name, n) (rt->metrics.name += (uint64_t)(n))
+#define METRIC_MAX(name, n) do { \
+    uint64_t n0 = (uint64_t)(n); \
+    if (n0 > rt->metrics.name) { \
+        rt->metrics.name = n0; \
+    } \
+} while (0)
+#define METRIC_NOW() getnow()
+#define METRIC_SPAN(name, kind, start) \
+    metrics_span(&rt->metrics.name, kind, start)
+
+static void hist_record(neco_hist *hist, int64_t ns) {
+    uint64_t v = ns > 0 ? (uint64_t)ns : 0;
+    int i = v > 1 ? 63 - __builtin_clzll(v) : 0;
+    hist->buckets[i < NECO_HISTBUCKETS ? i : NECO_HISTBUCKETS-1]++;
+    hist->count++;
+    hist->sum += v;
+    if (v > hist->max) {
+        hist->max = v;
+    }
+}
+
+// Records the duration of a scheduler span that began at start.
+static void metrics_span(neco_hist *hist, int kind, int64_t start) {
+    int64_t now = getnow();
+    hist_record(hist, now-start);
+    trace_push(kind, now, 0, now-start);
+    (void)kind;
+}
+
+static void metrics_onready(void *udata) {
+    struct coroutine *co = udata;
+    if (co && co->readyts == 0) {
+        co->readyts = getnow();
+    }
+}
+
+static void metrics_onswitch(void *udata) {
+    if (!rt) {
+        return;
+    }
+    struct coroutine *co = udata;
+    int64_t now = getnow();
+    if (!co) {
+        trace_push(NECO_TRACE_SCHED, now, 0, 0);
+        return;
+    }
+    int64_t latency = 0;
+    if (co->readyts > 0) {
+        latency = now - co->readyts;
+        hist_record(&rt->metrics.schedlat, latency);
+        co->readyts = 0;
+    }
+    rt->metrics.switches++;
+    trace_push(NECO_TRACE_RUN, now, co->id, latency);
+}
+
+#ifndef NECO_NOWORKERS
+static void metrics_onsubmit(int queued) {
+    if (rt) {
+        METRIC_INC(workerjobs);
+        METRIC_MAX(workermaxq, queued);
+    }
+}
+#endif
+#else
+#define METRIC_INC(name) ((void)0)
+#define METRIC_ADD(name, n) ((void)0)
+#define METRIC_MAX(name, n) ((void)0)
+#define METRIC_NOW() INT64_C(0)
+#define METRIC_SPAN(name, kind, start) ((void)0)
+#endif
+
 noinline
 static void coexit(bool async);
 
@@ -3722,8 +4233,8 @@ int neco_is_main_thread(void) {
     return ret;
 }
 
-static bool costackget(struct coroutine *co) {
-    return stack_get0(&rt->stkmgr, &co->stack) == 0;
+static bool costackget(struct coroutine *co, size_t stacksz) {
+    return stack_get0(&rt->stkmgr, &co->stack, stacksz) == 0;
 }
 
 static void costackfree(struct coroutine *co) {
@@ -3738,16 +4249,17 @@ static void *costackaddr(struct coroutine *co) {
     return stack_addr(&co->stack);
 }
 
-// Create a new coroutines with the provided coroutine function and stack size.
+// Create a new coroutines with the provided stack size, or the default size
+// when zero.
 // Returns NULL if out of memory.
-static struct coroutine *coroutine_new(void) {
+static struct coroutine *coroutine_new(size_t stacksz) {
     struct coroutine *co = malloc0(sizeof(struct coroutine));
     if (!co) {
         return NULL;
     }
     memset(co, 0, sizeof(struct coroutine));
     co->kind = COROUTINE;
-    if (!costackget(co)) {
+    if (!costackget(co, stacksz)) {
         free0(co);
         return NULL;
     }
@@ -3776,6 +4288,7 @@ static void chan_fastretain(struct neco_chan *chan);
 static void coroutine_free(struct coroutine *co) {
     if (co) {
         cofreeargs(co);
+        free0(co->xcase);
         costackfree(co);
         free0(co);
     }
@@ -3835,7 +4348,7 @@ static void coentry(void *udata) {
 
 
 static int start(void(*coroutine)(int, void**), int argc, va_list *args,
-    void *argv[], neco_gen **gen, size_t gen_data_size)
+    void *argv[], neco_gen **gen, size_t gen_data_size, size_t stacksz)
 {
     struct coroutine *co;
 #ifndef NECO_NOPOOL
@@ -3843,11 +4356,21 @@ static int start(void(*coroutine)(int, void**), int argc, va_list *args,
     if (co) {
         rt->npool--;
         co->pool_ts = 0;
+        if (costacksize(co) != stack_request_size(&rt->stkmgr, stacksz)) {
+            // The pooled coroutine has a stack from another size class.
+            coroutine_free(co);
+            co = coroutine_new(stacksz);
+            METRIC_INC(poolmisses);
+        } else {
+            METRIC_INC(poolhits);
+        }
     } else {
-        co = coroutine_new();
+        co = coroutine_new(stacksz);
+        METRIC_INC(poolmisses);
     }
 #else
-    co = coroutine_new();
+    co = coroutine_new(stacksz);
+    METRIC_INC(poolmisses);
 #endif
     if (!co) {
         goto fail;
@@ -3855,6 +4378,9 @@ static int start(void(*coroutine)(int, void**), int argc, va_list *args,
     co->coroutine = coroutine;
     co->canceltype = env_canceltype;
     co->cancelstate = env_cancelstate;
+#ifdef NECO_USEARENAS
+    co->arena = arena_pool_make(&co->arenachain);
+#endif
 
     if (gen) {
         co->gen = chan_fastmake(gen_data_size, 0, true);
@@ -4073,10 +4599,194 @@ static void rt_sched_signal_step(void) {
     }
 }
 
+#ifdef NECO_POLL_URING
+// uring - A minimal io_uring, driven with raw system calls so that liburing is
+// not needed. Coroutines fill the submission queue during a scheduler round,
+// then the paused step flushes the whole batch with a single io_uring_enter,
+// which is also used to wait for the completions.
+struct uring {
+    int fd;
+    atomic_uint *sqhead;           // consumed by the kernel
+    atomic_uint *sqtail;           // published to the kernel on enter
+    unsigned sqmask;
+    unsigned sqentries;
+    unsigned sqtail0;              // local tail of unpublished entries
+    struct io_uring_sqe *sqes;
+    atomic_uint *cqhead;
+    atomic_uint *cqtail;
+    unsigned cqmask;
+    struct io_uring_cqe *cqes;
+    void *ring;                    // single mmap for the sq and cq rings
+    size_t ringsz;
+    size_t sqessz;
+    int64_t lastused;              // last time the ring was stepped
+};
+
+// A pending operation. It lives on the stack of the waiting coroutine and its
+// address is the user_data of the submission.
+struct uring_op {
+    struct coroutine *co;
+    int res;
+    bool done;
+};
+
+static void uring_free(struct uring *ring) {
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqessz);
+    }
+    if (ring->ring) {
+        munmap(ring->ring, ring->ringsz);
+    }
+    close(ring->fd);
+    free0(ring);
+}
+
+static struct uring *uring_new(void) {
+    struct io_uring_params params = { 0 };
+    int fd = (int)syscall(__NR_io_uring_setup, NECO_URINGSIZE, &params);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct uring *ring = malloc0(sizeof(struct uring));
+    if (!ring) {
+        close(fd);
+        return NULL;
+    }
+    memset(ring, 0, sizeof(struct uring));
+    ring->fd = fd;
+    // EXT_ARG provides the timeout for waiting, NODROP guarantees that an
+    // overflowing completion queue never loses a completion, and RW_CUR_POS
+    // allows for reads and writes at the current file position. All are
+    // present since Linux 5.11.
+    unsigned features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | 
+        IORING_FEAT_RW_CUR_POS | IORING_FEAT_EXT_ARG;
+    if ((params.features & features) != features) {
+        goto fail;
+    }
+    size_t sqsz = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqsz = params.cq_off.cqes + 
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ringsz = sqsz > cqsz ? sqsz : cqsz;
+    char *mem = mmap(NULL, ring->ringsz, PROT_READ | PROT_WRITE, 
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (mem == MAP_FAILED) {
+        goto fail;
+    }
+    ring->ring = mem;
+    ring->sqessz = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, ring->sqessz, PROT_READ | PROT_WRITE, 
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        goto fail;
+    }
+    ring->sqes = sqes;
+    ring->sqhead = (atomic_uint*)(mem + params.sq_off.head);
+    ring->sqtail = (atomic_uint*)(mem + params.sq_off.tail);
+    ring->sqmask = *(unsigned*)(mem + params.sq_off.ring_mask);
+    ring->sqentries = params.sq_entries;
+    ring->sqtail0 = atomic_load_explicit(ring->sqtail, memory_order_relaxed);
+    ring->cqhead = (atomic_uint*)(mem + params.cq_off.head);
+    ring->cqtail = (atomic_uint*)(mem + params.cq_off.tail);
+    ring->cqmask = *(unsigned*)(mem + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(mem + params.cq_off.cqes);
+    // The submission array is an indirection that is never needed, so map
+    // each slot to itself once.
+    unsigned *array = (unsigned*)(mem + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        array[i] = i;
+    }
+    ring->lastused = getnow();
+    return ring;
+fail:
+    uring_free(ring);
+    return NULL;
+}
+
+// Publish the pending submissions and optionally wait up to timeout 
+// nanoseconds for at least one completion.
+static int uring_enter(struct uring *ring, bool wait, int64_t timeout) {
+    unsigned head = atomic_load_explicit(ring->sqhead, memory_order_acquire);
+    unsigned nsubmit = ring->sqtail0 - head;
+    if (nsubmit == 0 && !wait) {
+        return 0;
+    }
+    atomic_store_explicit(ring->sqtail, ring->sqtail0, memory_order_release);
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout/1000000000,
+        .tv_nsec = timeout%1000000000,
+    };
+    struct io_uring_getevents_arg arg = { .ts = (uint64_t)(uintptr_t)&ts };
+    unsigned flags = IORING_ENTER_EXT_ARG | (wait ? IORING_ENTER_GETEVENTS : 0);
+    return (int)syscall(__NR_io_uring_enter, ring->fd, nsubmit, wait ? 1 : 0,
+        flags, &arg, sizeof(arg));
+}
+
+// Returns a zeroed submission entry or NULL if the submission queue is full
+// and could not be flushed.
+static struct io_uring_sqe *uring_sqe(struct uring *ring) {
+    unsigned head = atomic_load_explicit(ring->sqhead, memory_order_acquire);
+    if (ring->sqtail0 - head == ring->sqentries) {
+        // Full. Flush to the kernel now, without waiting.
+        if (uring_enter(ring, false, 0) == -1) {
+            return NULL;
+        }
+        head = atomic_load_explicit(ring->sqhead, memory_order_acquire);
+        if (ring->sqtail0 - head == ring->sqentries) {
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqtail0 & ring->sqmask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sqtail0++;
+    return sqe;
+}
+
+// Wake each coroutine that has a completed operation.
+static void uring_reap(struct uring *ring) {
+    unsigned head = atomic_load_explicit(ring->cqhead, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(ring->cqtail, memory_order_acquire);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & ring->cqmask];
+        struct uring_op *op = (struct uring_op*)(uintptr_t)cqe->user_data;
+        // Cancelations have no user_data.
+        if (op) {
+            op->res = cqe->res;
+            op->done = true;
+            sco_resume(op->co->id);
+        }
+        METRIC_INC(events);
+        head++;
+    }
+    atomic_store_explicit(ring->cqhead, head, memory_order_release);
+}
+
+static void rt_sched_uring_step(int64_t timeout) {
+    struct uring *ring = rt->uring;
+    unsigned head = atomic_load_explicit(ring->cqhead, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(ring->cqtail, memory_order_acquire);
+    // Only block when there's nothing already waiting to be reaped.
+    bool wait = timeout > 0 && head == tail;
+    int ret = uring_enter(ring, wait, timeout);
+    // The wait may timeout, be interrupted by a signal, or return early 
+    // because the completion queue overflowed. Those are all fine because
+    // the completions are reaped right after.
+    must(ret != -1 || errno == ETIME || errno == EINTR || errno == EBUSY ||
+        errno == EAGAIN);
+    uring_reap(ring);
+    ring->lastused = getnow();
+}
+#endif
+
 #define NEVENTS 16
 
 static void rt_sched_event_step(int64_t timeout) {
     (void)timeout;
+#ifdef NECO_POLL_URING
+    if (rt->uring) {
+        rt_sched_uring_step(timeout);
+        return;
+    }
+#endif
 #if defined(NECO_POLL_EPOLL) 
     struct epoll_event evs[NEVENTS];
     int timeout_ms = (int)(timeout/NECO_MILLISECOND);
@@ -4094,6 +4804,7 @@ static void rt_sched_event_step(int64_t timeout) {
     // the sighandler() will responsibly manage the incoming signals, which
     // are then dealt with by this function, right after the event loop.
     must(nevents != -1 || errno == EINTR);
+    METRIC_ADD(events, nevents > 0 ? nevents : 0);
 
     // Consume each event.
     for (int i = 0; i < nevents; i++) {
@@ -4153,10 +4864,147 @@ int64_t i64_add_clamp(int64_t a, int64_t b) {
     return a + b;
 }
 
+static void tw_link(struct timerwheel *tw, struct coroutine *co, int level,
+    int slot)
+{
+    struct coroutine **head = &tw->slots[level][slot];
+    co->tw_next = *head;
+    if (co->tw_next) {
+        co->tw_next->tw_pprev = &co->tw_next;
+    }
+    co->tw_pprev = head;
+    *head = co;
+    co->tw_level = (uint8_t)level;
+    co->tw_slot = (uint8_t)slot;
+    tw->used[level] |= UINT64_C(1) << slot;
+    tw->count++;
+}
+
+static void tw_unlink(struct timerwheel *tw, struct coroutine *co) {
+    *co->tw_pprev = co->tw_next;
+    if (co->tw_next) {
+        co->tw_next->tw_pprev = co->tw_pprev;
+    }
+    if (!tw->slots[co->tw_level][co->tw_slot]) {
+        tw->used[co->tw_level] &= ~(UINT64_C(1) << co->tw_slot);
+    }
+    co->tw_next = NULL;
+    co->tw_pprev = NULL;
+    tw->count--;
+}
+
+// Hash the coroutine into its slot. The coroutine expires on the first tick
+// after its deadline, which may be up to a tick late but is never early.
+static void tw_insert(struct timerwheel *tw, struct coroutine *co) {
+    int64_t expires = (co->deadline >> TW_TICK) + 1;
+    if (expires < tw->tick) {
+        expires = tw->tick;
+    }
+    int64_t span = INT64_C(1) << (TW_BITS*TW_LEVELS);
+    if (expires - tw->tick >= span) {
+        expires = tw->tick + span - 1;
+    }
+    int64_t delta = expires - tw->tick;
+    int level = 0;
+    while (delta >= INT64_C(1) << (TW_BITS*(level+1))) {
+        level++;
+    }
+    int slot = (int)((expires >> (TW_BITS*level)) & (TW_SLOTS-1));
+    tw_link(tw, co, level, slot);
+}
+
+// Arm the wheel with the coroutine's deadline. Returns false if the deadline
+// is too close for the wheel's resolution.
+static bool tw_arm(struct timerwheel *tw, struct coroutine *co) {
+#ifdef NECO_NOTIMERWHEEL
+    (void)tw; (void)co;
+    (void)tw_insert;
+    return false;
+#else
+    int64_t now = getnow();
+    if (co->deadline - now < INT64_C(1) << TW_TICK) {
+        return false;
+    }
+    if (tw->count == 0) {
+        // An empty wheel does not advance so catch it up first.
+        tw->tick = now >> TW_TICK;
+    }
+    tw_insert(tw, co);
+    return true;
+#endif
+}
+
+// Returns the time of the next tick that has work to do, either a slot that
+// expires or a cascade from an upper level.
+static int64_t tw_next(struct timerwheel *tw) {
+    if (tw->count == 0) {
+        return INT64_MAX;
+    }
+    // Upper level slots cascade at the start of a first level round.
+    int64_t next = INT64_MAX;
+    for (int level = 1; level < TW_LEVELS; level++) {
+        if (tw->used[level]) {
+            next = (tw->tick | (TW_SLOTS-1)) + 1;
+            break;
+        }
+    }
+    uint64_t used = tw->used[0];
+    if (used) {
+        int shift = (int)((tw->tick + 1) & (TW_SLOTS-1));
+        if (shift) {
+            used = used >> shift | used << (64 - shift);
+        }
+        int64_t tick = tw->tick + 1 + __builtin_ctzll(used);
+        next = tick < next ? tick : next;
+    }
+    return next << TW_TICK;
+}
+
+// Move each coroutine in an upper level slot down to a lower level.
+static void tw_cascade(struct timerwheel *tw, int level, int slot) {
+    struct coroutine *co = tw->slots[level][slot];
+    while (co) {
+        struct coroutine *next = co->tw_next;
+        tw_unlink(tw, co);
+        tw_insert(tw, co);
+        co = next;
+    }
+}
+
+// Process every tick up to now, waking each expired coroutine.
+static void tw_advance(struct timerwheel *tw, int64_t now) {
+    int64_t target = now >> TW_TICK;
+    while (tw->count > 0 && tw->tick < target) {
+        tw->tick++;
+        for (int level = 1; level < TW_LEVELS; level++) {
+            if (tw->tick & ((INT64_C(1) << (TW_BITS*level)) - 1)) {
+                break;
+            }
+            tw_cascade(tw, level, 
+                (int)((tw->tick >> (TW_BITS*level)) & (TW_SLOTS-1)));
+        }
+        int slot = (int)(tw->tick & (TW_SLOTS-1));
+        struct coroutine *co = tw->slots[0][slot];
+        while (co) {
+            struct coroutine *next = co->tw_next;
+            tw_unlink(tw, co);
+            co->deadlined = true;
+            sco_resume(co->id);
+            co = next;
+        }
+    }
+    if (tw->tick < target) {
+        tw->tick = target;
+    }
+}
+
 #define MAX_TIMEOUT 500000000 // 500 ms
 
 // Handle paused couroutines.
 static void rt_sched_paused_step(void) {
+    int64_t start = METRIC_NOW();
+    (void)start;
+
     // Resume all the paused coroutines that are waiting for immediate 
     // attention.
     struct coroutine *co = colist_pop_front(&rt->resumers);
@@ -4180,8 +5028,12 @@ static void rt_sched_paused_step(void) {
     }
     if (timeout > 0 && rt->ndeadlines > 0) {
         // There's at least one deadline coroutine. Use the one with
-        // the minimum 'deadline' value to determine the timeout.
-        int64_t min_deadline = dlqueue_first(&rt->deadlines)->deadline;
+        // the minimum 'deadline' value to determine the timeout. The wheel
+        // provides the time of its next tick instead.
+        struct coroutine *first = dlqueue_first(&rt->deadlines);
+        int64_t min_deadline = first ? first->deadline : INT64_MAX;
+        int64_t tick = tw_next(&rt->timers);
+        min_deadline = tick < min_deadline ? tick : min_deadline;
         int64_t timeout0 = i64_add_clamp(min_deadline, -getnow());
         if (timeout0 < timeout) {
             timeout = timeout0;
@@ -4206,7 +5058,11 @@ static void rt_sched_paused_step(void) {
 
     if (rt->nevwaiters > 0) {
         // Event waiters need their own logic.
+        int64_t evstart = METRIC_NOW();
+        (void)evstart;
         rt_sched_event_step(timeout);
+        METRIC_INC(evwaits);
+        METRIC_SPAN(evwait, NECO_TRACE_EVWAIT, evstart);
     } else if (timeout > 0) {
         // There are sleepers (or signal waiters), but no event waiters.
         // Therefore no need for an event queue. We can just do a simple sleep
@@ -4234,6 +5090,10 @@ static void rt_sched_paused_step(void) {
         sco_resume(co->id);
         co = dlqueue_next(&rt->deadlines, co);
     }
+    tw_advance(&rt->timers, now);
+
+    METRIC_INC(pausedsteps);
+    METRIC_SPAN(pausedstep, NECO_TRACE_STEP, start);
 }
 
 // Resource collection step
@@ -4248,6 +5108,15 @@ static void rt_rc_step(void) {
             rt->qfd = 0;
         }
     }
+#ifdef NECO_POLL_URING
+    if (rt->nevwaiters == 0 && rt->uring) {
+        if (now - rt->uring->lastused > NECO_MILLISECOND * 100) {
+            // Same for the io_uring.
+            uring_free(rt->uring);
+            rt->uring = NULL;
+        }
+    }
+#endif
     // Deal with coroutine pools.
     if (rt->npool > 0) {
         // First assign timestamps to newly pooled coroutines, then remove
@@ -4275,6 +5144,7 @@ static int rt_scheduler(void) {
     // magic happens.
     int ret = NECO_OK;
     while (sco_active()) {
+        METRIC_INC(loops);
         if (sco_info_paused() > 0) {
             rt_sched_paused_step();
         }
@@ -4285,6 +5155,12 @@ static int rt_scheduler(void) {
     if (rt->qfd) {
         close(rt->qfd);
     }
+#ifdef NECO_POLL_URING
+    if (rt->uring) {
+        uring_free(rt->uring);
+        rt->uring = NULL;
+    }
+#endif
     struct coroutine *co = colist_pop_front(&rt->pool);
     while (co) {
         coroutine_free(co);
@@ -4314,6 +5190,9 @@ static struct stack_opts stack_opts_make(void) {
 #ifdef NECO_NOSTACKFREELIST
         .nostackfreelist = true,
 #endif
+#ifdef NECO_NOPAGERELEASE
+        .nopagerelease = true,
+#endif
 #ifdef NECO_USEHEAPSTACK
         .onlymalloc = true,
 #endif
@@ -4337,7 +5216,7 @@ static void rt_release_dlhandles(void) {
 }
 
 static int run(void(*coroutine)(int, void**), int nargs, va_list *args,
-    void *argv[])
+    void *argv[], size_t stacksz)
 {
     init_networking();
     rt = malloc0(sizeof(struct runtime));
@@ -4355,6 +5234,7 @@ static int run(void(*coroutine)(int, void**), int nargs, va_list *args,
     colist_init(&rt->sigwaiters);
     colist_init(&rt->pool);
     colist_init(&rt->resumers);
+    pthread_mutex_init(&rt->xmu, 0);
 
     // Initialize the signal handlers
     int ret = rt_handle_signals();
@@ -4362,6 +5242,16 @@ static int run(void(*coroutine)(int, void**), int nargs, va_list *args,
         goto fail;
     }
 
+#ifdef NECO_USETRACE
+    rt->trace = malloc0(sizeof(struct trace));
+    if (!rt->trace) {
+        ret = NECO_NOMEM;
+        goto fail;
+    }
+    rt->trace->pos = 0;
+    rt->trace->len = 0;
+#endif
+
 #ifndef NECO_NOWORKERS
     struct worker_opts wopts = {
         .max_threads = NECO_MAXWORKERS,
@@ -4379,7 +5269,7 @@ static int run(void(*coroutine)(int, void**), int nargs, va_list *args,
 #endif
 
     // Start the main coroutine. Actually, it's just queued to run first.
-    ret = start(coroutine, nargs, args, argv, 0, 0);
+    ret = start(coroutine, nargs, args, argv, 0, 0, stacksz);
     if (ret != NECO_OK) {
         goto fail;
     }
@@ -4390,6 +5280,9 @@ static int run(void(*coroutine)(int, void**), int nargs, va_list *args,
 fail:
     stack_mgr_destroy(&rt->stkmgr);
     rt_freezchanpool();
+#ifdef NECO_USEARENAS
+    thread_arena_release();
+#endif
     rt_restore_signal_handlers();
     rt_release_dlhandles();
 #ifndef NECO_NOWORKERS
@@ -4400,16 +5293,17 @@ fail:
 }
 
 static int startv(void(*coroutine)(int argc, void *argv[]), int argc, 
-    va_list *args, void *argv[], neco_gen **gen, size_t gen_data_size)
+    va_list *args, void *argv[], neco_gen **gen, size_t gen_data_size,
+    size_t stacksz)
 {
-    if (!coroutine || argc < 0) {
+    if (!coroutine || argc < 0 || stacksz > STACK_MAXSIZE) {
         return NECO_INVAL;
     }
     int ret;
     if (!rt) {
-        ret = run(coroutine, argc, args, argv);
+        ret = run(coroutine, argc, args, argv, stacksz);
     } else {
-        ret = start(coroutine, argc, args, argv, gen, gen_data_size);
+        ret = start(coroutine, argc, args, argv, gen, gen_data_size, stacksz);
     }
     return ret;
 }
@@ -4442,7 +5336,7 @@ static int startv(void(*coroutine)(int argc, void *argv[]), int argc,
 int neco_start(void(*coroutine)(int argc, void *argv[]), int argc, ...) {
     va_list args;
     va_start(args, argc);
-    int ret = startv(coroutine, argc, &args, 0, 0, 0);
+    int ret = startv(coroutine, argc, &args, 0, 0, 0, 0);
     va_end(args);
     error_guard(ret);
     return ret;
@@ -4454,7 +5348,83 @@ int neco_start(void(*coroutine)(int argc, void *argv[]), int argc, ...) {
 int neco_startv(void(*coroutine)(int argc, void *argv[]), int argc, 
     void *argv[])
 {
-    int ret = startv(coroutine, argc, 0, argv, 0, 0);
+    int ret = startv(coroutine, argc, 0, argv, 0, 0, 0);
+    error_guard(ret);
+    return ret;
+}
+
+/// Starts a new coroutine with a specific stack size.
+///
+/// The same as neco_start() except that the coroutine gets a stack of at
+/// least stack_size bytes instead of the default NECO_STACKSIZE. Stacks come
+/// in sizes from 16 KB to 512 MB, four for each power of two, such as 64, 80,
+/// 96 and 112 KB. The size is rounded up to the next one, and to whole pages. 
+/// Each size has its own pool of reusable stacks.
+///
+/// Small stacks are useful for very large numbers of mostly idle coroutines.
+/// Use neco_stack_highwater() to measure how much of a stack is actually
+/// used before shrinking it.
+///
+/// @param stack_size Stack size in bytes, or zero for the default size
+/// @param coroutine The coroutine that will soon run
+/// @param argc Number of arguments
+/// @param ... Arguments passed to the coroutine
+/// @return NECO_OK Success
+/// @return NECO_NOMEM The system lacked the necessary resources
+/// @return NECO_INVAL An invalid parameter was provided
+/// @see neco_start
+int neco_start_sized(size_t stack_size, 
+    void(*coroutine)(int argc, void *argv[]), int argc, ...)
+{
+    va_list args;
+    va_start(args, argc);
+    int ret = startv(coroutine, argc, &args, 0, 0, 0, stack_size);
+    va_end(args);
+    error_guard(ret);
+    return ret;
+}
+
+/// Same as neco_start_sized() but using an array for arguments.
+int neco_startv_sized(size_t stack_size, 
+    void(*coroutine)(int argc, void *argv[]), int argc, void *argv[])
+{
+    int ret = startv(coroutine, argc, 0, argv, 0, 0, stack_size);
+    error_guard(ret);
+    return ret;
+}
+
+static struct coroutine *cofind(int64_t id);
+
+static ssize_t stack_highwater0(int64_t id) {
+    if (!rt) {
+        return NECO_PERM;
+    }
+    struct coroutine *co = cofind(id);
+    if (!co) {
+        return NECO_NOTFOUND;
+    }
+    return (ssize_t)stack_highwater(&rt->stkmgr, &co->stack);
+}
+
+/// Returns the most stack that a coroutine has used, in bytes.
+///
+/// This is measured by the deepest stack page that is resident in memory,
+/// so it is rounded up to pages, and it includes pages that were touched 
+/// by earlier coroutines that used the same stack when built with
+/// NECO_NOPAGERELEASE. Stacks on the heap (NECO_USEHEAPSTACK) report their 
+/// full size.
+///
+/// ```
+/// ssize_t used = neco_stack_highwater(neco_getid());
+/// ```
+///
+/// @param id Coroutine identifier
+/// @return The number of bytes used
+/// @return NECO_NOTFOUND No such coroutine
+/// @return NECO_PERM Operation called outside of a coroutine
+/// @see neco_start_sized
+ssize_t neco_stack_highwater(int64_t id) {
+    ssize_t ret = stack_highwater0(id);
     error_guard(ret);
     return ret;
 }
@@ -4492,15 +5462,24 @@ static void copause(int64_t deadline) {
     // Cannot pause an already canceled or deadlined coroutine.
     if (!co->canceled && !co->deadlined) {
         co->deadline = deadline;
+        bool wheel = false;
         if (co->deadline < INT64_MAX) {
-            dlqueue_insert(&rt->deadlines, co);
+            wheel = tw_arm(&rt->timers, co);
+            if (!wheel) {
+                dlqueue_insert(&rt->deadlines, co);
+            }
             rt->ndeadlines++;
         }
         co->paused = true;
         sco_pause();
         co->paused = false;
         if (co->deadline < INT64_MAX) {
-            dlqueue_delete(&rt->deadlines, co);
+            if (!wheel) {
+                dlqueue_delete(&rt->deadlines, co);
+            } else if (co->tw_pprev) {
+                // Not yet expired.
+                tw_unlink(&rt->timers, co);
+            }
             rt->ndeadlines--;
         }
         co->deadline = 0;
@@ -4895,6 +5874,172 @@ static void wait_dl_delevent(struct coroutine *co, int fd, enum evkind kind) {
 }
 #endif
 
+#ifdef NECO_POLL_URING
+// Returns the io_uring for the runtime, creating it on first use. Returns 
+// NULL when io_uring is not available, such as on older kernels or when
+// disabled by a container policy, in which case the runtime stays with epoll.
+static struct uring *uring_get(void) {
+    if (!rt->uring && !rt->uringoff) {
+        rt->uring = uring_new();
+        rt->uringoff = !rt->uring;
+    }
+    return rt->uring;
+}
+
+#define uring_active() (uring_get() != NULL)
+
+// Returns a submission entry, yielding to the scheduler until one frees up.
+static struct io_uring_sqe *uring_sqe_wait(void) {
+    struct io_uring_sqe *sqe = uring_sqe(rt->uring);
+    while (!sqe) {
+        sco_yield();
+        sqe = uring_sqe(rt->uring);
+    }
+    return sqe;
+}
+
+// uring_io submits the operation in sqe and pauses the coroutine until the
+// scheduler reaps its completion.
+// When the deadline is reached or the coroutine is canceled, the operation
+// is canceled in the kernel, but the coroutine still waits for the final
+// completion because until then the kernel may be using both the uring_op
+// and the caller's buffers.
+// Returns the completion result, a negative errno on failure, or -ETIMEDOUT
+// or -ECANCELED when the operation was stopped by the deadline or a cancel.
+static int uring_io(struct io_uring_sqe *sqe, int64_t deadline) {
+    struct coroutine *co = coself();
+    struct uring_op op = { .co = co };
+    sqe->user_data = (uint64_t)(uintptr_t)&op;
+    rt->nevwaiters++;
+    bool canceling = false;
+    while (!op.done) {
+        if (!canceling && (co->canceled || co->deadlined)) {
+            struct io_uring_sqe *sqe = uring_sqe_wait();
+            if (op.done) {
+                sqe->opcode = IORING_OP_NOP;
+                break;
+            }
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = (uint64_t)(uintptr_t)&op;
+            canceling = true;
+        }
+        if (canceling) {
+            sco_pause();
+        } else {
+            copause(deadline);
+        }
+    }
+    rt->nevwaiters--;
+    if (canceling && (op.res == -ECANCELED || op.res == -EINTR)) {
+        return checkdl(co, INT64_MAX) == NECO_CANCELED ? 
+            -ECANCELED : -ETIMEDOUT;
+    }
+    // The operation finished on its own. The result wins over a deadline
+    // that was reached at the same time, while a cancel stays flagged for
+    // the next operation.
+    co->deadlined = false;
+    return op.res;
+}
+
+static int uring_wait(int fd, enum evkind kind, int64_t deadline) {
+    struct io_uring_sqe *sqe = uring_sqe_wait();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = kind == EVREAD ? POLLIN : POLLOUT;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    // The kernel reads the events as two swapped halfwords.
+    sqe->poll32_events = sqe->poll32_events >> 16 | sqe->poll32_events << 16;
+#endif
+    int res = uring_io(sqe, deadline);
+    if (res == -ECANCELED) {
+        return NECO_CANCELED;
+    } else if (res == -ETIMEDOUT) {
+        return NECO_TIMEDOUT;
+    } else if (res < 0) {
+        errno = -res;
+        return NECO_ERROR;
+    }
+    return NECO_OK;
+}
+
+static ssize_t uring_call(struct io_uring_sqe *sqe, int64_t deadline) {
+    int res = uring_io(sqe, deadline);
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+    return res;
+}
+
+// The following operations follow the conventions of their Posix versions,
+// returning -1 and setting errno on error. Reads and writes are limited to 
+// INT_MAX bytes per call because completions report an int.
+
+static ssize_t uring_read(int fd, void *data, size_t nbytes, int64_t deadline)
+{
+    struct io_uring_sqe *sqe = uring_sqe_wait();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = (unsigned)(nbytes > INT_MAX ? INT_MAX : nbytes);
+    sqe->off = (uint64_t)-1;
+    return uring_call(sqe, deadline);
+}
+
+static ssize_t uring_write(int fd, const void *data, size_t nbytes, 
+    int64_t deadline)
+{
+    struct io_uring_sqe *sqe = uring_sqe_wait();
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = (unsigned)(nbytes > INT_MAX ? INT_MAX : nbytes);
+    sqe->off = (uint64_t)-1;
+    ssize_t n = uring_call(sqe, deadline);
+#ifndef NECO_TESTING
+    if (n == -1 && errno == EPIPE && (fd == 1 || fd == 2)) {
+        // Broken pipe on stdout or stderr, same as write1()
+        _Exit(128+EPIPE);
+    }
+#endif
+    return n;
+}
+
+// The accepted socket is already in non-blocking mode.
+static int uring_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen,
+    int64_t deadline)
+{
+    struct io_uring_sqe *sqe = uring_sqe_wait();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sockfd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->addr2 = (uint64_t)(uintptr_t)addrlen;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    return (int)uring_call(sqe, deadline);
+}
+
+static int uring_connect(int fd, const struct sockaddr *addr, 
+    socklen_t addrlen, int64_t deadline)
+{
+    struct io_uring_sqe *sqe = uring_sqe_wait();
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->off = addrlen;
+    return (int)uring_call(sqe, deadline);
+}
+#else
+#define uring_active() false
+#define uring_wait(fd, kind, deadline) \
+    ((void)(fd), (void)(kind), (void)(deadline), NECO_ERROR)
+#define uring_read(fd, data, nbytes, deadline) \
+    ((void)(fd), (void)(data), (void)(nbytes), (void)(deadline), -1)
+#define uring_write uring_read
+#define uring_accept(fd, addr, addrlen, deadline) \
+    ((void)(fd), (void)(addr), (void)(addrlen), (void)(deadline), -1)
+#define uring_connect uring_accept
+#endif
+
 // wait_dl makes the current coroutine wait for the file descriptor to be
 // available for reading or writing.
 static int wait_dl(int fd, enum evkind kind, int64_t deadline) {
@@ -4912,6 +6057,9 @@ static int wait_dl(int fd, enum evkind kind, int64_t deadline) {
 
     sco_yield();
 #else
+    if (uring_active()) {
+        return uring_wait(fd, kind, deadline);
+    }
     if (rt->qfd == 0) {
         // The scheduler currently does not have an event queue for handling
         // file events. Create one now. This new queue will be shared for the 
@@ -5095,18 +6243,28 @@ static ssize_t read_dl(int fd, void *data, size_t nbytes, int64_t deadline) {
         errno = EPERM;
         return -1;
     }
+    bool uring = uring_active();
     while (1) {
         int ret = checkdl(co, deadline);
         if (ret != NECO_OK) {
             errno = ret == NECO_CANCELED ? ECANCELED : ETIMEDOUT;
             return -1;
         }
+        ssize_t n;
+        if (uring) {
+            // The read itself waits for the data.
+            n = uring_read(fd, data, nbytes, deadline);
+        } else {
 #if NECO_BURST < 0
-        cowait(fd, EVREAD, deadline);
+            cowait(fd, EVREAD, deadline);
 #endif
-        ssize_t n = read1(fd, data, nbytes);
+            n = read1(fd, data, nbytes);
+        }
         if (n == -1) {
-            if (errno == EINTR || errno == EAGAIN) {
+            if (uring && errno == EAGAIN) {
+                // Older kernels do not wait on non-blocking files.
+                cowait(fd, EVREAD, deadline);
+            } else if (errno == EINTR || errno == EAGAIN) {
 #if NECO_BURST >= 0
                 if (rt->burstcount == NECO_BURST) {
                     rt->burstcount = 0;
@@ -5259,6 +6417,7 @@ static ssize_t write_dl(int fd, const void *data, size_t nbytes,
         errno = EPERM;
         return -1;
     }
+    bool uring = uring_active();
     ssize_t written = 0;
     while (1) {
         int ret = checkdl(co, deadline);
@@ -5268,7 +6427,8 @@ static ssize_t write_dl(int fd, const void *data, size_t nbytes,
         }
         // size_t maxnbytes = CLAMP(nbytes, 0, 8096);
         // ssize_t n = write2(fd, data, maxnbytes);
-        ssize_t n = write3(fd, data, nbytes);
+        ssize_t n = uring ? uring_write(fd, data, nbytes, deadline) :
+            write3(fd, data, nbytes);
         if (n == -1) {
             if (errno == EINTR || errno == EAGAIN) {
                 cowait(fd, EVWRITE, deadline);
@@ -5335,60 +6495,9 @@ ssize_t neco_write(int fd, const void *buf, size_t count) {
     return neco_write_dl(fd, buf, count, INT64_MAX);
 }
 
-#ifdef _WIN32
-
-static int wsa_err_to_errno(int wsaerr) {
-    switch (wsaerr) {
-    case WSAEINTR: return EINTR;
-    case WSAEBADF: return EBADF;
-    case WSAEACCES: return EACCES;
-    case WSAEFAULT: return EFAULT;
-    case WSAEINVAL: return EINVAL;
-    case WSAEMFILE: return EMFILE;
-    case WSAEWOULDBLOCK: return EAGAIN;
-    case WSAEINPROGRESS: return EINPROGRESS;
-    case WSAEALREADY: return EALREADY;
-    case WSAENOTSOCK: return ENOTSOCK;
-    case WSAEDESTADDRREQ: return EDESTADDRREQ;
-    case WSAEMSGSIZE: return EMSGSIZE;
-    case WSAEPROTOTYPE: return EPROTOTYPE;
-    case WSAENOPROTOOPT: return ENOPROTOOPT;
-    case WSAEPROTONOSUPPORT: return EPROTONOSUPPORT;
-    case WSAEOPNOTSUPP: return EOPNOTSUPP;
-    case WSAEADDRINUSE: return EADDRINUSE;
-    case WSAEADDRNOTAVAIL: return EADDRNOTAVAIL;
-    case WSAENETDOWN: return ENETDOWN;
-    case WSAENETUNREACH: return ENETUNREACH;
-    case WSAENETRESET: return ENETRESET;
-    case WSAECONNABORTED: return ECONNABORTED;
-    case WSAECONNRESET: return ECONNRESET;
-    case WSAENOBUFS: return ENOBUFS;
-    case WSAEISCONN: return EISCONN;
-    case WSAENOTCONN: return ENOTCONN;
-    case WSAETIMEDOUT: return ETIMEDOUT;
-    case WSAECONNREFUSED: return ECONNREFUSED;
-    case WSAELOOP: return ELOOP;
-    case WSAENAMETOOLONG: return ENAMETOOLONG;
-    case WSAEHOSTUNREACH: return EHOSTUNREACH;
-    case WSAENOTEMPTY: return ENOTEMPTY;
-    case WSAECANCELLED: return ECANCELED;
-    case WSA_E_CANCELLED: return ECANCELED;
-    }
-    return wsaerr;
-}
-
-int accept1(int sock, struct sockaddr *addr, socklen_t *len) {
-    int fd = accept0(sock, addr, len);
-    if (fd == -1) {
-        errno = wsa_err_to_errno(WSAGetLastError());
-    }
-    return fd;
-}
-#else
-#define accept1 accept0
-#endif
+#ifndef _WIN32
 
-static int accept_dl(int sockfd, struct sockaddr *addr, socklen_t *addrlen, 
+static ssize_t readv_dl(int fd, const struct iovec *iov, int iovcnt,
     int64_t deadline)
 {
     struct coroutine *co = coself();
@@ -5402,3360 +6511,6457 @@ static int accept_dl(int sockfd, struct sockaddr *addr, socklen_t *addrlen,
             errno = ret == NECO_CANCELED ? ECANCELED : ETIMEDOUT;
             return -1;
         }
-        int fd = accept1(sockfd, addr, addrlen);
-        if (fd == -1) {
+        ssize_t n = readv(fd, iov, iovcnt);
+        if (n == -1) {
             if (errno == EINTR || errno == EAGAIN) {
-                cowait(sockfd, EVREAD, deadline);
+                cowait(fd, EVREAD, deadline);
             } else {
                 return -1;
             }
         } else {
-            if (neco_setnonblock(fd, true, 0) == -1) {
-                close(fd);
-                return -1;
-            }
-            return fd;
+            return n;
         }
     }
 }
 
-/// Same as neco_accept() but with a deadline parameter. 
-int neco_accept_dl(int sockfd, struct sockaddr *addr, socklen_t *addrlen, 
+/// Same as neco_readv() but with a deadline parameter.
+ssize_t neco_readv_dl(int fd, const struct iovec *iov, int iovcnt,
     int64_t deadline)
 {
-    int ret = accept_dl(sockfd, addr, addrlen, deadline);
+    ssize_t ret = readv_dl(fd, iov, iovcnt, deadline);
     async_error_guard(ret);
     return ret;
 }
 
-/// Accept a connection on a socket.
-///
-/// While in a coroutine, this function should be used instead of the standard
-/// accept() to avoid blocking other coroutines from running concurrently.
+/// Read from a file descriptor into multiple buffers.
 ///
-/// The the accepted file descriptor is returned in non-blocking mode.
+/// This is a Posix wrapper function for the purpose of running in a Neco
+/// coroutine. It's expected that the provided file descriptor is in 
+/// non-blocking state.
 ///
-/// @param sockfd Socket file descriptor
-/// @param addr Socket address out
-/// @param addrlen Socket address length out
-/// @return On success, file descriptor (non-blocking)
+/// @return On success, the number of bytes read is returned (zero indicates
+///         end of file)
 /// @return On error, value -1 (NECO_ERROR) is returned, and errno is set to
 ///         indicate the error.
-/// @see Posix
-int neco_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
-    return neco_accept_dl(sockfd, addr, addrlen, INT64_MAX);
+/// @see    Posix
+/// @see    https://www.man7.org/linux/man-pages/man2/readv.2.html
+ssize_t neco_readv(int fd, const struct iovec *iov, int iovcnt) {
+    return neco_readv_dl(fd, iov, iovcnt, INT64_MAX);
 }
 
-static int connect_dl(int fd, const struct sockaddr *addr, socklen_t addrlen, 
+#define NIOVS 64
+
+static ssize_t writev_dl(int fd, const struct iovec *iov, int iovcnt,
     int64_t deadline)
 {
     struct coroutine *co = coself();
     if (!co) {
         errno = EPERM;
         return -1;
+    } else if (iovcnt < 0) {
+        errno = EINVAL;
+        return -1;
     }
-    bool inprog = false;
+    // The remaining vectors are copied to the stack, NIOVS at a time, so that
+    // a partial write can be resumed without touching the caller's array.
+    struct iovec iovs[NIOVS];
+    int idx = 0;          // first unwritten vector
+    size_t off = 0;       // bytes already written of that vector
+    ssize_t written = 0;
     while (1) {
+        while (idx < iovcnt && off == iov[idx].iov_len) {
+            idx++;
+            off = 0;
+        }
+        if (idx == iovcnt) {
+            break;
+        }
         int ret = checkdl(co, deadline);
         if (ret != NECO_OK) {
             errno = ret == NECO_CANCELED ? ECANCELED : ETIMEDOUT;
-            return -1;
+            return written > 0 ? written : -1;
         }
-        errno = 0;
-        ret = connect0(fd, addr, addrlen);
-        if (ret == -1) {
-            switch (errno) {
-            case EISCONN:
-                // The socket is already connected. 
-                // This could be because we just tried a moment ago and
-                // received an EINPROGRESS. In that case return success,
-                // otherwise return an error.
-                ret = inprog ? 0 : -1;
-                break;
-            case EAGAIN:
-                // Only unix domain sockets can get this error.
-                // Linux manual does not describe why this can happen or 
-                // what to do when it does. FreeBSD says it means that there
-                // are not enough ports available on the system to assign to
-                // the  file descriptor. We can (maybe??) try again. But
-                // probably best to return an error that is different than
-                // EAGAIN. 
-                errno = ECONNREFUSED;
-                break;
-            case EINPROGRESS:
-                // EINPROGRESS means the connection is in progress and may
-                // take a while. We are allowed to add this file descriptor
-                // to an event queue and wait for the connection to be ready.
-                // This can be done by waiting on a write event. 
-                // printf("D\n");
-                inprog = true;
+        int niovs = iovcnt-idx < NIOVS ? iovcnt-idx : NIOVS;
+        memcpy(iovs, iov+idx, sizeof(struct iovec) * (size_t)niovs);
+        iovs[0].iov_base = (char*)iovs[0].iov_base + off;
+        iovs[0].iov_len -= off;
+        ssize_t n = writev(fd, iovs, niovs);
+        if (n == -1) {
+            if (errno == EINTR || errno == EAGAIN) {
                 cowait(fd, EVWRITE, deadline);
-                continue;
-            case EINTR:  // Interrupted. Just try again.
-            case ENOMEM: // Mac OS can sometimes return ENOMEM (bug)
-                continue;
+            } else if (written == 0) {
+                return -1;
+            } else {
+                // Same as write_dl, report the amount written.
+                return written;
             }
+            continue;
         }
-        return ret;
-    }
+        written += n;
+        while (n > 0) {
+            size_t left = iov[idx].iov_len - off;
+            if ((size_t)n < left) {
+                off += (size_t)n;
+                break;
+            }
+            n -= (ssize_t)left;
+            idx++;
+            off = 0;
+        }
+        if (idx < iovcnt) {
+            // Avoid starving the other coroutines.
+            coyield();
+        }
+    }
+    return written;
 }
 
-/// Same as neco_connect() but with a deadline parameter.
-int neco_connect_dl(int sockfd, const struct sockaddr *addr, socklen_t addrlen, 
+/// Same as neco_writev() but with a deadline parameter.
+ssize_t neco_writev_dl(int fd, const struct iovec *iov, int iovcnt,
     int64_t deadline)
 {
-    int ret = connect_dl(sockfd, addr, addrlen, deadline);
+    ssize_t ret = writev_dl(fd, iov, iovcnt, deadline);
     async_error_guard(ret);
+    if (ret >= 0) {
+        size_t count = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            count += iov[i].iov_len;
+        }
+        if ((size_t)ret < count) {
+            lasterr = NECO_PARTIALWRITE;
+        }
+    }
     return ret;
 }
 
-/// Connects the socket referred to by the file descriptor sockfd to the
-/// address specified by addr.
+/// Write multiple buffers to a file descriptor.
 ///
-/// While in a coroutine, this function should be used instead of the standard
-/// connect() to avoid blocking other coroutines from running concurrently.
+/// This is a Posix wrapper function for the purpose of running in a Neco
+/// coroutine. It's expected that the provided file descriptor is in 
+/// non-blocking state.
 ///
-/// @param sockfd Socket file descriptor
-/// @param addr Socket address out
-/// @param addrlen Socket address length out
-/// @return NECO_OK Success
+/// Like neco_write(), this function will attempt to write _all_ bytes of all
+/// buffers, and neco_lasterr() returns NECO_PARTIALWRITE when fewer were
+/// written. The iov array is not modified.
+///
+/// @return On success, the number of bytes written is returned.
 /// @return On error, value -1 (NECO_ERROR) is returned, and errno is set to
 ///         indicate the error.
-int neco_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
-    return neco_connect_dl(sockfd, addr, addrlen, INT64_MAX);
+/// @see    Posix
+/// @see    https://www.man7.org/linux/man-pages/man2/writev.2.html
+ssize_t neco_writev(int fd, const struct iovec *iov, int iovcnt) {
+    return neco_writev_dl(fd, iov, iovcnt, INT64_MAX);
 }
 
-void neco_errconv_to_sys(int err) {
-    switch (err) {
-    case NECO_OK:
-        errno = 0;
-        break;
-    case NECO_INVAL:
-        errno = EINVAL;
-        break;
-    case NECO_PERM:
-        errno = EPERM;
-        break;
-    case NECO_NOMEM:
-        errno = ENOMEM;
-        break;
-    case NECO_CANCELED:
-        errno = ECANCELED;
-        break;
-    case NECO_TIMEDOUT:
-        errno = ETIMEDOUT;
-        break;
-    }
+#if defined(__linux__)
+
+// Linux sends straight from the page cache, and needs no copy buffer.
+struct sendbuf {
+    size_t len;
+};
+
+// Send up to count bytes from in_fd to out_fd, without waiting. Returns -1
+// with EAGAIN when out_fd is not ready.
+static ssize_t sendfile0(int out_fd, int in_fd, off_t *offset, size_t count,
+    struct sendbuf *buf)
+{
+    (void)buf;
+    return sendfile(out_fd, in_fd, offset, count);
 }
 
-int neco_errconv_from_sys(void) {
-    switch (errno) {
-    case EINVAL:
-        return NECO_INVAL;
-    case EPERM:
-        return NECO_PERM;
-    case ENOMEM:
-        return NECO_NOMEM;
-    case ECANCELED:
-        return NECO_CANCELED;
-    case ETIMEDOUT:
-        return NECO_TIMEDOUT;
-    default:
-        return NECO_ERROR;
+static void sendfile_unread(int in_fd, off_t *offset, struct sendbuf *buf) {
+    (void)in_fd; (void)offset; (void)buf;
+}
+
+#else
+
+// Bytes that were read from in_fd and not yet written to out_fd. They are
+// written before anything more is read, so a pipe or socket in_fd loses
+// nothing while out_fd is full.
+struct sendbuf {
+    size_t len;
+    size_t pos;
+    char data[16384];
+};
+
+// Copy through a buffer on systems without a Linux style sendfile.
+static ssize_t sendfile0(int out_fd, int in_fd, off_t *offset, size_t count,
+    struct sendbuf *buf)
+{
+    if (buf->len == 0) {
+        size_t n = count < sizeof(buf->data) ? count : sizeof(buf->data);
+        ssize_t nread = offset ? pread(in_fd, buf->data, n, *offset) : 
+            read(in_fd, buf->data, n);
+        if (nread <= 0) {
+            return nread;
+        }
+        buf->pos = 0;
+        buf->len = (size_t)nread;
+    }
+    ssize_t nwritten = write0(out_fd, buf->data+buf->pos, buf->len);
+    if (nwritten > 0) {
+        buf->pos += (size_t)nwritten;
+        buf->len -= (size_t)nwritten;
+        if (offset) {
+            *offset += nwritten;
+        }
     }
+    return nwritten;
 }
 
-const char *neco_shortstrerror(int code) {
-    switch (code) {
-    case NECO_OK:
-        return "NECO_OK";
-    case NECO_ERROR:
-        return "NECO_ERROR";
-    case NECO_INVAL:
-        return "NECO_INVAL";
-    case NECO_PERM:
-        return "NECO_PERM";
-    case NECO_NOMEM:
-        return "NECO_NOMEM";
-    case NECO_NOTFOUND:
-        return "NECO_NOTFOUND";
-    case NECO_NOSIGWATCH:
-        return "NECO_NOSIGWATCH";
-    case NECO_CLOSED:
-        return "NECO_CLOSED";
-    case NECO_EMPTY:
-        return "NECO_EMPTY";
-    case NECO_TIMEDOUT:
-        return "NECO_TIMEDOUT";
-    case NECO_CANCELED:
-        return "NECO_CANCELED";
-    case NECO_BUSY:
-        return "NECO_BUSY";
-    case NECO_NEGWAITGRP:
-        return "NECO_NEGWAITGRP";
-    case NECO_GAIERROR:
-        return "NECO_GAIERROR";
-    case NECO_UNREADFAIL:
-        return "NECO_UNREADFAIL";
-    case NECO_PARTIALWRITE:
-        return "NECO_PARTIALWRITE";
-    case NECO_NOTGENERATOR:
-        return "NECO_NOTGENERATOR";
-    case NECO_NOTSUSPENDED:
-        return "NECO_NOTSUSPENDED";
-    default:
-        return "UNKNOWN";
+// Puts back the bytes that were read but not sent, when the copy stops early.
+// With an offset nothing was consumed beyond what was sent.
+static void sendfile_unread(int in_fd, off_t *offset, struct sendbuf *buf) {
+    if (!offset && buf->len > 0) {
+        lseek(in_fd, -(off_t)buf->len, SEEK_CUR);
     }
 }
 
-/// Returns a string representation of an error code.
-/// @see Errors
-const char *neco_strerror(ssize_t errcode) {
-    switch (errcode) {
-    case NECO_OK:
-        return "Success";
-    case NECO_ERROR:
-        return strerror(errno);
-    case NECO_INVAL:
-        return strerror(EINVAL);
-    case NECO_PERM:
-        return strerror(EPERM);
-    case NECO_NOMEM:
-        return strerror(ENOMEM);
-    case NECO_NOTFOUND:
-        return "No such coroutine";
-    case NECO_NOSIGWATCH:
-        return "Not watching on a signal";
-    case NECO_CLOSED:
-        return "Channel closed";
-    case NECO_EMPTY:
-        return "Channel empty";
-    case NECO_TIMEDOUT:
-        return strerror(ETIMEDOUT);
-    case NECO_CANCELED:
-        return strerror(ECANCELED);
-    case NECO_BUSY:
-        return strerror(EBUSY);
-    case NECO_NEGWAITGRP:
-        return "Negative waitgroup counter";
-    case NECO_GAIERROR:
-        if (neco_gai_errno == EAI_SYSTEM) {
-            return strerror(errno);
-        } else {
-            return gai_strerror(neco_gai_errno);
-        }
-    case NECO_UNREADFAIL:
-        return "Failed to unread byte";
-    case NECO_PARTIALWRITE:
-        return "Failed to write all bytes";
-    case NECO_NOTGENERATOR:
-        return "Coroutine is not a generator";
-    case NECO_NOTSUSPENDED:
-        return "Coroutine is not suspended";
-    default: {
-        static __thread char udmsg[32];
-        snprintf(udmsg, sizeof(udmsg)-1, "Undefined error: %zd", errcode);
-        return udmsg;
+#endif
+
+static ssize_t sendfile_dl(int out_fd, int in_fd, off_t *offset, size_t count,
+    int64_t deadline)
+{
+    struct coroutine *co = coself();
+    if (!co) {
+        errno = EPERM;
+        return -1;
     }
+    struct sendbuf buf;
+    buf.len = 0;
+    ssize_t sent = 0;
+    while (count > 0) {
+        int ret = checkdl(co, deadline);
+        if (ret != NECO_OK) {
+            sendfile_unread(in_fd, offset, &buf);
+            errno = ret == NECO_CANCELED ? ECANCELED : ETIMEDOUT;
+            return sent > 0 ? sent : -1;
+        }
+        ssize_t n = sendfile0(out_fd, in_fd, offset, count, &buf);
+        if (n == -1) {
+            if (errno == EINTR || errno == EAGAIN) {
+                cowait(out_fd, EVWRITE, deadline);
+                continue;
+            }
+            int err = errno;
+            sendfile_unread(in_fd, offset, &buf);
+            errno = err;
+            return sent > 0 ? sent : -1;
+        } else if (n == 0) {
+            // End of file
+            break;
+        }
+        sent += n;
+        count -= (size_t)n;
+        if (count > 0) {
+            coyield();
+        }
     }
+    return sent;
 }
 
-static int getstats(neco_stats *stats) {
-    if (!stats) {
-        return NECO_INVAL;
-    } else if (!rt) {
-        return NECO_PERM;
-    }
-    *stats = (neco_stats) {
-        .coroutines = rt->all.count,
-        .sleepers = rt->nsleepers,
-        .evwaiters = rt->nevwaiters,
-        .sigwaiters = rt->nsigwaiters,
-        .senders = rt->nsenders,
-        .receivers = rt->nreceivers,
-        .locked = rt->nlocked,
-        .waitgroupers = rt->nwaitgroupers,
-        .condwaiters = rt->ncondwaiters,
-        .suspended = rt->nsuspended,
-    };
-    return NECO_OK;
+/// Same as neco_sendfile() but with a deadline parameter.
+ssize_t neco_sendfile_dl(int out_fd, int in_fd, off_t *offset, size_t count,
+    int64_t deadline)
+{
+    ssize_t ret = sendfile_dl(out_fd, in_fd, offset, count, deadline);
+    async_error_guard(ret);
+    return ret;
 }
 
-/// Returns various stats for the current Neco runtime.
-/// 
-/// ```c
-/// // Print the number of active coroutines
-/// neco_stats stats;
-/// neco_getstats(&stats);
-/// printf("%zu\n", stats.coroutines);
-/// ```
+/// Send data from a file to a socket or other file descriptor, without
+/// copying it through user space.
 ///
-/// Other stats include:
+/// This works like the Linux sendfile(), but keeps going until count bytes
+/// are sent or the end of the file is reached, waiting for out_fd to be
+/// writable when needed. On other systems the data is copied through a
+/// small buffer instead. There, if the call stops early without an offset,
+/// the bytes it read but could not send are put back with lseek(), so they
+/// are lost when in_fd is a pipe or socket.
 ///
-/// ```c
-/// coroutines
-/// sleepers
-/// evwaiters
-/// sigwaiters
-/// senders
-/// receivers
-/// locked
-/// waitgroupers
-/// condwaiters
-/// suspended
-/// ```
-
-int neco_getstats(neco_stats *stats) {
-    int ret = getstats(stats);
-    error_guard(ret);
-    return ret;
+/// @param out_fd Destination, such as a non-blocking socket
+/// @param in_fd Source file
+/// @param offset Position to read from, which is updated, or NULL to use and
+///        update the file position of in_fd
+/// @param count Number of bytes to send
+/// @return On success, the number of bytes sent, which is less than count
+///         only at the end of the file
+/// @return On error, value -1 (NECO_ERROR) is returned, and errno is set to
+///         indicate the error.
+/// @see    Posix
+/// @see    https://www.man7.org/linux/man-pages/man2/sendfile.2.html
+ssize_t neco_sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+    return neco_sendfile_dl(out_fd, in_fd, offset, count, INT64_MAX);
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// channels
-////////////////////////////////////////////////////////////////////////////////
-
-struct neco_chan {
-    int64_t rtid;         // runtime id. for runtime/thread isolation
-    int rc;               // reference counter
-    bool sclosed;         // sender closed
-    bool rclosed;         // receiver closed
-    bool qrecv;           // queue has all receivers, otherwise all senders
-    bool lok;             // used for the select-case 'closed' result
-    struct colist queue;  // waiting coroutines. Either senders or receivers
-    int msgsize;          // size of each message
-    int bufcap;           // max number of messages in ring buffer
+static ssize_t splice_dl(int fd_in, int64_t *off_in, int fd_out, 
+    int64_t *off_out, size_t len, unsigned int flags, int64_t deadline)
+{
+    struct coroutine *co = coself();
+    if (!co) {
+        errno = EPERM;
+        return -1;
+    }
+#if defined(__linux__) && defined(SYS_splice)
+    flags |= 2; // SPLICE_F_NONBLOCK
+    while (1) {
+        int ret = checkdl(co, deadline);
+        if (ret != NECO_OK) {
+            errno = ret == NECO_CANCELED ? ECANCELED : ETIMEDOUT;
+            return -1;
+        }
+        ssize_t n = (ssize_t)syscall(SYS_splice, fd_in, off_in, fd_out, 
+            off_out, len, flags);
+        if (n >= 0) {
+            return n;
+        } else if (errno != EINTR && errno != EAGAIN) {
+            return -1;
+        }
+        // Either side may be the one that is not ready, so ask which.
+        struct pollfd fds[2] = { 
+            { .fd = fd_in, .events = POLLIN },
+            { .fd = fd_out, .events = POLLOUT },
+        };
+        poll(fds, 2, 0);
+        if (!fds[0].revents) {
+            cowait(fd_in, EVREAD, deadline);
+        } else if (!fds[1].revents) {
+            cowait(fd_out, EVWRITE, deadline);
+        } else {
+            coyield();
+        }
+    }
+#else
+    (void)fd_in; (void)off_in; (void)fd_out; (void)off_out; (void)len;
+    (void)flags; (void)deadline;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/// Same as neco_splice() but with a deadline parameter.
+ssize_t neco_splice_dl(int fd_in, int64_t *off_in, int fd_out, 
+    int64_t *off_out, size_t len, unsigned int flags, int64_t deadline)
+{
+    ssize_t ret = splice_dl(fd_in, off_in, fd_out, off_out, len, flags, 
+        deadline);
+    async_error_guard(ret);
+    return ret;
+}
+
+/// Move data between two file descriptors, where one of them is a pipe,
+/// without copying it through user space.
+///
+/// This works like the Linux splice(), with SPLICE_F_NONBLOCK always added
+/// to flags, and waits until at least one byte can be moved. A proxy joins 
+/// two sockets with a pipe and two splices, one into and one out of the
+/// pipe.
+///
+/// Only available on Linux. Other systems fail with ENOSYS.
+///
+/// @return On success, the number of bytes moved (zero indicates end of
+///         input)
+/// @return On error, value -1 (NECO_ERROR) is returned, and errno is set to
+///         indicate the error.
+/// @see    Posix
+/// @see    https://www.man7.org/linux/man-pages/man2/splice.2.html
+ssize_t neco_splice(int fd_in, int64_t *off_in, int fd_out, int64_t *off_out,
+    size_t len, unsigned int flags)
+{
+    return neco_splice_dl(fd_in, off_in, fd_out, off_out, len, flags, 
+        INT64_MAX);
+}
+
+#endif // !_WIN32
+
+#ifdef _WIN32
+
+static int wsa_err_to_errno(int wsaerr) {
+    switch (wsaerr) {
+    case WSAEINTR: return EINTR;
+    case WSAEBADF: return EBADF;
+    case WSAEACCES: return EACCES;
+    case WSAEFAULT: return EFAULT;
+    case WSAEINVAL: return EINVAL;
+    case WSAEMFILE: return EMFILE;
+    case WSAEWOULDBLOCK: return EAGAIN;
+    case WSAEINPROGRESS: return EINPROGRESS;
+    case WSAEALREADY: return EALREADY;
+    case WSAENOTSOCK: return ENOTSOCK;
+    case WSAEDESTADDRREQ: return EDESTADDRREQ;
+    case WSAEMSGSIZE: return EMSGSIZE;
+    case WSAEPROTOTYPE: return EPROTOTYPE;
+    case WSAENOPROTOOPT: return ENOPROTOOPT;
+    case WSAEPROTONOSUPPORT: return EPROTONOSUPPORT;
+    case WSAEOPNOTSUPP: return EOPNOTSUPP;
+    case WSAEADDRINUSE: return EADDRINUSE;
+    case WSAEADDRNOTAVAIL: return EADDRNOTAVAIL;
+    case WSAENETDOWN: return ENETDOWN;
+    case WSAENETUNREACH: return ENETUNREACH;
+    case WSAENETRESET: return ENETRESET;
+    case WSAECONNABORTED: return ECONNABORTED;
+    case WSAECONNRESET: return ECONNRESET;
+    case WSAENOBUFS: return ENOBUFS;
+    case WSAEISCONN: return EISCONN;
+    case WSAENOTCONN: return ENOTCONN;
+    case WSAETIMEDOUT: return ETIMEDOUT;
+    case WSAECONNREFUSED: return ECONNREFUSED;
+    case WSAELOOP: return ELOOP;
+    case WSAENAMETOOLONG: return ENAMETOOLONG;
+    case WSAEHOSTUNREACH: return EHOSTUNREACH;
+    case WSAENOTEMPTY: return ENOTEMPTY;
+    case WSAECANCELLED: return ECANCELED;
+    case WSA_E_CANCELLED: return ECANCELED;
+    }
+    return wsaerr;
+}
+
+int accept1(int sock, struct sockaddr *addr, socklen_t *len) {
+    int fd = accept0(sock, addr, len);
+    if (fd == -1) {
+        errno = wsa_err_to_errno(WSAGetLastError());
+    }
+    return fd;
+}
+#else
+#define accept1 accept0
+#endif
+
+static int accept_dl(int sockfd, struct sockaddr *addr, socklen_t *addrlen, 
+    int64_t deadline)
+{
+    struct coroutine *co = coself();
+    if (!co) {
+        errno = EPERM;
+        return -1;
+    }
+    bool uring = uring_active();
+    while (1) {
+        int ret = checkdl(co, deadline);
+        if (ret != NECO_OK) {
+            errno = ret == NECO_CANCELED ? ECANCELED : ETIMEDOUT;
+            return -1;
+        }
+        int fd = uring ? uring_accept(sockfd, addr, addrlen, deadline) :
+            accept1(sockfd, addr, addrlen);
+        if (fd == -1) {
+            if (errno == EINTR || errno == EAGAIN) {
+                cowait(sockfd, EVREAD, deadline);
+            } else {
+                return -1;
+            }
+        } else {
+            if (!uring && neco_setnonblock(fd, true, 0) == -1) {
+                close(fd);
+                return -1;
+            }
+            return fd;
+        }
+    }
+}
+
+/// Same as neco_accept() but with a deadline parameter. 
+int neco_accept_dl(int sockfd, struct sockaddr *addr, socklen_t *addrlen, 
+    int64_t deadline)
+{
+    int ret = accept_dl(sockfd, addr, addrlen, deadline);
+    async_error_guard(ret);
+    return ret;
+}
+
+/// Accept a connection on a socket.
+///
+/// While in a coroutine, this function should be used instead of the standard
+/// accept() to avoid blocking other coroutines from running concurrently.
+///
+/// The the accepted file descriptor is returned in non-blocking mode.
+///
+/// @param sockfd Socket file descriptor
+/// @param addr Socket address out
+/// @param addrlen Socket address length out
+/// @return On success, file descriptor (non-blocking)
+/// @return On error, value -1 (NECO_ERROR) is returned, and errno is set to
+///         indicate the error.
+/// @see Posix
+int neco_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
+    return neco_accept_dl(sockfd, addr, addrlen, INT64_MAX);
+}
+
+static int connect_dl(int fd, const struct sockaddr *addr, socklen_t addrlen, 
+    int64_t deadline)
+{
+    struct coroutine *co = coself();
+    if (!co) {
+        errno = EPERM;
+        return -1;
+    }
+    bool uring = uring_active();
+    bool inprog = false;
+    while (1) {
+        int ret = checkdl(co, deadline);
+        if (ret != NECO_OK) {
+            errno = ret == NECO_CANCELED ? ECANCELED : ETIMEDOUT;
+            return -1;
+        }
+        errno = 0;
+        ret = uring ? uring_connect(fd, addr, addrlen, deadline) :
+            connect0(fd, addr, addrlen);
+        if (ret == -1) {
+            switch (errno) {
+            case EISCONN:
+                // The socket is already connected. 
+                // This could be because we just tried a moment ago and
+                // received an EINPROGRESS. In that case return success,
+                // otherwise return an error.
+                ret = inprog ? 0 : -1;
+                break;
+            case EAGAIN:
+                // Only unix domain sockets can get this error.
+                // Linux manual does not describe why this can happen or 
+                // what to do when it does. FreeBSD says it means that there
+                // are not enough ports available on the system to assign to
+                // the  file descriptor. We can (maybe??) try again. But
+                // probably best to return an error that is different than
+                // EAGAIN. 
+                errno = ECONNREFUSED;
+                break;
+            case EINPROGRESS:
+                // EINPROGRESS means the connection is in progress and may
+                // take a while. We are allowed to add this file descriptor
+                // to an event queue and wait for the connection to be ready.
+                // This can be done by waiting on a write event. 
+                // printf("D\n");
+                inprog = true;
+                cowait(fd, EVWRITE, deadline);
+                continue;
+            case EINTR:  // Interrupted. Just try again.
+            case ENOMEM: // Mac OS can sometimes return ENOMEM (bug)
+                continue;
+            }
+        }
+        return ret;
+    }
+}
+
+/// Same as neco_connect() but with a deadline parameter.
+int neco_connect_dl(int sockfd, const struct sockaddr *addr, socklen_t addrlen, 
+    int64_t deadline)
+{
+    int ret = connect_dl(sockfd, addr, addrlen, deadline);
+    async_error_guard(ret);
+    return ret;
+}
+
+/// Connects the socket referred to by the file descriptor sockfd to the
+/// address specified by addr.
+///
+/// While in a coroutine, this function should be used instead of the standard
+/// connect() to avoid blocking other coroutines from running concurrently.
+///
+/// @param sockfd Socket file descriptor
+/// @param addr Socket address out
+/// @param addrlen Socket address length out
+/// @return NECO_OK Success
+/// @return On error, value -1 (NECO_ERROR) is returned, and errno is set to
+///         indicate the error.
+int neco_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+    return neco_connect_dl(sockfd, addr, addrlen, INT64_MAX);
+}
+
+void neco_errconv_to_sys(int err) {
+    switch (err) {
+    case NECO_OK:
+        errno = 0;
+        break;
+    case NECO_INVAL:
+        errno = EINVAL;
+        break;
+    case NECO_PERM:
+        errno = EPERM;
+        break;
+    case NECO_NOMEM:
+        errno = ENOMEM;
+        break;
+    case NECO_CANCELED:
+        errno = ECANCELED;
+        break;
+    case NECO_TIMEDOUT:
+        errno = ETIMEDOUT;
+        break;
+    }
+}
+
+int neco_errconv_from_sys(void) {
+    switch (errno) {
+    case EINVAL:
+        return NECO_INVAL;
+    case EPERM:
+        return NECO_PERM;
+    case ENOMEM:
+        return NECO_NOMEM;
+    case ECANCELED:
+        return NECO_CANCELED;
+    case ETIMEDOUT:
+        return NECO_TIMEDOUT;
+    default:
+        return NECO_ERROR;
+    }
+}
+
+const char *neco_shortstrerror(int code) {
+    switch (code) {
+    case NECO_OK:
+        return "NECO_OK";
+    case NECO_ERROR:
+        return "NECO_ERROR";
+    case NECO_INVAL:
+        return "NECO_INVAL";
+    case NECO_PERM:
+        return "NECO_PERM";
+    case NECO_NOMEM:
+        return "NECO_NOMEM";
+    case NECO_NOTFOUND:
+        return "NECO_NOTFOUND";
+    case NECO_NOSIGWATCH:
+        return "NECO_NOSIGWATCH";
+    case NECO_CLOSED:
+        return "NECO_CLOSED";
+    case NECO_EMPTY:
+        return "NECO_EMPTY";
+    case NECO_TIMEDOUT:
+        return "NECO_TIMEDOUT";
+    case NECO_CANCELED:
+        return "NECO_CANCELED";
+    case NECO_BUSY:
+        return "NECO_BUSY";
+    case NECO_NEGWAITGRP:
+        return "NECO_NEGWAITGRP";
+    case NECO_GAIERROR:
+        return "NECO_GAIERROR";
+    case NECO_UNREADFAIL:
+        return "NECO_UNREADFAIL";
+    case NECO_PARTIALWRITE:
+        return "NECO_PARTIALWRITE";
+    case NECO_NOTGENERATOR:
+        return "NECO_NOTGENERATOR";
+    case NECO_NOTSUSPENDED:
+        return "NECO_NOTSUSPENDED";
+    default:
+        return "UNKNOWN";
+    }
+}
+
+/// Returns a string representation of an error code.
+/// @see Errors
+const char *neco_strerror(ssize_t errcode) {
+    switch (errcode) {
+    case NECO_OK:
+        return "Success";
+    case NECO_ERROR:
+        return strerror(errno);
+    case NECO_INVAL:
+        return strerror(EINVAL);
+    case NECO_PERM:
+        return strerror(EPERM);
+    case NECO_NOMEM:
+        return strerror(ENOMEM);
+    case NECO_NOTFOUND:
+        return "No such coroutine";
+    case NECO_NOSIGWATCH:
+        return "Not watching on a signal";
+    case NECO_CLOSED:
+        return "Channel closed";
+    case NECO_EMPTY:
+        return "Channel empty";
+    case NECO_TIMEDOUT:
+        return strerror(ETIMEDOUT);
+    case NECO_CANCELED:
+        return strerror(ECANCELED);
+    case NECO_BUSY:
+        return strerror(EBUSY);
+    case NECO_NEGWAITGRP:
+        return "Negative waitgroup counter";
+    case NECO_GAIERROR:
+        if (neco_gai_errno == EAI_SYSTEM) {
+            return strerror(errno);
+        } else {
+            return gai_strerror(neco_gai_errno);
+        }
+    case NECO_UNREADFAIL:
+        return "Failed to unread byte";
+    case NECO_PARTIALWRITE:
+        return "Failed to write all bytes";
+    case NECO_NOTGENERATOR:
+        return "Coroutine is not a generator";
+    case NECO_NOTSUSPENDED:
+        return "Coroutine is not suspended";
+    default: {
+        static __thread char udmsg[32];
+        snprintf(udmsg, sizeof(udmsg)-1, "Undefined error: %zd", errcode);
+        return udmsg;
+    }
+    }
+}
+
+static int getstats(neco_stats *stats) {
+    if (!stats) {
+        return NECO_INVAL;
+    } else if (!rt) {
+        return NECO_PERM;
+    }
+    *stats = (neco_stats) {
+        .coroutines = rt->all.count,
+        .sleepers = rt->nsleepers,
+        .evwaiters = rt->nevwaiters,
+        .sigwaiters = rt->nsigwaiters,
+        .senders = rt->nsenders,
+        .receivers = rt->nreceivers,
+        .locked = rt->nlocked,
+        .waitgroupers = rt->nwaitgroupers,
+        .condwaiters = rt->ncondwaiters,
+        .suspended = rt->nsuspended,
+    };
+    return NECO_OK;
+}
+
+/// Returns various stats for the current Neco runtime.
+/// 
+/// ```c
+/// // Print the number of active coroutines
+/// neco_stats stats;
+/// neco_getstats(&stats);
+/// printf("%zu\n", stats.coroutines);
+/// ```
+///
+/// Other stats include:
+///
+/// ```c
+/// coroutines
+/// sleepers
+/// evwaiters
+/// sigwaiters
+/// senders
+/// receivers
+/// locked
+/// waitgroupers
+/// condwaiters
+/// suspended
+/// ```
+
+int neco_getstats(neco_stats *stats) {
+    int ret = getstats(stats);
+    error_guard(ret);
+    return ret;
+}
+
+static int getmetrics(neco_metrics *metrics) {
+    if (!metrics) {
+        return NECO_INVAL;
+    } else if (!rt) {
+        return NECO_PERM;
+    }
+#ifdef NECO_USEMETRICS
+    *metrics = rt->metrics;
+#else
+    memset(metrics, 0, sizeof(neco_metrics));
+#endif
+    return NECO_OK;
+}
+
+/// Returns the counters and latency histograms of the current Neco runtime.
+///
+/// Metrics are only collected when neco.c is compiled with NECO_USEMETRICS,
+/// otherwise this provides all zeros.
+///
+/// ```c
+/// neco_metrics m;
+/// neco_getmetrics(&m);
+/// printf("%" PRIu64 " switches, mean latency %" PRIu64 " ns\n", m.switches,
+///     m.schedlat.count ? m.schedlat.sum / m.schedlat.count : 0);
+/// ```
+///
+/// @param metrics Metrics to fill
+/// @return NECO_OK Success
+/// @return NECO_INVAL An invalid parameter was provided
+/// @return NECO_PERM Operation called outside of a coroutine
+int neco_getmetrics(neco_metrics *metrics) {
+    int ret = getmetrics(metrics);
+    error_guard(ret);
+    return ret;
+}
+
+static int resetmetrics(void) {
+    if (!rt) {
+        return NECO_PERM;
+    }
+#ifdef NECO_USEMETRICS
+    memset(&rt->metrics, 0, sizeof(neco_metrics));
+#endif
+    return NECO_OK;
+}
+
+/// Zeroes the metrics of the current Neco runtime.
+/// @return NECO_OK Success
+/// @return NECO_PERM Operation called outside of a coroutine
+int neco_resetmetrics(void) {
+    int ret = resetmetrics();
+    error_guard(ret);
+    return ret;
+}
+
+static ssize_t trace_read(neco_trace_event *events, size_t nevents) {
+    if (!events && nevents > 0) {
+        return NECO_INVAL;
+    } else if (!rt) {
+        return NECO_PERM;
+    }
+#ifdef NECO_USETRACE
+    struct trace *trace = rt->trace;
+    size_t n = nevents < trace->len ? nevents : trace->len;
+    size_t pos = (trace->pos + NECO_TRACESIZE - trace->len) % NECO_TRACESIZE;
+    for (size_t i = 0; i < n; i++) {
+        events[i] = trace->events[pos];
+        pos = pos+1 == NECO_TRACESIZE ? 0 : pos+1;
+    }
+    trace->len -= n;
+    return (ssize_t)n;
+#else
+    (void)events, (void)nevents;
+    return 0;
+#endif
+}
+
+/// Takes the oldest events out of the trace ring of the current runtime.
+///
+/// Each runtime keeps its most recent NECO_TRACESIZE events, overwriting the
+/// oldest ones as new events come in, so the ring should be read before it
+/// wraps to get a complete trace. Events are plain data which can be written
+/// to a file as is and converted later with neco_trace_chrome().
+///
+/// Tracing is only available when neco.c is compiled with NECO_USETRACE,
+/// otherwise no events are ever returned.
+///
+/// ```c
+/// neco_trace_event evs[1024];
+/// ssize_t n;
+/// while ((n = neco_trace_read(evs, 1024)) > 0) {
+///     write(fd, evs, (size_t)n * sizeof(neco_trace_event));
+/// }
+/// ```
+///
+/// @param events Array to fill
+/// @param nevents Capacity of the array
+/// @return Number of events read, or NECO_INVAL or NECO_PERM
+ssize_t neco_trace_read(neco_trace_event *events, size_t nevents) {
+    ssize_t ret = trace_read(events, nevents);
+    error_guard(ret);
+    return ret;
+}
+
+struct trace_out {
+    int fd;
+    size_t len;
+    bool failed;
+    char buf[4096];
+};
+
+static void trace_flush(struct trace_out *out) {
+    size_t written = 0;
+    while (!out->failed && written < out->len) {
+        ssize_t n = write(out->fd, out->buf+written, out->len-written);
+        if (n == -1 && errno != EINTR) {
+            out->failed = true;
+        } else if (n > 0) {
+            written += (size_t)n;
+        }
+    }
+    out->len = 0;
+}
+
+static void trace_printf(struct trace_out *out, const char *fmt, ...) {
+    if (out->len > sizeof(out->buf) - 256) {
+        trace_flush(out);
+    }
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(out->buf+out->len, sizeof(out->buf)-out->len, fmt, args);
+    va_end(args);
+    out->len += n > 0 ? (size_t)n : 0;
+}
+
+static int trace_chrome(int fd, const neco_trace_event *events, 
+    size_t nevents)
+{
+    if (fd < 0 || (!events && nevents > 0)) {
+        return NECO_INVAL;
+    }
+    struct trace_out out = { .fd = fd };
+    trace_printf(&out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    const char *sep = "\n";
+    for (size_t i = 0; i < nevents; i++) {
+        const neco_trace_event *ev = &events[i];
+        double ts = (double)ev->ts / 1000.0;
+        switch (ev->kind) {
+        case NECO_TRACE_RUN:
+        case NECO_TRACE_SCHED: {
+            // A slice that lasts until the next switch on the same runtime.
+            size_t j = i + 1;
+            while (j < nevents && (events[j].rtid != ev->rtid || 
+                (events[j].kind != NECO_TRACE_RUN && 
+                 events[j].kind != NECO_TRACE_SCHED)))
+            {
+                j++;
+            }
+            if (j == nevents) {
+                // The last slice of the runtime has no known end
+                break;
+            }
+            double dur = (double)(events[j].ts - ev->ts) / 1000.0;
+            if (ev->kind == NECO_TRACE_RUN) {
+                trace_printf(&out, "%s{\"name\":\"coroutine %" PRIi64 "\","
+                    "\"ph\":\"X\",\"pid\":1,\"tid\":%" PRIi32 ","
+                    "\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"args\":{\"latency_ns\":%" PRIi64 "}}",
+                    sep, ev->id, ev->rtid, ts, dur, ev->arg);
+            } else {
+                trace_printf(&out, "%s{\"name\":\"scheduler\","
+                    "\"ph\":\"X\",\"pid\":1,\"tid\":%" PRIi32 ","
+                    "\"ts\":%.3f,\"dur\":%.3f}",
+                    sep, ev->rtid, ts, dur);
+            }
+            sep = ",\n";
+            break;
+        }
+        case NECO_TRACE_STEP:
+        case NECO_TRACE_EVWAIT:
+            // Spans are recorded at their end.
+            trace_printf(&out, "%s{\"name\":\"%s\",\"ph\":\"X\","
+                "\"pid\":1,\"tid\":%" PRIi32 ",\"ts\":%.3f,\"dur\":%.3f}",
+                sep, ev->kind == NECO_TRACE_STEP ? "paused step" : "evwait",
+                ev->rtid, (double)(ev->ts - ev->arg) / 1000.0, 
+                (double)ev->arg / 1000.0);
+            sep = ",\n";
+            break;
+        }
+    }
+    trace_printf(&out, "\n]}\n");
+    trace_flush(&out);
+    return out.failed ? NECO_ERROR : NECO_OK;
+}
+
+/// Writes trace events in the Chrome trace event JSON format, which can be
+/// opened with Perfetto or chrome://tracing.
+///
+/// Each runtime is shown as a thread, with a slice for each run of a 
+/// coroutine and for the scheduler in between. Paused steps and polls are
+/// nested in the scheduler slices.
+///
+/// The events may come straight from neco_trace_read() or from a file that
+/// events were written to, and this does not require a runtime.
+///
+/// @param fd File descriptor to write to, using blocking writes
+/// @param events Events, oldest first
+/// @param nevents Number of events
+/// @return NECO_OK Success
+/// @return NECO_INVAL An invalid parameter was provided
+/// @return NECO_ERROR Writing failed, check errno
+int neco_trace_chrome(int fd, const neco_trace_event *events, size_t nevents) {
+    int ret = trace_chrome(fd, events, nevents);
+    error_guard(ret);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// shared objects
+////////////////////////////////////////////////////////////////////////////////
+
+// The channels, mutexes and waitgroups made by the *_shared functions may be
+// used by the coroutines of every runtime, such as those on the threads of a
+// neco_pool. Each one is guarded by a spinlock that is held only while its
+// state changes.
+//
+// A coroutine that waits on a shared object is queued on it as usual, and
+// goes into the XWAITING state. Whoever wakes it takes it off the queue while
+// holding the lock. A waker on the same runtime resumes it directly. A waker
+// on another thread sets it XWOKEN and, once the lock is released, hands it
+// to the xwoken list of its runtime, where the xdrain coroutine resumes it.
+// A waiter that timed out or was canceled checks its state under the lock.
+// If it was woken anyway then the operation went ahead, and it waits for the
+// hand over before returning.
+
+enum { XIDLE, XWAITING, XWOKEN };
+
+static int setnonblock(int fd, bool nonblock, bool *oldnonblock);
+
+static void xlock(atomic_bool *lock) {
+    while (atomic_exchange_explicit(lock, true, memory_order_acquire)) {
+        sched_yield0();
+    }
+}
+
+static void xunlock(atomic_bool *lock) {
+    atomic_store_explicit(lock, false, memory_order_release);
+}
+
+// Wakes a coroutine that was taken off the queue of a shared object, while
+// holding its lock. Those of other runtimes are handed over by xflush().
+// Returns true if the coroutine was scheduled to resume on this runtime.
+static bool xwake(struct coroutine *co) {
+    if (co->xrt != rt) {
+        atomic_store(&co->xstate, XWOKEN);
+        co->xnext = rt->xpending;
+        rt->xpending = co;
+        return false;
+    }
+    atomic_store(&co->xstate, XIDLE);
+    if (!co->paused) {
+        // Not yet paused, and will find out before it does.
+        return false;
+    }
+    sched_resume(co);
+    return true;
+}
+
+// Hands the coroutines that xwake() woke to their runtimes. This must be 
+// called after releasing the lock, before the current coroutine yields.
+static void xflush(void) {
+    while (rt->xpending) {
+        struct coroutine *co = rt->xpending;
+        struct runtime *xrt = co->xrt;
+        rt->xpending = co->xnext;
+        pthread_mutex_lock(&xrt->xmu);
+        co->xnext = xrt->xwoken;
+        xrt->xwoken = co;
+        if (xrt->xsleeping) {
+            xrt->xsleeping = false;
+            char c = 0;
+            (void)!write0(xrt->xfds[1], &c, 1);
+        }
+        pthread_mutex_unlock(&xrt->xmu);
+    }
+}
+
+// Resumes the coroutines that other threads woke.
+static void xdeliver(void) {
+    pthread_mutex_lock(&rt->xmu);
+    struct coroutine *co = rt->xwoken;
+    rt->xwoken = NULL;
+    pthread_mutex_unlock(&rt->xmu);
+    while (co) {
+        struct coroutine *next = co->xnext;
+        atomic_store(&co->xstate, XIDLE);
+        if (co->paused) {
+            sched_resume(co);
+        }
+        co = next;
+    }
+}
+
+// Runs while the runtime has coroutines waiting on shared objects, and 
+// resumes those that other threads woke.
+static void xdrain(int argc, void *argv[]) {
+    (void)argc; (void)argv;
+    while (rt->nxwaiters > 0) {
+        pthread_mutex_lock(&rt->xmu);
+        bool sleeping = !rt->xwoken;
+        rt->xsleeping = sleeping;
+        pthread_mutex_unlock(&rt->xmu);
+        if (sleeping) {
+            wait_dl(rt->xfds[0], EVREAD, INT64_MAX);
+            pthread_mutex_lock(&rt->xmu);
+            rt->xsleeping = false;
+            pthread_mutex_unlock(&rt->xmu);
+            char buf[64];
+            while (read0(rt->xfds[0], buf, sizeof(buf)) > 0);
+        }
+        xdeliver();
+        yield_for_sched_resume();
+    }
+    rt->xdraining = false;
+}
+
+// Counts a coroutine that is about to wait on shared objects, and starts
+// xdrain if it's not running yet.
+static int xenter(void) {
+    rt->nxwaiters++;
+    if (rt->xdraining) {
+        return NECO_OK;
+    }
+    if (!rt->xfds[0]) {
+        int fds[2];
+        if (pipe0(fds) == -1) {
+            return NECO_ERROR;
+        }
+        if (setnonblock(fds[0], true, 0) == -1 || 
+            setnonblock(fds[1], true, 0) == -1)
+        {
+            close(fds[0]);
+            close(fds[1]);
+            return NECO_ERROR;
+        }
+        rt->xfds[0] = fds[0];
+        rt->xfds[1] = fds[1];
+    }
+    rt->xdraining = true;
+    int ret = startv(xdrain, 0, NULL, NULL, 0, 0, 0);
+    if (ret != NECO_OK) {
+        rt->xdraining = false;
+    }
+    return ret;
+}
+
+// Waits for the hand over of a coroutine that another thread woke, then 
+// stops counting it. The coroutine must no longer be queued on any object.
+static void xleave(struct coroutine *co) {
+    while (atomic_load(&co->xstate) == XWOKEN) {
+        if (rt->xdraining) {
+            co->paused = true;
+            sco_pause();
+            co->paused = false;
+        } else {
+            // Only when xdrain could not be started.
+            xdeliver();
+            coyield();
+        }
+    }
+    atomic_store(&co->xstate, XIDLE);
+    rt->nxwaiters--;
+    if (rt->nxwaiters == 0 && rt->xdraining) {
+        // Let xdrain finish.
+        pthread_mutex_lock(&rt->xmu);
+        if (rt->xsleeping) {
+            rt->xsleeping = false;
+            char c = 0;
+            (void)!write0(rt->xfds[1], &c, 1);
+        }
+        pthread_mutex_unlock(&rt->xmu);
+    }
+}
+
+// Waits on a shared object whose lock is held, after the caller queued the 
+// coroutine on it. Returns with the lock held again, and NECO_OK only when
+// the coroutine was woken. Otherwise it's still queued and the caller must
+// remove it.
+static int xwait(atomic_bool *lock, struct coroutine *co, int64_t deadline) {
+    co->xrt = rt;
+    atomic_store(&co->xstate, XWAITING);
+    xunlock(lock);
+    xflush();
+    int ret = xenter();
+    while (ret == NECO_OK && atomic_load(&co->xstate) == XWAITING) {
+        copause(deadline);
+        ret = checkdl(co, INT64_MAX);
+    }
+    xlock(lock);
+    int state = atomic_load(&co->xstate);
+    if (state == XWAITING) {
+        xleave(co);
+        return ret;
+    }
+    if (state == XWOKEN) {
+        xunlock(lock);
+        xleave(co);
+        xlock(lock);
+    } else {
+        xleave(co);
+    }
+    struct colink *link = (void*)co;
+    if (link->next != co) {
+        // A deadline resumed it before the wake did, which left it in the 
+        // resumers queue. It must not resume a later pause.
+        remove_from_list(co);
+        rt->nresumers--;
+    }
+    if (ret == NECO_CANCELED) {
+        // The operation went ahead. Leave the cancel for the next one.
+        co->canceled = true;
+    }
+    return NECO_OK;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// channels
+////////////////////////////////////////////////////////////////////////////////
+
+struct neco_chan {
+    int64_t rtid;         // runtime id. for runtime/thread isolation
+    int rc;               // reference counter
+    bool sclosed;         // sender closed
+    bool rclosed;         // receiver closed
+    bool qrecv;           // queue has all receivers, otherwise all senders
+    bool lok;             // used for the select-case 'closed' result
+    bool shared;          // used by every runtime, see neco_chan_make_shared
+    atomic_bool lock;     // guards a shared channel
+    struct colist queue;  // waiting coroutines. Either senders or receivers
+    int msgsize;          // size of each message
+    int bufcap;           // max number of messages in ring buffer
     int buflen;           // number of messages in ring buffer
     int bufpos;           // position of first message in ring buffer
     char data[];          // message ring buffer + one extra entry for 'lmsg'
 };
 
-// coselectcase pretends to be a coroutine for the purpose of multiplexing
-// select-case channels into a single coroutine. 
-// It's required that this structure is 16-byte aligned.
-struct coselectcase {
-    struct coroutine *prev;
-    struct coroutine *next;
-    enum cokind kind;
+// coselectcase pretends to be a coroutine for the purpose of multiplexing
+// select-case channels into a single coroutine. 
+// It's required that this structure is 16-byte aligned.
+struct coselectcase {
+    struct coroutine *prev;
+    struct coroutine *next;
+    enum cokind kind;
+
+    struct neco_chan *chan;
+    struct coroutine *co;
+    void *data;
+    bool *ok;
+    int idx;
+    atomic_int *ret_idx;
+} aligned16;
+
+// Claims the select of a select-case for the waker that found it in a queue,
+// unless another channel already did.
+static bool select_claim(struct coselectcase *cocase) {
+    int idx = -1;
+    return atomic_compare_exchange_strong(cocase->ret_idx, &idx, cocase->idx);
+}
+
+// Channels can be used by the coroutines of the runtime that made them, and
+// by those of any runtime when shared.
+static bool chan_ours(struct neco_chan *chan) {
+    return chan->shared || chan->rtid == rt->id;
+}
+
+// returns the message slot
+static char *cbufslot(struct neco_chan *chan, int index) {
+    return chan->data + (chan->msgsize * index);
+}
+
+// push a message to the back by copying from data
+static void cbuf_push(struct neco_chan *chan, void *data) {
+    int pos = chan->bufpos + chan->buflen;
+    if (pos >= chan->bufcap) {
+        pos -= chan->bufcap;
+    }
+    if (chan->msgsize > 0) {
+        memcpy(cbufslot(chan, pos), data, (size_t)chan->msgsize);
+    }
+    chan->buflen++;
+    METRIC_MAX(chanmaxbuf, chan->buflen);
+}
+
+// pop a message from the front and copy to data
+static void cbuf_pop(struct neco_chan *chan, void *data) {
+    if (chan->msgsize) {
+        memcpy(data, cbufslot(chan, chan->bufpos), (size_t)chan->msgsize);
+    }
+    chan->bufpos++;
+    if (chan->bufpos == chan->bufcap) {
+        chan->bufpos = 0;
+    }
+    chan->buflen--;
+}
+
+// push count messages to the back by copying from data
+static void cbuf_pushn(struct neco_chan *chan, const char *data, int count) {
+    int pos = chan->bufpos + chan->buflen;
+    if (pos >= chan->bufcap) {
+        pos -= chan->bufcap;
+    }
+    if (chan->msgsize > 0) {
+        int n = count < chan->bufcap - pos ? count : chan->bufcap - pos;
+        size_t size = (size_t)chan->msgsize;
+        memcpy(cbufslot(chan, pos), data, size * (size_t)n);
+        memcpy(cbufslot(chan, 0), data + size * (size_t)n, 
+            size * (size_t)(count - n));
+    }
+    chan->buflen += count;
+    METRIC_MAX(chanmaxbuf, chan->buflen);
+}
+
+// pop count messages from the front and copy to data
+static void cbuf_popn(struct neco_chan *chan, char *data, int count) {
+    if (chan->msgsize > 0) {
+        int n = count < chan->bufcap - chan->bufpos ? 
+            count : chan->bufcap - chan->bufpos;
+        size_t size = (size_t)chan->msgsize;
+        memcpy(data, cbufslot(chan, chan->bufpos), size * (size_t)n);
+        memcpy(data + size * (size_t)n, cbufslot(chan, 0), 
+            size * (size_t)(count - n));
+    }
+    chan->bufpos += count;
+    if (chan->bufpos >= chan->bufcap) {
+        chan->bufpos -= chan->bufcap;
+    }
+    chan->buflen -= count;
+}
+
+static struct neco_chan *chan_fastmake(size_t data_size, size_t capacity,
+    bool as_generator)
+{
+    struct neco_chan *chan;
+    // Generators do not need buffered capacity of any size because they can't
+    // use the neco_select, which requires at least one buffered slot for the 
+    // neco_case operation to store the pending data.
+    size_t ring_size = as_generator ? 0 : data_size * (capacity+1);
+    if (POOL_ENABLED && ring_size == 0 && rt->zchanpoollen > 0) {
+        chan = rt->zchanpool[--rt->zchanpoollen];
+    } else {
+        size_t memsize = sizeof(struct neco_chan) + ring_size;
+        chan = malloc0(memsize);
+        if (!chan) {
+            return NULL;
+        }
+    }
+    // Zero the struct memory space, not the data space.
+    memset(chan, 0, sizeof(struct neco_chan));
+    chan->rtid = rt->id;
+    chan->msgsize = (int)data_size;
+    chan->bufcap = (int)capacity;
+    colist_init(&chan->queue);
+    return chan;
+}
+
+static int chan_make(struct neco_chan **chan, size_t data_size, size_t capacity)
+{
+    if (!chan || data_size > INT_MAX || capacity > INT_MAX) {
+        return NECO_INVAL;
+    } else if (!rt) {
+        return NECO_PERM; 
+    }
+    *chan = chan_fastmake(data_size, capacity, 0);
+    if (!*chan) {
+        return NECO_NOMEM;
+    }
+    return NECO_OK;
+}
+
+/// Creates a new channel for sharing messages with other coroutines.
+///
+/// **Example**
+///
+/// ```
+/// void coroutine(int argc, void *argv[]) {
+///     neco_chan *ch = argv[0];
+/// 
+///     // Send a message
+///     neco_chan_send(ch, &(int){ 1 });
+/// 
+///     // Release the channel
+///     neco_chan_release(ch);
+/// }
+/// 
+/// int neco_start(int argc, char *argv[]) {
+///     neco_chan *ch;
+///     neco_chan_make(&ch, sizeof(int), 0);
+///     
+///     // Retain a reference of the channel and provide it to a newly started
+///     // coroutine. 
+///     neco_chan_retain(ch);
+///     neco_start(coroutine, 1, ch);
+///     
+///     // Receive a message
+///     int msg;
+///     neco_chan_recv(ch, &msg);
+///     printf("%d\n", msg);      // prints '1'
+///     
+///     // Always release the channel when you are done
+///     neco_chan_release(ch);
+/// }
+/// ```
+///
+/// @param chan Channel
+/// @param data_size Data size of messages
+/// @param capacity Buffer capacity
+/// @return NECO_OK Success
+/// @return NECO_NOMEM The system lacked the necessary resources
+/// @return NECO_INVAL An invalid parameter was provided
+/// @return NECO_PERM Operation called outside of a coroutine
+/// @note The caller is responsible for freeing with neco_chan_release()
+/// @note data_size and capacity cannot be greater than INT_MAX
+int neco_chan_make(struct neco_chan **chan, size_t data_size, size_t capacity) {
+    int ret = chan_make(chan, data_size, capacity);
+    error_guard(ret);
+    return ret;
+}
+
+static int chan_make_shared(struct neco_chan **chan, size_t data_size, 
+    size_t capacity)
+{
+    int ret = chan_make(chan, data_size, capacity);
+    if (ret == NECO_OK) {
+        (*chan)->shared = true;
+    }
+    return ret;
+}
+
+/// Creates a new channel that coroutines of any thread may use, such as
+/// those running on a neco_pool.
+///
+/// It works like a channel from neco_chan_make(), and may be retained and
+/// released from any thread. A coroutine that waits on it is woken by
+/// coroutines of other threads through a pipe of its own runtime.
+///
+/// @param chan Channel
+/// @param data_size Data size of messages
+/// @param capacity Buffer capacity
+/// @return NECO_OK Success
+/// @return NECO_NOMEM The system lacked the necessary resources
+/// @return NECO_INVAL An invalid parameter was provided
+/// @return NECO_PERM Operation called outside of a coroutine
+/// @note The caller is responsible for freeing with neco_chan_release()
+/// @see Channels
+int neco_chan_make_shared(struct neco_chan **chan, size_t data_size, 
+    size_t capacity)
+{
+    int ret = chan_make_shared(chan, data_size, capacity);
+    error_guard(ret);
+    return ret;
+}
+
+static void chan_fastretain(struct neco_chan *chan) {
+   chan->rc++;
+}
+
+static int chan_retain(struct neco_chan *chan) {
+    if (!chan) {
+        return NECO_INVAL;
+    } else if (!rt || !chan_ours(chan)) {
+        return NECO_PERM;
+    } else if (chan->shared) {
+        xlock(&chan->lock);
+        chan_fastretain(chan);
+        xunlock(&chan->lock);
+        return NECO_OK;
+    }
+    chan_fastretain(chan);
+    return NECO_OK;
+}
+
+/// Retain a reference of the channel so it can be shared with other coroutines.
+///
+/// This is needed for avoiding use-after-free bugs.
+/// 
+/// See neco_chan_make() for an example.
+///
+/// @param chan The channel
+/// @return NECO_OK Success
+/// @return NECO_INVAL An invalid parameter was provided
+/// @return NECO_PERM Operation called outside of a coroutine
+/// @note The caller is responsible for releasing the reference with 
+///       neco_chan_release()
+/// @see Channels
+/// @see neco_chan_release()
+int neco_chan_retain(struct neco_chan *chan) {
+    int ret = chan_retain(chan);
+    error_guard(ret);
+    return ret;
+}
+
+static bool zchanpush(struct neco_chan *chan) {
+    if (rt->zchanpoollen == rt->zchanpoolcap) {
+        if (rt->zchanpoolcap == 256) {
+            return false;
+        }
+        int cap = rt->zchanpoolcap == 0 ? 16 : rt->zchanpoolcap * 2;
+        void *zchanpool2 = realloc0(rt->zchanpool, 
+            sizeof(struct neco_chan) * (size_t)cap);
+        if (!zchanpool2) {
+            return false;
+        }
+        rt->zchanpoolcap = cap;
+        rt->zchanpool = zchanpool2;
+    }
+    rt->zchanpool[rt->zchanpoollen++] = chan;
+    return true;
+}
+
+static void chan_fastrelease(struct neco_chan *chan) {
+    chan->rc--;
+    if (chan->rc < 0) {
+        if (!POOL_ENABLED || chan->msgsize > 0 || !zchanpush(chan)) {
+            free0(chan);
+        }
+    }
+}
+
+static int chan_release(struct neco_chan *chan) {
+    if (!chan) {
+        return NECO_INVAL;
+    } else if (!rt || !chan_ours(chan)) {
+        return NECO_PERM;
+    } else if (chan->shared) {
+        xlock(&chan->lock);
+        bool last = chan->rc == 0;
+        if (!last) {
+            chan->rc--;
+        }
+        xunlock(&chan->lock);
+        if (!last) {
+            return NECO_OK;
+        }
+        // No other references are left to race with.
+    }
+    chan_fastrelease(chan);
+    return NECO_OK;
+}
+
+/// Release a reference to a channel
+///
+/// See neco_chan_make() for an example.
+///
+/// @param chan The channel
+/// @return NECO_OK Success
+/// @return NECO_INVAL An invalid parameter was provided
+/// @return NECO_PERM Operation called outside of a coroutine
+/// @see Channels
+/// @see neco_chan_retain()
+int neco_chan_release(struct neco_chan *chan) {
+    int ret = chan_release(chan);
+    error_guard(ret);
+    return ret;
+}
+
+// Pops the receiver at the front of a shared channel's queue, which must be
+// a receiver queue, while holding its lock. Returns NULL for a select-case
+// that was already handled.
+static struct coroutine *chan_xtake(struct neco_chan *chan, bool ok) {
+    struct coroutine *recv = colist_pop_front(&chan->queue);
+    if (recv->kind == SELECTCASE) {
+        struct coselectcase *cocase = (struct coselectcase *)recv;
+        if (!select_claim(cocase)) {
+            return NULL;
+        }
+        recv = cocase->co;
+        recv->cmsg = cocase->data;
+        *cocase->ok = ok;
+    }
+    return recv;
+}
+
+// Same as chan_send0() for a shared channel, while holding its lock.
+static int chan_xsend0(struct neco_chan *chan, struct coroutine *co, 
+    void *data, bool broadcast, int64_t deadline)
+{
+    if (chan->sclosed) {
+        return NECO_CLOSED;
+    }
+    if (co->canceled && !broadcast) {
+        co->canceled = false;
+        return NECO_CANCELED;
+    }
+    METRIC_INC(chansends);
+    int sent = 0;
+    while (!colist_is_empty(&chan->queue) && chan->qrecv) {
+        struct coroutine *recv = chan_xtake(chan, true);
+        if (!recv) {
+            continue;
+        }
+        if (chan->msgsize > 0) {
+            memcpy(recv->cmsg, data, (size_t)chan->msgsize);
+        }
+        xwake(recv);
+        if (!broadcast) {
+            return NECO_OK;
+        }
+        sent++;
+    }
+    if (broadcast) {
+        return sent;
+    }
+    if (chan->buflen < chan->bufcap) {
+        cbuf_push(chan, data);
+        return NECO_OK;
+    }
+    colist_push_back(&chan->queue, co);
+    chan->qrecv = false;
+    co->cmsg = data;
+    rt->nsenders++;
+    METRIC_INC(chanwaits);
+    int ret = xwait(&chan->lock, co, deadline);
+    rt->nsenders--;
+    if (ret != NECO_OK) {
+        remove_from_list(co);
+    }
+    co->cmsg = NULL;
+    return ret;
+}
+
+static int chan_xsend(struct neco_chan *chan, void *data, bool broadcast, 
+    int64_t deadline)
+{
+    struct coroutine *co = coself();
+    xlock(&chan->lock);
+    int ret = chan_xsend0(chan, co, data, broadcast, deadline);
+    xunlock(&chan->lock);
+    xflush();
+    if (broadcast && ret != NECO_CLOSED) {
+        yield_for_sched_resume();
+    }
+    return ret;
+}
+
+static int chan_send0(struct neco_chan *chan, void *data, bool broadcast, 
+    int64_t deadline)
+{
+    if (!chan) {
+        return NECO_INVAL;
+    } else if (!rt || !chan_ours(chan)) {
+        return NECO_PERM;
+    } else if (chan->shared) {
+        return chan_xsend(chan, data, broadcast, deadline);
+    } else if (chan->sclosed) {
+        return NECO_CLOSED;
+    }
+    struct coroutine *co = coself();
+    if (co->canceled && !broadcast) {
+        co->canceled = false;
+        return NECO_CANCELED;
+    }
+    METRIC_INC(chansends);
+    int sent = 0;
+    while (!colist_is_empty(&chan->queue) && chan->qrecv) {
+        // A receiver is currently waiting for a message.
+        // Pop it from the queue.
+        struct coroutine *recv = colist_pop_front(&chan->queue);
+        if (recv->kind == SELECTCASE) {
+            // The receiver is a select-case. 
+            struct coselectcase *cocase = (struct coselectcase *)recv;
+            if (!select_claim(cocase)) {
+                // This select-case has already been handled
+                continue;
+            }
+            // The far stack index pointer is set. Exchange the select-case
+            // with the real coroutine.
+            recv = cocase->co;
+            recv->cmsg = cocase->data;
+            *cocase->ok = true;
+        }
+        // Directly copy the message to the receiver's 'data' argument.
+        if (chan->msgsize > 0) {
+            memcpy(recv->cmsg, data, (size_t)chan->msgsize);
+        }
+        if (!broadcast) {
+            // Resume receiver immediately.
+            sco_resume(recv->id);
+            return NECO_OK;
+        } else {
+            // Schedule the reciever.
+            sched_resume(recv);
+            sent++;
+        }
+    }
+    if (broadcast) {
+        yield_for_sched_resume();
+        return sent;
+    }
+
+    if (chan->buflen < chan->bufcap) {
+        // There room to write to the ring buffer. 
+        // Add this message and return immediately.
+        cbuf_push(chan, data);
+        return NECO_OK;
+    }
+
+    // Push this sender to queue
+    colist_push_back(&chan->queue, co);
+    chan->qrecv = false;
+    co->cmsg = data;
+
+    // Wait for a receiver to consume this message.
+    rt->nsenders++;
+    METRIC_INC(chanwaits);
+    copause(deadline);
+    rt->nsenders--;
+    remove_from_list(co);
+
+    co->cmsg = NULL;
+    return checkdl(co, INT64_MAX);
+}
+
+/// Same as neco_chan_send() but with a deadline parameter.
+int neco_chan_send_dl(neco_chan *chan, void *data, int64_t deadline) {
+    int ret = chan_send0(chan, data, false, deadline);
+    async_error_guard(ret);
+    return ret;
+}
+
+/// Send a message
+///
+/// See neco_chan_make() for an example.
+///
+/// @return NECO_OK Success
+/// @return NECO_PERM Operation called outside of a coroutine
+/// @return NECO_INVAL An invalid parameter was provided
+/// @return NECO_CANCELED Operation canceled
+/// @return NECO_CLOSED Channel closed
+/// @see Channels
+/// @see neco_chan_recv()
+int neco_chan_send(struct neco_chan *chan, void *data) {
+    return neco_chan_send_dl(chan, data, INT64_MAX);
+}
+
+/// Sends message to all receiving channels.
+/// @return The number of channels that received the message
+/// @return NECO_PERM Operation called outside of a coroutine
+/// @return NECO_INVAL An invalid parameter was provided
+/// @return NECO_CLOSED Channel closed
+/// @note This operation cannot be canceled and does not timeout
+/// @see Channels
+/// @see neco_chan_recv()
+int neco_chan_broadcast(struct neco_chan *chan, void *data) {
+    int ret = chan_send0(chan, data, true, INT64_MAX);
+    error_guard(ret);
+    return ret;
+}
+
+// Same as chan_tryrecv0() for a shared channel, while holding its lock.
+static int chan_xrecv0(struct neco_chan *chan, struct coroutine *co, 
+    void *data, bool try, int64_t deadline)
+{
+    if (chan->rclosed) {
+        return NECO_CLOSED;
+    }
+    if (co->canceled) {
+        co->canceled = false;
+        return NECO_CANCELED;
+    }
+    METRIC_INC(chanrecvs);
+    if (chan->buflen > 0 || (!colist_is_empty(&chan->queue) && !chan->qrecv)) {
+        struct coroutine *send = NULL;
+        if (chan->buflen > 0) {
+            cbuf_pop(chan, data);
+            if (!colist_is_empty(&chan->queue)) {
+                send = colist_pop_front(&chan->queue);
+                cbuf_push(chan, send->cmsg);
+            }
+        } else {
+            send = colist_pop_front(&chan->queue);
+            if (chan->msgsize) {
+                memcpy(data, send->cmsg, (size_t)chan->msgsize);
+            }
+        }
+        if (chan->sclosed && colist_is_empty(&chan->queue) && 
+            chan->buflen == 0)
+        {
+            chan->rclosed = true;
+        }
+        if (send) {
+            xwake(send);
+        }
+        return NECO_OK;
+    }
+    if (try) {
+        return NECO_EMPTY;
+    }
+    colist_push_back(&chan->queue, co);
+    chan->qrecv = true;
+    co->cmsg = data;
+    co->cclosed = false;
+    rt->nreceivers++;
+    METRIC_INC(chanwaits);
+    int ret = xwait(&chan->lock, co, deadline);
+    rt->nreceivers--;
+    co->cmsg = NULL;
+    if (ret != NECO_OK) {
+        remove_from_list(co);
+        return ret;
+    }
+    if (co->cclosed) {
+        if (chan->msgsize) {
+            memset(data, 0, (size_t)chan->msgsize);
+        }
+        co->cclosed = false;
+        return NECO_CLOSED;
+    }
+    return NECO_OK;
+}
+
+static int chan_xrecv(struct neco_chan *chan, void *data, bool try,
+    int64_t deadline)
+{
+    struct coroutine *co = coself();
+    xlock(&chan->lock);
+    int ret = chan_xrecv0(chan, co, data, try, deadline);
+    xunlock(&chan->lock);
+    xflush();
+    return ret;
+}
+
+static int chan_tryrecv0(struct neco_chan *chan, void *data, bool try,
+    int64_t deadline)
+{
+    if (!chan) {
+        return NECO_INVAL;
+    } else if (!rt || !chan_ours(chan)) {
+        return NECO_PERM;
+    } else if (chan->shared) {
+        return chan_xrecv(chan, data, try, deadline);
+    } else if (chan->rclosed) {
+        return NECO_CLOSED;
+    }
+    struct coroutine *co = coself();
+    if (co->canceled) {
+        co->canceled = false;
+        return NECO_CANCELED;
+    }
+    METRIC_INC(chanrecvs);
+    if (chan->buflen > 0) {
+        // Take from the buffer
+        cbuf_pop(chan, data);
+        struct coroutine *send = NULL;
+        if (!colist_is_empty(&chan->queue)) {
+            // There's a sender waiting to send a message.
+            // Put the sender's message in the buffer and wake it up.
+            send = colist_pop_front(&chan->queue);
+            cbuf_push(chan, send->cmsg);
+        }
+        if (chan->sclosed && colist_is_empty(&chan->queue) && 
+            chan->buflen == 0)
+        {
+            // The channel was closed and there are no more messages.
+            // Close the receiving side too
+            chan->rclosed = true;
+        }
+        if (send) {
+            sco_resume(send->id);
+        }
+        return NECO_OK;
+    }
+
+    if (!colist_is_empty(&chan->queue) && !chan->qrecv) {
+        // A sender is currently waiting to send a message.
+        // This message must be consumed immediately.
+        struct coroutine *send = colist_pop_front(&chan->queue);
+        if (chan->msgsize) {
+            memcpy(data, send->cmsg, (size_t)chan->msgsize);
+        }
+        if (chan->sclosed && colist_is_empty(&chan->queue) && 
+            chan->buflen == 0)
+        {
+            // The channel was closed and there are no more messages.
+            // Now close the receiving side too.
+            chan->rclosed = true;
+        }
+        sco_resume(send->id);
+        return NECO_OK;
+    }
+    if (try) {
+        return NECO_EMPTY;
+    }
+    // Push the receiver to the queue. 
+    colist_push_back(&chan->queue, co);
+    chan->qrecv = true;
+    // Assign the 'cmsg' message slot so that the sender knows where to copy
+    // the message.
+    co->cmsg = data;
+    // Set the channel closed flag that *may* be changed by the sender.
+    co->cclosed = false;
+    // Wait for a sender.
+    rt->nreceivers++;
+    METRIC_INC(chanwaits);
+    copause(deadline);
+    rt->nreceivers--;
+    remove_from_list(co);
+    // The sender has already copied its message to 'data'.
+    co->cmsg = NULL;
+    int ret = checkdl(co, INT64_MAX);
+    if (ret != NECO_OK) {
+        return ret;
+    }
+    if (co->cclosed) {
+        // The channel was closed for receiving while this coroutine was
+        // waiting on a new message.
+        if (chan->msgsize) {
+            memset(data, 0, (size_t)chan->msgsize);
+        }
+        co->cclosed = false;
+        return NECO_CLOSED;
+    } else {
+        return NECO_OK;
+    }
+}
+
+/// Same as neco_chan_recv() but with a deadline parameter.
+int neco_chan_recv_dl(struct neco_chan *chan, void *data, int64_t deadline) {
+    int ret = chan_tryrecv0(chan, data, false, deadline);
+    async_error_guard(ret);
+    return ret;
+}
+
+/// Receive a message
+///
+/// See neco_chan_make() for an example.
+///
+/// @param chan channel
+/// @param data data pointer
+/// @return NECO_OK Success
+/// @return NECO_PERM Operation called outside of a coroutine
+/// @return NECO_INVAL An invalid parameter was provided
+/// @return NECO_CANCELED Operation canceled
+/// @return NECO_CLOSED Channel closed
+/// @see Channels
+/// @see neco_chan_send()
+int neco_chan_recv(struct neco_chan *chan, void *data) {
+    return neco_chan_recv_dl(chan, data, INT64_MAX);
+}
+
+/// Receive a message, but do not wait if the message is not available.
+/// @param chan channel
+/// @param data data pointer
+/// @return NECO_OK Success
+/// @return NECO_EMPTY No message available
+/// @return NECO_CLOSED Channel closed
+/// @return NECO_PERM Operation called outside of a coroutine
+/// @return NECO_INVAL An invalid parameter was provided
+/// @see Channels
+/// @see neco_chan_recv()
+int neco_chan_tryrecv(struct neco_chan *chan, void *data) {
+    int ret = chan_tryrecv0(chan, data, true, INT64_MAX);
+    async_error_guard(ret);
+    return ret;
+}
+
+// Same as chan_sendv0() for a shared channel.
+static int chan_xsendv(struct neco_chan *chan, void *data, int count,
+    int64_t deadline)
+{
+    struct coroutine *co = coself();
+    char *msgs = data;
+    size_t size = (size_t)chan->msgsize;
+    int sent = 0;
+    int ret = NECO_OK;
+    xlock(&chan->lock);
+    if (chan->sclosed) {
+        ret = NECO_CLOSED;
+    } else if (co->canceled) {
+        co->canceled = false;
+        ret = NECO_CANCELED;
+    }
+    while (ret == NECO_OK && sent < count) {
+        while (sent < count && !colist_is_empty(&chan->queue) && chan->qrecv) {
+            struct coroutine *recv = chan_xtake(chan, true);
+            if (!recv) {
+                continue;
+            }
+            if (size > 0) {
+                memcpy(recv->cmsg, msgs + size * (size_t)sent, size);
+            }
+            xwake(recv);
+            sent++;
+        }
+        int n = count - sent;
+        if (n > chan->bufcap - chan->buflen) {
+            n = chan->bufcap - chan->buflen;
+        }
+        if (n > 0) {
+            cbuf_pushn(chan, msgs + size * (size_t)sent, n);
+            sent += n;
+        }
+        if (sent == count) {
+            break;
+        }
+        ret = chan_xsend0(chan, co, msgs + size * (size_t)sent, false, 
+            deadline);
+        if (ret == NECO_OK) {
+            sent++;
+        }
+    }
+    xunlock(&chan->lock);
+    xflush();
+    if (ret != NECO_OK) {
+        if (sent == 0) {
+            return ret;
+        }
+        co->canceled = ret == NECO_CANCELED;
+    }
+    return sent;
+}
+
+static int chan_sendv0(struct neco_chan *chan, void *data, int count,
+    int64_t deadline)
+{
+    if (!chan || count < 0 || (count > 0 && !data && chan->msgsize > 0)) {
+        return NECO_INVAL;
+    } else if (!rt || !chan_ours(chan)) {
+        return NECO_PERM;
+    } else if (chan->shared) {
+        return chan_xsendv(chan, data, count, deadline);
+    } else if (chan->sclosed) {
+        return NECO_CLOSED;
+    }
+    struct coroutine *co = coself();
+    if (co->canceled) {
+        co->canceled = false;
+        return NECO_CANCELED;
+    }
+    char *msgs = data;
+    size_t size = (size_t)chan->msgsize;
+    int sent = 0;
+    while (sent < count) {
+        // Hand messages directly to the waiting receivers. They are woken
+        // as a batch once this coroutine pauses or yields.
+        while (sent < count && !colist_is_empty(&chan->queue) && chan->qrecv) {
+            struct coroutine *recv = colist_pop_front(&chan->queue);
+            if (recv->kind == SELECTCASE) {
+                struct coselectcase *cocase = (struct coselectcase *)recv;
+                if (!select_claim(cocase)) {
+                    continue;
+                }
+                recv = cocase->co;
+                recv->cmsg = cocase->data;
+                *cocase->ok = true;
+            }
+            if (size > 0) {
+                memcpy(recv->cmsg, msgs + size * (size_t)sent, size);
+            }
+            sched_resume(recv);
+            sent++;
+        }
+        // Then fill the ring buffer with as many as will fit.
+        int n = count - sent;
+        if (n > chan->bufcap - chan->buflen) {
+            n = chan->bufcap - chan->buflen;
+        }
+        if (n > 0) {
+            cbuf_pushn(chan, msgs + size * (size_t)sent, n);
+            sent += n;
+        }
+        if (sent == count) {
+            break;
+        }
+        // Full. Wait for a receiver with the next message.
+        int ret = chan_send0(chan, msgs + size * (size_t)sent, false, deadline);
+        if (ret != NECO_OK) {
+            if (sent == 0) {
+                return ret;
+            }
+            // Report what was sent, and leave the cancel for the next
+            // operation.
+            co->canceled = ret == NECO_CANCELED;
+            return sent;
+        }
+        sent++;
+    }
+    return sent;
+}
+
+/// Same as neco_chan_sendv() but with a deadline parameter.
+int neco_chan_sendv_dl(neco_chan *chan, void *data, int count, 
+    int64_t deadline)
+{
+    int ret = chan_sendv0(chan, data, count, deadline);
+    async_error_guard(ret);
+    return ret;
+}
+
+/// Send many messages.
+///
+/// The count messages are read one after another from data. Messages are
+/// handed to waiting receivers, which are woken together, and then copied
+/// into the channel buffer in bulk. The call only waits when the buffer is
+/// full, and goes back to bulk copying each time a receiver makes room.
+///
+/// @param chan channel
+/// @param data array of count messages
+/// @param count number of messages
+/// @return The number of messages sent, which is less than count only when
+///         the deadline elapsed, the operation was canceled, or the channel
+///         was closed after some were sent
+/// @return NECO_PERM Operation called outside of a coroutine
+/// @return NECO_INVAL An invalid parameter was provided
+/// @return NECO_CANCELED Operation canceled
+/// @return NECO_CLOSED Channel closed
+/// @see Channels
+/// @see neco_chan_recvv()
+int neco_chan_sendv(neco_chan *chan, void *data, int count) {
+    return neco_chan_sendv_dl(chan, data, count, INT64_MAX);
+}
+
+// Same as chan_recvv0() for a shared channel.
+static int chan_xrecvv(struct neco_chan *chan, void *data, int count, 
+    int64_t deadline)
+{
+    struct coroutine *co = coself();
+    xlock(&chan->lock);
+    int ret = chan_xrecv0(chan, co, data, false, deadline);
+    char *msgs = data;
+    size_t size = (size_t)chan->msgsize;
+    int recvd = 1;
+    while (ret == NECO_OK && recvd < count) {
+        if (chan->buflen > 0) {
+            int n = count - recvd;
+            n = n < chan->buflen ? n : chan->buflen;
+            cbuf_popn(chan, msgs + size * (size_t)recvd, n);
+            recvd += n;
+            while (chan->buflen < chan->bufcap && 
+                !colist_is_empty(&chan->queue) && !chan->qrecv)
+            {
+                struct coroutine *send = colist_pop_front(&chan->queue);
+                cbuf_push(chan, send->cmsg);
+                xwake(send);
+            }
+        } else if (!colist_is_empty(&chan->queue) && !chan->qrecv) {
+            struct coroutine *send = colist_pop_front(&chan->queue);
+            if (size > 0) {
+                memcpy(msgs + size * (size_t)recvd, send->cmsg, size);
+            }
+            recvd++;
+            xwake(send);
+        } else {
+            break;
+        }
+    }
+    if (ret == NECO_OK && chan->sclosed && colist_is_empty(&chan->queue) && 
+        chan->buflen == 0)
+    {
+        chan->rclosed = true;
+    }
+    xunlock(&chan->lock);
+    xflush();
+    return ret == NECO_OK ? recvd : ret;
+}
+
+static int chan_recvv0(struct neco_chan *chan, void *data, int count, 
+    int64_t deadline)
+{
+    if (!chan || count < 0 || (count > 0 && !data && chan->msgsize > 0)) {
+        return NECO_INVAL;
+    } else if (!rt || !chan_ours(chan)) {
+        return NECO_PERM;
+    } else if (count == 0) {
+        return 0;
+    } else if (chan->shared) {
+        return chan_xrecvv(chan, data, count, deadline);
+    }
+    // Wait for the first message like any other receive.
+    int ret = chan_tryrecv0(chan, data, false, deadline);
+    if (ret != NECO_OK) {
+        return ret;
+    }
+    char *msgs = data;
+    size_t size = (size_t)chan->msgsize;
+    int recvd = 1;
+    while (recvd < count) {
+        if (chan->buflen > 0) {
+            int n = count - recvd;
+            n = n < chan->buflen ? n : chan->buflen;
+            cbuf_popn(chan, msgs + size * (size_t)recvd, n);
+            recvd += n;
+            // Move the messages of waiting senders into the freed slots.
+            while (chan->buflen < chan->bufcap && 
+                !colist_is_empty(&chan->queue) && !chan->qrecv)
+            {
+                struct coroutine *send = colist_pop_front(&chan->queue);
+                cbuf_push(chan, send->cmsg);
+                sched_resume(send);
+            }
+        } else if (!colist_is_empty(&chan->queue) && !chan->qrecv) {
+            struct coroutine *send = colist_pop_front(&chan->queue);
+            if (size > 0) {
+                memcpy(msgs + size * (size_t)recvd, send->cmsg, size);
+            }
+            recvd++;
+            sched_resume(send);
+        } else {
+            break;
+        }
+    }
+    if (chan->sclosed && colist_is_empty(&chan->queue) && chan->buflen == 0) {
+        chan->rclosed = true;
+    }
+    return recvd;
+}
+
+/// Same as neco_chan_recvv() but with a deadline parameter.
+int neco_chan_recvv_dl(neco_chan *chan, void *data, int count, 
+    int64_t deadline)
+{
+    int ret = chan_recvv0(chan, data, count, deadline);
+    async_error_guard(ret);
+    return ret;
+}
+
+/// Receive many messages.
+///
+/// Waits for at least one message, then takes up to count messages that are
+/// available without waiting, from the channel buffer and from waiting
+/// senders, which are woken together.
+///
+/// @param chan channel
+/// @param data array with room for count messages
+/// @param count maximum number of messages
+/// @return The number of messages received
+/// @return NECO_PERM Operation called outside of a coroutine
+/// @return NECO_INVAL An invalid parameter was provided
+/// @return NECO_CANCELED Operation canceled
+/// @return NECO_CLOSED Channel closed
+/// @see Channels
+/// @see neco_chan_sendv()
+int neco_chan_recvv(neco_chan *chan, void *data, int count) {
+    return neco_chan_recvv_dl(chan, data, count, INT64_MAX);
+}
+
+// Same as chan_close() for a shared channel.
+static int chan_xclose(struct neco_chan *chan) {
+    xlock(&chan->lock);
+    if (chan->sclosed) {
+        xunlock(&chan->lock);
+        return NECO_CLOSED;
+    }
+    chan->sclosed = true;
+    if (chan->buflen > 0 || (!colist_is_empty(&chan->queue) && !chan->qrecv)) {
+        xunlock(&chan->lock);
+        return NECO_OK;
+    }
+    while (!colist_is_empty(&chan->queue)) {
+        struct coroutine *recv = chan_xtake(chan, false);
+        if (recv) {
+            recv->cclosed = true;
+            xwake(recv);
+        }
+    }
+    chan->rclosed = true;
+    chan->qrecv = false;
+    xunlock(&chan->lock);
+    xflush();
+    yield_for_sched_resume();
+    return NECO_OK;
+}
+
+static int chan_close(struct neco_chan *chan) {
+    if (!chan) {
+        return NECO_INVAL;
+    } else if (!rt || !chan_ours(chan)) {
+        return NECO_PERM;
+    } else if (chan->shared) {
+        return chan_xclose(chan);
+    } else if (chan->sclosed) {
+        return NECO_CLOSED;
+    }
+    chan->sclosed = true;
+    if (chan->buflen > 0 || (!colist_is_empty(&chan->queue) && !chan->qrecv)) {
+        // There are currently messages in the buffer or senders still waiting
+        // to send messages. Do not close the receiver side yet.
+        return NECO_OK;
+    }
+    // No buffered messages or senders waiting. 
+    // Close the receiver side and wake up all receivers.
+    while (!colist_is_empty(&chan->queue)) {
+        struct coroutine *recv = colist_pop_front(&chan->queue);
+        if (recv->kind == SELECTCASE) {
+            // The receiver is a select-case. 
+            struct coselectcase *cocase = (struct coselectcase *)recv;
+            if (!select_claim(cocase)) {
+                // This select-case has already been handled
+                continue;
+            }
+            // The far stack index pointer is set. Exchange the select-case
+            // with the real coroutine.
+            recv = cocase->co;
+            *cocase->ok = false;
+        }
+        recv->cclosed = true;
+        sched_resume(recv);
+    }
+    chan->rclosed = true;
+    chan->qrecv = false;
+    yield_for_sched_resume();
+    return NECO_OK;
+}
+
+/// Close a channel for sending.
+/// @param chan channel
+/// @return NECO_OK Success
+/// @return NECO_PERM Operation called outside of a coroutine
+/// @return NECO_INVAL An invalid parameter was provided
+/// @return NECO_CLOSED Channel already closed
+int neco_chan_close(struct neco_chan *chan) {
+    int ret = chan_close(chan);
+    error_guard(ret);
+    return ret;
+}
+
+// Removes the first n select-cases from their channel queues.
+static void select_xremove(int n, struct coselectcase *cases) {
+    for (int i = 0; i < n; i++) {
+        struct neco_chan *chan = cases[i].chan;
+        if (chan->shared) {
+            xlock(&chan->lock);
+        }
+        remove_from_list((struct coroutine*)&cases[i]);
+        if (chan->shared) {
+            xunlock(&chan->lock);
+        }
+    }
+}
+
+// Same as chan_select() when some of the channels are shared.
+// Each case is queued on its channel while holding the channel's lock, which
+// is also when the channel is checked for messages. Messages from shared
+// channels go to the coroutine's xcase buffer rather than to the channel, as
+// other coroutines may select on the same channel at once.
+static int chan_xselect(int ncases, struct coselectcase *cases, 
+    atomic_int *ret_idx, int64_t deadline, bool try)
+{
+    struct coroutine *co = coself();
+    if (co->canceled) {
+        co->canceled = false;
+        return NECO_CANCELED;
+    }
+    size_t size = 0;
+    for (int i = 0; i < ncases; i++) {
+        if (cases[i].chan->shared && (size_t)cases[i].chan->msgsize > size) {
+            size = (size_t)cases[i].chan->msgsize;
+        }
+    }
+    if (size > co->xcasecap) {
+        char *xcase = realloc0(co->xcase, size);
+        if (!xcase) {
+            return NECO_NOMEM;
+        }
+        co->xcase = xcase;
+        co->xcasecap = size;
+    }
+    co->xcasechan = NULL;
+    co->xrt = rt;
+    atomic_store(&co->xstate, XWAITING);
+
+    // Queue the cases until a channel has a message or is closed.
+    int nqueued = 0;
+    for (; nqueued < ncases; nqueued++) {
+        struct coselectcase *cocase = &cases[nqueued];
+        struct neco_chan *chan = cocase->chan;
+        if (chan->shared) {
+            cocase->data = co->xcase;
+            cocase->ok = &co->xcaseok;
+            xlock(&chan->lock);
+        }
+        if ((!colist_is_empty(&chan->queue) && !chan->qrecv) || 
+            chan->buflen > 0 || chan->rclosed)
+        {
+            break;
+        }
+        if (!try) {
+            colist_push_back(&chan->queue, (struct coroutine*)cocase);
+            chan->qrecv = true;
+        }
+        if (chan->shared) {
+            xunlock(&chan->lock);
+        }
+    }
+    if (nqueued < ncases) {
+        // Receive from the ready channel, unless a waker claimed one of the
+        // queued cases in the meantime.
+        struct coselectcase *cocase = &cases[nqueued];
+        struct neco_chan *chan = cocase->chan;
+        bool claimed = select_claim(cocase);
+        int ret = NECO_OK;
+        if (claimed && chan->shared) {
+            ret = chan_xrecv0(chan, co, cocase->data, true, INT64_MAX);
+        }
+        if (chan->shared) {
+            xunlock(&chan->lock);
+            xflush();
+        } else if (claimed) {
+            ret = chan_tryrecv0(chan, cocase->data, true, INT64_MAX);
+        }
+        if (claimed) {
+            *cocase->ok = ret == NECO_OK;
+            select_xremove(try ? 0 : nqueued, cases);
+            atomic_store(&co->xstate, XIDLE);
+            co->xcasechan = chan->shared ? chan : NULL;
+            return nqueued;
+        }
+    } else if (try) {
+        atomic_store(&co->xstate, XIDLE);
+        return NECO_EMPTY;
+    }
+
+    // Wait for a sender to claim a case and wake us up.
+    rt->nreceivers++;
+    METRIC_INC(chanwaits);
+    int ret = xenter();
+    while (ret == NECO_OK && atomic_load(ret_idx) == -1) {
+        copause(deadline);
+        ret = checkdl(co, INT64_MAX);
+    }
+    rt->nreceivers--;
+    int idx = -1;
+    bool woken = !atomic_compare_exchange_strong(ret_idx, &idx, -2);
+
+    // Once every case is out of its queue, no waker still refers to them.
+    select_xremove(nqueued, cases);
+    xleave(co);
+    if (!woken) {
+        return ret;
+    }
+    if (ret == NECO_CANCELED) {
+        co->canceled = true;
+    }
+    co->xcasechan = cases[idx].chan->shared ? cases[idx].chan : NULL;
+    return idx;
+}
+
+static int chan_select(int ncases, struct coselectcase *cases, 
+    atomic_int *ret_idx, int64_t deadline, bool try)
+{
+    // Check that the channels are valid before continuing.
+    bool shared = false;
+    for (int i = 0; i < ncases; i++) {
+        struct neco_chan *chan = cases[i].chan;
+        if (!chan) {
+            return NECO_INVAL;
+        } else if (!chan_ours(chan)) {
+            return NECO_PERM;
+        }
+        shared = shared || chan->shared;
+    }
+    if (shared) {
+        return chan_xselect(ncases, cases, ret_idx, deadline, try);
+    }
+
+    struct coroutine *co = coself();
+
+    if (co->canceled) {
+        co->canceled = false;
+        return NECO_CANCELED;
+    }
+
+    // Scan each channel and see if there are any messages waiting in their
+    // queue or if any are closed. 
+    // If so then receive that channel immediately.
+    for (int i = 0; i < ncases; i++) {
+        struct neco_chan *chan = cases[i].chan;
+        if ((!colist_is_empty(&chan->queue) && !chan->qrecv) || 
+            chan->buflen > 0 || chan->rclosed)
+        {
+            int ret = neco_chan_recv(cases[i].chan, cases[i].data);
+            *cases[i].ok = ret == NECO_OK;
+            return i;
+        }
+    }
+
+    if (try) {
+        return NECO_EMPTY;
+    }
+
+    // Push all cases into their repsective channel queue.
+    for (int i = 0; i < ncases; i++) {
+        colist_push_back(&cases[i].chan->queue, (struct coroutine*)&cases[i]);
+        cases[i].chan->qrecv = true;
+    }
+
+    // Wait for a sender to wake us up
+    rt->nreceivers++;
+    METRIC_INC(chanwaits);
+    copause(deadline);
+    rt->nreceivers--;
+
+    // Remove all cases
+    for (int i = 0; i < ncases; i++) {
+        remove_from_list((struct coroutine*)&cases[i]);
+    }
+    int ret = checkdl(co, INT64_MAX);
+    return ret == NECO_OK ? *ret_idx : ret;
+}
+
+static int chan_selectv_dl(int ncases, va_list *args, struct neco_chan **chans, 
+    int64_t deadline, bool try)
+{
+    if (ncases < 0) {
+        return NECO_INVAL;
+    } else if (!rt) {
+        return NECO_PERM;
+    }
+
+    // Allocate space for storing each select-case struct. 
+    // These are used in place of a coroutine for the channel receiver queues.
+    bool must_free;
+    struct coselectcase stack_cases[8];
+    struct coselectcase *cases;
+    if (ncases > 8) {
+        cases = malloc0((size_t)ncases * sizeof(struct coselectcase));
+        if (!cases) {
+            return NECO_NOMEM;
+        }
+        must_free = true;
+    } else {
+        cases = stack_cases;
+        must_free = false;
+    }
+    struct coroutine *co = coself();
+    atomic_int ret_idx = -1;
+
+    // Copy the select-case arguments into the array.
+    for (int i = 0; i < ncases; i++) {
+        struct neco_chan *chan;
+        chan = args ? va_arg(*args, struct neco_chan*) : chans[i];
+        cases[i] = (struct coselectcase){
+            .chan = chan,
+            .kind = SELECTCASE,
+            .idx = i,
+            .ret_idx = &ret_idx,
+            .co = co,
+            .data = chan ? cbufslot(chan, chan->bufcap) : 0,
+            .ok = chan ? &chan->lok : 0,
+        };
+        cases[i].next = (struct coroutine*)&cases[i];
+        cases[i].prev = (struct coroutine*)&cases[i];
+    }
+    int ret = chan_select(ncases, cases, &ret_idx, deadline, try);
+    if (must_free) {
+        free0(cases);
+    }
+    return ret;
+}
+
+/// Same as neco_chan_selectv() but with a deadline parameter.
+int neco_chan_selectv_dl(int nchans, struct neco_chan *chans[],
+    int64_t deadline)
+{
+    int ret = chan_selectv_dl(nchans, 0, chans, deadline, false);
+    async_error_guard(ret);
+    return ret;
+}
+
+/// Same as neco_chan_select() but using an array for arguments.
+int neco_chan_selectv(int nchans, struct neco_chan *chans[]) {
+    return neco_chan_selectv_dl(nchans, chans, INT64_MAX);
+}
+
+/// Same as neco_chan_select() but with a deadline parameter.
+int neco_chan_select_dl(int64_t deadline, int nchans, ...) {
+    va_list args;
+    va_start(args, nchans);
+    int ret = chan_selectv_dl(nchans, &args, 0, deadline, false);
+    va_end(args);
+    async_error_guard(ret);
+    return ret;
+}
+
+/// Wait on multiple channel operations at the same time. 
+///
+/// **Example**
+///
+/// ```
+/// 
+/// // Let's say we have two channels 'c1' and 'c2' that both transmit 'char *'
+/// // messages.
+///
+/// // Use neco_chan_select() to wait on both channels.
+///
+/// char *msg;
+/// int idx = neco_chan_select(2, c1, c2);
+/// switch (idx) {
+/// case 0:
+///     neco_chan_case(c1, &msg);
+///     break;
+/// case 1:
+///     neco_chan_case(c2, &msg);
+///     break;
+/// default:
+///     // Error occured. The return value 'idx' is the error
+/// }
+///
+/// printf("%s\n", msg);
+/// ```
+///
+/// @param nchans Number of channels 
+/// @param ... The channels 
+/// @return The index of channel with an available message
+/// @return NECO_PERM Operation called outside of a coroutine
+/// @return NECO_INVAL An invalid parameter was provided
+/// @return NECO_NOMEM The system lacked the necessary resources
+/// @return NECO_CANCELED Operation canceled
+/// @see Channels
+int neco_chan_select(int nchans, ...) {
+    va_list args;
+    va_start(args, nchans);
+    int ret = chan_selectv_dl(nchans, &args, 0, INT64_MAX, false);
+    va_end(args);
+    async_error_guard(ret);
+    return ret;
+}
+
+/// Same as neco_chan_select() but does not wait if a message is not available
+/// @return NECO_EMPTY No message available
+/// @see Channels
+/// @see neco_chan_select()
+int neco_chan_tryselect(int nchans, ...) {
+    va_list args;
+    va_start(args, nchans);
+    int ret = chan_selectv_dl(nchans, &args, 0, INT64_MAX, true);
+    va_end(args);
+    async_error_guard(ret);
+    return ret;
+}
+
+/// Same as neco_chan_tryselect() but uses an array for arguments.
+int neco_chan_tryselectv(int nchans, struct neco_chan *chans[]) {
+    int ret = chan_selectv_dl(nchans, 0, chans, 0, true);
+    async_error_guard(ret);
+    return ret;
+}
+
+static int chan_case(struct neco_chan *chan, void *data) {
+    if (!chan) {
+        return NECO_INVAL;
+    } else if (!rt || !chan_ours(chan)) {
+        return NECO_PERM;
+    } else if (chan->shared) {
+        // The message went to the coroutine that selected it.
+        struct coroutine *co = coself();
+        if (co->xcasechan != chan || !co->xcaseok) {
+            return NECO_CLOSED;
+        }
+        if (chan->msgsize) {
+            memcpy(data, co->xcase, (size_t)chan->msgsize);
+        }
+        return NECO_OK;
+    } else if (!chan->lok) {
+        return NECO_CLOSED;
+    }
+    if (chan->msgsize) {
+        memcpy(data, cbufslot(chan, chan->bufcap), (size_t)chan->msgsize);
+    }
+    return NECO_OK;
+}
+
+/// Receive the message after a successful neco_chan_select().
+/// See neco_chan_select() for an example.
+/// @param chan The channel
+/// @param data The data
+/// @return NECO_OK Success
+/// @return NECO_PERM Operation called outside of a coroutine
+/// @return NECO_INVAL An invalid parameter was provided
+/// @return NECO_CLOSED Channel closed
+int neco_chan_case(struct neco_chan *chan, void *data) {
+    int ret = chan_case(chan, data);
+    error_guard(ret);
+    return ret;
+}
+
+struct getaddrinfo_args {
+    atomic_int returned;
+    char *node;
+    char *service;
+    struct addrinfo *hints;
+    struct addrinfo *res;
+    int fds[2];
+    int ret;
+    int errnum;
+#ifdef __FreeBSD__
+    void *dlhandle;
+#endif
+};
+
+static void gai_args_free(struct getaddrinfo_args *args) {
+    if (args) {
+        free0(args->service);
+        free0(args->node);
+        free0(args->hints);
+        freeaddrinfo(args->res);
+        if (args->fds[0]) {
+            must(close(args->fds[0]) == 0);
+        }
+        if (args->fds[1]) {
+            must(close(args->fds[1]) == 0);
+        }
+#ifdef __FreeBSD__
+        if (args->dlhandle) {
+            dlclose(args->dlhandle);
+        }
+#endif
+        free0(args);
+    }
+}
+
+static struct getaddrinfo_args *gai_args_new(const char *node, 
+    const char *service, const struct addrinfo *hints)
+{
+    struct getaddrinfo_args *args = malloc0(sizeof(struct getaddrinfo_args));
+    if (!args) {
+        return NULL;
+    }
+    memset(args, 0, sizeof(struct getaddrinfo_args));
+    if (node) {
+        size_t nnode = strlen(node);
+        args->node = malloc0(nnode+1);
+        if (!args->node) {
+            gai_args_free(args);
+            return NULL;
+        }
+        memcpy(args->node, node, nnode+1);
+    }
+    if (service) {
+        size_t nservice = strlen(service);
+        args->service = malloc0(nservice+1);
+        if (!args->service) {
+            gai_args_free(args);
+            return NULL;
+        }
+        memcpy(args->service, service, nservice+1);
+    }
+    if (hints) {
+        args->hints = malloc0(sizeof(struct addrinfo));
+        if (!args->hints) {
+            gai_args_free(args);
+            return NULL;
+        }
+        memset(args->hints, 0, sizeof(struct addrinfo));
+        args->hints->ai_flags = hints->ai_flags;
+        args->hints->ai_family = hints->ai_family;
+        args->hints->ai_socktype = hints->ai_socktype;
+        args->hints->ai_protocol = hints->ai_protocol;
+        args->hints->ai_next = NULL;
+    }
+    return args;
+}
+
+static atomic_int getaddrinfo_th_counter = 0;
+
+#ifdef NECO_TESTING
+int neco_getaddrinfo_nthreads(void) {
+    return atomic_load(&getaddrinfo_th_counter);
+}
+#endif
+
+static void *getaddrinfo_th(void *v) {
+    struct getaddrinfo_args *a = v;
+    a->ret = getaddrinfo(a->node, a->service, a->hints, &a->res);
+    a->errnum = errno;
+    must(write(a->fds[1], &(int){1}, sizeof(int)) == sizeof(int));
+    while (!atomic_load(&a->returned)) {
+        sched_yield();
+    }
+    gai_args_free(a);
+    atomic_fetch_sub(&getaddrinfo_th_counter, 1);
+    return NULL;
+}
+
+static bool is_ip_address(const char *addr) {
+    bool ok = false;
+    if (addr) {
+        struct in6_addr result;
+        ok = inet_pton(AF_INET, addr, &result) == 1 || 
+             inet_pton(AF_INET6, addr, &result) == 1;
+    }
+    return ok;
+}
+
+static void cleanup_gai(void *ptr) {
+    // This notifies the gai thread that it should return. The thread itself
+    // will do the actual cleanup of resources.
+    struct getaddrinfo_args *args = ptr;
+    atomic_store(&args->returned, 1);
+}
+
+#ifdef _WIN32
+int pipe1(int fds[2]) {
+    return _pipe(fds, 64, _O_BINARY);
+}
+#else
+#define pipe1 pipe0
+#endif
+
+// Looks up the address in a background thread, waiting on a local pipe.
+static int getaddrinfo_th_dl(const char *node, const char *service,
+    const struct addrinfo *hints, struct addrinfo **res, int64_t deadline)
+{
+    int ret;
+    struct getaddrinfo_args *args = gai_args_new(node, service, hints);
+    if (!args) {
+        return EAI_MEMORY;
+    }
+
+    // Create a pipe to communicate with the thread. This allows us to use the
+    // async neco_read() operation, which includes builtin deadline and cancel
+    // support. Using a traditional pthread mutexes or cond variables are not
+    // an option.
+    if (pipe1(args->fds) == -1) {
+        gai_args_free(args);
+        return EAI_SYSTEM;
+    }
+#ifndef _WIN32
+    if (neco_setnonblock(args->fds[0], true, 0) == -1) {
+        gai_args_free(args);
+        return EAI_SYSTEM;
+    }
+#endif
+
+    pthread_t th;
+#ifdef __FreeBSD__
+    // The pthread functions are not included in libc for FreeBSD, dynamically
+    // load the function instead.
+    int (*pthread_create)(pthread_t*,const pthread_attr_t*,void*(*)(void*),
+        void*);
+    int (*pthread_detach)(pthread_t);
+    args->dlhandle = dlopen("/usr/lib/libpthread.so", RTLD_LAZY);
+    if (!args->dlhandle) {
+        gai_args_free(args);
+        return EAI_SYSTEM;
+    }
+    pthread_create = (int(*)(pthread_t*,const pthread_attr_t*,void*(*)(void*),
+        void*))dlsym(args->dlhandle, "pthread_create");
+    pthread_detach = (int(*)(pthread_t))
+        dlsym(args->dlhandle, "pthread_detach");
+    if (!pthread_create || !pthread_detach) {
+        gai_args_free(args);
+        return EAI_SYSTEM;
+    }
+#endif
+    atomic_fetch_add(&getaddrinfo_th_counter, 1);
+    ret = pthread_create0(&th, 0, getaddrinfo_th, args);
+    if (ret != 0) {
+        errno = ret;
+        gai_args_free(args);
+        atomic_fetch_sub(&getaddrinfo_th_counter, 1);
+        return EAI_SYSTEM;
+    }
+    must(pthread_detach0(th) == 0);
+
+    // At this point the args are owned by the thread and all cleanup will
+    // happen there. The thread will complete the getaddrinfo operation.
+    // Then we'll steal the result and return it to the caller.
+    neco_cleanup_push(cleanup_gai, args);
+    int ready = 0;
+    ssize_t n = neco_read_dl(args->fds[0], &ready, sizeof(int), deadline);
+    ret = EAI_SYSTEM;
+    if (n != -1) {
+        must(ready == 1 && n == sizeof(int));
+        *res = args->res;
+        args->res = NULL;
+        ret = args->ret;
+        errno = args->errnum;
+        coyield();
+    }
+    neco_cleanup_pop(1);
+    return ret;
+}
+
+#ifndef NECO_NODNSCACHE
+////////////////////////////////////////////////////////////////////////////////
+// dns cache
+//
+// Host name lookups are cached per runtime for NECO_DNSTTL seconds. Lookups
+// of the same name that arrive while one is in flight wait for it and share
+// its result, instead of each occupying a thread with its own query. The libc
+// resolver does not report the record TTLs, so NECO_DNSTTL is used for all of
+// them and should be kept below the shortest TTL that matters. Failures are
+// shared with the waiters but are never cached.
+////////////////////////////////////////////////////////////////////////////////
+
+struct dns_entry {
+    struct dns_entry *prev;
+    struct dns_entry *next;
+    uint64_t hash;
+    char *node;
+    char *service;            // NULL when not provided
+    struct addrinfo hints;    // only flags, family, socktype and protocol
+    int refs;                 // the table, the lookup and each waiter
+    bool intable;
+    bool inflight;            // the lookup has not finished
+    bool done;                // the lookup returned, instead of being killed
+    bool retry;               // the result belongs to the lookup alone
+    int ret;                  // getaddrinfo return value
+    int errnum;
+    struct addrinfo *res;     // freeaddrinfo() compatible copy of the result
+    int64_t expires;
+    struct colist waiters;
+};
 
-    struct neco_chan *chan;
-    struct coroutine *co;
-    void *data;
-    bool *ok;
-    int idx;
-    int *ret_idx;
-} aligned16;
+static uint64_t dns_hash(const char *node, const char *service,
+    const struct addrinfo *hints)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *p = node; *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+    }
+    hash = (hash ^ 0xff) * 1099511628211ULL;
+    for (const char *p = service ? service : ""; *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+    }
+    int ints[] = { hints->ai_flags, hints->ai_family, hints->ai_socktype,
+        hints->ai_protocol };
+    for (size_t i = 0; i < sizeof(ints)/sizeof(int); i++) {
+        hash = (hash ^ (uint64_t)(unsigned)ints[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
 
-// returns the message slot
-static char *cbufslot(struct neco_chan *chan, int index) {
-    return chan->data + (chan->msgsize * index);
+static bool dns_match(struct dns_entry *e, uint64_t hash, const char *node,
+    const char *service, const struct addrinfo *hints)
+{
+    return e->hash == hash && strcmp(e->node, node) == 0 &&
+        (e->service ? service && strcmp(e->service, service) == 0 : !service) &&
+        e->hints.ai_flags == hints->ai_flags &&
+        e->hints.ai_family == hints->ai_family &&
+        e->hints.ai_socktype == hints->ai_socktype &&
+        e->hints.ai_protocol == hints->ai_protocol;
+}
+
+// Copies an addrinfo list the way the libc lays it out, with the address
+// following each node and the canonical name allocated on its own. The libc
+// malloc is used, and not malloc0, because freeaddrinfo() frees the copy.
+static struct addrinfo *dns_dup(const struct addrinfo *ai) {
+    struct addrinfo *head = NULL;
+    struct addrinfo **tail = &head;
+    for (; ai; ai = ai->ai_next) {
+        struct addrinfo *p = malloc(sizeof(struct addrinfo)+ai->ai_addrlen);
+        if (!p) {
+            freeaddrinfo(head);
+            return NULL;
+        }
+        memcpy(p, ai, sizeof(struct addrinfo));
+        p->ai_next = NULL;
+        p->ai_canonname = NULL;
+        p->ai_addr = (struct sockaddr*)(p+1);
+        memcpy(p->ai_addr, ai->ai_addr, ai->ai_addrlen);
+        *tail = p;
+        tail = &p->ai_next;
+        if (ai->ai_canonname) {
+            p->ai_canonname = strdup(ai->ai_canonname);
+            if (!p->ai_canonname) {
+                freeaddrinfo(head);
+                return NULL;
+            }
+        }
+    }
+    return head;
 }
 
-// push a message to the back by copying from data
-static void cbuf_push(struct neco_chan *chan, void *data) {
-    int pos = chan->bufpos + chan->buflen;
-    if (pos >= chan->bufcap) {
-        pos -= chan->bufcap;
+static void dns_unref(struct dns_entry *e) {
+    if (--e->refs > 0) {
+        return;
     }
-    if (chan->msgsize > 0) {
-        memcpy(cbufslot(chan, pos), data, (size_t)chan->msgsize);
+    if (e->res) {
+        freeaddrinfo(e->res);
     }
-    chan->buflen++;
+    free0(e->service);
+    free0(e->node);
+    free0(e);
 }
 
-// pop a message from the front and copy to data
-static void cbuf_pop(struct neco_chan *chan, void *data) {
-    if (chan->msgsize) {
-        memcpy(data, cbufslot(chan, chan->bufpos), (size_t)chan->msgsize);
+static void dns_unlink(struct dns_entry *e) {
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        rt->dnshead = e->next;
     }
-    chan->bufpos++;
-    if (chan->bufpos == chan->bufcap) {
-        chan->bufpos = 0;
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        rt->dnstail = e->prev;
     }
-    chan->buflen--;
+    e->prev = NULL;
+    e->next = NULL;
 }
 
-static struct neco_chan *chan_fastmake(size_t data_size, size_t capacity,
-    bool as_generator)
-{
-    struct neco_chan *chan;
-    // Generators do not need buffered capacity of any size because they can't
-    // use the neco_select, which requires at least one buffered slot for the 
-    // neco_case operation to store the pending data.
-    size_t ring_size = as_generator ? 0 : data_size * (capacity+1);
-    if (POOL_ENABLED && ring_size == 0 && rt->zchanpoollen > 0) {
-        chan = rt->zchanpool[--rt->zchanpoollen];
+static void dns_push_front(struct dns_entry *e) {
+    e->next = rt->dnshead;
+    if (rt->dnshead) {
+        rt->dnshead->prev = e;
     } else {
-        size_t memsize = sizeof(struct neco_chan) + ring_size;
-        chan = malloc0(memsize);
-        if (!chan) {
-            return NULL;
-        }
+        rt->dnstail = e;
     }
-    // Zero the struct memory space, not the data space.
-    memset(chan, 0, sizeof(struct neco_chan));
-    chan->rtid = rt->id;
-    chan->msgsize = (int)data_size;
-    chan->bufcap = (int)capacity;
-    colist_init(&chan->queue);
-    return chan;
+    rt->dnshead = e;
 }
 
-static int chan_make(struct neco_chan **chan, size_t data_size, size_t capacity)
-{
-    if (!chan || data_size > INT_MAX || capacity > INT_MAX) {
-        return NECO_INVAL;
-    } else if (!rt) {
-        return NECO_PERM; 
+static void dns_remove(struct dns_entry *e) {
+    if (e->intable) {
+        dns_unlink(e);
+        e->intable = false;
+        rt->ndns--;
+        dns_unref(e);
     }
-    *chan = chan_fastmake(data_size, capacity, 0);
-    if (!*chan) {
-        return NECO_NOMEM;
-    }
-    return NECO_OK;
 }
 
-/// Creates a new channel for sharing messages with other coroutines.
-///
-/// **Example**
-///
-/// ```
-/// void coroutine(int argc, void *argv[]) {
-///     neco_chan *ch = argv[0];
-/// 
-///     // Send a message
-///     neco_chan_send(ch, &(int){ 1 });
-/// 
-///     // Release the channel
-///     neco_chan_release(ch);
-/// }
-/// 
-/// int neco_start(int argc, char *argv[]) {
-///     neco_chan *ch;
-///     neco_chan_make(&ch, sizeof(int), 0);
-///     
-///     // Retain a reference of the channel and provide it to a newly started
-///     // coroutine. 
-///     neco_chan_retain(ch);
-///     neco_start(coroutine, 1, ch);
-///     
-///     // Receive a message
-///     int msg;
-///     neco_chan_recv(ch, &msg);
-///     printf("%d\n", msg);      // prints '1'
-///     
-///     // Always release the channel when you are done
-///     neco_chan_release(ch);
-/// }
-/// ```
-///
-/// @param chan Channel
-/// @param data_size Data size of messages
-/// @param capacity Buffer capacity
-/// @return NECO_OK Success
-/// @return NECO_NOMEM The system lacked the necessary resources
-/// @return NECO_INVAL An invalid parameter was provided
-/// @return NECO_PERM Operation called outside of a coroutine
-/// @note The caller is responsible for freeing with neco_chan_release()
-/// @note data_size and capacity cannot be greater than INT_MAX
-int neco_chan_make(struct neco_chan **chan, size_t data_size, size_t capacity) {
-    int ret = chan_make(chan, data_size, capacity);
-    error_guard(ret);
-    return ret;
+static void dns_release(void) {
+    while (rt->dnshead) {
+        dns_remove(rt->dnshead);
+    }
 }
 
-static void chan_fastretain(struct neco_chan *chan) {
-   chan->rc++;
+static struct dns_entry *dns_find(uint64_t hash, const char *node,
+    const char *service, const struct addrinfo *hints)
+{
+    for (struct dns_entry *e = rt->dnshead; e; e = e->next) {
+        if (dns_match(e, hash, node, service, hints)) {
+            return e;
+        }
+    }
+    return NULL;
 }
 
-static int chan_retain(struct neco_chan *chan) {
-    if (!chan) {
-        return NECO_INVAL;
-    } else if (!rt || rt->id != chan->rtid) {
-        return NECO_PERM;
+// Adds an in flight entry, which is referenced by the table and the caller.
+static struct dns_entry *dns_insert(uint64_t hash, const char *node,
+    const char *service, const struct addrinfo *hints)
+{
+    // Make room by evicting the least recently used finished entry.
+    for (struct dns_entry *e = rt->dnstail; e && rt->ndns >= NECO_DNSCACHESIZE;
+        e = e->prev)
+    {
+        if (!e->inflight) {
+            dns_remove(e);
+            break;
+        }
     }
-    chan_fastretain(chan);
-    return NECO_OK;
+    struct dns_entry *e = malloc0(sizeof(struct dns_entry));
+    if (!e) {
+        return NULL;
+    }
+    memset(e, 0, sizeof(struct dns_entry));
+    size_t nnode = strlen(node);
+    e->node = malloc0(nnode+1);
+    if (!e->node) {
+        free0(e);
+        return NULL;
+    }
+    memcpy(e->node, node, nnode+1);
+    if (service) {
+        size_t nservice = strlen(service);
+        e->service = malloc0(nservice+1);
+        if (!e->service) {
+            free0(e->node);
+            free0(e);
+            return NULL;
+        }
+        memcpy(e->service, service, nservice+1);
+    }
+    e->hash = hash;
+    e->hints.ai_flags = hints->ai_flags;
+    e->hints.ai_family = hints->ai_family;
+    e->hints.ai_socktype = hints->ai_socktype;
+    e->hints.ai_protocol = hints->ai_protocol;
+    e->refs = 2;
+    e->intable = true;
+    e->inflight = true;
+    colist_init(&e->waiters);
+    dns_push_front(e);
+    rt->ndns++;
+    return e;
+}
+
+// Runs when the lookup returns, and also when its coroutine is terminated
+// by an async cancelation without ever returning.
+static void dns_finish(void *ptr) {
+    struct dns_entry *e = ptr;
+    int errnum = errno;
+    e->inflight = false;
+    if (!e->done) {
+        e->retry = true;
+    }
+    if (e->retry || e->ret != 0 || NECO_DNSTTL <= 0) {
+        dns_remove(e);
+    } else {
+        e->expires = getnow() + (int64_t)NECO_DNSTTL * INT64_C(1000000000);
+    }
+    struct coroutine *co;
+    while ((co = colist_pop_front(&e->waiters))) {
+        sched_resume(co);
+    }
+    dns_unref(e);
+    errno = errnum;
 }
 
-/// Retain a reference of the channel so it can be shared with other coroutines.
-///
-/// This is needed for avoiding use-after-free bugs.
-/// 
-/// See neco_chan_make() for an example.
-///
-/// @param chan The channel
-/// @return NECO_OK Success
-/// @return NECO_INVAL An invalid parameter was provided
-/// @return NECO_PERM Operation called outside of a coroutine
-/// @note The caller is responsible for releasing the reference with 
-///       neco_chan_release()
-/// @see Channels
-/// @see neco_chan_release()
-int neco_chan_retain(struct neco_chan *chan) {
-    int ret = chan_retain(chan);
-    error_guard(ret);
-    return ret;
+static int dns_result(struct dns_entry *e, struct addrinfo **res) {
+    if (e->ret != 0) {
+        errno = e->errnum;
+        return e->ret;
+    }
+    *res = dns_dup(e->res);
+    return *res ? 0 : EAI_MEMORY;
 }
 
-static bool zchanpush(struct neco_chan *chan) {
-    if (rt->zchanpoollen == rt->zchanpoolcap) {
-        if (rt->zchanpoolcap == 256) {
-            return false;
+static int dns_getaddrinfo_dl(const char *node, const char *service,
+    const struct addrinfo *hints, struct addrinfo **res, int64_t deadline)
+{
+    // Missing hints are keyed as the flags that glibc defaults them to, which
+    // is a different lookup than zeroed hints.
+    struct addrinfo key = { .ai_family = AF_UNSPEC };
+    if (hints) {
+        key = *hints;
+    } else {
+        key.ai_flags = AI_V4MAPPED | AI_ADDRCONFIG;
+    }
+    uint64_t hash = dns_hash(node, service, &key);
+    struct dns_entry *e;
+    while ((e = dns_find(hash, node, service, &key))) {
+        if (!e->inflight) {
+            if (e->expires > getnow()) {
+                METRIC_INC(dnshits);
+                dns_unlink(e);
+                dns_push_front(e);
+                return dns_result(e, res);
+            }
+            dns_remove(e);
+            break;
         }
-        int cap = rt->zchanpoolcap == 0 ? 16 : rt->zchanpoolcap * 2;
-        void *zchanpool2 = realloc0(rt->zchanpool, 
-            sizeof(struct neco_chan) * (size_t)cap);
-        if (!zchanpool2) {
-            return false;
+        // Wait for the lookup in flight. The waiter holds a reference to the
+        // entry, which may leave the table before the waiter resumes.
+        METRIC_INC(dnscoalesced);
+        struct coroutine *co = coself();
+        e->refs++;
+        colist_push_back(&e->waiters, co);
+        copause(deadline);
+        remove_from_list(co);
+        int ret = checkdl(co, INT64_MAX);
+        if (ret != NECO_OK) {
+            dns_unref(e);
+            errno = ret == NECO_CANCELED ? ECANCELED : ETIMEDOUT;
+            return EAI_SYSTEM;
         }
-        rt->zchanpoolcap = cap;
-        rt->zchanpool = zchanpool2;
+        if (!e->retry) {
+            ret = dns_result(e, res);
+            dns_unref(e);
+            return ret;
+        }
+        // The lookup timed out or was canceled on its own behalf, so this
+        // caller starts over, likely becoming the one doing the lookup.
+        dns_unref(e);
     }
-    rt->zchanpool[rt->zchanpoollen++] = chan;
-    return true;
+    METRIC_INC(dnsmisses);
+    e = dns_insert(hash, node, service, &key);
+    if (!e) {
+        return getaddrinfo_th_dl(node, service, hints, res, deadline);
+    }
+    int ret;
+    neco_cleanup_push(dns_finish, e);
+    e->ret = getaddrinfo_th_dl(node, service, hints, res, deadline);
+    e->errnum = errno;
+    e->done = true;
+    if (e->ret == 0) {
+        e->res = dns_dup(*res);
+        e->retry = !e->res;
+    } else if (e->ret == EAI_SYSTEM) {
+        e->retry = e->errnum == ECANCELED || e->errnum == ETIMEDOUT;
+    }
+    ret = e->ret;
+    neco_cleanup_pop(1);
+    return ret;
 }
+#endif // NECO_NODNSCACHE
 
-static void chan_fastrelease(struct neco_chan *chan) {
-    chan->rc--;
-    if (chan->rc < 0) {
-        if (!POOL_ENABLED || chan->msgsize > 0 || !zchanpush(chan)) {
-            free0(chan);
-        }
+static int getaddrinfo_dl(const char *node, const char *service,
+    const struct addrinfo *hints, struct addrinfo **res, int64_t deadline)
+{
+    struct coroutine *co = coself();
+    if (!co) {
+        errno = EPERM;
+        return EAI_SYSTEM;
+    }
+    int ret = checkdl(co, deadline);
+    if (ret != NECO_OK) {
+        errno = ret == NECO_CANCELED ? ECANCELED : ETIMEDOUT;
+        return EAI_SYSTEM;
+    }
+    if (is_ip_address(node)) {
+        // This is a simple address. Since there's no DNS lookup involved we
+        // can use the standard getaddrinfo function without worrying about
+        // much delay.
+        return getaddrinfo(node, service, hints, res);
+    }
+
+    // DNS lookup is probably needed. This may cause network usage and who
+    // knows how long it will take to return. Here we'll use a background
+    // thread to do the work, sharing it with other lookups of the same name.
+#ifndef NECO_NODNSCACHE
+    if (node) {
+        return dns_getaddrinfo_dl(node, service, hints, res, deadline);
     }
+#endif
+    return getaddrinfo_th_dl(node, service, hints, res, deadline);
 }
 
-static int chan_release(struct neco_chan *chan) {
-    if (!chan) {
-        return NECO_INVAL;
-    } else if (!rt || rt->id != chan->rtid) {
-        return NECO_PERM;
+/// Same as neco_getaddrinfo() but with a deadline parameter.
+int neco_getaddrinfo_dl(const char *node, const char *service,
+    const struct addrinfo *hints, struct addrinfo **res, int64_t deadline)
+{
+    int ret = getaddrinfo_dl(node, service, hints, res, deadline);
+    int err;
+    if (ret == 0) {
+        err = NECO_OK;
+    } else if (ret == EAI_SYSTEM) {
+        err = NECO_ERROR;
+    } else {
+        err = NECO_GAIERROR;
     }
-    chan_fastrelease(chan);
-    return NECO_OK;
+    async_error_guard(err);
+    return ret;
 }
 
-/// Release a reference to a channel
+/// The getaddrinfo() function is used to get a list of addresses and port
+/// numbers for node (hostname) and service.
+/// 
+/// This is functionally identical to the Posix getaddrinfo function with the
+/// exception that it does not block, allowing for usage in a Neco coroutine.
 ///
-/// See neco_chan_make() for an example.
+/// Host names are cached by each thread for NECO_DNSTTL seconds, and
+/// concurrent lookups of the same name share a single query, unless built
+/// with NECO_NODNSCACHE.
 ///
-/// @param chan The channel
-/// @return NECO_OK Success
-/// @return NECO_INVAL An invalid parameter was provided
-/// @return NECO_PERM Operation called outside of a coroutine
-/// @see Channels
-/// @see neco_chan_retain()
-int neco_chan_release(struct neco_chan *chan) {
-    int ret = chan_release(chan);
-    error_guard(ret);
-    return ret;
+/// @return On success, 0 is returned
+/// @return On error, a nonzero error code defined by the system. See the link
+///         below for a list.
+/// @see Posix
+/// @see https://www.man7.org/linux/man-pages/man3/getaddrinfo.3.html
+int neco_getaddrinfo(const char *node, const char *service,
+    const struct addrinfo *hints, struct addrinfo **res)
+{
+    return neco_getaddrinfo_dl(node, service, hints, res, INT64_MAX);
 }
 
-static int chan_send0(struct neco_chan *chan, void *data, bool broadcast, 
-    int64_t deadline)
-{
-    if (!chan) {
+// Returns a host and port.
+// The host will need to be freed by the caller.  
+static int parse_tcp_addr(const char *addr, char **host, const char **port) {
+    size_t naddr = strlen(addr);
+    if (naddr == 0) {
         return NECO_INVAL;
-    } else if (!rt || chan->rtid != rt->id) {
-        return NECO_PERM;
-    } else if (chan->sclosed) {
-        return NECO_CLOSED;
-    }
-    struct coroutine *co = coself();
-    if (co->canceled && !broadcast) {
-        co->canceled = false;
-        return NECO_CANCELED;
     }
-    int sent = 0;
-    while (!colist_is_empty(&chan->queue) && chan->qrecv) {
-        // A receiver is currently waiting for a message.
-        // Pop it from the queue.
-        struct coroutine *recv = colist_pop_front(&chan->queue);
-        if (recv->kind == SELECTCASE) {
-            // The receiver is a select-case. 
-            struct coselectcase *cocase = (struct coselectcase *)recv;
-            if (*cocase->ret_idx != -1) {
-                // This select-case has already been handled
-                continue;
-            }
-            // Set the far stack index pointer and exchange the select-case
-            // with the real coroutine.
-            *cocase->ret_idx = cocase->idx;
-            recv = cocase->co;
-            recv->cmsg = cocase->data;
-            *cocase->ok = true;
-        }
-        // Directly copy the message to the receiver's 'data' argument.
-        if (chan->msgsize > 0) {
-            memcpy(recv->cmsg, data, (size_t)chan->msgsize);
+    const char *colon = NULL;
+    for (size_t i = naddr-1; ; i--) {
+        if (addr[i] == ':') {
+            colon = addr+i;
+            break;
         }
-        if (!broadcast) {
-            // Resume receiver immediately.
-            sco_resume(recv->id);
-            return NECO_OK;
-        } else {
-            // Schedule the reciever.
-            sched_resume(recv);
-            sent++;
+        if (i == 0) {
+            break;
         }
     }
-    if (broadcast) {
-        yield_for_sched_resume();
-        return sent;
+    if (!colon) {
+        return NECO_INVAL;
     }
-
-    if (chan->buflen < chan->bufcap) {
-        // There room to write to the ring buffer. 
-        // Add this message and return immediately.
-        cbuf_push(chan, data);
-        return NECO_OK;
+    *port = colon+1;
+    naddr = (size_t)(colon-addr);
+    if (addr[0] == '[' && addr[naddr-1] == ']') {
+        addr++;
+        naddr -= 2;
     }
-
-    // Push this sender to queue
-    colist_push_back(&chan->queue, co);
-    chan->qrecv = false;
-    co->cmsg = data;
-
-    // Wait for a receiver to consume this message.
-    rt->nsenders++;
-    copause(deadline);
-    rt->nsenders--;
-    remove_from_list(co);
-
-    co->cmsg = NULL;
-    return checkdl(co, INT64_MAX);
-}
-
-/// Same as neco_chan_send() but with a deadline parameter.
-int neco_chan_send_dl(neco_chan *chan, void *data, int64_t deadline) {
-    int ret = chan_send0(chan, data, false, deadline);
-    async_error_guard(ret);
-    return ret;
+    *host = malloc0(naddr+1);
+    if (!*host) {
+        return NECO_NOMEM;
+    }
+    memcpy(*host, addr, naddr);
+    (*host)[naddr] = '\0';
+    return NECO_OK;
 }
 
-/// Send a message
-///
-/// See neco_chan_make() for an example.
-///
-/// @return NECO_OK Success
-/// @return NECO_PERM Operation called outside of a coroutine
-/// @return NECO_INVAL An invalid parameter was provided
-/// @return NECO_CANCELED Operation canceled
-/// @return NECO_CLOSED Channel closed
-/// @see Channels
-/// @see neco_chan_recv()
-int neco_chan_send(struct neco_chan *chan, void *data) {
-    return neco_chan_send_dl(chan, data, INT64_MAX);
+int neco_errconv_from_gai(int errnum) {
+    switch (errnum) {
+    case EAI_MEMORY:
+        return NECO_NOMEM;
+    case EAI_SYSTEM:
+        return neco_errconv_from_sys();
+    default:
+        neco_gai_errno = errnum;
+        return NECO_GAIERROR;
+    }
 }
 
-/// Sends message to all receiving channels.
-/// @return The number of channels that received the message
-/// @return NECO_PERM Operation called outside of a coroutine
-/// @return NECO_INVAL An invalid parameter was provided
-/// @return NECO_CLOSED Channel closed
-/// @note This operation cannot be canceled and does not timeout
-/// @see Channels
-/// @see neco_chan_recv()
-int neco_chan_broadcast(struct neco_chan *chan, void *data) {
-    int ret = chan_send0(chan, data, true, INT64_MAX);
-    error_guard(ret);
-    return ret;
+static void cleanup_free_host(void *host) {
+    free0(host);
 }
 
-static int chan_tryrecv0(struct neco_chan *chan, void *data, bool try,
-    int64_t deadline)
+// Returns NECO errors
+static int getaddrinfo_from_tcp_addr_dl(const char *addr, int tcp_vers, 
+    struct addrinfo **res, int64_t deadline)
 {
-    if (!chan) {
-        return NECO_INVAL;
-    } else if (!rt || chan->rtid != rt->id) {
-        return NECO_PERM;
-    } else if (chan->rclosed) {
-        return NECO_CLOSED;
-    }
-    struct coroutine *co = coself();
-    if (co->canceled) {
-        co->canceled = false;
-        return NECO_CANCELED;
+    char *host = NULL;
+    const char *port = 0;
+    int ret = parse_tcp_addr(addr, &host, &port);
+    if (ret != NECO_OK) {
+        return ret;
     }
-    if (chan->buflen > 0) {
-        // Take from the buffer
-        cbuf_pop(chan, data);
-        struct coroutine *send = NULL;
-        if (!colist_is_empty(&chan->queue)) {
-            // There's a sender waiting to send a message.
-            // Put the sender's message in the buffer and wake it up.
-            send = colist_pop_front(&chan->queue);
-            cbuf_push(chan, send->cmsg);
-        }
-        if (chan->sclosed && colist_is_empty(&chan->queue) && 
-            chan->buflen == 0)
-        {
-            // The channel was closed and there are no more messages.
-            // Close the receiving side too
-            chan->rclosed = true;
-        }
-        if (send) {
-            sco_resume(send->id);
+    struct addrinfo hints = { 0 };
+    hints.ai_family = AF_UNSPEC; 
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_family = tcp_vers;
+    struct addrinfo *ainfo = NULL;
+    const char *vhost = host;
+    if (vhost[0] == '\0') {
+        if (tcp_vers == AF_INET6) {
+            vhost = "::";
+        } else {
+            vhost = "0.0.0.0";
         }
-        return NECO_OK;
     }
-
-    if (!colist_is_empty(&chan->queue) && !chan->qrecv) {
-        // A sender is currently waiting to send a message.
-        // This message must be consumed immediately.
-        struct coroutine *send = colist_pop_front(&chan->queue);
-        if (chan->msgsize) {
-            memcpy(data, send->cmsg, (size_t)chan->msgsize);
-        }
-        if (chan->sclosed && colist_is_empty(&chan->queue) && 
-            chan->buflen == 0)
-        {
-            // The channel was closed and there are no more messages.
-            // Now close the receiving side too.
-            chan->rclosed = true;
-        }
-        sco_resume(send->id);
-        return NECO_OK;
+    neco_cleanup_push(cleanup_free_host, host);
+    ret = neco_getaddrinfo_dl(vhost, port, &hints, &ainfo, deadline);
+    neco_cleanup_pop(1);
+    if (ret != 0) {
+        return neco_errconv_from_gai(ret);
     }
-    if (try) {
-        return NECO_EMPTY;
+    // It has been observed on Linux that a getaddrinfo can successfully return
+    // but with an empty result. Let's check for that case and ensure an error
+    // is returned to the caller.
+    neco_gai_errno = EAI_FAIL;
+    ret = NECO_GAIERROR;
+    *res = 0;
+    if (ainfo) {
+        *res = ainfo;
+        ret = NECO_OK; 
+        neco_gai_errno = EAI_FAIL;
+    }
+    return ret;
+}
+
+
+
+static int getaddrinfo_from_tcp_addr_dl(const char *addr, int tcp_vers, 
+    struct addrinfo **res, int64_t deadline);
+
+int neco_errconv_from_sys(void);
+
+static int setnonblock(int fd, bool nonblock, bool *oldnonblock) {
+#ifdef _WIN32
+    // There's no way to detect if a socket is in non-blocking mode in Windows.
+    return ioctlsocket(fd, FIONBIO, &(unsigned long){ nonblock });
+#else
+    int flags = fcntl0(fd, F_GETFL, 0);
+    if (flags == -1) {
+        return -1;
     }
-    // Push the receiver to the queue. 
-    colist_push_back(&chan->queue, co);
-    chan->qrecv = true;
-    // Assign the 'cmsg' message slot so that the sender knows where to copy
-    // the message.
-    co->cmsg = data;
-    // Set the channel closed flag that *may* be changed by the sender.
-    co->cclosed = false;
-    // Wait for a sender.
-    rt->nreceivers++;
-    copause(deadline);
-    rt->nreceivers--;
-    remove_from_list(co);
-    // The sender has already copied its message to 'data'.
-    co->cmsg = NULL;
-    int ret = checkdl(co, INT64_MAX);
-    if (ret != NECO_OK) {
-        return ret;
+    if (oldnonblock) {
+        *oldnonblock = (flags & O_NONBLOCK) == O_NONBLOCK;
     }
-    if (co->cclosed) {
-        // The channel was closed for receiving while this coroutine was
-        // waiting on a new message.
-        if (chan->msgsize) {
-            memset(data, 0, (size_t)chan->msgsize);
-        }
-        co->cclosed = false;
-        return NECO_CLOSED;
+    if (nonblock) {
+        flags |= O_NONBLOCK;
     } else {
-        return NECO_OK;
+        flags &= ~O_NONBLOCK;
     }
+    return fcntl0(fd, F_SETFL, flags);
+#endif
 }
 
-/// Same as neco_chan_recv() but with a deadline parameter.
-int neco_chan_recv_dl(struct neco_chan *chan, void *data, int64_t deadline) {
-    int ret = chan_tryrecv0(chan, data, false, deadline);
-    async_error_guard(ret);
+/// Change the non-blocking state for a file descriptor.
+/// @see Posix2
+int neco_setnonblock(int fd, bool nonblock, bool *oldnonblock) {
+    int ret = setnonblock(fd, nonblock, oldnonblock);
+    error_guard(ret);
     return ret;
 }
 
-/// Receive a message
-///
-/// See neco_chan_make() for an example.
-///
-/// @param chan channel
-/// @param data data pointer
-/// @return NECO_OK Success
-/// @return NECO_PERM Operation called outside of a coroutine
-/// @return NECO_INVAL An invalid parameter was provided
-/// @return NECO_CANCELED Operation canceled
-/// @return NECO_CLOSED Channel closed
-/// @see Channels
-/// @see neco_chan_send()
-int neco_chan_recv(struct neco_chan *chan, void *data) {
-    return neco_chan_recv_dl(chan, data, INT64_MAX);
+static void cleanup_close_socket(void *arg) {
+    close(*(int*)arg);
 }
 
-/// Receive a message, but do not wait if the message is not available.
-/// @param chan channel
-/// @param data data pointer
-/// @return NECO_OK Success
-/// @return NECO_EMPTY No message available
-/// @return NECO_CLOSED Channel closed
-/// @return NECO_PERM Operation called outside of a coroutine
-/// @return NECO_INVAL An invalid parameter was provided
-/// @see Channels
-/// @see neco_chan_recv()
-int neco_chan_tryrecv(struct neco_chan *chan, void *data) {
-    int ret = chan_tryrecv0(chan, data, true, INT64_MAX);
-    async_error_guard(ret);
+static int dial_connect_dl(int domain, int type, int protocol, 
+    const struct sockaddr *addr, socklen_t addrlen, int64_t deadline)
+{
+    int fd = socket0(domain, type, protocol);
+    if (fd == -1) {
+        return -1;
+    }
+    if (neco_setnonblock(fd, true, 0) == -1) {
+        close(fd);
+        return -1;
+    }
+    int ret;
+    neco_cleanup_push(cleanup_close_socket, &fd);
+    ret = neco_connect_dl(fd, addr, addrlen, deadline);
+    if (ret == 0) {
+        ret = fd;
+        fd = -1;
+    }
+    neco_cleanup_pop(1);
     return ret;
 }
 
-static int chan_close(struct neco_chan *chan) {
-    if (!chan) {
+static void cleanup_addrinfo(void *arg) {
+    struct addrinfo *ainfo = arg;
+    freeaddrinfo(ainfo);
+}
+
+static int dial_tcp_dl(const char *addr, int tcp_vers, int64_t deadline) {
+    struct addrinfo *ainfo;
+    int ret = getaddrinfo_from_tcp_addr_dl(addr, tcp_vers, &ainfo, deadline);
+    if (ret != NECO_OK) {
+        return ret;
+    }
+    int fd;
+    neco_cleanup_push(cleanup_addrinfo, ainfo);
+    struct addrinfo *ai = ainfo;
+    do {
+        fd = dial_connect_dl(ai->ai_family, ai->ai_socktype, ai->ai_protocol, 
+            ai->ai_addr, ai->ai_addrlen, deadline);
+        if (fd != -1) {
+            break;
+        }
+        ai = ai->ai_next;
+    } while (ai);
+    if (fd == -1) {
+        fd = neco_errconv_from_sys();
+    }
+    neco_cleanup_pop(1);
+    return fd;
+}
+
+static int dial_unix_dl(const char *addr, int64_t deadline) {
+    (void)addr; (void)deadline;
+#ifdef _WIN32
+    return NECO_PERM;
+#else
+    struct sockaddr_un unaddr = { .sun_family = AF_UNIX };
+    size_t naddr = strlen(addr);
+    if (naddr > sizeof(unaddr.sun_path) - 1) {
         return NECO_INVAL;
-    } else if (!rt || chan->rtid != rt->id) {
-        return NECO_PERM;
-    } else if (chan->sclosed) {
-        return NECO_CLOSED;
     }
-    chan->sclosed = true;
-    if (chan->buflen > 0 || (!colist_is_empty(&chan->queue) && !chan->qrecv)) {
-        // There are currently messages in the buffer or senders still waiting
-        // to send messages. Do not close the receiver side yet.
-        return NECO_OK;
+    strncpy(unaddr.sun_path, addr, sizeof(unaddr.sun_path) - 1);
+    int fd = dial_connect_dl(AF_UNIX, SOCK_STREAM, 0, (void*)&unaddr,
+        sizeof(struct sockaddr_un), deadline);
+    if (fd == -1) {
+        fd = neco_errconv_from_sys();
     }
-    // No buffered messages or senders waiting. 
-    // Close the receiver side and wake up all receivers.
-    while (!colist_is_empty(&chan->queue)) {
-        struct coroutine *recv = colist_pop_front(&chan->queue);
-        if (recv->kind == SELECTCASE) {
-            // The receiver is a select-case. 
-            struct coselectcase *cocase = (struct coselectcase *)recv;
-            if (*cocase->ret_idx != -1) {
-                // This select-case has already been handled
-                continue;
-            }
-            // Set the far stack index pointer and exchange the select-case
-            // with the real coroutine.
-            *cocase->ret_idx = cocase->idx;
-            recv = cocase->co;
-            *cocase->ok = false;
-        }
-        recv->cclosed = true;
-        sched_resume(recv);
+    return fd;
+#endif
+}
+
+static int dial_dl(const char *network, const char *address, int64_t deadline) {
+    if (neco_getid() <= 0) {
+        return NECO_PERM; 
+    } else if (!network || !address) {
+        return NECO_INVAL;
+    } else if (strcmp(network, "tcp") == 0) {
+        return dial_tcp_dl(address, 0, deadline);
+    } else if (strcmp(network, "tcp4") == 0) {
+        return dial_tcp_dl(address, AF_INET, deadline);
+    } else if (strcmp(network, "tcp6") == 0) {
+        return dial_tcp_dl(address, AF_INET6, deadline);
+    } else if (strcmp(network, "unix") == 0) {
+        return dial_unix_dl(address, deadline);
+    } else {
+        return NECO_INVAL;
     }
-    chan->rclosed = true;
-    chan->qrecv = false;
-    yield_for_sched_resume();
-    return NECO_OK;
 }
 
-/// Close a channel for sending.
-/// @param chan channel
-/// @return NECO_OK Success
-/// @return NECO_PERM Operation called outside of a coroutine
-/// @return NECO_INVAL An invalid parameter was provided
-/// @return NECO_CLOSED Channel already closed
-int neco_chan_close(struct neco_chan *chan) {
-    int ret = chan_close(chan);
+/// Same as neco_dial() but with a deadline parameter. 
+int neco_dial_dl(const char *network, const char *address, int64_t deadline) {
+    int ret = dial_dl(network, address, deadline);
     error_guard(ret);
     return ret;
 }
 
-static int chan_select(int ncases, struct coselectcase *cases, int *ret_idx,
-    int64_t deadline, bool try)
-{
-    // Check that the channels are valid before continuing.
-    for (int i = 0; i < ncases; i++) {
-        struct neco_chan *chan = cases[i].chan;
-        if (!chan) {
-            return NECO_INVAL;
-        } else if (chan->rtid != rt->id) {
-            return NECO_PERM;
+/// Connect to a remote server.
+///
+/// **Example**
+///
+/// ```c 
+/// int fd = neco_dial("tcp", "google.com:80");
+/// if (fd < 0) {
+///    // .. error, do something with it.
+/// }
+/// // Connected to google.com. Use neco_read(), neco_write(), or create a 
+/// // stream using neco_stream_make(fd).
+/// close(fd);
+/// ```
+/// @param network must be "tcp", "tcp4", "tcp6", or "unix".
+/// @param address the address to dial
+/// @return On success, file descriptor (non-blocking)
+/// @return On error, Neco error
+/// @see Networking
+/// @see neco_serve()
+int neco_dial(const char *network, const char *address) {
+    return neco_dial_dl(network, address, INT64_MAX);
+}
+
+static int listen_tcp_dl(const char *addr, int tcp_vers, int64_t deadline) {
+    struct addrinfo *ainfo;
+    int ret = getaddrinfo_from_tcp_addr_dl(addr, tcp_vers, &ainfo, deadline);
+    if (ret != NECO_OK) {
+        return ret;
+    }
+    int fd = socket0(ainfo->ai_family, ainfo->ai_socktype, ainfo->ai_protocol);
+    bool ok = fd != -1 && setsockopt0(fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, 
+        sizeof(int)) != -1;
+    ok = ok && bind0(fd, ainfo->ai_addr, ainfo->ai_addrlen) != -1;
+    freeaddrinfo(ainfo);
+    ok = ok && listen0(fd, SOMAXCONN) != -1;
+    ok = ok && neco_setnonblock(fd, true, 0) != -1;
+    if (!ok) {
+        if (fd != -1) {
+            close(fd);
+            fd = -1;
         }
     }
+    return fd;
+}
 
-    struct coroutine *co = coself();
-
-    if (co->canceled) {
-        co->canceled = false;
-        return NECO_CANCELED;
-    }
-
-    // Scan each channel and see if there are any messages waiting in their
-    // queue or if any are closed. 
-    // If so then receive that channel immediately.
-    for (int i = 0; i < ncases; i++) {
-        struct neco_chan *chan = cases[i].chan;
-        if ((!colist_is_empty(&chan->queue) && !chan->qrecv) || 
-            chan->buflen > 0 || chan->rclosed)
-        {
-            int ret = neco_chan_recv(cases[i].chan, cases[i].data);
-            *cases[i].ok = ret == NECO_OK;
-            return i;
-        }
+static int listen_unix_dl(const char *addr, int64_t deadline) {
+    (void)addr; (void)deadline;
+#ifdef _WIN32
+    return NECO_PERM;
+#else
+    int fd = socket0(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return NECO_ERROR;
     }
-
-    if (try) {
-        return NECO_EMPTY;
+    struct sockaddr_un unaddr;
+    memset(&unaddr, 0, sizeof(struct sockaddr_un));
+    unaddr.sun_family = AF_UNIX;
+    strncpy(unaddr.sun_path, addr, sizeof(unaddr.sun_path) - 1);
+    if (bind0(fd, (void*)&unaddr, sizeof(struct sockaddr_un)) == -1) {
+        close(fd);
+        return NECO_ERROR;
     }
-
-    // Push all cases into their repsective channel queue.
-    for (int i = 0; i < ncases; i++) {
-        colist_push_back(&cases[i].chan->queue, (struct coroutine*)&cases[i]);
-        cases[i].chan->qrecv = true;
+    if (listen0(fd, SOMAXCONN) == -1) {
+        close(fd);
+        return NECO_ERROR;
     }
-
-    // Wait for a sender to wake us up
-    rt->nreceivers++;
-    copause(deadline);
-    rt->nreceivers--;
-
-    // Remove all cases
-    for (int i = 0; i < ncases; i++) {
-        remove_from_list((struct coroutine*)&cases[i]);
+    if (neco_setnonblock(fd, true, 0) == -1) {
+        close(fd);
+        return NECO_ERROR;
     }
-    int ret = checkdl(co, INT64_MAX);
-    return ret == NECO_OK ? *ret_idx : ret;
+    return fd;
+#endif
 }
 
-static int chan_selectv_dl(int ncases, va_list *args, struct neco_chan **chans, 
-    int64_t deadline, bool try)
+static int serve_dl(const char *network, const char *address, int64_t deadline)
 {
-    if (ncases < 0) {
+    if (!network || !address) {
         return NECO_INVAL;
-    } else if (!rt) {
-        return NECO_PERM;
-    }
-
-    // Allocate space for storing each select-case struct. 
-    // These are used in place of a coroutine for the channel receiver queues.
-    bool must_free;
-    struct coselectcase stack_cases[8];
-    struct coselectcase *cases;
-    if (ncases > 8) {
-        cases = malloc0((size_t)ncases * sizeof(struct coselectcase));
-        if (!cases) {
-            return NECO_NOMEM;
-        }
-        must_free = true;
+    } else if (neco_getid() <= 0) {
+        return NECO_PERM; 
+    } else if (strcmp(network, "tcp") == 0) {
+        return listen_tcp_dl(address, 0, deadline);
+    } else if (strcmp(network, "tcp4") == 0) {
+        return listen_tcp_dl(address, AF_INET, deadline);
+    } else if (strcmp(network, "tcp6") == 0) {
+        return listen_tcp_dl(address, AF_INET6, deadline);
+    } else if (strcmp(network, "unix") == 0) {
+        return listen_unix_dl(address, deadline);
     } else {
-        cases = stack_cases;
-        must_free = false;
-    }
-    struct coroutine *co = coself();
-    int ret_idx = -1;
-
-    // Copy the select-case arguments into the array.
-    for (int i = 0; i < ncases; i++) {
-        struct neco_chan *chan;
-        chan = args ? va_arg(*args, struct neco_chan*) : chans[i];
-        cases[i] = (struct coselectcase){
-            .chan = chan,
-            .kind = SELECTCASE,
-            .idx = i,
-            .ret_idx = &ret_idx,
-            .co = co,
-            .data = chan ? cbufslot(chan, chan->bufcap) : 0,
-            .ok = chan ? &chan->lok : 0,
-        };
-        cases[i].next = (struct coroutine*)&cases[i];
-        cases[i].prev = (struct coroutine*)&cases[i];
-    }
-    int ret = chan_select(ncases, cases, &ret_idx, deadline, try);
-    if (must_free) {
-        free0(cases);
+        return NECO_INVAL;
     }
-    return ret;
 }
 
-/// Same as neco_chan_selectv() but with a deadline parameter.
-int neco_chan_selectv_dl(int nchans, struct neco_chan *chans[],
-    int64_t deadline)
-{
-    int ret = chan_selectv_dl(nchans, 0, chans, deadline, false);
+/// Same as neco_serve() but with a deadline parameter. 
+int neco_serve_dl(const char *network, const char *address, int64_t deadline) {
+    int ret = serve_dl(network, address, deadline);
     async_error_guard(ret);
     return ret;
 }
 
-/// Same as neco_chan_select() but using an array for arguments.
-int neco_chan_selectv(int nchans, struct neco_chan *chans[]) {
-    return neco_chan_selectv_dl(nchans, chans, INT64_MAX);
-}
-
-/// Same as neco_chan_select() but with a deadline parameter.
-int neco_chan_select_dl(int64_t deadline, int nchans, ...) {
-    va_list args;
-    va_start(args, nchans);
-    int ret = chan_selectv_dl(nchans, &args, 0, deadline, false);
-    va_end(args);
-    async_error_guard(ret);
-    return ret;
-}
 
-/// Wait on multiple channel operations at the same time. 
+/// Listen on a local network address.
 ///
 /// **Example**
 ///
-/// ```
-/// 
-/// // Let's say we have two channels 'c1' and 'c2' that both transmit 'char *'
-/// // messages.
-///
-/// // Use neco_chan_select() to wait on both channels.
-///
-/// char *msg;
-/// int idx = neco_chan_select(2, c1, c2);
-/// switch (idx) {
-/// case 0:
-///     neco_chan_case(c1, &msg);
-///     break;
-/// case 1:
-///     neco_chan_case(c2, &msg);
-///     break;
-/// default:
-///     // Error occured. The return value 'idx' is the error
+/// ```c 
+/// int servefd = neco_serve("tcp", "127.0.0.1:8080");
+/// if (servefd < 0) {
+///    // .. error, do something with it.
+/// }
+/// while (1) {
+///     int fd = neco_accept(servefd, 0, 0);
+///     // client accepted
 /// }
 ///
-/// printf("%s\n", msg);
+/// close(servefd);
 /// ```
-///
-/// @param nchans Number of channels 
-/// @param ... The channels 
-/// @return The index of channel with an available message
-/// @return NECO_PERM Operation called outside of a coroutine
-/// @return NECO_INVAL An invalid parameter was provided
-/// @return NECO_NOMEM The system lacked the necessary resources
-/// @return NECO_CANCELED Operation canceled
-/// @see Channels
-int neco_chan_select(int nchans, ...) {
-    va_list args;
-    va_start(args, nchans);
-    int ret = chan_selectv_dl(nchans, &args, 0, INT64_MAX, false);
-    va_end(args);
-    async_error_guard(ret);
-    return ret;
+/// @param network must be "tcp", "tcp4", "tcp6", or "unix".
+/// @param address the address to serve on
+/// @return On success, file descriptor (non-blocking)
+/// @return On error, Neco error
+/// @see Networking
+/// @see neco_dial()
+int neco_serve(const char *network, const char *address) {
+    return neco_serve_dl(network, address, INT64_MAX);
 }
 
-/// Same as neco_chan_select() but does not wait if a message is not available
-/// @return NECO_EMPTY No message available
-/// @see Channels
-/// @see neco_chan_select()
-int neco_chan_tryselect(int nchans, ...) {
-    va_list args;
-    va_start(args, nchans);
-    int ret = chan_selectv_dl(nchans, &args, 0, INT64_MAX, true);
-    va_end(args);
-    async_error_guard(ret);
-    return ret;
-}
+////////////////////////////////////////////////////////////////////////////////
+// sync 
+////////////////////////////////////////////////////////////////////////////////
 
-/// Same as neco_chan_tryselect() but uses an array for arguments.
-int neco_chan_tryselectv(int nchans, struct neco_chan *chans[]) {
-    int ret = chan_selectv_dl(nchans, 0, chans, 0, true);
-    async_error_guard(ret);
-    return ret;
-}
+struct neco_mutex {
+    int64_t rtid;        // runtime id
+    struct colist queue; // coroutine doubly linked list
+    int  rlocked;        // read lock counter
+    bool locked;         // mutex is locked (read or write)
+    bool shared;         // used by every runtime, see neco_mutex_init_shared
+    atomic_bool lock;    // guards a shared mutex
+};
 
-static int chan_case(struct neco_chan *chan, void *data) {
-    if (!chan) {
+static_assert(sizeof(neco_mutex) >= sizeof(struct neco_mutex), "");
+static_assert(_Alignof(neco_mutex) == _Alignof(struct neco_mutex), "");
+
+static int mutex_init(neco_mutex *mutex) {
+    struct neco_mutex *mu = (void*)mutex;
+    if (!mu) {
         return NECO_INVAL;
-    } else if (!rt || chan->rtid != rt->id) {
+    } else if (!rt) {
         return NECO_PERM;
-    } else if (!chan->lok) {
-        return NECO_CLOSED;
-    }
-    if (chan->msgsize) {
-        memcpy(data, cbufslot(chan, chan->bufcap), (size_t)chan->msgsize);
     }
+    memset(mu, 0, sizeof(struct neco_mutex));
+    mu->rtid = rt->id;
+    colist_init(&mu->queue);
     return NECO_OK;
 }
 
-/// Receive the message after a successful neco_chan_select().
-/// See neco_chan_select() for an example.
-/// @param chan The channel
-/// @param data The data
+int neco_mutex_init(neco_mutex *mutex) {
+    int ret = mutex_init(mutex);
+    error_guard(ret);
+    return ret;
+}
+
+static int mutex_init_shared(neco_mutex *mutex) {
+    int ret = mutex_init(mutex);
+    if (ret == NECO_OK) {
+        ((struct neco_mutex*)mutex)->shared = true;
+    }
+    return ret;
+}
+
+/// Initialize a mutex that coroutines of any thread may use, such as those
+/// running on a neco_pool.
+/// @param mutex The mutex
 /// @return NECO_OK Success
-/// @return NECO_PERM Operation called outside of a coroutine
 /// @return NECO_INVAL An invalid parameter was provided
-/// @return NECO_CLOSED Channel closed
-int neco_chan_case(struct neco_chan *chan, void *data) {
-    int ret = chan_case(chan, data);
+/// @return NECO_PERM Operation called outside of a coroutine
+/// @see Mutexes
+int neco_mutex_init_shared(neco_mutex *mutex) {
+    int ret = mutex_init_shared(mutex);
     error_guard(ret);
     return ret;
 }
 
-struct getaddrinfo_args {
-    atomic_int returned;
-    char *node;
-    char *service;
-    struct addrinfo *hints;
-    struct addrinfo *res;
-    int fds[2];
-    int ret;
-    int errnum;
-#ifdef __FreeBSD__
-    void *dlhandle;
-#endif
-};
-
-static void gai_args_free(struct getaddrinfo_args *args) {
-    if (args) {
-        free0(args->service);
-        free0(args->node);
-        free0(args->hints);
-        freeaddrinfo(args->res);
-        if (args->fds[0]) {
-            must(close(args->fds[0]) == 0);
-        }
-        if (args->fds[1]) {
-            must(close(args->fds[1]) == 0);
-        }
-#ifdef __FreeBSD__
-        if (args->dlhandle) {
-            dlclose(args->dlhandle);
-        }
-#endif
-        free0(args);
+inline
+static int check_mutex(struct coroutine *co, struct neco_mutex *mu) {
+    if (!mu) {
+        return NECO_INVAL;
+    } else if (!co) {
+        return NECO_PERM;
+    } else if (mu->rtid == 0) {
+        return neco_mutex_init((neco_mutex*)mu);
+    } else if (rt->id != mu->rtid && !mu->shared) {
+        return NECO_PERM;
     }
+    return NECO_OK;
 }
 
-static struct getaddrinfo_args *gai_args_new(const char *node, 
-    const char *service, const struct addrinfo *hints)
+inline
+static int mutex_trylock(struct coroutine *co, struct neco_mutex *mu, 
+    bool tryonly, int64_t deadline)
 {
-    struct getaddrinfo_args *args = malloc0(sizeof(struct getaddrinfo_args));
-    if (!args) {
-        return NULL;
-    }
-    memset(args, 0, sizeof(struct getaddrinfo_args));
-    if (node) {
-        size_t nnode = strlen(node);
-        args->node = malloc0(nnode+1);
-        if (!args->node) {
-            gai_args_free(args);
-            return NULL;
-        }
-        memcpy(args->node, node, nnode+1);
-    }
-    if (service) {
-        size_t nservice = strlen(service);
-        args->service = malloc0(nservice+1);
-        if (!args->service) {
-            gai_args_free(args);
-            return NULL;
+    if (!tryonly) {
+        int ret = checkdl(co, deadline);
+        if (ret != NECO_OK) {
+            return ret;
         }
-        memcpy(args->service, service, nservice+1);
     }
-    if (hints) {
-        args->hints = malloc0(sizeof(struct addrinfo));
-        if (!args->hints) {
-            gai_args_free(args);
-            return NULL;
-        }
-        memset(args->hints, 0, sizeof(struct addrinfo));
-        args->hints->ai_flags = hints->ai_flags;
-        args->hints->ai_family = hints->ai_family;
-        args->hints->ai_socktype = hints->ai_socktype;
-        args->hints->ai_protocol = hints->ai_protocol;
-        args->hints->ai_next = NULL;
+    if (mu->locked) {
+        return NECO_BUSY;
     }
-    return args;
-}
-
-static atomic_int getaddrinfo_th_counter = 0;
-
-#ifdef NECO_TESTING
-int neco_getaddrinfo_nthreads(void) {
-    return atomic_load(&getaddrinfo_th_counter);
+    mu->locked = true;
+    return NECO_OK;
 }
-#endif
 
-static void *getaddrinfo_th(void *v) {
-    struct getaddrinfo_args *a = v;
-    a->ret = getaddrinfo(a->node, a->service, a->hints, &a->res);
-    a->errnum = errno;
-    must(write(a->fds[1], &(int){1}, sizeof(int)) == sizeof(int));
-    while (!atomic_load(&a->returned)) {
-        sched_yield();
+inline
+static int mutex_tryrdlock(struct coroutine *co, struct neco_mutex *mu,
+    bool tryonly, int64_t deadline)
+{
+    if (!tryonly) {
+        int ret = checkdl(co, deadline);
+        if (ret != NECO_OK) {
+            return ret;
+        }
     }
-    gai_args_free(a);
-    atomic_fetch_sub(&getaddrinfo_th_counter, 1);
-    return NULL;
+    if (!colist_is_empty(&mu->queue) || (mu->rlocked == 0 && mu->locked)) {
+        return NECO_BUSY;
+    }
+    mu->rlocked++;
+    mu->locked = true;
+    return NECO_OK;
 }
 
-static bool is_ip_address(const char *addr) {
-    bool ok = false;
-    if (addr) {
-        struct in6_addr result;
-        ok = inet_pton(AF_INET, addr, &result) == 1 || 
-             inet_pton(AF_INET6, addr, &result) == 1;
+int neco_mutex_trylock(neco_mutex *mutex) {
+    struct coroutine *co = coself();
+    struct neco_mutex *mu = (void*)mutex;
+    int ret = check_mutex(co, mu);
+    if (ret != NECO_OK) {
+        return ret;
     }
-    return ok;
+    if (mu->shared) {
+        xlock(&mu->lock);
+    }
+    ret = mutex_trylock(co, mu, true, 0);
+    if (mu->shared) {
+        xunlock(&mu->lock);
+    }
+    async_error_guard(ret);
+    return ret;
 }
 
-static void cleanup_gai(void *ptr) {
-    // This notifies the gai thread that it should return. The thread itself
-    // will do the actual cleanup of resources.
-    struct getaddrinfo_args *args = ptr;
-    atomic_store(&args->returned, 1);
+int neco_mutex_tryrdlock(neco_mutex *mutex) {
+    struct coroutine *co = coself();
+    struct neco_mutex *mu = (void*)mutex;
+    int ret = check_mutex(co, mu);
+    if (ret != NECO_OK) {
+        return ret;
+    }
+    if (mu->shared) {
+        xlock(&mu->lock);
+    }
+    ret = mutex_tryrdlock(co, mu, true, 0);
+    if (mu->shared) {
+        xunlock(&mu->lock);
+    }
+    async_error_guard(ret);
+    return ret;
 }
 
-#ifdef _WIN32
-int pipe1(int fds[2]) {
-    return _pipe(fds, 64, _O_BINARY);
+noinline
+static int finish_lock(struct coroutine *co, struct neco_mutex *mu, 
+    bool rlocked, int64_t deadline)
+{
+    co->rlocked = rlocked;
+    colist_push_back(&mu->queue, co);
+    rt->nlocked++;
+    copause(deadline);
+    rt->nlocked--;
+    remove_from_list(co);
+    co->rlocked = false;
+    return checkdl(co, INT64_MAX);
 }
-#else
-#define pipe1 pipe0
-#endif
 
-static int getaddrinfo_dl(const char *node, const char *service,
-    const struct addrinfo *hints, struct addrinfo **res, int64_t deadline)
+// Same as mutex_lock_dl() and neco_mutex_rdlock_dl() for a shared mutex. 
+// The unlocker hands the lock over to the coroutines it wakes.
+static int mutex_xlock(struct coroutine *co, struct neco_mutex *mu, 
+    bool rlocked, int64_t deadline)
 {
-    struct coroutine *co = coself();
-    if (!co) {
-        errno = EPERM;
-        return EAI_SYSTEM;
-    }
     int ret = checkdl(co, deadline);
     if (ret != NECO_OK) {
-        errno = ret == NECO_CANCELED ? ECANCELED : ETIMEDOUT;
-        return EAI_SYSTEM;
-    }
-    if (is_ip_address(node)) {
-        // This is a simple address. Since there's no DNS lookup involved we
-        // can use the standard getaddrinfo function without worrying about
-        // much delay.
-        return getaddrinfo(node, service, hints, res);
-    }
-
-    // DNS lookup is probably needed. This may cause network usage and who
-    // knows how long it will take to return. Here we'll use a background
-    // thread to do the work and we'll wait by using a local pipe.
-    struct getaddrinfo_args *args = gai_args_new(node, service, hints);
-    if (!args) {
-        return EAI_MEMORY;
+        return ret;
     }
-
-    // Create a pipe to communicate with the thread. This allows us to use the
-    // async neco_read() operation, which includes builtin deadline and cancel
-    // support. Using a traditional pthread mutexes or cond variables are not
-    // an option.
-    if (pipe1(args->fds) == -1) {
-        gai_args_free(args);
-        return EAI_SYSTEM;
+    xlock(&mu->lock);
+    if (rlocked) {
+        ret = mutex_tryrdlock(co, mu, true, 0);
+    } else {
+        ret = mutex_trylock(co, mu, true, 0);
     }
-#ifndef _WIN32
-    if (neco_setnonblock(args->fds[0], true, 0) == -1) {
-        gai_args_free(args);
-        return EAI_SYSTEM;
+    if (ret == NECO_BUSY) {
+        co->rlocked = rlocked;
+        colist_push_back(&mu->queue, co);
+        rt->nlocked++;
+        ret = xwait(&mu->lock, co, deadline);
+        rt->nlocked--;
+        if (ret != NECO_OK) {
+            remove_from_list(co);
+        }
+        co->rlocked = false;
     }
-#endif
+    xunlock(&mu->lock);
+    return ret;
+}
 
-    pthread_t th;
-#ifdef __FreeBSD__
-    // The pthread functions are not included in libc for FreeBSD, dynamically
-    // load the function instead.
-    int (*pthread_create)(pthread_t*,const pthread_attr_t*,void*(*)(void*),
-        void*);
-    int (*pthread_detach)(pthread_t);
-    args->dlhandle = dlopen("/usr/lib/libpthread.so", RTLD_LAZY);
-    if (!args->dlhandle) {
-        gai_args_free(args);
-        return EAI_SYSTEM;
-    }
-    pthread_create = (int(*)(pthread_t*,const pthread_attr_t*,void*(*)(void*),
-        void*))dlsym(args->dlhandle, "pthread_create");
-    pthread_detach = (int(*)(pthread_t))
-        dlsym(args->dlhandle, "pthread_detach");
-    if (!pthread_create || !pthread_detach) {
-        gai_args_free(args);
-        return EAI_SYSTEM;
+static int mutex_lock_dl(struct coroutine *co, struct neco_mutex *mu,
+    int64_t deadline)
+{
+    if (mu->shared) {
+        return mutex_xlock(co, mu, false, deadline);
     }
-#endif
-    atomic_fetch_add(&getaddrinfo_th_counter, 1);
-    ret = pthread_create0(&th, 0, getaddrinfo_th, args);
-    if (ret != 0) {
-        errno = ret;
-        gai_args_free(args);
-        atomic_fetch_sub(&getaddrinfo_th_counter, 1);
-        return EAI_SYSTEM;
+    int ret = mutex_trylock(co, mu, false, deadline);
+    if (ret == NECO_BUSY) {
+        // Another coroutine is holding this lock.
+        ret = finish_lock(co, mu, false, deadline);
     }
-    must(pthread_detach0(th) == 0);
+    return ret;
+}
 
-    // At this point the args are owned by the thread and all cleanup will
-    // happen there. The thread will complete the getaddrinfo operation.
-    // Then we'll steal the result and return it to the caller.
-    neco_cleanup_push(cleanup_gai, args);
-    int ready = 0;
-    ssize_t n = neco_read_dl(args->fds[0], &ready, sizeof(int), deadline);
-    ret = EAI_SYSTEM;
-    if (n != -1) {
-        must(ready == 1 && n == sizeof(int));
-        *res = args->res;
-        args->res = NULL;
-        ret = args->ret;
-        errno = args->errnum;
-        coyield();
+int neco_mutex_lock_dl(neco_mutex *mutex, int64_t deadline) {
+    struct coroutine *co = coself();
+    struct neco_mutex *mu = (void*)mutex;
+    int ret = check_mutex(co, mu);
+    if (ret != NECO_OK) {
+        return ret;
     }
-    neco_cleanup_pop(1);
+    ret = mutex_lock_dl(co, mu, deadline);
+    async_error_guard(ret);
     return ret;
 }
 
-/// Same as neco_getaddrinfo() but with a deadline parameter.
-int neco_getaddrinfo_dl(const char *node, const char *service,
-    const struct addrinfo *hints, struct addrinfo **res, int64_t deadline)
-{
-    int ret = getaddrinfo_dl(node, service, hints, res, deadline);
-    int err;
-    if (ret == 0) {
-        err = NECO_OK;
-    } else if (ret == EAI_SYSTEM) {
-        err = NECO_ERROR;
+int neco_mutex_lock(neco_mutex *mutex) {
+    return neco_mutex_lock_dl(mutex, INT64_MAX);
+}
+
+int neco_mutex_rdlock_dl(neco_mutex *mutex, int64_t deadline) {
+    struct coroutine *co = coself();
+    struct neco_mutex *mu = (void*)mutex;
+    int ret = check_mutex(co, mu);
+    if (ret != NECO_OK) {
+        return ret;
+    }
+    if (mu->shared) {
+        ret = mutex_xlock(co, mu, true, deadline);
     } else {
-        err = NECO_GAIERROR;
+        ret = mutex_tryrdlock(co, mu, false, deadline);
+        if (ret == NECO_BUSY) {
+            // Another coroutine is holding this lock.
+            ret = finish_lock(co, mu, true, deadline);
+        }
     }
-    async_error_guard(err);
+    async_error_guard(ret);
     return ret;
 }
 
-/// The getaddrinfo() function is used to get a list of addresses and port
-/// numbers for node (hostname) and service.
-/// 
-/// This is functionally identical to the Posix getaddrinfo function with the
-/// exception that it does not block, allowing for usage in a Neco coroutine.
-///
-/// @return On success, 0 is returned
-/// @return On error, a nonzero error code defined by the system. See the link
-///         below for a list.
-/// @see Posix
-/// @see https://www.man7.org/linux/man-pages/man3/getaddrinfo.3.html
-int neco_getaddrinfo(const char *node, const char *service,
-    const struct addrinfo *hints, struct addrinfo **res)
-{
-    return neco_getaddrinfo_dl(node, service, hints, res, INT64_MAX);
+int neco_mutex_rdlock(neco_mutex *mutex) {
+    return neco_mutex_rdlock_dl(mutex, INT64_MAX);
 }
 
-// Returns a host and port.
-// The host will need to be freed by the caller.  
-static int parse_tcp_addr(const char *addr, char **host, const char **port) {
-    size_t naddr = strlen(addr);
-    if (naddr == 0) {
-        return NECO_INVAL;
-    }
-    const char *colon = NULL;
-    for (size_t i = naddr-1; ; i--) {
-        if (addr[i] == ':') {
-            colon = addr+i;
-            break;
+// Same as mutex_fastunlock() for a shared mutex.
+static void mutex_xunlock(struct neco_mutex *mu) {
+    bool yield = false;
+    xlock(&mu->lock);
+    if (mu->locked && (mu->rlocked == 0 || --mu->rlocked == 0)) {
+        if (colist_is_empty(&mu->queue)) {
+            mu->locked = false;
         }
-        if (i == 0) {
-            break;
+        while (!colist_is_empty(&mu->queue)) {
+            struct coroutine *co = colist_pop_front(&mu->queue);
+            bool rlocked = co->rlocked;
+            yield = xwake(co) || yield;
+            if (!rlocked) {
+                break;
+            }
+            mu->rlocked++;
+            if (colist_is_empty(&mu->queue) || !mu->queue.head.next->rlocked) {
+                break;
+            }
         }
     }
-    if (!colon) {
-        return NECO_INVAL;
+    xunlock(&mu->lock);
+    xflush();
+    if (yield) {
+        yield_for_sched_resume();
     }
-    *port = colon+1;
-    naddr = (size_t)(colon-addr);
-    if (addr[0] == '[' && addr[naddr-1] == ']') {
-        addr++;
-        naddr -= 2;
+}
+
+static void mutex_fastunlock(struct neco_mutex *mu) {
+    if (mu->shared) {
+        mutex_xunlock(mu);
+        return;
     }
-    *host = malloc0(naddr+1);
-    if (!*host) {
-        return NECO_NOMEM;
+    if (!mu->locked) {
+        return;
     }
-    memcpy(*host, addr, naddr);
-    (*host)[naddr] = '\0';
-    return NECO_OK;
+    if (mu->rlocked > 0) {
+        // This lock is currently being used by a reader.
+        mu->rlocked--;
+        if (mu->rlocked > 0) {
+            // There are still more readers using this lock.
+            return;
+        }
+    }
+    if (colist_is_empty(&mu->queue)) {
+        // There are no more coroutines in the queue.
+        mu->locked = false;
+        return;
+    }
+    // Choose next coroutine to take the lock.
+    while (1) {
+        struct coroutine *co = colist_pop_front(&mu->queue);
+        // Schedule the coroutines to resume.
+        sched_resume(co);
+        if (co->rlocked) {
+            // The popped coroutine was a reader.
+            mu->rlocked++;
+            if (!colist_is_empty(&mu->queue) && mu->queue.head.next->rlocked) {
+                // The next in queue is also reader. 
+                // Allow it to continue too.
+                continue;
+            }
+        }
+        break;
+    }
+    yield_for_sched_resume();
 }
 
-int neco_errconv_from_gai(int errnum) {
-    switch (errnum) {
-    case EAI_MEMORY:
-        return NECO_NOMEM;
-    case EAI_SYSTEM:
-        return neco_errconv_from_sys();
-    default:
-        neco_gai_errno = errnum;
-        return NECO_GAIERROR;
+static int mutex_unlock(neco_mutex *mutex) {
+    struct coroutine *co = coself();
+    struct neco_mutex *mu = (void*)mutex;
+    int ret = check_mutex(co, mu);
+    if (ret != NECO_OK) {
+        return ret;
     }
+    mutex_fastunlock(mu);
+    coyield();
+    return NECO_OK;
 }
 
-static void cleanup_free_host(void *host) {
-    free0(host);
+int neco_mutex_unlock(neco_mutex *mutex) {
+    int ret = mutex_unlock(mutex);
+    error_guard(ret);
+    return ret;
 }
 
-// Returns NECO errors
-static int getaddrinfo_from_tcp_addr_dl(const char *addr, int tcp_vers, 
-    struct addrinfo **res, int64_t deadline)
+inline
+static int mutex_fastlock(struct coroutine *co, struct neco_mutex *mu,
+    int64_t deadline)
 {
-    char *host = NULL;
-    const char *port = 0;
-    int ret = parse_tcp_addr(addr, &host, &port);
+    if (!mu->shared && !mu->locked) {
+        mu->locked = true;
+        return NECO_OK;
+    }
+    int ret = mutex_lock_dl(co, mu, deadline);
+    async_error_guard(ret);
+    return ret;
+}
+
+#ifdef NECO_TESTING
+// An optimistic lock routine for testing only
+int neco_mutex_fastlock(neco_mutex *mutex, int64_t deadline) {
+    struct coroutine *co = coself();
+    return mutex_fastlock(co, (struct neco_mutex *)mutex, deadline);
+}
+#endif
+
+static int mutex_destroy(neco_mutex *mutex) {
+    struct coroutine *co = coself();
+    struct neco_mutex *mu = (void*)mutex;
+    int ret = check_mutex(co, mu);
     if (ret != NECO_OK) {
         return ret;
     }
-    struct addrinfo hints = { 0 };
-    hints.ai_family = AF_UNSPEC; 
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
-    hints.ai_family = tcp_vers;
-    struct addrinfo *ainfo = NULL;
-    const char *vhost = host;
-    if (vhost[0] == '\0') {
-        if (tcp_vers == AF_INET6) {
-            vhost = "::";
-        } else {
-            vhost = "0.0.0.0";
-        }
-    }
-    neco_cleanup_push(cleanup_free_host, host);
-    ret = neco_getaddrinfo_dl(vhost, port, &hints, &ainfo, deadline);
-    neco_cleanup_pop(1);
-    if (ret != 0) {
-        return neco_errconv_from_gai(ret);
-    }
-    // It has been observed on Linux that a getaddrinfo can successfully return
-    // but with an empty result. Let's check for that case and ensure an error
-    // is returned to the caller.
-    neco_gai_errno = EAI_FAIL;
-    ret = NECO_GAIERROR;
-    *res = 0;
-    if (ainfo) {
-        *res = ainfo;
-        ret = NECO_OK; 
-        neco_gai_errno = EAI_FAIL;
+    if (mu->locked) {
+        return NECO_BUSY;
     }
-    return ret;
+    memset(mu, 0, sizeof(struct neco_mutex));
+    return NECO_OK;
 }
 
+int neco_mutex_destroy(neco_mutex *mutex) {
+    int ret = mutex_destroy(mutex);
+    error_guard(ret);
+    return ret;
+}
 
+struct neco_waitgroup {
+    int64_t rtid;         // runtime id
+    struct colist queue;  // coroutine doubly linked list
+    int count;            // current wait count
+    bool shared;          // see neco_waitgroup_init_shared
+    atomic_bool lock;     // guards a shared waitgroup
+};
 
-static int getaddrinfo_from_tcp_addr_dl(const char *addr, int tcp_vers, 
-    struct addrinfo **res, int64_t deadline);
-
-int neco_errconv_from_sys(void);
+static_assert(sizeof(neco_waitgroup) >= sizeof(struct neco_waitgroup), "");
+static_assert(_Alignof(neco_waitgroup) == _Alignof(struct neco_waitgroup), "");
 
-static int setnonblock(int fd, bool nonblock, bool *oldnonblock) {
-#ifdef _WIN32
-    // There's no way to detect if a socket is in non-blocking mode in Windows.
-    return ioctlsocket(fd, FIONBIO, &(unsigned long){ nonblock });
-#else
-    int flags = fcntl0(fd, F_GETFL, 0);
-    if (flags == -1) {
-        return -1;
-    }
-    if (oldnonblock) {
-        *oldnonblock = (flags & O_NONBLOCK) == O_NONBLOCK;
+inline
+static int check_waitgroup(struct neco_waitgroup *wg) {
+    if (!wg) {
+        return NECO_INVAL;
+    } else if (!rt) {
+        return NECO_PERM;
+    } else if (wg->rtid == 0) {
+        return neco_waitgroup_init((neco_waitgroup*)wg);
+    } else if (rt->id != wg->rtid && !wg->shared) {
+        return NECO_PERM;
     }
-    if (nonblock) {
-        flags |= O_NONBLOCK;
-    } else {
-        flags &= ~O_NONBLOCK;
+    return NECO_OK;
+}
+
+static int waitgroup_init(neco_waitgroup *waitgroup) {
+    struct neco_waitgroup *wg = (void*)waitgroup;
+    if (!wg) {
+        return NECO_INVAL;
+    } else if (!rt) {
+        return NECO_PERM;
     }
-    return fcntl0(fd, F_SETFL, flags);
-#endif
+    memset(wg, 0, sizeof(struct neco_waitgroup));
+    wg->rtid = rt->id;
+    colist_init(&wg->queue);
+    return NECO_OK;
 }
 
-/// Change the non-blocking state for a file descriptor.
-/// @see Posix2
-int neco_setnonblock(int fd, bool nonblock, bool *oldnonblock) {
-    int ret = setnonblock(fd, nonblock, oldnonblock);
+
+int neco_waitgroup_init(neco_waitgroup *waitgroup) {
+    int ret = waitgroup_init(waitgroup);
     error_guard(ret);
     return ret;
 }
 
-static void cleanup_close_socket(void *arg) {
-    close(*(int*)arg);
-}
-
-static int dial_connect_dl(int domain, int type, int protocol, 
-    const struct sockaddr *addr, socklen_t addrlen, int64_t deadline)
-{
-    int fd = socket0(domain, type, protocol);
-    if (fd == -1) {
-        return -1;
-    }
-    if (neco_setnonblock(fd, true, 0) == -1) {
-        close(fd);
-        return -1;
-    }
-    int ret;
-    neco_cleanup_push(cleanup_close_socket, &fd);
-    ret = neco_connect_dl(fd, addr, addrlen, deadline);
-    if (ret == 0) {
-        ret = fd;
-        fd = -1;
+static int waitgroup_init_shared(neco_waitgroup *waitgroup) {
+    int ret = waitgroup_init(waitgroup);
+    if (ret == NECO_OK) {
+        ((struct neco_waitgroup*)waitgroup)->shared = true;
     }
-    neco_cleanup_pop(1);
     return ret;
 }
 
-static void cleanup_addrinfo(void *arg) {
-    struct addrinfo *ainfo = arg;
-    freeaddrinfo(ainfo);
+/// Initialize a waitgroup that coroutines of any thread may use, such as
+/// those running on a neco_pool.
+/// @param waitgroup The waitgroup
+/// @return NECO_OK Success
+/// @return NECO_INVAL An invalid parameter was provided
+/// @return NECO_PERM Operation called outside of a coroutine
+/// @see WaitGroups
+int neco_waitgroup_init_shared(neco_waitgroup *waitgroup) {
+    int ret = waitgroup_init_shared(waitgroup);
+    error_guard(ret);
+    return ret;
 }
 
-static int dial_tcp_dl(const char *addr, int tcp_vers, int64_t deadline) {
-    struct addrinfo *ainfo;
-    int ret = getaddrinfo_from_tcp_addr_dl(addr, tcp_vers, &ainfo, deadline);
+static int waitgroup_add(neco_waitgroup *waitgroup, int delta) {
+    struct neco_waitgroup *wg = (void*)waitgroup;
+    int ret = check_waitgroup(wg);
     if (ret != NECO_OK) {
         return ret;
     }
-    int fd;
-    neco_cleanup_push(cleanup_addrinfo, ainfo);
-    struct addrinfo *ai = ainfo;
-    do {
-        fd = dial_connect_dl(ai->ai_family, ai->ai_socktype, ai->ai_protocol, 
-            ai->ai_addr, ai->ai_addrlen, deadline);
-        if (fd != -1) {
-            break;
-        }
-        ai = ai->ai_next;
-    } while (ai);
-    if (fd == -1) {
-        fd = neco_errconv_from_sys();
+    if (wg->shared) {
+        xlock(&wg->lock);
     }
-    neco_cleanup_pop(1);
-    return fd;
-}
-
-static int dial_unix_dl(const char *addr, int64_t deadline) {
-    (void)addr; (void)deadline;
-#ifdef _WIN32
-    return NECO_PERM;
-#else
-    struct sockaddr_un unaddr = { .sun_family = AF_UNIX };
-    size_t naddr = strlen(addr);
-    if (naddr > sizeof(unaddr.sun_path) - 1) {
-        return NECO_INVAL;
+    int waiters = wg->count + delta;
+    if (waiters >= 0) {
+        wg->count = waiters;
     }
-    strncpy(unaddr.sun_path, addr, sizeof(unaddr.sun_path) - 1);
-    int fd = dial_connect_dl(AF_UNIX, SOCK_STREAM, 0, (void*)&unaddr,
-        sizeof(struct sockaddr_un), deadline);
-    if (fd == -1) {
-        fd = neco_errconv_from_sys();
+    if (wg->shared) {
+        xunlock(&wg->lock);
     }
-    return fd;
-#endif
+    return waiters < 0 ? NECO_NEGWAITGRP : NECO_OK;
 }
 
-static int dial_dl(const char *network, const char *address, int64_t deadline) {
-    if (neco_getid() <= 0) {
-        return NECO_PERM; 
-    } else if (!network || !address) {
-        return NECO_INVAL;
-    } else if (strcmp(network, "tcp") == 0) {
-        return dial_tcp_dl(address, 0, deadline);
-    } else if (strcmp(network, "tcp4") == 0) {
-        return dial_tcp_dl(address, AF_INET, deadline);
-    } else if (strcmp(network, "tcp6") == 0) {
-        return dial_tcp_dl(address, AF_INET6, deadline);
-    } else if (strcmp(network, "unix") == 0) {
-        return dial_unix_dl(address, deadline);
-    } else {
-        return NECO_INVAL;
-    }
-}
 
-/// Same as neco_dial() but with a deadline parameter. 
-int neco_dial_dl(const char *network, const char *address, int64_t deadline) {
-    int ret = dial_dl(network, address, deadline);
+int neco_waitgroup_add(neco_waitgroup *waitgroup, int delta) {
+    int ret = waitgroup_add(waitgroup, delta);
     error_guard(ret);
     return ret;
 }
 
-/// Connect to a remote server.
-///
-/// **Example**
-///
-/// ```c 
-/// int fd = neco_dial("tcp", "google.com:80");
-/// if (fd < 0) {
-///    // .. error, do something with it.
-/// }
-/// // Connected to google.com. Use neco_read(), neco_write(), or create a 
-/// // stream using neco_stream_make(fd).
-/// close(fd);
-/// ```
-/// @param network must be "tcp", "tcp4", "tcp6", or "unix".
-/// @param address the address to dial
-/// @return On success, file descriptor (non-blocking)
-/// @return On error, Neco error
-/// @see Networking
-/// @see neco_serve()
-int neco_dial(const char *network, const char *address) {
-    return neco_dial_dl(network, address, INT64_MAX);
+// Same as waitgroup_done() for a shared waitgroup.
+static int waitgroup_xdone(struct neco_waitgroup *wg) {
+    xlock(&wg->lock);
+    if (wg->count == 0) {
+        xunlock(&wg->lock);
+        return NECO_NEGWAITGRP;
+    }
+    wg->count--;
+    bool yield = false;
+    if (wg->count == 0) {
+        struct coroutine *co = colist_pop_front(&wg->queue);
+        while (co) {
+            yield = xwake(co) || yield;
+            co = colist_pop_front(&wg->queue);
+        }
+    }
+    xunlock(&wg->lock);
+    xflush();
+    if (yield) {
+        yield_for_sched_resume();
+    }
+    return NECO_OK;
 }
 
-static int listen_tcp_dl(const char *addr, int tcp_vers, int64_t deadline) {
-    struct addrinfo *ainfo;
-    int ret = getaddrinfo_from_tcp_addr_dl(addr, tcp_vers, &ainfo, deadline);
+static int waitgroup_done(neco_waitgroup *waitgroup) {
+    struct neco_waitgroup *wg = (void*)waitgroup;
+    int ret = check_waitgroup(wg);
     if (ret != NECO_OK) {
         return ret;
+    } else if (wg->shared) {
+        return waitgroup_xdone(wg);
     }
-    int fd = socket0(ainfo->ai_family, ainfo->ai_socktype, ainfo->ai_protocol);
-    bool ok = fd != -1 && setsockopt0(fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, 
-        sizeof(int)) != -1;
-    ok = ok && bind0(fd, ainfo->ai_addr, ainfo->ai_addrlen) != -1;
-    freeaddrinfo(ainfo);
-    ok = ok && listen0(fd, SOMAXCONN) != -1;
-    ok = ok && neco_setnonblock(fd, true, 0) != -1;
-    if (!ok) {
-        if (fd != -1) {
-            close(fd);
-            fd = -1;
+    if (wg->count == 0) {
+        return NECO_NEGWAITGRP;
+    }
+    wg->count--;
+    if (wg->count == 0 && !colist_is_empty(&wg->queue)) {
+        struct coroutine *co = colist_pop_front(&wg->queue);
+        if (colist_is_empty(&wg->queue)) {
+            // Only one waiter. Do a quick switch.
+            sco_resume(co->id);
+        } else {
+            // Many waiters. Batch them together.
+            do {
+                sched_resume(co);
+                co = colist_pop_front(&wg->queue);  
+            } while (co);
+            yield_for_sched_resume();
         }
     }
-    return fd;
+    return NECO_OK;
 }
 
-static int listen_unix_dl(const char *addr, int64_t deadline) {
-    (void)addr; (void)deadline;
-#ifdef _WIN32
-    return NECO_PERM;
-#else
-    int fd = socket0(AF_UNIX, SOCK_STREAM, 0);
-    if (fd == -1) {
-        return NECO_ERROR;
-    }
-    struct sockaddr_un unaddr;
-    memset(&unaddr, 0, sizeof(struct sockaddr_un));
-    unaddr.sun_family = AF_UNIX;
-    strncpy(unaddr.sun_path, addr, sizeof(unaddr.sun_path) - 1);
-    if (bind0(fd, (void*)&unaddr, sizeof(struct sockaddr_un)) == -1) {
-        close(fd);
-        return NECO_ERROR;
-    }
-    if (listen0(fd, SOMAXCONN) == -1) {
-        close(fd);
-        return NECO_ERROR;
+int neco_waitgroup_done(neco_waitgroup *waitgroup) {
+    int ret = waitgroup_done(waitgroup);
+    error_guard(ret);
+    return ret;
+}
+
+// Same as waitgroup_wait_dl() for a shared waitgroup.
+static int waitgroup_xwait(struct neco_waitgroup *wg, struct coroutine *co,
+    int64_t deadline)
+{
+    xlock(&wg->lock);
+    if (wg->count == 0) {
+        xunlock(&wg->lock);
+        coyield();
+        return NECO_OK;
     }
-    if (neco_setnonblock(fd, true, 0) == -1) {
-        close(fd);
-        return NECO_ERROR;
+    colist_push_back(&wg->queue, co);
+    rt->nwaitgroupers++;
+    int ret = xwait(&wg->lock, co, deadline);
+    rt->nwaitgroupers--;
+    if (ret != NECO_OK) {
+        remove_from_list(co);
     }
-    return fd;
-#endif
+    xunlock(&wg->lock);
+    return ret;
 }
 
-static int serve_dl(const char *network, const char *address, int64_t deadline)
-{
-    if (!network || !address) {
-        return NECO_INVAL;
-    } else if (neco_getid() <= 0) {
-        return NECO_PERM; 
-    } else if (strcmp(network, "tcp") == 0) {
-        return listen_tcp_dl(address, 0, deadline);
-    } else if (strcmp(network, "tcp4") == 0) {
-        return listen_tcp_dl(address, AF_INET, deadline);
-    } else if (strcmp(network, "tcp6") == 0) {
-        return listen_tcp_dl(address, AF_INET6, deadline);
-    } else if (strcmp(network, "unix") == 0) {
-        return listen_unix_dl(address, deadline);
-    } else {
-        return NECO_INVAL;
+static int waitgroup_wait_dl(neco_waitgroup *waitgroup, int64_t deadline) {
+    struct neco_waitgroup *wg = (void*)waitgroup;
+    int ret = check_waitgroup(wg);
+    if (ret != NECO_OK) {
+        return ret;
     }
+    struct coroutine *co = coself();
+    ret = checkdl(co, deadline);
+    if (ret != NECO_OK) {
+        return ret;
+    } else if (wg->shared) {
+        return waitgroup_xwait(wg, co, deadline);
+    }
+    if (wg->count == 0) {
+        // It's probably a good idea to yield to another coroutine.
+        coyield();
+        return NECO_OK;
+    }
+    // The coroutine was added to the deadliner queue. We can safely
+    // yield and wait to be woken at some point in the future.
+    colist_push_back(&wg->queue, co);
+    rt->nwaitgroupers++;
+    copause(deadline);
+    rt->nwaitgroupers--;
+    remove_from_list(co);
+    return checkdl(co, INT64_MAX);
 }
 
-/// Same as neco_serve() but with a deadline parameter. 
-int neco_serve_dl(const char *network, const char *address, int64_t deadline) {
-    int ret = serve_dl(network, address, deadline);
+int neco_waitgroup_wait_dl(neco_waitgroup *waitgroup, int64_t deadline) {
+    int ret = waitgroup_wait_dl(waitgroup, deadline);
     async_error_guard(ret);
     return ret;
 }
 
+int neco_waitgroup_wait(neco_waitgroup *waitgroup) {
+    return neco_waitgroup_wait_dl(waitgroup, INT64_MAX);
+}
 
-/// Listen on a local network address.
-///
-/// **Example**
-///
-/// ```c 
-/// int servefd = neco_serve("tcp", "127.0.0.1:8080");
-/// if (servefd < 0) {
-///    // .. error, do something with it.
-/// }
-/// while (1) {
-///     int fd = neco_accept(servefd, 0, 0);
-///     // client accepted
-/// }
-///
-/// close(servefd);
-/// ```
-/// @param network must be "tcp", "tcp4", "tcp6", or "unix".
-/// @param address the address to serve on
-/// @return On success, file descriptor (non-blocking)
-/// @return On error, Neco error
-/// @see Networking
-/// @see neco_dial()
-int neco_serve(const char *network, const char *address) {
-    return neco_serve_dl(network, address, INT64_MAX);
+static int waitgroup_destroy(neco_waitgroup *waitgroup) {
+    struct neco_waitgroup *wg = (void*)waitgroup;
+    int ret = check_waitgroup(wg);
+    if (ret != NECO_OK) {
+        return ret;
+    }
+    memset(wg, 0, sizeof(struct neco_waitgroup));
+    return NECO_OK;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// sync 
-////////////////////////////////////////////////////////////////////////////////
+int neco_waitgroup_destroy(neco_waitgroup *waitgroup) {
+    int ret = waitgroup_destroy(waitgroup);
+    error_guard(ret);
+    return ret;
+}
 
-struct neco_mutex {
+struct neco_cond {
     int64_t rtid;        // runtime id
     struct colist queue; // coroutine doubly linked list
-    int  rlocked;        // read lock counter
-    bool locked;         // mutex is locked (read or write)
 };
 
-static_assert(sizeof(neco_mutex) >= sizeof(struct neco_mutex), "");
-static_assert(_Alignof(neco_mutex) == _Alignof(struct neco_mutex), "");
+static_assert(sizeof(neco_cond) >= sizeof(struct neco_cond), "");
+static_assert(_Alignof(neco_cond) == _Alignof(struct neco_cond), "");
 
-static int mutex_init(neco_mutex *mutex) {
-    struct neco_mutex *mu = (void*)mutex;
-    if (!mu) {
+static int cond_init0(struct neco_cond *cv) {
+    memset(cv, 0, sizeof(struct neco_cond));
+    cv->rtid = rt->id;
+    colist_init(&cv->queue);
+    return NECO_OK;
+}
+
+static int cond_init(neco_cond *cond) {
+    struct neco_cond *cv = (void*)cond;
+    if (!cv) {
         return NECO_INVAL;
     } else if (!rt) {
         return NECO_PERM;
     }
-    memset(mu, 0, sizeof(struct neco_mutex));
-    mu->rtid = rt->id;
-    colist_init(&mu->queue);
-    return NECO_OK;
+    return cond_init0((struct neco_cond*)cond);
 }
 
-int neco_mutex_init(neco_mutex *mutex) {
-    int ret = mutex_init(mutex);
+int neco_cond_init(neco_cond *cond) {
+    int ret = cond_init(cond);
     error_guard(ret);
     return ret;
 }
 
 inline
-static int check_mutex(struct coroutine *co, struct neco_mutex *mu) {
-    if (!mu) {
+static int check_cond(struct neco_cond *cv) {
+    if (!cv) {
         return NECO_INVAL;
-    } else if (!co) {
+    } else if (!rt) {
         return NECO_PERM;
-    } else if (mu->rtid == 0) {
-        return neco_mutex_init((neco_mutex*)mu);
-    } else if (rt->id != mu->rtid) {
+    } else if (cv->rtid == 0) {
+        return cond_init0(cv);
+    } else if (rt->id != cv->rtid) {
         return NECO_PERM;
     }
     return NECO_OK;
 }
 
-inline
-static int mutex_trylock(struct coroutine *co, struct neco_mutex *mu, 
-    bool tryonly, int64_t deadline)
-{
-    if (!tryonly) {
-        int ret = checkdl(co, deadline);
-        if (ret != NECO_OK) {
-            return ret;
-        }
+static int cond_destroy(neco_cond *cond) {
+    struct neco_cond *cv = (void*)cond;
+    int ret = check_cond(cv);
+    if (ret != NECO_OK) {
+        return ret;
     }
-    if (mu->locked) {
-        return NECO_BUSY;
+    memset(cv, 0, sizeof(struct neco_cond));
+    return NECO_OK;
+}
+
+int neco_cond_destroy(neco_cond *cond) {
+    int ret = cond_destroy(cond);
+    error_guard(ret);
+    return ret;
+}
+
+static int cond_signal(neco_cond *cond) {
+    struct neco_cond *cvar = (void*)cond;
+    int ret = check_cond(cvar);
+    if (ret != NECO_OK) {
+        return ret;
+    }
+    struct coroutine *co = colist_pop_front(&cvar->queue);
+    if (co) {
+        sco_resume(co->id);
     }
-    mu->locked = true;
     return NECO_OK;
 }
 
-inline
-static int mutex_tryrdlock(struct coroutine *co, struct neco_mutex *mu,
-    bool tryonly, int64_t deadline)
-{
-    if (!tryonly) {
-        int ret = checkdl(co, deadline);
-        if (ret != NECO_OK) {
-            return ret;
-        }
+int neco_cond_signal(neco_cond *cond) {
+    int ret = cond_signal(cond);
+    error_guard(ret);
+    return ret;
+}
+
+static int cond_broadcast(neco_cond *cond) {
+    struct neco_cond *cvar = (void*)cond;
+    int ret = check_cond(cvar);
+    if (ret != NECO_OK) {
+        return ret;
     }
-    if (!colist_is_empty(&mu->queue) || (mu->rlocked == 0 && mu->locked)) {
-        return NECO_BUSY;
+    struct coroutine *co = colist_pop_front(&cvar->queue);
+    while (co) {
+        sched_resume(co);
+        co = colist_pop_front(&cvar->queue);
     }
-    mu->rlocked++;
-    mu->locked = true;
+    yield_for_sched_resume();
     return NECO_OK;
 }
 
-int neco_mutex_trylock(neco_mutex *mutex) {
+int neco_cond_broadcast(neco_cond *cond) {
+    int ret = cond_broadcast(cond);
+    error_guard(ret);
+    return ret;
+}
+
+static int cond_wait_dl(neco_cond *cond, neco_mutex *mutex, int64_t deadline) {
+    struct neco_cond *cvar = (struct neco_cond*)cond;
+    int ret = check_cond(cvar);
+    if (ret != NECO_OK) {
+        return ret;
+    }
     struct coroutine *co = coself();
-    struct neco_mutex *mu = (void*)mutex;
-    int ret = check_mutex(co, mu);
+    struct neco_mutex *mu = (struct neco_mutex*)mutex;
+    ret = check_mutex(co, mu);
     if (ret != NECO_OK) {
         return ret;
     }
-    ret = mutex_trylock(co, mu, true, 0);
+    if (co->canceled) {
+        co->canceled = false;
+        return NECO_CANCELED;
+    }
+    mutex_fastunlock(mu);
+    // The coroutine was added to the deadliner queue. We can safely
+    // yield and wait to be woken at some point in the future.
+    colist_push_back(&cvar->queue, co);
+    rt->ncondwaiters++;
+    copause(deadline);
+    rt->ncondwaiters--;
+    remove_from_list(co);
+    ret = checkdl(co, INT64_MAX);
+    // Must relock.
+    while (mutex_fastlock(co, mu, INT64_MAX) != NECO_OK) { }
+    return ret;
+}
+
+int neco_cond_wait_dl(neco_cond *cond, neco_mutex *mutex, int64_t deadline) {
+    int ret = cond_wait_dl(cond, mutex, deadline);
     async_error_guard(ret);
     return ret;
 }
 
-int neco_mutex_tryrdlock(neco_mutex *mutex) {
-    struct coroutine *co = coself();
-    struct neco_mutex *mu = (void*)mutex;
-    int ret = check_mutex(co, mu);
-    if (ret != NECO_OK) {
-        return ret;
-    }
-    ret = mutex_tryrdlock(co, mu, true, 0);
-    async_error_guard(ret);
+int neco_cond_wait(neco_cond *cond, neco_mutex *mutex) {
+    return neco_cond_wait_dl(cond, mutex, INT64_MAX);
+}
+
+// Returns a string that indicates which coroutine method is being used by
+// the program. Such as "asm,aarch64" or "ucontext", etc.
+const char *neco_switch_method(void) {
+    return sco_info_method();
+}
+
+static int setcanceltype(int type, int *oldtype) {
+    if (type != NECO_CANCEL_ASYNC && type != NECO_CANCEL_INLINE) {
+        return NECO_INVAL;
+    }
+    struct coroutine *co = coself();
+    if (!co) {
+        return NECO_PERM;
+    }
+    if (oldtype) {
+        *oldtype = co->canceltype;
+    }
+    co->canceltype = type;
+    return NECO_OK;
+}
+
+int neco_setcanceltype(int type, int *oldtype) {
+    int ret = setcanceltype(type, oldtype);
+    error_guard(ret);
+    return ret;
+}
+
+static int setcancelstate(int state, int *oldstate) {
+    if (state != NECO_CANCEL_ENABLE && state != NECO_CANCEL_DISABLE) {
+        return NECO_INVAL;
+    }
+    struct coroutine *co = coself();
+    if (!co) {
+        return NECO_PERM;
+    }
+    if (oldstate) {
+        *oldstate = co->cancelstate;
+    }
+    co->cancelstate = state;
+    return NECO_OK;
+}
+
+int neco_setcancelstate(int state, int *oldstate) {
+    int ret = setcancelstate(state, oldstate);
+    error_guard(ret);
     return ret;
 }
 
-noinline
-static int finish_lock(struct coroutine *co, struct neco_mutex *mu, 
-    bool rlocked, int64_t deadline)
+static void cleanup_push(struct cleanup *handler, void (*routine)(void *),
+    void *arg)
 {
-    co->rlocked = rlocked;
-    colist_push_back(&mu->queue, co);
-    rt->nlocked++;
-    copause(deadline);
-    rt->nlocked--;
-    remove_from_list(co);
-    co->rlocked = false;
-    return checkdl(co, INT64_MAX);
+    struct coroutine *co = coself();
+    handler->routine = routine;
+    handler->arg = arg;
+    handler->next = co->cleanup;
+    co->cleanup = handler;
 }
 
-static int mutex_lock_dl(struct coroutine *co, struct neco_mutex *mu,
-    int64_t deadline)
-{
-    int ret = mutex_trylock(co, mu, false, deadline);
-    if (ret == NECO_BUSY) {
-        // Another coroutine is holding this lock.
-        ret = finish_lock(co, mu, false, deadline);
+static void cleanup_pop(int execute) {
+    struct coroutine *co = coself();
+    struct cleanup *handler = co->cleanup;
+    co->cleanup = handler->next;
+    if (execute && handler->routine) {
+        handler->routine(handler->arg);
     }
-    return ret;
 }
 
-int neco_mutex_lock_dl(neco_mutex *mutex, int64_t deadline) {
-    struct coroutine *co = coself();
-    struct neco_mutex *mu = (void*)mutex;
-    int ret = check_mutex(co, mu);
-    if (ret != NECO_OK) {
-        return ret;
-    }
-    ret = mutex_lock_dl(co, mu, deadline);
-    async_error_guard(ret);
-    return ret;
+static_assert(sizeof(struct cleanup) <= 32, "");
+
+void __neco_c0(void *cl, void (*routine)(void *), void *arg) {
+    cleanup_push(cl, routine, arg);
 }
 
-int neco_mutex_lock(neco_mutex *mutex) {
-    return neco_mutex_lock_dl(mutex, INT64_MAX);
+void __neco_c1(int execute) {
+    cleanup_pop(execute);
 }
 
-int neco_mutex_rdlock_dl(neco_mutex *mutex, int64_t deadline) {
+// coexit is performed at the exit of every coroutine. 
+// Most general coroutine cleanup is performed here because this operation
+// always runs from inside of the coroutine context/stack and during a standard
+// runtime scheduler step.
+// The async flag indicates that the coroutine is being exited before the entry
+// function has been completed. In this case the cleanup push/pop stack stack
+// will immediately be unrolled and the coroutine will cease execution.
+noinline
+static void coexit(bool async) {
+    // The current coroutine _must_ exit.
     struct coroutine *co = coself();
-    struct neco_mutex *mu = (void*)mutex;
-    int ret = check_mutex(co, mu);
-    if (ret != NECO_OK) {
-        return ret;
-    }
-    ret = mutex_tryrdlock(co, mu, false, deadline);
-    if (ret == NECO_BUSY) {
-        // Another coroutine is holding this lock.
-        ret = finish_lock(co, mu, true, deadline);
+
+    if (async) {
+        // Run the cleanup stack
+        while (co->cleanup) {
+            cleanup_pop(1);
+        }
     }
-    async_error_guard(ret);
-    return ret;
-}
 
-int neco_mutex_rdlock(neco_mutex *mutex) {
-    return neco_mutex_rdlock_dl(mutex, INT64_MAX);
-}
+    // Delete from map 
+    comap_delete(&rt->all, co);
 
-static void mutex_fastunlock(struct neco_mutex *mu) {
-    if (!mu->locked) {
-        return;
+    // Notify all cancel waiters (if any)
+    bool sched = false;
+    struct coroutine *cowaiter = colist_pop_front(&co->cancellist);
+    while (cowaiter) {
+        sched_resume(cowaiter);
+        sched = true;
+        cowaiter = colist_pop_front(&co->cancellist);
     }
-    if (mu->rlocked > 0) {
-        // This lock is currently being used by a reader.
-        mu->rlocked--;
-        if (mu->rlocked > 0) {
-            // There are still more readers using this lock.
-            return;
-        }
+
+    // Notify all join waiters (if any)
+    cowaiter = colist_pop_front(&co->joinlist);
+    while (cowaiter) {
+        sched_resume(cowaiter);
+        sched = true;
+        cowaiter = colist_pop_front(&co->joinlist);
     }
-    if (colist_is_empty(&mu->queue)) {
-        // There are no more coroutines in the queue.
-        mu->locked = false;
-        return;
+
+    // Close the generator
+    if (co->gen) {
+        chan_close((void*)co->gen);
+        chan_fastrelease((void*)co->gen);
+        co->gen = 0;
     }
-    // Choose next coroutine to take the lock.
-    while (1) {
-        struct coroutine *co = colist_pop_front(&mu->queue);
-        // Schedule the coroutines to resume.
-        sched_resume(co);
-        if (co->rlocked) {
-            // The popped coroutine was a reader.
-            mu->rlocked++;
-            if (!colist_is_empty(&mu->queue) && mu->queue.head.next->rlocked) {
-                // The next in queue is also reader. 
-                // Allow it to continue too.
-                continue;
-            }
-        }
-        break;
+
+    // Free the call arguments
+    cofreeargs(co);
+
+#ifdef NECO_USEARENAS
+    // Return all arena blocks to the thread's pool
+    arena_release(&co->arena);
+#endif
+
+    if (sched) { 
+        yield_for_sched_resume();
     }
-    yield_for_sched_resume();
-}
 
-static int mutex_unlock(neco_mutex *mutex) {
-    struct coroutine *co = coself();
-    struct neco_mutex *mu = (void*)mutex;
-    int ret = check_mutex(co, mu);
-    if (ret != NECO_OK) {
-        return ret;
+    if (async) {
+        sco_exit();
     }
-    mutex_fastunlock(mu);
-    coyield();
-    return NECO_OK;
 }
 
-int neco_mutex_unlock(neco_mutex *mutex) {
-    int ret = mutex_unlock(mutex);
-    error_guard(ret);
-    return ret;
+static void co_pipe(int argc, void *argv[]) {
+    must(argc == 3);
+    char *path = argv[0];
+    int64_t secret = *(int64_t*)argv[1];
+    int *fd_out = argv[2];
+    int fd = neco_dial("unix", path);
+    neco_write(fd, &secret, 8);
+    *fd_out = fd;
 }
 
-inline
-static int mutex_fastlock(struct coroutine *co, struct neco_mutex *mu,
-    int64_t deadline)
-{
-    if (!mu->locked) {
-        mu->locked = true;
-        return NECO_OK;
+static int _pipe_(int pipefd[2]) {
+    if (!pipefd) {
+        errno = EINVAL;
+        return -1;
     }
-    int ret = mutex_lock_dl(co, mu, deadline);
-    async_error_guard(ret);
+    if (!rt) {
+        errno = EPERM;
+        return -1;
+    }
+    int oldstate = 0;
+    neco_setcancelstate(NECO_CANCEL_DISABLE, &oldstate);
+    int fd0 = -2;
+    int fd1 = -2;
+    int ret = -1;
+    int64_t secret;
+    uint64_t tmpkey;
+    neco_rand(&secret, 8, NECO_PRNG);
+    neco_rand(&tmpkey, 8, NECO_PRNG);
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/tmp/neco.%" PRIu64 ".sock", tmpkey);
+    int ln = neco_serve("unix", path);
+    int64_t childid = 0;
+    if (ln > 0) {
+        // State a coroutine to connect to the listener.
+        int nret = neco_start(co_pipe, 3, path, &secret, &fd0);
+        neco_errconv_to_sys(nret);
+        if (nret == NECO_OK) {
+            childid = neco_lastid();
+            int64_t dl = neco_now() + NECO_SECOND * 5;
+            fd1 = neco_accept_dl(ln, 0, 0, dl);
+            neco_errconv_to_sys(fd1);
+            if (fd1 > 0) {
+                // Other side of pipe is connected.
+                // Waiting for the handshake.
+                int64_t data;
+                ssize_t n = neco_read_dl(fd1, &data, 8, dl);
+                neco_errconv_to_sys(n);
+                if (n == 8 && data == secret) {
+                    // Handshake good.
+                    ret = 0;
+                }
+            }
+        }
+        close(ln);
+        unlink(path);
+    }
+    int perrno = errno;
+    if (ret == 0) {
+        neco_join(childid);
+        pipefd[0] = fd0;
+        pipefd[1] = fd1;
+        fd0 = -1;
+        fd1 = -1;
+    }
+    close(fd0);
+    close(fd1);
+    neco_setcancelstate(oldstate, 0);
+    errno = perrno;
     return ret;
 }
 
-#ifdef NECO_TESTING
-// An optimistic lock routine for testing only
-int neco_mutex_fastlock(neco_mutex *mutex, int64_t deadline) {
-    struct coroutine *co = coself();
-    return mutex_fastlock(co, (struct neco_mutex *)mutex, deadline);
+/// Create a bidirection data channel for communicating between threads.
+/// @param pipefd The array pipefd is used to return two file descriptors 
+//  referring to the ends of the pipe.
+/// @return On success, zero is returned. On error, -1 is returned, errno is
+/// set to indicate the error, and pipefd is left unchanged.
+/// @note This is the POSIX equivalent of `pipe()` with the following changes:
+/// The original `pipe()` function only creates a unidirectional data channel
+/// while this one is bidirectional, meaning that both file descriptors can
+/// be used by different threads for both reading and writing, similar to a
+/// socket. Also, the file descriptors are returned in non-blocking state.
+int neco_pipe(int pipefd[2]) {
+    int ret = _pipe_(pipefd);
+    error_guard(ret);
+    return ret;
 }
-#endif
 
-static int mutex_destroy(neco_mutex *mutex) {
-    struct coroutine *co = coself();
-    struct neco_mutex *mu = (void*)mutex;
-    int ret = check_mutex(co, mu);
+static int join_dl(int64_t id, int64_t deadline) {
+     struct coroutine *co = coself();
+    if (!co) {
+        return NECO_PERM;
+    }
+    struct coroutine *cotarg = cofind(id);
+    if (!cotarg) {
+        return NECO_OK;
+    }
+    int ret = checkdl(co, deadline);
     if (ret != NECO_OK) {
         return ret;
     }
-    if (mu->locked) {
-        return NECO_BUSY;
+    if (cotarg == co) {
+        return NECO_PERM;
     }
-    memset(mu, 0, sizeof(struct neco_mutex));
-    return NECO_OK;
+    colist_push_back(&cotarg->joinlist, co);
+    cotarg->njoinlist++;
+    copause(deadline);
+    remove_from_list(co);
+    cotarg->njoinlist--;
+    return checkdl(co, INT64_MAX);
 }
 
-int neco_mutex_destroy(neco_mutex *mutex) {
-    int ret = mutex_destroy(mutex);
-    error_guard(ret);
+/// Same as neco_join() but with a deadline parameter. 
+int neco_join_dl(int64_t id, int64_t deadline) {
+    int ret = join_dl(id, deadline);
+    async_error_guard(ret);
     return ret;
 }
 
-struct neco_waitgroup {
-    int64_t rtid;         // runtime id
-    struct colist queue;  // coroutine doubly linked list
-    int count;            // current wait count
+/// Wait for a coroutine to terminate.
+/// If that coroutine has already terminated or is not found, then this
+/// operation returns immediately.
+///
+/// **Example**
+///
+/// ```
+/// // Start a new coroutine
+/// neco_start(coroutine, 0);
+///
+/// // Get the identifier of the new coroutine.
+/// int64_t id = neco_lastid();
+///
+/// // Wait until the coroutine has terminated.
+/// neco_join(id);
+/// ```
+///
+/// @param id Coroutine identifier
+/// @return NECO_OK Success
+/// @return NECO_CANCELED Operation canceled
+/// @return NECO_PERM Operation called outside of a coroutine
+/// @see neco_join_dl()
+int neco_join(int64_t id) {
+    return neco_join_dl(id, INT64_MAX);
+}
+
+#define DEFAULT_BUFFER_SIZE 4096
+
+struct bufrd {
+    size_t len;
+    size_t pos;
+    size_t cap;
+    char *data;
 };
 
-static_assert(sizeof(neco_waitgroup) >= sizeof(struct neco_waitgroup), "");
-static_assert(_Alignof(neco_waitgroup) == _Alignof(struct neco_waitgroup), "");
+struct bufwr {
+    size_t len;
+    char *data;
+};
 
-inline
-static int check_waitgroup(struct neco_waitgroup *wg) {
-    if (!wg) {
+struct neco_stream {
+    int fd;
+    int64_t rtid;
+    bool buffered;
+
+    struct bufrd rd;
+    struct bufwr wr;
+    size_t cap;
+    char data[];
+};
+
+typedef struct neco_stream neco_stream;
+
+static int stream_make_buffered_size(neco_stream **stream, int fd, bool buffered,
+    size_t buffer_size)
+{
+    if (!stream || fd < 0) {
         return NECO_INVAL;
     } else if (!rt) {
         return NECO_PERM;
-    } else if (wg->rtid == 0) {
-        return neco_waitgroup_init((neco_waitgroup*)wg);
-    } else if (rt->id != wg->rtid) {
-        return NECO_PERM;
+    }
+    size_t memsize;
+    if (buffered) {
+        buffer_size = buffer_size == 0 ? DEFAULT_BUFFER_SIZE : buffer_size;
+        memsize = sizeof(neco_stream) + buffer_size;
+    } else {
+        memsize = offsetof(neco_stream, rd);
+    }
+    *stream = malloc0(memsize);
+    if (!*stream) {
+        return NECO_NOMEM;
+    }
+    memset(*stream, 0, memsize);
+    (*stream)->rtid = rt->id;
+    (*stream)->fd = fd;
+    (*stream)->buffered = buffered;
+    if (buffered) {
+        (*stream)->cap = buffer_size;
     }
     return NECO_OK;
 }
 
-static int waitgroup_init(neco_waitgroup *waitgroup) {
-    struct neco_waitgroup *wg = (void*)waitgroup;
-    if (!wg) {
-        return NECO_INVAL;
-    } else if (!rt) {
-        return NECO_PERM;
-    }
-    memset(wg, 0, sizeof(struct neco_waitgroup));
-    wg->rtid = rt->id;
-    colist_init(&wg->queue);
-    return NECO_OK;
+/// Create a buffered stream with a specific buffer size.
+///
+/// The same as neco_stream_make_buffered(), which uses 4096 bytes. The read
+/// buffer may still grow past buffer_size for neco_stream_peek() and
+/// neco_stream_readuntil().
+int neco_stream_make_buffered_size(neco_stream **stream, int fd, 
+    size_t buffer_size)
+{
+    int ret = stream_make_buffered_size(stream, fd, true, buffer_size);
+    error_guard(ret);
+    return ret;
 }
 
+int neco_stream_make_buffered(neco_stream **stream, int fd) {
+    int ret = stream_make_buffered_size(stream, fd, true, 0);
+    error_guard(ret);
+    return ret;
+}
 
-int neco_waitgroup_init(neco_waitgroup *waitgroup) {
-    int ret = waitgroup_init(waitgroup);
+int neco_stream_make(neco_stream **stream, int fd) {
+    int ret = stream_make_buffered_size(stream, fd, false, 0);
     error_guard(ret);
     return ret;
 }
 
-static int waitgroup_add(neco_waitgroup *waitgroup, int delta) {
-    struct neco_waitgroup *wg = (void*)waitgroup;
-    int ret = check_waitgroup(wg);
-    if (ret != NECO_OK) {
-        return ret;
+static int stream_release(neco_stream *stream) {
+    if (!stream) {
+        return NECO_INVAL;
+    } else if (!rt || stream->rtid != rt->id) {
+        return NECO_PERM;
     }
-    int waiters = wg->count + delta;
-    if (waiters < 0) {
-        return NECO_NEGWAITGRP;
+    if (stream->buffered) {
+        if (stream->rd.data && stream->rd.data != stream->data) {
+            free0(stream->rd.data);
+        }
+        if (stream->wr.data && stream->wr.data != stream->data) {
+            free0(stream->wr.data);
+        }
     }
-    wg->count = waiters;
+    free0(stream);
     return NECO_OK;
 }
 
-
-int neco_waitgroup_add(neco_waitgroup *waitgroup, int delta) {
-    int ret = waitgroup_add(waitgroup, delta);
+int neco_stream_release(neco_stream *stream) {
+    int ret = stream_release(stream);
     error_guard(ret);
     return ret;
 }
 
-static int waitgroup_done(neco_waitgroup *waitgroup) {
-    struct neco_waitgroup *wg = (void*)waitgroup;
-    int ret = check_waitgroup(wg);
-    if (ret != NECO_OK) {
-        return ret;
-    }
-    if (wg->count == 0) {
-        return NECO_NEGWAITGRP;
-    }
-    wg->count--;
-    if (wg->count == 0 && !colist_is_empty(&wg->queue)) {
-        struct coroutine *co = colist_pop_front(&wg->queue);
-        if (colist_is_empty(&wg->queue)) {
-            // Only one waiter. Do a quick switch.
-            sco_resume(co->id);
+static bool ensure_rd_data(neco_stream *stream) {
+    if (!stream->rd.data) {
+        stream->rd.cap = stream->cap;
+        if (!stream->wr.data) {
+            stream->rd.data = stream->data;
         } else {
-            // Many waiters. Batch them together.
-            do {
-                sched_resume(co);
-                co = colist_pop_front(&wg->queue);  
-            } while (co);
-            yield_for_sched_resume();
+            stream->rd.data = malloc0(stream->cap);
+            if (!stream->rd.data) {
+                return false;
+            }
         }
     }
-    return NECO_OK;
+    return true;
 }
 
-int neco_waitgroup_done(neco_waitgroup *waitgroup) {
-    int ret = waitgroup_done(waitgroup);
-    error_guard(ret);
-    return ret;
+static bool ensure_wr_data(neco_stream *stream) {
+    if (!stream->wr.data) {
+        if (!stream->rd.data) {
+            stream->wr.data = stream->data;
+        } else {
+            stream->wr.data = malloc0(stream->cap);
+            if (!stream->wr.data) {
+                return false;
+            }
+        }
+    }
+    return true;
 }
 
-static int waitgroup_wait_dl(neco_waitgroup *waitgroup, int64_t deadline) {
-    struct neco_waitgroup *wg = (void*)waitgroup;
-    int ret = check_waitgroup(wg);
-    if (ret != NECO_OK) {
-        return ret;
+static ssize_t stream_read_dl(neco_stream *stream, void *data, size_t nbytes,
+    int64_t deadline)
+{
+    if (!stream) {
+        return NECO_INVAL;
+    } else if (!rt || stream->rtid != rt->id) {
+        return NECO_PERM;
     }
-    struct coroutine *co = coself();
-    ret = checkdl(co, deadline);
-    if (ret != NECO_OK) {
-        return ret;
+    if (!stream->buffered) {
+        return neco_read_dl(stream->fd, data, nbytes, deadline);
     }
-    if (wg->count == 0) {
-        // It's probably a good idea to yield to another coroutine.
-        coyield();
-        return NECO_OK;
+    if (!ensure_rd_data(stream)) {
+        return NECO_NOMEM;
     }
-    // The coroutine was added to the deadliner queue. We can safely
-    // yield and wait to be woken at some point in the future.
-    colist_push_back(&wg->queue, co);
-    rt->nwaitgroupers++;
-    copause(deadline);
-    rt->nwaitgroupers--;
-    remove_from_list(co);
-    return checkdl(co, INT64_MAX);
+    if (stream->rd.len == 0) {
+        ssize_t n = neco_read_dl(stream->fd, stream->rd.data, stream->rd.cap, 
+            deadline);
+        if (n == -1) {
+            return neco_errconv_from_sys();
+        }
+        stream->rd.len = (size_t)n;
+        stream->rd.pos = 0;
+    }
+    nbytes = stream->rd.len < nbytes ? stream->rd.len : nbytes;
+    memcpy(data, stream->rd.data + stream->rd.pos, nbytes);
+    stream->rd.pos += nbytes;
+    stream->rd.len -= nbytes;
+    return (ssize_t)nbytes;
 }
 
-int neco_waitgroup_wait_dl(neco_waitgroup *waitgroup, int64_t deadline) {
-    int ret = waitgroup_wait_dl(waitgroup, deadline);
-    async_error_guard(ret);
+ssize_t neco_stream_read_dl(neco_stream *stream, void *data, size_t nbytes,
+    int64_t deadline)
+{
+    ssize_t ret = stream_read_dl(stream, data, nbytes, deadline);
+    if (ret == 0 && nbytes > 0 && neco_lasterr() == NECO_OK) {
+        ret = NECO_EOF;
+    }
+    error_guard(ret);
     return ret;
 }
 
-int neco_waitgroup_wait(neco_waitgroup *waitgroup) {
-    return neco_waitgroup_wait_dl(waitgroup, INT64_MAX);
+ssize_t neco_stream_read(neco_stream *stream, void *data, size_t nbytes) {
+    return neco_stream_read_dl(stream, data, nbytes, INT64_MAX);
 }
 
-static int waitgroup_destroy(neco_waitgroup *waitgroup) {
-    struct neco_waitgroup *wg = (void*)waitgroup;
-    int ret = check_waitgroup(wg);
-    if (ret != NECO_OK) {
-        return ret;
-    }
-    memset(wg, 0, sizeof(struct neco_waitgroup));
-    return NECO_OK;
+static ssize_t stream_readfull_dl(neco_stream *stream, void *data, 
+    size_t nbytes, int64_t deadline)
+{
+    ssize_t nread = 0;
+    do {
+        ssize_t n = neco_stream_read_dl(stream, data, nbytes, deadline);
+        if (n <= 0) {
+            if (nread == 0) {
+                nread = n;
+            }
+            return nread;
+        } else {
+            data = (char*)data + n;
+            nbytes -= (size_t)n;
+            nread += n;
+        }
+    } while (nbytes > 0);
+    return nread;
 }
 
-int neco_waitgroup_destroy(neco_waitgroup *waitgroup) {
-    int ret = waitgroup_destroy(waitgroup);
+ssize_t neco_stream_readfull_dl(neco_stream *stream, void *data, size_t nbytes,
+    int64_t deadline)
+{
+    ssize_t ret = stream_readfull_dl(stream, data, nbytes, deadline);
     error_guard(ret);
     return ret;
 }
 
-struct neco_cond {
-    int64_t rtid;        // runtime id
-    struct colist queue; // coroutine doubly linked list
-};
-
-static_assert(sizeof(neco_cond) >= sizeof(struct neco_cond), "");
-static_assert(_Alignof(neco_cond) == _Alignof(struct neco_cond), "");
-
-static int cond_init0(struct neco_cond *cv) {
-    memset(cv, 0, sizeof(struct neco_cond));
-    cv->rtid = rt->id;
-    colist_init(&cv->queue);
-    return NECO_OK;
+ssize_t neco_stream_readfull(neco_stream *stream, void *data, size_t nbytes) {
+    return neco_stream_readfull_dl(stream, data, nbytes, INT64_MAX);
 }
 
-static int cond_init(neco_cond *cond) {
-    struct neco_cond *cv = (void*)cond;
-    if (!cv) {
+static ssize_t stream_buffered_read_size(neco_stream *stream) {
+    if (!stream) {
         return NECO_INVAL;
-    } else if (!rt) {
+    } else if (!rt || stream->rtid != rt->id) {
         return NECO_PERM;
+    } else if (!stream->buffered) {
+        return 0;
     }
-    return cond_init0((struct neco_cond*)cond);
+    return (ssize_t)stream->rd.len;
 }
 
-int neco_cond_init(neco_cond *cond) {
-    int ret = cond_init(cond);
+ssize_t neco_stream_buffered_read_size(neco_stream *stream) {
+    ssize_t ret = stream_buffered_read_size(stream);
     error_guard(ret);
     return ret;
 }
 
-inline
-static int check_cond(struct neco_cond *cv) {
-    if (!cv) {
-        return NECO_INVAL;
-    } else if (!rt) {
-        return NECO_PERM;
-    } else if (cv->rtid == 0) {
-        return cond_init0(cv);
-    } else if (rt->id != cv->rtid) {
-        return NECO_PERM;
+/// Same as neco_stream_read_byte() but with a deadline parameter.
+int neco_stream_read_byte_dl(neco_stream *stream, int64_t deadline) {
+    unsigned char byte;
+    if (rt && stream && stream->rtid == rt->id && stream->buffered && 
+        stream->rd.len > 0 && checkdl(coself(), deadline) == NECO_OK)
+    {
+        // fast-track read byte
+        byte = (unsigned char)stream->rd.data[stream->rd.pos];
+        stream->rd.pos++;
+        stream->rd.len--;
+    } else {
+        ssize_t ret = neco_stream_read_dl(stream, &byte, 1, deadline);
+        if (ret != 1) {
+            return ret;
+        }
     }
-    return NECO_OK;
+    return byte;
 }
 
-static int cond_destroy(neco_cond *cond) {
-    struct neco_cond *cv = (void*)cond;
-    int ret = check_cond(cv);
-    if (ret != NECO_OK) {
-        return ret;
+/// Read and returns a single byte. If no byte is available, returns an error.
+int neco_stream_read_byte(neco_stream *stream) {
+    return neco_stream_read_byte_dl(stream, INT64_MAX);
+}
+
+static int stream_unread_byte(neco_stream *stream) {
+    if (!stream) {
+        return NECO_INVAL;
+    } else if (!rt || stream->rtid != rt->id) {
+        return NECO_PERM;
+    } else if (!stream->buffered || stream->rd.pos == 0) {
+        return NECO_UNREADFAIL;
     }
-    memset(cv, 0, sizeof(struct neco_cond));
+    stream->rd.pos--;
+    stream->rd.len++;
     return NECO_OK;
 }
 
-int neco_cond_destroy(neco_cond *cond) {
-    int ret = cond_destroy(cond);
+/// Unread the last byte. Only the most recently read byte can be unread.
+int neco_stream_unread_byte(neco_stream *stream) {
+    int ret = stream_unread_byte(stream);
     error_guard(ret);
     return ret;
 }
 
-static int cond_signal(neco_cond *cond) {
-    struct neco_cond *cvar = (void*)cond;
-    int ret = check_cond(cvar);
-    if (ret != NECO_OK) {
-        return ret;
+// Make the read buffer hold at least cap bytes, keeping the unread data.
+static bool grow_rd_data(neco_stream *stream, size_t cap) {
+    size_t newcap = stream->rd.cap;
+    while (newcap < cap) {
+        newcap *= 2;
     }
-    struct coroutine *co = colist_pop_front(&cvar->queue);
-    if (co) {
-        sco_resume(co->id);
+    char *data = malloc0(newcap);
+    if (!data) {
+        return false;
     }
-    return NECO_OK;
-}
-
-int neco_cond_signal(neco_cond *cond) {
-    int ret = cond_signal(cond);
-    error_guard(ret);
-    return ret;
+    memcpy(data, stream->rd.data+stream->rd.pos, stream->rd.len);
+    if (stream->rd.data != stream->data) {
+        free0(stream->rd.data);
+    }
+    stream->rd.data = data;
+    stream->rd.cap = newcap;
+    stream->rd.pos = 0;
+    return true;
 }
 
-static int cond_broadcast(neco_cond *cond) {
-    struct neco_cond *cvar = (void*)cond;
-    int ret = check_cond(cvar);
-    if (ret != NECO_OK) {
-        return ret;
+// Read from the file descriptor until at least nbytes are buffered. 
+// Returns NECO_EOF if the end of the stream came first.
+static int stream_fill_dl(neco_stream *stream, size_t nbytes, 
+    int64_t deadline)
+{
+    if (!ensure_rd_data(stream)) {
+        return NECO_NOMEM;
     }
-    struct coroutine *co = colist_pop_front(&cvar->queue);
-    while (co) {
-        sched_resume(co);
-        co = colist_pop_front(&cvar->queue);
+    if (nbytes > stream->rd.cap && !grow_rd_data(stream, nbytes)) {
+        return NECO_NOMEM;
+    }
+    while (stream->rd.len < nbytes) {
+        if (stream->rd.pos + nbytes > stream->rd.cap) {
+            // Not enough room at the end. Move the unread bytes to the front.
+            memmove(stream->rd.data, stream->rd.data+stream->rd.pos, 
+                stream->rd.len);
+            stream->rd.pos = 0;
+        }
+        size_t end = stream->rd.pos + stream->rd.len;
+        ssize_t n = neco_read_dl(stream->fd, stream->rd.data+end, 
+            stream->rd.cap-end, deadline);
+        if (n == -1) {
+            return neco_errconv_from_sys();
+        } else if (n == 0) {
+            return NECO_EOF;
+        }
+        stream->rd.len += (size_t)n;
     }
-    yield_for_sched_resume();
     return NECO_OK;
 }
 
-int neco_cond_broadcast(neco_cond *cond) {
-    int ret = cond_broadcast(cond);
-    error_guard(ret);
-    return ret;
-}
-
-static int cond_wait_dl(neco_cond *cond, neco_mutex *mutex, int64_t deadline) {
-    struct neco_cond *cvar = (struct neco_cond*)cond;
-    int ret = check_cond(cvar);
-    if (ret != NECO_OK) {
-        return ret;
+static ssize_t stream_peek_dl(neco_stream *stream, const void **data, 
+    size_t nbytes, int64_t deadline)
+{
+    if (!stream || !data) {
+        return NECO_INVAL;
+    } else if (!rt || stream->rtid != rt->id) {
+        return NECO_PERM;
+    } else if (!stream->buffered) {
+        return NECO_INVAL;
     }
-    struct coroutine *co = coself();
-    struct neco_mutex *mu = (struct neco_mutex*)mutex;
-    ret = check_mutex(co, mu);
-    if (ret != NECO_OK) {
+    int ret = stream_fill_dl(stream, nbytes, deadline);
+    if (ret != NECO_OK && (ret != NECO_EOF || stream->rd.len == 0)) {
         return ret;
     }
-    if (co->canceled) {
-        co->canceled = false;
-        return NECO_CANCELED;
-    }
-    mutex_fastunlock(mu);
-    // The coroutine was added to the deadliner queue. We can safely
-    // yield and wait to be woken at some point in the future.
-    colist_push_back(&cvar->queue, co);
-    rt->ncondwaiters++;
-    copause(deadline);
-    rt->ncondwaiters--;
-    remove_from_list(co);
-    ret = checkdl(co, INT64_MAX);
-    // Must relock.
-    while (mutex_fastlock(co, mu, INT64_MAX) != NECO_OK) { }
-    return ret;
+    *data = stream->rd.data + stream->rd.pos;
+    return (ssize_t)stream->rd.len;
 }
 
-int neco_cond_wait_dl(neco_cond *cond, neco_mutex *mutex, int64_t deadline) {
-    int ret = cond_wait_dl(cond, mutex, deadline);
-    async_error_guard(ret);
+/// Same as neco_stream_peek() but with a deadline parameter.
+ssize_t neco_stream_peek_dl(neco_stream *stream, const void **data, 
+    size_t nbytes, int64_t deadline)
+{
+    ssize_t ret = stream_peek_dl(stream, data, nbytes, deadline);
+    error_guard(ret);
     return ret;
 }
 
-int neco_cond_wait(neco_cond *cond, neco_mutex *mutex) {
-    return neco_cond_wait_dl(cond, mutex, INT64_MAX);
-}
-
-// Returns a string that indicates which coroutine method is being used by
-// the program. Such as "asm,aarch64" or "ucontext", etc.
-const char *neco_switch_method(void) {
-    return sco_info_method();
+/// Look at the buffered bytes of a stream without consuming them.
+///
+/// Reads from the file descriptor until at least nbytes are buffered, growing
+/// the buffer when nbytes is larger than its capacity, and points data at the
+/// first unread byte. Nothing is copied. Use neco_stream_consume() to move
+/// past the bytes that were used.
+///
+/// The pointer is only valid until the next read, peek, or consume on the
+/// stream.
+///
+/// ```
+/// // Read a 4-byte big endian length prefixed frame.
+/// const void *p;
+/// if (neco_stream_peek(stream, &p, 4) < 4) { return; }
+/// uint32_t len = ((uint8_t*)p)[0]<<24 | ((uint8_t*)p)[1]<<16 |
+///                ((uint8_t*)p)[2]<<8 | ((uint8_t*)p)[3];
+/// if (neco_stream_peek(stream, &p, 4+len) < 4+len) { return; }
+/// handle_frame((char*)p+4, len);
+/// neco_stream_consume(stream, 4+len);
+/// ```
+///
+/// @param stream A buffered stream
+/// @param data Pointer to the buffered bytes (out)
+/// @param nbytes Number of bytes wanted. Zero returns what is already
+///        buffered without reading.
+/// @return The number of bytes available at data, which is at least nbytes
+///         unless the end of the stream was reached
+/// @return NECO_EOF End of stream and nothing buffered
+/// @return NECO_INVAL The stream is not buffered
+/// @return NECO_NOMEM The buffer could not grow
+/// @return NECO_PERM Operation called outside of a coroutine
+/// @return NECO_TIMEDOUT Deadline has elapsed
+/// @return NECO_CANCELED Operation canceled
+ssize_t neco_stream_peek(neco_stream *stream, const void **data, 
+    size_t nbytes)
+{
+    return neco_stream_peek_dl(stream, data, nbytes, INT64_MAX);
 }
 
-static int setcanceltype(int type, int *oldtype) {
-    if (type != NECO_CANCEL_ASYNC && type != NECO_CANCEL_INLINE) {
+static int stream_consume(neco_stream *stream, size_t nbytes) {
+    if (!stream) {
         return NECO_INVAL;
-    }
-    struct coroutine *co = coself();
-    if (!co) {
+    } else if (!rt || stream->rtid != rt->id) {
         return NECO_PERM;
+    } else if (!stream->buffered || nbytes > stream->rd.len) {
+        return NECO_INVAL;
     }
-    if (oldtype) {
-        *oldtype = co->canceltype;
-    }
-    co->canceltype = type;
+    stream->rd.pos += nbytes;
+    stream->rd.len -= nbytes;
     return NECO_OK;
 }
 
-int neco_setcanceltype(int type, int *oldtype) {
-    int ret = setcanceltype(type, oldtype);
+/// Discard buffered bytes, usually after looking at them with 
+/// neco_stream_peek().
+/// @return NECO_OK Success
+/// @return NECO_INVAL More bytes than are buffered, or not a buffered stream
+/// @return NECO_PERM Operation called outside of a coroutine
+int neco_stream_consume(neco_stream *stream, size_t nbytes) {
+    int ret = stream_consume(stream, nbytes);
     error_guard(ret);
     return ret;
 }
 
-static int setcancelstate(int state, int *oldstate) {
-    if (state != NECO_CANCEL_ENABLE && state != NECO_CANCEL_DISABLE) {
+static ssize_t stream_readuntil_dl(neco_stream *stream, int delim, 
+    size_t maxlen, const void **data, int64_t deadline)
+{
+    if (!stream || !data || maxlen == 0) {
         return NECO_INVAL;
-    }
-    struct coroutine *co = coself();
-    if (!co) {
+    } else if (!rt || stream->rtid != rt->id) {
         return NECO_PERM;
+    } else if (!stream->buffered) {
+        return NECO_INVAL;
     }
-    if (oldstate) {
-        *oldstate = co->cancelstate;
+    size_t scanned = 0;
+    while (1) {
+        // The buffer may not exist until the first fill.
+        size_t len = stream->rd.len < maxlen ? stream->rd.len : maxlen;
+        if (len > scanned) {
+            char *start = stream->rd.data + stream->rd.pos;
+            char *p = memchr(start+scanned, delim, len-scanned);
+            if (p) {
+                size_t n = (size_t)(p - start) + 1;
+                *data = start;
+                stream->rd.pos += n;
+                stream->rd.len -= n;
+                return (ssize_t)n;
+            }
+            scanned = len;
+        }
+        if (scanned == maxlen) {
+            // Leave the bytes buffered for the caller to peek at or consume.
+            return NECO_NOMEM;
+        }
+        int ret = stream_fill_dl(stream, stream->rd.len+1, deadline);
+        if (ret == NECO_EOF && stream->rd.len > 0) {
+            // The last bytes of the stream, without a delimiter.
+            size_t n = stream->rd.len;
+            *data = stream->rd.data + stream->rd.pos;
+            stream->rd.pos += n;
+            stream->rd.len = 0;
+            return (ssize_t)n;
+        } else if (ret != NECO_OK) {
+            return ret;
+        }
     }
-    co->cancelstate = state;
-    return NECO_OK;
 }
 
-int neco_setcancelstate(int state, int *oldstate) {
-    int ret = setcancelstate(state, oldstate);
+/// Same as neco_stream_readuntil() but with a deadline parameter.
+ssize_t neco_stream_readuntil_dl(neco_stream *stream, int delim, 
+    size_t maxlen, const void **data, int64_t deadline)
+{
+    ssize_t ret = stream_readuntil_dl(stream, delim, maxlen, data, deadline);
     error_guard(ret);
     return ret;
 }
 
-static void cleanup_push(struct cleanup *handler, void (*routine)(void *),
-    void *arg)
+/// Read up to and including the next delim byte, without copying.
+///
+/// Points data at the bytes in the stream's buffer and consumes them. The
+/// buffer grows as needed to hold the whole line or record, up to maxlen
+/// bytes. If the stream ends before a delimiter is found then the remaining
+/// bytes are returned and the last byte will not be delim.
+///
+/// The pointer is only valid until the next read, peek, or consume on the
+/// stream.
+///
+/// ```
+/// const void *line;
+/// ssize_t n;
+/// while ((n = neco_stream_readuntil(stream, '\n', 65536, &line)) > 0) {
+///     json_parse_line(line, n);
+/// }
+/// ```
+///
+/// @param stream A buffered stream
+/// @param delim The delimiter byte, such as '\n'
+/// @param maxlen The most bytes to read, including the delimiter
+/// @param data Pointer to the bytes read (out)
+/// @return The number of bytes read, including the delimiter
+/// @return NECO_EOF End of stream
+/// @return NECO_INVAL The stream is not buffered, or maxlen is zero
+/// @return NECO_NOMEM No delimiter within maxlen bytes, which are left 
+///         buffered, or the buffer could not grow
+/// @return NECO_PERM Operation called outside of a coroutine
+/// @return NECO_TIMEDOUT Deadline has elapsed
+/// @return NECO_CANCELED Operation canceled
+ssize_t neco_stream_readuntil(neco_stream *stream, int delim, 
+    size_t maxlen, const void **data)
 {
-    struct coroutine *co = coself();
-    handler->routine = routine;
-    handler->arg = arg;
-    handler->next = co->cleanup;
-    co->cleanup = handler;
+    return neco_stream_readuntil_dl(stream, delim, maxlen, data, INT64_MAX);
 }
 
-static void cleanup_pop(int execute) {
-    struct coroutine *co = coself();
-    struct cleanup *handler = co->cleanup;
-    co->cleanup = handler->next;
-    if (execute && handler->routine) {
-        handler->routine(handler->arg);
+static int stream_flush_dl(neco_stream *stream, int64_t deadline) {
+    if (!stream) {
+        return NECO_INVAL;
+    } else if (!rt || stream->rtid != rt->id) {
+        return NECO_PERM;
+    } else if (!stream->buffered) {
+        // Not buffered. Only need to check the deadline.
+        return checkdl(coself(), deadline);
     }
-}
-
-static_assert(sizeof(struct cleanup) <= 32, "");
-
-void __neco_c0(void *cl, void (*routine)(void *), void *arg) {
-    cleanup_push(cl, routine, arg);
-}
-
-void __neco_c1(int execute) {
-    cleanup_pop(execute);
-}
-
-// coexit is performed at the exit of every coroutine. 
-// Most general coroutine cleanup is performed here because this operation
-// always runs from inside of the coroutine context/stack and during a standard
-// runtime scheduler step.
-// The async flag indicates that the coroutine is being exited before the entry
-// function has been completed. In this case the cleanup push/pop stack stack
-// will immediately be unrolled and the coroutine will cease execution.
-noinline
-static void coexit(bool async) {
-    // The current coroutine _must_ exit.
-    struct coroutine *co = coself();
-
-    if (async) {
-        // Run the cleanup stack
-        while (co->cleanup) {
-            cleanup_pop(1);
+    ssize_t n = neco_write_dl(stream->fd, stream->wr.data, stream->wr.len, 
+        deadline);
+    if (n <= 0) {
+        if (n == 0 && stream->wr.len == 0) {
+            return NECO_OK;
+        } else {
+            return neco_errconv_from_sys();
         }
     }
-
-    // Delete from map 
-    comap_delete(&rt->all, co);
-
-    // Notify all cancel waiters (if any)
-    bool sched = false;
-    struct coroutine *cowaiter = colist_pop_front(&co->cancellist);
-    while (cowaiter) {
-        sched_resume(cowaiter);
-        sched = true;
-        cowaiter = colist_pop_front(&co->cancellist);
-    }
-
-    // Notify all join waiters (if any)
-    cowaiter = colist_pop_front(&co->joinlist);
-    while (cowaiter) {
-        sched_resume(cowaiter);
-        sched = true;
-        cowaiter = colist_pop_front(&co->joinlist);
-    }
-
-    // Close the generator
-    if (co->gen) {
-        chan_close((void*)co->gen);
-        chan_fastrelease((void*)co->gen);
-        co->gen = 0;
-    }
-
-    // Free the call arguments
-    cofreeargs(co);
-
-    if (sched) { 
-        yield_for_sched_resume();
+    if ((size_t)n < stream->wr.len) {
+        // parital write.
+        memmove(stream->wr.data, stream->wr.data+n, stream->wr.len-(size_t)n);
+        stream->wr.len -= (size_t)n;
+        return NECO_PARTIALWRITE;
+    } else {
+        stream->wr.len = 0;
+        return NECO_OK;
     }
+}
 
-    if (async) {
-        sco_exit();
-    }
+/// Same as neco_stream_flush() but with a deadline parameter.
+int neco_stream_flush_dl(neco_stream *stream, int64_t deadline) {
+    int ret = stream_flush_dl(stream, deadline);
+    async_error_guard(ret);
+    return ret;
 }
 
-static void co_pipe(int argc, void *argv[]) {
-    must(argc == 3);
-    char *path = argv[0];
-    int64_t secret = *(int64_t*)argv[1];
-    int *fd_out = argv[2];
-    int fd = neco_dial("unix", path);
-    neco_write(fd, &secret, 8);
-    *fd_out = fd;
+/// Flush writes any buffered data to the underlying file descriptor.
+int neco_stream_flush(neco_stream *stream) {
+    return neco_stream_flush_dl(stream, INT64_MAX);
 }
 
-static int _pipe_(int pipefd[2]) {
-    if (!pipefd) {
-        errno = EINVAL;
-        return -1;
+static ssize_t stream_write_dl(neco_stream *stream, const void *data, 
+    size_t nbytes, int64_t deadline)
+{
+    if (!stream) {
+        return NECO_INVAL;
+    } else if (!rt || stream->rtid != rt->id) {
+        return NECO_PERM;
     }
-    if (!rt) {
-        errno = EPERM;
-        return -1;
+    if (!stream->buffered) {
+        return neco_write_dl(stream->fd, data, nbytes, deadline);
     }
-    int oldstate = 0;
-    neco_setcancelstate(NECO_CANCEL_DISABLE, &oldstate);
-    int fd0 = -2;
-    int fd1 = -2;
-    int ret = -1;
-    int64_t secret;
-    uint64_t tmpkey;
-    neco_rand(&secret, 8, NECO_PRNG);
-    neco_rand(&tmpkey, 8, NECO_PRNG);
-    char path[PATH_MAX];
-    snprintf(path, sizeof(path), "/tmp/neco.%" PRIu64 ".sock", tmpkey);
-    int ln = neco_serve("unix", path);
-    int64_t childid = 0;
-    if (ln > 0) {
-        // State a coroutine to connect to the listener.
-        int nret = neco_start(co_pipe, 3, path, &secret, &fd0);
-        neco_errconv_to_sys(nret);
-        if (nret == NECO_OK) {
-            childid = neco_lastid();
-            int64_t dl = neco_now() + NECO_SECOND * 5;
-            fd1 = neco_accept_dl(ln, 0, 0, dl);
-            neco_errconv_to_sys(fd1);
-            if (fd1 > 0) {
-                // Other side of pipe is connected.
-                // Waiting for the handshake.
-                int64_t data;
-                ssize_t n = neco_read_dl(fd1, &data, 8, dl);
-                neco_errconv_to_sys(n);
-                if (n == 8 && data == secret) {
-                    // Handshake good.
-                    ret = 0;
+    if (!ensure_wr_data(stream)) {
+        return NECO_NOMEM;
+    }
+    ssize_t nwritten = 0;
+    while (nbytes > 0) {
+        if (stream->wr.len == stream->cap) {
+            // Buffer is full.
+            int ret = neco_stream_flush_dl(stream, deadline);
+            if (ret != NECO_OK) {
+                if (nwritten == 0) {
+                    nwritten = ret;
                 }
+                break;
             }
         }
-        close(ln);
-        unlink(path);
-    }
-    int perrno = errno;
-    if (ret == 0) {
-        neco_join(childid);
-        pipefd[0] = fd0;
-        pipefd[1] = fd1;
-        fd0 = -1;
-        fd1 = -1;
+        // Copy data into the buffer
+        size_t n = stream->cap - stream->wr.len;
+        n = n < nbytes ? n : nbytes;
+        memcpy(stream->wr.data+stream->wr.len, data, n);
+        stream->wr.len += n;
+        data = (char*)data + n;
+        nbytes -= n;
+        nwritten += n;
     }
-    close(fd0);
-    close(fd1);
-    neco_setcancelstate(oldstate, 0);
-    errno = perrno;
+    return nwritten;
+}
+
+ssize_t neco_stream_write_dl(neco_stream *stream, const void *data, 
+    size_t nbytes, int64_t deadline)
+{
+    ssize_t ret = stream_write_dl(stream, data, nbytes, deadline);
+    async_error_guard(ret);
     return ret;
 }
 
-/// Create a bidirection data channel for communicating between threads.
-/// @param pipefd The array pipefd is used to return two file descriptors 
-//  referring to the ends of the pipe.
-/// @return On success, zero is returned. On error, -1 is returned, errno is
-/// set to indicate the error, and pipefd is left unchanged.
-/// @note This is the POSIX equivalent of `pipe()` with the following changes:
-/// The original `pipe()` function only creates a unidirectional data channel
-/// while this one is bidirectional, meaning that both file descriptors can
-/// be used by different threads for both reading and writing, similar to a
-/// socket. Also, the file descriptors are returned in non-blocking state.
-int neco_pipe(int pipefd[2]) {
-    int ret = _pipe_(pipefd);
+ssize_t neco_stream_write(neco_stream *stream, const void *data, size_t nbytes){
+    return neco_stream_write_dl(stream, data, nbytes, INT64_MAX);
+}
+
+static ssize_t stream_buffered_write_size(neco_stream *stream) {
+    if (!stream) {
+        return NECO_INVAL;
+    } else if (!rt || stream->rtid != rt->id) {
+        return NECO_PERM;
+    } else if (!stream->buffered) {
+        return 0;
+    }
+    return (ssize_t)stream->wr.len;
+}
+
+ssize_t neco_stream_buffered_write_size(neco_stream *stream) {
+    ssize_t ret = stream_buffered_write_size(stream);
     error_guard(ret);
     return ret;
 }
 
-static int join_dl(int64_t id, int64_t deadline) {
-     struct coroutine *co = coself();
-    if (!co) {
+static int stream_close_dl(neco_stream *stream, int64_t deadline) {
+    if (!stream) {
+        return NECO_INVAL;
+    } else if (!rt || stream->rtid != rt->id) {
         return NECO_PERM;
     }
-    struct coroutine *cotarg = cofind(id);
-    if (!cotarg) {
-        return NECO_OK;
-    }
-    int ret = checkdl(co, deadline);
-    if (ret != NECO_OK) {
-        return ret;
-    }
-    if (cotarg == co) {
-        return NECO_PERM;
+    int ret = NECO_OK;
+    if (stream->buffered && (deadline < INT64_MAX || stream->wr.len > 0)) {
+        ret = stream_flush_dl(stream, deadline);
     }
-    colist_push_back(&cotarg->joinlist, co);
-    cotarg->njoinlist++;
-    copause(deadline);
-    remove_from_list(co);
-    cotarg->njoinlist--;
-    return checkdl(co, INT64_MAX);
+    close(stream->fd);
+    stream_release(stream);
+    return ret;
 }
 
-/// Same as neco_join() but with a deadline parameter. 
-int neco_join_dl(int64_t id, int64_t deadline) {
-    int ret = join_dl(id, deadline);
-    async_error_guard(ret);
+/// Close a stream with a deadline. 
+/// A deadline is provided to accomodate for buffered streams that may need to
+/// flush bytes on close
+int neco_stream_close_dl(neco_stream *stream, int64_t deadline) {
+    int ret = stream_close_dl(stream, deadline);
+    error_guard(ret);
     return ret;
 }
 
-/// Wait for a coroutine to terminate.
-/// If that coroutine has already terminated or is not found, then this
-/// operation returns immediately.
-///
-/// **Example**
-///
-/// ```
-/// // Start a new coroutine
-/// neco_start(coroutine, 0);
-///
-/// // Get the identifier of the new coroutine.
-/// int64_t id = neco_lastid();
-///
-/// // Wait until the coroutine has terminated.
-/// neco_join(id);
-/// ```
-///
-/// @param id Coroutine identifier
-/// @return NECO_OK Success
-/// @return NECO_CANCELED Operation canceled
-/// @return NECO_PERM Operation called outside of a coroutine
-/// @see neco_join_dl()
-int neco_join(int64_t id) {
-    return neco_join_dl(id, INT64_MAX);
+/// Close a stream
+int neco_stream_close(neco_stream *stream) {
+    return neco_stream_close_dl(stream, INT64_MAX);
 }
 
-#define DEFAULT_BUFFER_SIZE 4096
-
-struct bufrd {
-    size_t len;
-    size_t pos;
-    char *data;
-};
-
-struct bufwr {
-    size_t len;
-    char *data;
-};
+// pcg-family random number generator
 
-struct neco_stream {
-    int fd;
-    int64_t rtid;
-    bool buffered;
+static int64_t rincr(int64_t seed) {
+    return (int64_t)((uint64_t)(seed)*6364136223846793005 + 1);
+}
 
-    struct bufrd rd;
-    struct bufwr wr;
-    size_t cap;
-    char data[];
-};
+static uint32_t rgen(int64_t seed) {
+    uint64_t state = (uint64_t)seed;
+    uint32_t xorshifted = (uint32_t)(((state >> 18) ^ state) >> 27);
+    uint32_t rot = (uint32_t)(state >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
 
-typedef struct neco_stream neco_stream;
+static uint32_t rnext(int64_t *seed) {
+    *seed = rincr(rincr(*seed)); // twice called intentionally
+    uint32_t value = rgen(*seed);
+    return value;
+}
 
-static int stream_make_buffered_size(neco_stream **stream, int fd, bool buffered,
-    size_t buffer_size)
-{
-    if (!stream || fd < 0) {
-        return NECO_INVAL;
-    } else if (!rt) {
-        return NECO_PERM;
+static void pcgrandom_buf(void *data, size_t nbytes, int64_t *seed) {
+    while (nbytes >= 4) {
+        uint32_t value = rnext(seed);
+        ((char*)data)[0] = ((char*)&value)[0];
+        ((char*)data)[1] = ((char*)&value)[1];
+        ((char*)data)[2] = ((char*)&value)[2];
+        ((char*)data)[3] = ((char*)&value)[3];
+        data = (char*)data + 4;
+        nbytes -= 4;
     }
-    size_t memsize;
-    if (buffered) {
-        buffer_size = buffer_size == 0 ? DEFAULT_BUFFER_SIZE : buffer_size;
-        memsize = sizeof(neco_stream) + buffer_size;
-    } else {
-        memsize = offsetof(neco_stream, rd);
+    if (nbytes > 0) {
+        uint32_t value = rnext(seed);
+        for (size_t i = 0; i < nbytes; i++) {
+            ((char*)data)[i] = ((char*)&value)[i];
+        }
     }
-    *stream = malloc0(memsize);
-    if (!*stream) {
-        return NECO_NOMEM;
+}
+
+static int rand_setseed(int64_t seed, int64_t *oldseed) {
+    if (!rt) {
+        return NECO_PERM;
     }
-    memset(*stream, 0, memsize);
-    (*stream)->rtid = rt->id;
-    (*stream)->fd = fd;
-    (*stream)->buffered = buffered;
-    if (buffered) {
-        (*stream)->cap = buffer_size;
+    if (oldseed) {
+        *oldseed = rt->rand_seed;
     }
+    rt->rand_seed = seed;
     return NECO_OK;
 }
 
-int neco_stream_make_buffered_size(neco_stream **stream, int fd, 
-    size_t buffer_size)
-{
-    int ret = stream_make_buffered_size(stream, fd, true, buffer_size);
-    error_guard(ret);
-    return ret;
-}
-
-int neco_stream_make_buffered(neco_stream **stream, int fd) {
-    int ret = stream_make_buffered_size(stream, fd, true, 0);
-    error_guard(ret);
-    return ret;
-}
-
-int neco_stream_make(neco_stream **stream, int fd) {
-    int ret = stream_make_buffered_size(stream, fd, false, 0);
+/// Set the random seed for the Neco pseudorandom number generator.
+///
+/// The provided seed is only used for the (non-crypto) NECO_PRNG and is
+/// ignored for NECO_CPRNG.
+///
+/// @param seed 
+/// @param oldseed[out] The previous seed
+/// @return NECO_OK Success
+/// @return NECO_INVAL An invalid parameter was provided
+/// @return NECO_PERM Operation called outside of a coroutine
+/// @see Random
+int neco_rand_setseed(int64_t seed, int64_t *oldseed) {
+    int ret = rand_setseed(seed, oldseed);
     error_guard(ret);
     return ret;
 }
 
-static int stream_release(neco_stream *stream) {
-    if (!stream) {
+static int rand_dl(void *data, size_t nbytes, int attr, int64_t deadline) {
+    if (attr != NECO_CSPRNG && attr != NECO_PRNG) {
         return NECO_INVAL;
-    } else if (!rt || stream->rtid != rt->id) {
+    }
+    if (!rt) {
         return NECO_PERM;
     }
-    if (stream->buffered) {
-        if (stream->rd.data && stream->rd.data != stream->data) {
-            free0(stream->rd.data);
+    void (*arc4random_buf_l)(void *, size_t) = 0;
+    if (attr == NECO_CSPRNG) {
+#ifdef __linux__
+        // arc4random_buf should be available in libbsd for Linux.
+        if (!rt->arc4random_buf) {
+            if (!rt->libbsd_handle) {
+                rt->libbsd_handle = dlopen("libbsd.so.0", RTLD_LAZY);
+                must(rt->libbsd_handle);
+            }
+            rt->arc4random_buf = (void(*)(void*,size_t))
+                dlsym(rt->libbsd_handle, "arc4random_buf");
+            must(rt->arc4random_buf);
         }
-        if (stream->wr.data && stream->wr.data != stream->data) {
-            free0(stream->wr.data);
+        arc4random_buf_l = rt->arc4random_buf;
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+        arc4random_buf_l = arc4random_buf;
+#endif
+    }
+    struct coroutine *co = coself();
+    while (1) {
+        int ret = checkdl(co, deadline);
+        if (ret != NECO_OK) {
+            return ret;
+        }
+        if (nbytes == 0) {
+            break;
+        }
+        size_t partsz = nbytes < 256 ? nbytes : 256;
+        if (arc4random_buf_l) {
+            arc4random_buf_l(data, partsz);
+        } else {
+            pcgrandom_buf(data, partsz, &rt->rand_seed);
         }
+        nbytes -= partsz;
+        data = (char*)data + partsz;
+        if (nbytes == 0) {
+            break;
+        }
+        coyield();
     }
-    free0(stream);
     return NECO_OK;
 }
 
-int neco_stream_release(neco_stream *stream) {
-    int ret = stream_release(stream);
-    error_guard(ret);
+/// Same as neco_rand() but with a deadline parameter.
+int neco_rand_dl(void *data, size_t nbytes, int attr, int64_t deadline) {
+    int ret = rand_dl(data, nbytes, attr, deadline);
+    async_error_guard(ret);
     return ret;
 }
 
-static bool ensure_rd_data(neco_stream *stream) {
-    if (!stream->rd.data) {
-        if (!stream->wr.data) {
-            stream->rd.data = stream->data;
-        } else {
-            stream->rd.data = malloc0(stream->cap);
-            if (!stream->rd.data) {
-                return false;
-            }
-        }
+/// Generator random bytes
+///
+/// This operation can generate cryptographically secure data by
+/// providing the NECO_CSPRNG option or non-crypto secure data with 
+/// NECO_PRNG. 
+/// 
+/// Non-crypto secure data use the [pcg-family](https://www.pcg-random.org) 
+/// random number generator. 
+///
+/// @param data buffer for storing random bytes
+/// @param nbytes number of bytes to generate
+/// @param attr NECO_PRNG or NECO_CSPRNG
+/// @return NECO_OK Success
+/// @return NECO_INVAL An invalid parameter was provided
+/// @return NECO_PERM Operation called outside of a coroutine
+/// @return NECO_CANCELED Operation canceled
+int neco_rand(void *data, size_t nbytes, int attr) {
+    return neco_rand_dl(data, nbytes, attr, INT64_MAX);
+}
+
+/// Terminate the current coroutine.
+///
+/// Any clean-up handlers established by neco_cleanup_push() that
+/// have not yet been popped, are popped (in the reverse of the order
+/// in which they were pushed) and executed.
+///
+/// Calling this from outside of a coroutine context does nothing and will be
+/// treated effectivley as a no-op. 
+void neco_exit(void) {
+    if (rt) {
+        coexit(true);
     }
-    return true;
 }
 
-static bool ensure_wr_data(neco_stream *stream) {
-    if (!stream->wr.data) {
-        if (!stream->rd.data) {
-            stream->wr.data = stream->data;
-        } else {
-            stream->wr.data = malloc0(stream->cap);
-            if (!stream->wr.data) {
-                return false;
-            }
-        }
-    }
-    return true;
-}
+struct neco_gen { 
+    // A generator is actually a channel in disguise.
+    int _;
+};
 
-static ssize_t stream_read_dl(neco_stream *stream, void *data, size_t nbytes,
-    int64_t deadline)
-{
-    if (!stream) {
+static int gen_start_chk(neco_gen **gen, size_t data_size) {
+    if (!gen || data_size > INT_MAX) {
         return NECO_INVAL;
-    } else if (!rt || stream->rtid != rt->id) {
-        return NECO_PERM;
-    }
-    if (!stream->buffered) {
-        return neco_read_dl(stream->fd, data, nbytes, deadline);
     }
-    if (!ensure_rd_data(stream)) {
-        return NECO_NOMEM;
-    }
-    if (stream->rd.len == 0) {
-        ssize_t n = neco_read_dl(stream->fd, stream->rd.data, stream->cap, 
-            deadline);
-        if (n == -1) {
-            return neco_errconv_from_sys();
-        }
-        stream->rd.len = (size_t)n;
-        stream->rd.pos = 0;
+    if (!rt) {
+        return NECO_PERM;
     }
-    nbytes = stream->rd.len < nbytes ? stream->rd.len : nbytes;
-    memcpy(data, stream->rd.data + stream->rd.pos, nbytes);
-    stream->rd.pos += nbytes;
-    stream->rd.len -= nbytes;
-    return (ssize_t)nbytes;
+    return NECO_OK;
 }
 
-ssize_t neco_stream_read_dl(neco_stream *stream, void *data, size_t nbytes,
-    int64_t deadline)
+/// Start a generator coroutine
+///
+/// **Example**
+///
+/// ```
+/// void coroutine(int argc, void *argv[]) {
+///     // Yield each int to the caller, one at a time.
+///     for (int i = 0; i < 10; i++) {
+///         neco_gen_yield(&i);
+///     }
+/// }
+/// 
+/// int neco_main(int argc, char *argv[]) {
+///     
+///     // Create a new generator coroutine that is used to send ints.
+///     neco_gen *gen;
+///     neco_gen_start(&gen, sizeof(int), coroutine, 0);
+/// 
+///     // Iterate over each int until the generator is closed.
+///     int i;
+///     while (neco_gen_next(gen, &i) != NECO_CLOSED) {
+///         printf("%d\n", i); 
+///     }
+/// 
+///     // This coroutine no longer needs the generator.
+///     neco_gen_release(gen);
+///     return 0;
+/// }
+/// ```
+///
+/// @param[out] gen Generator object
+/// @param data_size Data size of messages
+/// @param coroutine Generator coroutine
+/// @param argc Number of arguments
+/// @return NECO_OK Success
+/// @return NECO_NOMEM The system lacked the necessary resources
+/// @return NECO_INVAL An invalid parameter was provided
+/// @return NECO_PERM Operation called outside of a coroutine
+/// @note The caller is responsible for freeing the generator object with 
+/// with neco_gen_release().
+int neco_gen_start(neco_gen **gen, size_t data_size,
+    void(*coroutine)(int argc, void *argv[]), int argc, ...)
 {
-    ssize_t ret = stream_read_dl(stream, data, nbytes, deadline);
-    if (ret == 0 && nbytes > 0 && neco_lasterr() == NECO_OK) {
-        ret = NECO_EOF;
+    int ret = gen_start_chk(gen, data_size);
+    if (ret == NECO_OK) {
+        va_list args;
+        va_start(args, argc);
+        ret = startv(coroutine, argc, &args, 0, (void*)gen, data_size, 0);
+        va_end(args);
     }
     error_guard(ret);
     return ret;
 }
 
-ssize_t neco_stream_read(neco_stream *stream, void *data, size_t nbytes) {
-    return neco_stream_read_dl(stream, data, nbytes, INT64_MAX);
-}
-
-static ssize_t stream_readfull_dl(neco_stream *stream, void *data, 
-    size_t nbytes, int64_t deadline)
-{
-    ssize_t nread = 0;
-    do {
-        ssize_t n = neco_stream_read_dl(stream, data, nbytes, deadline);
-        if (n <= 0) {
-            if (nread == 0) {
-                nread = n;
-            }
-            return nread;
-        } else {
-            data = (char*)data + n;
-            nbytes -= (size_t)n;
-            nread += n;
-        }
-    } while (nbytes > 0);
-    return nread;
-}
-
-ssize_t neco_stream_readfull_dl(neco_stream *stream, void *data, size_t nbytes,
-    int64_t deadline)
+/// Same as neco_gen_start() but using an array for arguments.
+int neco_gen_startv(neco_gen **gen, size_t data_size,
+    void(*coroutine)(int argc, void *argv[]), int argc, void *argv[])
 {
-    ssize_t ret = stream_readfull_dl(stream, data, nbytes, deadline);
+    int ret = gen_start_chk(gen, data_size);
+    if (ret == NECO_OK) {
+        ret = startv(coroutine, argc, 0, argv, (void*)gen, data_size, 0);
+    }
     error_guard(ret);
     return ret;
 }
 
-ssize_t neco_stream_readfull(neco_stream *stream, void *data, size_t nbytes) {
-    return neco_stream_readfull_dl(stream, data, nbytes, INT64_MAX);
+/// Retain a reference of the generator so it can be shared with other
+/// coroutines.
+///
+/// This is needed for avoiding use-after-free bugs.
+/// 
+/// See neco_gen_start() for an example.
+///
+/// @param gen The generator
+/// @return NECO_OK Success
+/// @return NECO_INVAL An invalid parameter was provided
+/// @return NECO_PERM Operation called outside of a coroutine
+/// @note The caller is responsible for releasing the reference with 
+///       neco_gen_release()
+/// @see Generators
+/// @see neco_gen_release()
+int neco_gen_retain(neco_gen *gen) {
+    return neco_chan_retain((void*)gen);
 }
 
-static ssize_t stream_buffered_read_size(neco_stream *stream) {
-    if (!stream) {
-        return NECO_INVAL;
-    } else if (!rt || stream->rtid != rt->id) {
+/// Release a reference to a generator
+///
+/// See neco_gen_start() for an example.
+///
+/// @param gen The generator
+/// @return NECO_OK Success
+/// @return NECO_INVAL An invalid parameter was provided
+/// @return NECO_PERM Operation called outside of a coroutine
+/// @see Generators
+/// @see neco_gen_retain()
+int neco_gen_release(neco_gen *gen) {
+    return neco_chan_release((void*)gen);
+}
+
+/// Same as neco_gen_yield() but with a deadline parameter.
+int neco_gen_yield_dl(void *data, int64_t deadline) {
+    struct coroutine *co = coself();
+    if (!co) {
         return NECO_PERM;
-    } else if (!stream->buffered) {
-        return 0;
     }
-    return (ssize_t)stream->rd.len;
+    if (!co->gen) {
+        return NECO_NOTGENERATOR;
+    }
+    return neco_chan_send_dl((void*)co->gen, data, deadline);
 }
 
-ssize_t neco_stream_buffered_read_size(neco_stream *stream) {
-    ssize_t ret = stream_buffered_read_size(stream);
-    error_guard(ret);
-    return ret;
+/// Send a value to the generator for the next iteration.
+///
+/// See neco_gen_start() for an example.
+int neco_gen_yield(void *data) {
+    return neco_gen_yield_dl(data, INT64_MAX);
 }
 
-/// Same as neco_stream_read_byte() but with a deadline parameter.
-int neco_stream_read_byte_dl(neco_stream *stream, int64_t deadline) {
-    unsigned char byte;
-    if (rt && stream && stream->rtid == rt->id && stream->buffered && 
-        stream->rd.len > 0 && checkdl(coself(), deadline) == NECO_OK)
-    {
-        // fast-track read byte
-        byte = (unsigned char)stream->rd.data[stream->rd.pos];
-        stream->rd.pos++;
-        stream->rd.len--;
-    } else {
-        ssize_t ret = neco_stream_read_dl(stream, &byte, 1, deadline);
-        if (ret != 1) {
-            return ret;
-        }
-    }
-    return byte;
+/// Same as neco_gen_next() but with a deadline parameter.
+int neco_gen_next_dl(neco_gen *gen, void *data, int64_t deadline) {
+    return neco_chan_recv_dl((void*)gen, data, deadline);
+}
+
+/// Receive the next value from a generator.
+///
+/// See neco_gen_start() for an example.
+int neco_gen_next(neco_gen *gen, void *data) {
+    return neco_gen_next_dl(gen, data, INT64_MAX);
+}
+
+/// Close the generator.
+/// @param gen Generator
+/// @return NECO_OK Success
+int neco_gen_close(neco_gen *gen) {
+    return neco_chan_close((void*)gen);
+}
+
+/// Test a neco error code. 
+/// @return the provided value, unchanged.
+int neco_testcode(int errcode) {
+    int ret = errcode;
+    error_guard(ret);
+    return ret;
 }
 
-/// Read and returns a single byte. If no byte is available, returns an error.
-int neco_stream_read_byte(neco_stream *stream) {
-    return neco_stream_read_byte_dl(stream, INT64_MAX);
+/// Stop normal execution of the current coroutine, print stack trace, and exit
+/// the program immediately.
+int neco_panic(const char *fmt, ...) {
+    char buf[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    panic("%s", buf);
+    return NECO_OK;
 }
 
-static int stream_unread_byte(neco_stream *stream) {
-    if (!stream) {
-        return NECO_INVAL;
-    } else if (!rt || stream->rtid != rt->id) {
+static int suspend_dl(int64_t deadline) {
+    struct coroutine *co = coself();
+    if (!co) {
         return NECO_PERM;
-    } else if (!stream->buffered || stream->rd.pos == 0) {
-        return NECO_UNREADFAIL;
     }
-    stream->rd.pos--;
-    stream->rd.len++;
-    return NECO_OK;
+
+    co->suspended = true;
+    rt->nsuspended++;
+    copause(deadline);
+    rt->nsuspended--;
+    co->suspended = false;
+
+    return checkdl(co, INT64_MAX);
 }
 
-/// Unread the last byte. Only the most recently read byte can be unread.
-int neco_stream_unread_byte(neco_stream *stream) {
-    int ret = stream_unread_byte(stream);
-    error_guard(ret);
+/// Same as neco_suspend() but with a deadline parameter. 
+int neco_suspend_dl(int64_t deadline) {
+    int ret = suspend_dl(deadline);
+    async_error_guard(ret);
     return ret;
 }
 
-static int stream_flush_dl(neco_stream *stream, int64_t deadline) {
-    if (!stream) {
-        return NECO_INVAL;
-    } else if (!rt || stream->rtid != rt->id) {
+/// Suspend the current coroutine.
+/// @return NECO_OK Success
+/// @return NECO_PERM Operation called outside of a coroutine
+/// @return NECO_CANCELED Operation canceled
+/// @see neco_resume
+/// @see neco_suspend_dl
+int neco_suspend(void) {
+    return neco_suspend_dl(INT64_MAX);
+}
+
+static int resume(int64_t id) {
+    if (!rt) {
         return NECO_PERM;
-    } else if (!stream->buffered) {
-        // Not buffered. Only need to check the deadline.
-        return checkdl(coself(), deadline);
     }
-    ssize_t n = neco_write_dl(stream->fd, stream->wr.data, stream->wr.len, 
-        deadline);
-    if (n <= 0) {
-        if (n == 0 && stream->wr.len == 0) {
-            return NECO_OK;
-        } else {
-            return neco_errconv_from_sys();
-        }
+    struct coroutine *co = cofind(id);
+    if (!co) {
+        return NECO_NOTFOUND;
     }
-    if ((size_t)n < stream->wr.len) {
-        // parital write.
-        memmove(stream->wr.data, stream->wr.data+n, stream->wr.len-(size_t)n);
-        stream->wr.len -= (size_t)n;
-        return NECO_PARTIALWRITE;
-    } else {
-        stream->wr.len = 0;
-        return NECO_OK;
+    if (!co->suspended) {
+        return NECO_NOTSUSPENDED;
     }
+    sco_resume(co->id);
+    return NECO_OK;
 }
 
-/// Same as neco_stream_flush() but with a deadline parameter.
-int neco_stream_flush_dl(neco_stream *stream, int64_t deadline) {
-    int ret = stream_flush_dl(stream, deadline);
-    async_error_guard(ret);
+/// Resume a suspended roroutine
+/// @return NECO_OK Success
+/// @return NECO_PERM Operation called outside of a coroutine
+/// @return NECO_NOTFOUND Coroutine not found
+/// @return NECO_NOTSUSPENDED Coroutine not suspended
+/// @see neco_suspend
+int neco_resume(int64_t id) {
+    int ret = resume(id);
+    error_guard(ret);
     return ret;
 }
 
-/// Flush writes any buffered data to the underlying file descriptor.
-int neco_stream_flush(neco_stream *stream) {
-    return neco_stream_flush_dl(stream, INT64_MAX);
+#ifndef NECO_NOWORKERS
+struct iowork {
+    void(*work)(void *udata);
+    void *udata;
+    struct coroutine *co;
+    struct runtime *rt;
+};
+
+static void iowork(void *udata) {
+    struct iowork *info = udata;
+    info->work(info->udata);
+    pthread_mutex_lock(&info->rt->iomu);
+    colist_push_back(&info->rt->iolist, info->co);
+    pthread_mutex_unlock(&info->rt->iomu);
 }
+#endif
 
-static ssize_t stream_write_dl(neco_stream *stream, const void *data, 
-    size_t nbytes, int64_t deadline)
-{
-    if (!stream) {
+static int workfn(int64_t pin, void(*work)(void *udata), void *udata) {
+    (void)pin;
+    struct coroutine *co = coself();
+    if (!work) {
         return NECO_INVAL;
-    } else if (!rt || stream->rtid != rt->id) {
-        return NECO_PERM;
-    }
-    if (!stream->buffered) {
-        return neco_write_dl(stream->fd, data, nbytes, deadline);
     }
-    if (!ensure_wr_data(stream)) {
-        return NECO_NOMEM;
+    if (!co) {
+        return NECO_PERM;
     }
-    ssize_t nwritten = 0;
-    while (nbytes > 0) {
-        if (stream->wr.len == stream->cap) {
-            // Buffer is full.
-            int ret = neco_stream_flush_dl(stream, deadline);
-            if (ret != NECO_OK) {
-                if (nwritten == 0) {
-                    nwritten = ret;
-                }
-                break;
-            }
-        }
-        // Copy data into the buffer
-        size_t n = stream->cap - stream->wr.len;
-        n = n < nbytes ? n : nbytes;
-        memcpy(stream->wr.data+stream->wr.len, data, n);
-        stream->wr.len += n;
-        data = (char*)data + n;
-        nbytes -= n;
-        nwritten += n;
+#ifdef NECO_NOWORKERS
+    // Run in foreground
+    work(udata);
+#else
+    // Run in background
+    struct iowork info = { .work = work, .udata = udata, .co = co, .rt = rt };
+    rt->niowaiters++;
+    while (!worker_submit(rt->worker, pin, iowork, &info)) {
+        sco_yield();
     }
-    return nwritten;
+    sco_pause();
+    rt->niowaiters--;
+#endif
+    return NECO_OK;
 }
 
-ssize_t neco_stream_write_dl(neco_stream *stream, const void *data, 
-    size_t nbytes, int64_t deadline)
-{
-    ssize_t ret = stream_write_dl(stream, data, nbytes, deadline);
-    async_error_guard(ret);
+/// Perform work in a background thread and wait until the work is done.
+/// 
+/// This operation cannot be canceled and cannot timeout. It's the responibilty
+/// of the caller to figure out a mechanism for doing those things from inside
+/// of the work function.
+/// 
+/// The work function will not be inside of a Neco context, thus all `neco_*`
+/// functions will fail if called from inside of the work function.
+///
+/// @param pin pin to a thread, or use -1 for round robin selection.
+/// @param work the work, must not be null
+/// @param udata any user data
+/// @return NECO_OK Success
+/// @return NECO_NOMEM The system lacked the necessary resources
+/// @return NECO_INVAL An invalid parameter was provided
+/// @note There is no way to cancel or timeout this operation
+/// @note There is no way to cancel or timeout this operation
+int neco_work(int64_t pin, void(*work)(void *udata), void *udata) {
+    int ret = workfn(pin, work, udata);
+    error_guard(ret);
     return ret;
 }
 
-ssize_t neco_stream_write(neco_stream *stream, const void *data, size_t nbytes){
-    return neco_stream_write_dl(stream, data, nbytes, INT64_MAX);
+/// Returns the arena of the running coroutine.
+///
+/// The arena is handed out when the coroutine starts and all of its memory
+/// is returned to a thread-local block pool when the coroutine exits, so
+/// nothing allocated from it may outlive the coroutine.
+/// Outside of a coroutine, such as in a neco_work() job running on a
+/// background worker thread, the arena of that thread is returned instead,
+/// which is reset after every job.
+///
+/// Only available when built with NECO_USEARENAS.
+/// @return The arena, or NULL when arenas are not enabled
+/// @see Arenas
+struct Arena *neco_arena(void) {
+#ifdef NECO_USEARENAS
+    struct coroutine *co = rt ? coself() : NULL;
+    return co ? &co->arena : thread_arena_get();
+#else
+    return NULL;
+#endif
 }
 
-static ssize_t stream_buffered_write_size(neco_stream *stream) {
-    if (!stream) {
-        return NECO_INVAL;
-    } else if (!rt || stream->rtid != rt->id) {
-        return NECO_PERM;
-    } else if (!stream->buffered) {
-        return 0;
+#ifndef NECO_NOWORKERS
+
+// A pool job is a coroutine that has not started yet. Every pool thread has
+// a deque of them. The owner takes from the back, newest first, and idle
+// threads steal from the front of the others. Pinned jobs go to a separate
+// deque that only the owner takes from. Once started, a coroutine stays on
+// its thread for good, so it uses the runtime of that thread like any other.
+struct pool_job {
+    struct pool_job *prev;
+    struct pool_job *next;
+    struct neco_pool *pool;
+    void(*coroutine)(int argc, void *argv[]);
+    int argc;
+    void *argv[];
+};
+
+struct pool_deque {
+    struct pool_job *head;
+    struct pool_job *tail;
+    atomic_size_t len;          // read without the lock to skip empty deques
+};
+
+struct pool_thread {
+    struct neco_pool *pool;
+    int index;
+    int ret;                    // result of the thread's runtime
+    pthread_t th;
+    pthread_mutex_t mu;
+    struct pool_deque jobs;     // may be stolen
+    struct pool_deque pinned;   // only for this thread
+    atomic_bool sleeping;       // waiting on the wakeup pipe
+    int fds[2];                 // wakeup pipe
+};
+
+struct neco_pool {
+    int nthreads;
+    atomic_size_t active;       // jobs queued or running
+    atomic_int nsleeping;
+    atomic_uint next;           // round robin for jobs from outside the pool
+    atomic_bool closing;
+    struct pool_thread threads[];
+};
+
+#define POOL_IDLE (NECO_MILLISECOND * 100)
+
+static __thread struct pool_thread *pool_self = NULL;
+
+static void pool_deque_push_back(struct pool_deque *dq, struct pool_job *job) {
+    job->next = NULL;
+    job->prev = dq->tail;
+    if (dq->tail) {
+        dq->tail->next = job;
+    } else {
+        dq->head = job;
     }
-    return (ssize_t)stream->wr.len;
+    dq->tail = job;
+    atomic_fetch_add(&dq->len, 1);
 }
 
-ssize_t neco_stream_buffered_write_size(neco_stream *stream) {
-    ssize_t ret = stream_buffered_write_size(stream);
-    error_guard(ret);
-    return ret;
+static void pool_deque_remove(struct pool_deque *dq, struct pool_job *job) {
+    if (job->prev) {
+        job->prev->next = job->next;
+    } else {
+        dq->head = job->next;
+    }
+    if (job->next) {
+        job->next->prev = job->prev;
+    } else {
+        dq->tail = job->prev;
+    }
+    atomic_fetch_sub(&dq->len, 1);
 }
 
-static int stream_close_dl(neco_stream *stream, int64_t deadline) {
-    if (!stream) {
-        return NECO_INVAL;
-    } else if (!rt || stream->rtid != rt->id) {
-        return NECO_PERM;
+static struct pool_job *pool_pop(struct pool_thread *t, struct pool_deque *dq,
+    bool back)
+{
+    if (atomic_load(&dq->len) == 0) {
+        return NULL;
     }
-    int ret = NECO_OK;
-    if (stream->buffered && (deadline < INT64_MAX || stream->wr.len > 0)) {
-        ret = stream_flush_dl(stream, deadline);
+    pthread_mutex_lock(&t->mu);
+    struct pool_job *job = back ? dq->tail : dq->head;
+    if (job) {
+        pool_deque_remove(dq, job);
     }
-    close(stream->fd);
-    stream_release(stream);
-    return ret;
+    pthread_mutex_unlock(&t->mu);
+    return job;
 }
-
-/// Close a stream with a deadline. 
-/// A deadline is provided to accomodate for buffered streams that may need to
-/// flush bytes on close
-int neco_stream_close_dl(neco_stream *stream, int64_t deadline) {
-    int ret = stream_close_dl(stream, deadline);
-    error_guard(ret);
-    return ret;
+
+static struct pool_job *pool_take(struct pool_thread *t) {
+    struct pool_job *job = pool_pop(t, &t->pinned, false);
+    if (!job) {
+        job = pool_pop(t, &t->jobs, true);
+    }
+    struct neco_pool *pool = t->pool;
+    for (int i = 1; !job && i < pool->nthreads; i++) {
+        struct pool_thread *victim = &pool->threads[(t->index+i)%pool->nthreads];
+        job = pool_pop(victim, &victim->jobs, false);
+    }
+    return job;
 }
 
-/// Close a stream
-int neco_stream_close(neco_stream *stream) {
-    return neco_stream_close_dl(stream, INT64_MAX);
+static bool pool_haswork(struct pool_thread *t) {
+    if (atomic_load(&t->pinned.len) > 0) {
+        return true;
+    }
+    for (int i = 0; i < t->pool->nthreads; i++) {
+        if (atomic_load(&t->pool->threads[i].jobs.len) > 0) {
+            return true;
+        }
+    }
+    return false;
 }
 
-// pcg-family random number generator
+// Wakes the thread if it's waiting on its pipe.
+static bool pool_wake(struct pool_thread *t) {
+    if (!atomic_exchange(&t->sleeping, false)) {
+        return false;
+    }
+    atomic_fetch_sub(&t->pool->nsleeping, 1);
+    char c = 0;
+    (void)!write0(t->fds[1], &c, 1);
+    return true;
+}
 
-static int64_t rincr(int64_t seed) {
-    return (int64_t)((uint64_t)(seed)*6364136223846793005 + 1);
+static void pool_wake_any(struct neco_pool *pool) {
+    for (int i = 0; i < pool->nthreads && atomic_load(&pool->nsleeping) > 0; 
+        i++)
+    {
+        if (pool_wake(&pool->threads[i])) {
+            break;
+        }
+    }
 }
 
-static uint32_t rgen(int64_t seed) {
-    uint64_t state = (uint64_t)seed;
-    uint32_t xorshifted = (uint32_t)(((state >> 18) ^ state) >> 27);
-    uint32_t rot = (uint32_t)(state >> 59);
-    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+static void pool_job_done(void *arg) {
+    struct pool_job *job = arg;
+    struct neco_pool *pool = job->pool;
+    free0(job);
+    if (atomic_fetch_sub(&pool->active, 1) == 1 && 
+        atomic_load(&pool->closing))
+    {
+        for (int i = 0; i < pool->nthreads; i++) {
+            pool_wake(&pool->threads[i]);
+        }
+    }
 }
 
-static uint32_t rnext(int64_t *seed) {
-    *seed = rincr(rincr(*seed)); // twice called intentionally
-    uint32_t value = rgen(*seed);
-    return value;
+static void pool_job_entry(int argc, void *argv[]) {
+    (void)argc;
+    struct pool_job *job = argv[0];
+    struct cleanup handler;
+    cleanup_push(&handler, pool_job_done, job);
+    job->coroutine(job->argc, job->argv);
+    cleanup_pop(1);
 }
 
-static void pcgrandom_buf(void *data, size_t nbytes, int64_t *seed) {
-    while (nbytes >= 4) {
-        uint32_t value = rnext(seed);
-        ((char*)data)[0] = ((char*)&value)[0];
-        ((char*)data)[1] = ((char*)&value)[1];
-        ((char*)data)[2] = ((char*)&value)[2];
-        ((char*)data)[3] = ((char*)&value)[3];
-        data = (char*)data + 4;
-        nbytes -= 4;
-    }
-    if (nbytes > 0) {
-        uint32_t value = rnext(seed);
-        for (size_t i = 0; i < nbytes; i++) {
-            ((char*)data)[i] = ((char*)&value)[i];
+// The first coroutine of every pool thread. It starts one job at a time and
+// then yields, so a thread that is busy running coroutines takes new jobs
+// slowly and leaves them for idle threads to steal.
+static void pool_loop(int argc, void *argv[]) {
+    (void)argc;
+    struct pool_thread *t = argv[0];
+    struct neco_pool *pool = t->pool;
+    pool_self = t;
+    while (1) {
+        struct pool_job *job = pool_take(t);
+        if (job) {
+            if (startv(pool_job_entry, 1, NULL, (void*[]){ job }, 0, 0, 0)) {
+                // Out of memory. Leave the job for later, or for another
+                // thread.
+                pthread_mutex_lock(&t->mu);
+                pool_deque_push_back(&t->jobs, job);
+                pthread_mutex_unlock(&t->mu);
+                sleep_dl(getnow()+NECO_MILLISECOND);
+            }
+            yield();
+            continue;
+        }
+        if (atomic_load(&pool->closing) && atomic_load(&pool->active) == 0) {
+            break;
         }
+        atomic_store(&t->sleeping, true);
+        atomic_fetch_add(&pool->nsleeping, 1);
+        // Check again, now that submitters can see that this thread sleeps.
+        if (!pool_haswork(t) && !(atomic_load(&pool->closing) && 
+            atomic_load(&pool->active) == 0))
+        {
+            wait_dl(t->fds[0], EVREAD, getnow()+POOL_IDLE);
+        }
+        if (atomic_exchange(&t->sleeping, false)) {
+            atomic_fetch_sub(&pool->nsleeping, 1);
+        }
+        char buf[64];
+        while (read0(t->fds[0], buf, sizeof(buf)) > 0);
     }
+    pool_self = NULL;
 }
 
-static int rand_setseed(int64_t seed, int64_t *oldseed) {
-    if (!rt) {
-        return NECO_PERM;
-    }
-    if (oldseed) {
-        *oldseed = rt->rand_seed;
-    }
-    rt->rand_seed = seed;
-    return NECO_OK;
+static void *pool_thread_main(void *arg) {
+    struct pool_thread *t = arg;
+    t->ret = startv(pool_loop, 1, NULL, (void*[]){ t }, 0, 0, 0);
+    return NULL;
 }
 
-/// Set the random seed for the Neco pseudorandom number generator.
-///
-/// The provided seed is only used for the (non-crypto) NECO_PRNG and is
-/// ignored for NECO_CPRNG.
-///
-/// @param seed 
-/// @param oldseed[out] The previous seed
-/// @return NECO_OK Success
-/// @return NECO_INVAL An invalid parameter was provided
-/// @return NECO_PERM Operation called outside of a coroutine
-/// @see Random
-int neco_rand_setseed(int64_t seed, int64_t *oldseed) {
-    int ret = rand_setseed(seed, oldseed);
-    error_guard(ret);
-    return ret;
+static void pool_thread_destroy(struct pool_thread *t) {
+    close(t->fds[0]);
+    close(t->fds[1]);
+    pthread_mutex_destroy(&t->mu);
 }
 
-static int rand_dl(void *data, size_t nbytes, int attr, int64_t deadline) {
-    if (attr != NECO_CSPRNG && attr != NECO_PRNG) {
+static int pool_new(neco_pool **pool, int nthreads) {
+    if (!pool || nthreads < 0) {
         return NECO_INVAL;
     }
-    if (!rt) {
-        return NECO_PERM;
+    if (nthreads == 0) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpus > 0 ? (int)ncpus : 1;
     }
-    void (*arc4random_buf_l)(void *, size_t) = 0;
-    if (attr == NECO_CSPRNG) {
-#ifdef __linux__
-        // arc4random_buf should be available in libbsd for Linux.
-        if (!rt->arc4random_buf) {
-            if (!rt->libbsd_handle) {
-                rt->libbsd_handle = dlopen("libbsd.so.0", RTLD_LAZY);
-                must(rt->libbsd_handle);
-            }
-            rt->arc4random_buf = (void(*)(void*,size_t))
-                dlsym(rt->libbsd_handle, "arc4random_buf");
-            must(rt->arc4random_buf);
-        }
-        arc4random_buf_l = rt->arc4random_buf;
-#elif defined(__APPLE__) || defined(__FreeBSD__)
-        arc4random_buf_l = arc4random_buf;
-#endif
+    struct neco_pool *p = malloc0(sizeof(struct neco_pool) + 
+        (size_t)nthreads * sizeof(struct pool_thread));
+    if (!p) {
+        return NECO_NOMEM;
     }
-    struct coroutine *co = coself();
-    while (1) {
-        int ret = checkdl(co, deadline);
-        if (ret != NECO_OK) {
-            return ret;
-        }
-        if (nbytes == 0) {
+    memset(p, 0, sizeof(struct neco_pool));
+    p->nthreads = nthreads;
+    int ret = NECO_OK;
+    int ninit = 0;
+    for (; ninit < nthreads; ninit++) {
+        struct pool_thread *t = &p->threads[ninit];
+        memset(t, 0, sizeof(struct pool_thread));
+        t->pool = p;
+        t->index = ninit;
+        if (pipe0(t->fds) == -1) {
+            ret = NECO_ERROR;
             break;
         }
-        size_t partsz = nbytes < 256 ? nbytes : 256;
-        if (arc4random_buf_l) {
-            arc4random_buf_l(data, partsz);
-        } else {
-            pcgrandom_buf(data, partsz, &rt->rand_seed);
+        if (setnonblock(t->fds[0], true, 0) == -1 || 
+            setnonblock(t->fds[1], true, 0) == -1)
+        {
+            close(t->fds[0]);
+            close(t->fds[1]);
+            ret = NECO_ERROR;
+            break;
         }
-        nbytes -= partsz;
-        data = (char*)data + partsz;
-        if (nbytes == 0) {
+        pthread_mutex_init(&t->mu, 0);
+    }
+    int nstarted = 0;
+    for (; ret == NECO_OK && nstarted < nthreads; nstarted++) {
+        struct pool_thread *t = &p->threads[nstarted];
+        if (pthread_create0(&t->th, 0, pool_thread_main, t) != 0) {
+            ret = NECO_ERROR;
             break;
         }
-        coyield();
     }
+    if (ret != NECO_OK) {
+        atomic_store(&p->closing, true);
+        for (int i = 0; i < nstarted; i++) {
+            pool_wake(&p->threads[i]);
+            pthread_join(p->threads[i].th, 0);
+        }
+        for (int i = 0; i < ninit; i++) {
+            pool_thread_destroy(&p->threads[i]);
+        }
+        free0(p);
+        return ret;
+    }
+    *pool = p;
     return NECO_OK;
 }
 
-/// Same as neco_rand() but with a deadline parameter.
-int neco_rand_dl(void *data, size_t nbytes, int attr, int64_t deadline) {
-    int ret = rand_dl(data, nbytes, attr, deadline);
-    async_error_guard(ret);
-    return ret;
-}
-
-/// Generator random bytes
+/// Create a pool of threads that each run a Neco runtime, for spreading
+/// coroutines over many cores.
 ///
-/// This operation can generate cryptographically secure data by
-/// providing the NECO_CSPRNG option or non-crypto secure data with 
-/// NECO_PRNG. 
-/// 
-/// Non-crypto secure data use the [pcg-family](https://www.pcg-random.org) 
-/// random number generator. 
+/// Coroutines are started on the pool with neco_pool_start(). A coroutine
+/// that is started from inside of the pool is queued on its own thread, and
+/// threads that run out of work steal queued coroutines from the others.
+/// Once a coroutine begins running it stays on its thread, along with the
+/// coroutines it starts with neco_start(). Channels, mutexes and waitgroups
+/// that coroutines of different threads use must be made with
+/// neco_chan_make_shared(), neco_mutex_init_shared() and 
+/// neco_waitgroup_init_shared(). The other Neco primitives remain local to a
+/// thread, as with any runtime.
 ///
-/// @param data buffer for storing random bytes
-/// @param nbytes number of bytes to generate
-/// @param attr NECO_PRNG or NECO_CSPRNG
+/// @param pool The new pool
+/// @param nthreads Number of threads, or 0 for one per CPU
 /// @return NECO_OK Success
+/// @return NECO_NOMEM The system lacked the necessary resources
 /// @return NECO_INVAL An invalid parameter was provided
-/// @return NECO_PERM Operation called outside of a coroutine
-/// @return NECO_CANCELED Operation canceled
-int neco_rand(void *data, size_t nbytes, int attr) {
-    return neco_rand_dl(data, nbytes, attr, INT64_MAX);
-}
-
-/// Terminate the current coroutine.
-///
-/// Any clean-up handlers established by neco_cleanup_push() that
-/// have not yet been popped, are popped (in the reverse of the order
-/// in which they were pushed) and executed.
-///
-/// Calling this from outside of a coroutine context does nothing and will be
-/// treated effectivley as a no-op. 
-void neco_exit(void) {
-    if (rt) {
-        coexit(true);
-    }
+/// @return NECO_ERROR A thread or pipe could not be created (check errno)
+/// @see Pools
+int neco_pool_new(neco_pool **pool, int nthreads) {
+    int ret = pool_new(pool, nthreads);
+    error_guard(ret);
+    return ret;
 }
 
-struct neco_gen { 
-    // A generator is actually a channel in disguise.
-    int _;
-};
-
-static int gen_start_chk(neco_gen **gen, size_t data_size) {
-    if (!gen || data_size > INT_MAX) {
+static int pool_start(neco_pool *pool, int thread, 
+    void(*coroutine)(int, void**), int argc, va_list *args, void *argv[])
+{
+    if (!pool || !coroutine || argc < 0 || thread < -1 || 
+        thread >= pool->nthreads)
+    {
         return NECO_INVAL;
     }
-    if (!rt) {
-        return NECO_PERM;
+    struct pool_job *job = malloc0(sizeof(struct pool_job) + 
+        (size_t)argc * sizeof(void*));
+    if (!job) {
+        return NECO_NOMEM;
+    }
+    job->pool = pool;
+    job->coroutine = coroutine;
+    job->argc = argc;
+    for (int i = 0; i < argc; i++) {
+        job->argv[i] = args ? va_arg(*args, void*) : argv[i];
+    }
+    atomic_fetch_add(&pool->active, 1);
+    struct pool_thread *t;
+    if (thread >= 0) {
+        t = &pool->threads[thread];
+    } else if (pool_self && pool_self->pool == pool) {
+        t = pool_self;
+    } else {
+        t = &pool->threads[atomic_fetch_add(&pool->next, 1)%pool->nthreads];
+    }
+    pthread_mutex_lock(&t->mu);
+    pool_deque_push_back(thread >= 0 ? &t->pinned : &t->jobs, job);
+    pthread_mutex_unlock(&t->mu);
+    if (!pool_wake(t) && thread < 0) {
+        pool_wake_any(pool);
     }
     return NECO_OK;
 }
 
-/// Start a generator coroutine
-///
-/// **Example**
+/// Start a coroutine on a pool.
 ///
-/// ```
-/// void coroutine(int argc, void *argv[]) {
-///     // Yield each int to the caller, one at a time.
-///     for (int i = 0; i < 10; i++) {
-///         neco_gen_yield(&i);
-///     }
-/// }
-/// 
-/// int neco_main(int argc, char *argv[]) {
-///     
-///     // Create a new generator coroutine that is used to send ints.
-///     neco_gen *gen;
-///     neco_gen_start(&gen, sizeof(int), coroutine, 0);
-/// 
-///     // Iterate over each int until the generator is closed.
-///     int i;
-///     while (neco_gen_next(gen, &i) != NECO_CLOSED) {
-///         printf("%d\n", i); 
-///     }
-/// 
-///     // This coroutine no longer needs the generator.
-///     neco_gen_release(gen);
-///     return 0;
-/// }
-/// ```
+/// The coroutine is queued and runs soon on one of the pool's threads.
+/// This may be called from any thread, including from coroutines that are
+/// running in the pool.
 ///
-/// @param[out] gen Generator object
-/// @param data_size Data size of messages
-/// @param coroutine Generator coroutine
+/// @param pool The pool
+/// @param coroutine The coroutine that will soon run
 /// @param argc Number of arguments
+/// @param ... Arguments passed to the coroutine
 /// @return NECO_OK Success
 /// @return NECO_NOMEM The system lacked the necessary resources
 /// @return NECO_INVAL An invalid parameter was provided
-/// @return NECO_PERM Operation called outside of a coroutine
-/// @note The caller is responsible for freeing the generator object with 
-/// with neco_gen_release().
-int neco_gen_start(neco_gen **gen, size_t data_size,
-    void(*coroutine)(int argc, void *argv[]), int argc, ...)
-{
-    int ret = gen_start_chk(gen, data_size);
-    if (ret == NECO_OK) {
-        va_list args;
-        va_start(args, argc);
-        ret = startv(coroutine, argc, &args, 0, (void*)gen, data_size);
-        va_end(args);
-    }
-    error_guard(ret);
-    return ret;
-}
-
-/// Same as neco_gen_start() but using an array for arguments.
-int neco_gen_startv(neco_gen **gen, size_t data_size,
-    void(*coroutine)(int argc, void *argv[]), int argc, void *argv[])
+/// @see Pools
+int neco_pool_start(neco_pool *pool, void(*coroutine)(int argc, void *argv[]),
+    int argc, ...)
 {
-    int ret = gen_start_chk(gen, data_size);
-    if (ret == NECO_OK) {
-        ret = startv(coroutine, argc, 0, argv, (void*)gen, data_size);
-    }
+    va_list args;
+    va_start(args, argc);
+    int ret = pool_start(pool, -1, coroutine, argc, &args, 0);
+    va_end(args);
     error_guard(ret);
     return ret;
 }
 
-/// Retain a reference of the generator so it can be shared with other
-/// coroutines.
-///
-/// This is needed for avoiding use-after-free bugs.
-/// 
-/// See neco_gen_start() for an example.
-///
-/// @param gen The generator
-/// @return NECO_OK Success
-/// @return NECO_INVAL An invalid parameter was provided
-/// @return NECO_PERM Operation called outside of a coroutine
-/// @note The caller is responsible for releasing the reference with 
-///       neco_gen_release()
-/// @see Generators
-/// @see neco_gen_release()
-int neco_gen_retain(neco_gen *gen) {
-    return neco_chan_retain((void*)gen);
+/// Start a coroutine on a pool using an array for arguments.
+/// @see neco_pool_start
+int neco_pool_startv(neco_pool *pool, void(*coroutine)(int argc, void *argv[]),
+    int argc, void *argv[])
+{
+    int ret = pool_start(pool, -1, coroutine, argc, 0, argv);
+    error_guard(ret);
+    return ret;
 }
 
-/// Release a reference to a generator
+/// Start a coroutine on a specific thread of a pool.
 ///
-/// See neco_gen_start() for an example.
+/// The coroutine is never stolen by another thread, which is useful for
+/// keeping related coroutines together, such as those sharing a channel.
 ///
-/// @param gen The generator
+/// @param pool The pool
+/// @param thread Index of the thread, from 0 to nthreads-1
+/// @param coroutine The coroutine that will soon run
+/// @param argc Number of arguments
+/// @param ... Arguments passed to the coroutine
 /// @return NECO_OK Success
+/// @return NECO_NOMEM The system lacked the necessary resources
 /// @return NECO_INVAL An invalid parameter was provided
-/// @return NECO_PERM Operation called outside of a coroutine
-/// @see Generators
-/// @see neco_gen_retain()
-int neco_gen_release(neco_gen *gen) {
-    return neco_chan_release((void*)gen);
+/// @see Pools, neco_pool_thread
+int neco_pool_start_on(neco_pool *pool, int thread,
+    void(*coroutine)(int argc, void *argv[]), int argc, ...)
+{
+    va_list args;
+    va_start(args, argc);
+    int ret = thread < 0 ? NECO_INVAL :
+        pool_start(pool, thread, coroutine, argc, &args, 0);
+    va_end(args);
+    error_guard(ret);
+    return ret;
 }
 
-/// Same as neco_gen_yield() but with a deadline parameter.
-int neco_gen_yield_dl(void *data, int64_t deadline) {
-    struct coroutine *co = coself();
-    if (!co) {
+/// Returns the index of the pool thread that the caller is running on, or
+/// -1 when not running in a pool.
+/// @see Pools
+int neco_pool_thread(void) {
+    return pool_self ? pool_self->index : -1;
+}
+
+static int pool_release(neco_pool *pool) {
+    if (!pool) {
+        return NECO_INVAL;
+    }
+    if (pool_self && pool_self->pool == pool) {
         return NECO_PERM;
     }
-    if (!co->gen) {
-        return NECO_NOTGENERATOR;
+    atomic_store(&pool->closing, true);
+    for (int i = 0; i < pool->nthreads; i++) {
+        pool_wake(&pool->threads[i]);
     }
-    return neco_chan_send_dl((void*)co->gen, data, deadline);
+    int ret = NECO_OK;
+    for (int i = 0; i < pool->nthreads; i++) {
+        pthread_join(pool->threads[i].th, 0);
+        if (ret == NECO_OK) {
+            ret = pool->threads[i].ret;
+        }
+        pool_thread_destroy(&pool->threads[i]);
+    }
+    free0(pool);
+    return ret;
 }
 
-/// Send a value to the generator for the next iteration.
+/// Wait for all of the coroutines of a pool to finish, including those that
+/// are still queued or started while waiting, then stop its threads and free
+/// it.
 ///
-/// See neco_gen_start() for an example.
-int neco_gen_yield(void *data) {
-    return neco_gen_yield_dl(data, INT64_MAX);
+/// This blocks the calling thread, and must not be called from the pool.
+///
+/// @param pool The pool
+/// @return NECO_OK Success
+/// @return NECO_INVAL An invalid parameter was provided
+/// @return NECO_PERM Called from one of the pool's threads
+/// @see Pools
+int neco_pool_free(neco_pool *pool) {
+    int ret = pool_release(pool);
+    error_guard(ret);
+    return ret;
 }
 
-/// Same as neco_gen_next() but with a deadline parameter.
-int neco_gen_next_dl(neco_gen *gen, void *data, int64_t deadline) {
-    return neco_chan_recv_dl((void*)gen, data, deadline);
+#endif // NECO_NOWORKERS
+
+// An mpsc is a bounded lock-free queue that any thread may send to, and that
+// the coroutines of one runtime receive from. A sender reserves a run of 
+// slots with a single CAS on the tail, copies its messages in, and marks each
+// slot as ready by storing its position plus one. The receiver takes ready
+// slots in order and advances the head. Senders write to the wakeup pipe only
+// when the receiver says it's waiting on it, so a busy receiver costs no
+// system calls and a sleeping one is woken once per batch.
+// Only one coroutine waits on the pipe at a time. Other receivers of the 
+// runtime queue up behind it, and each waiter that leaves wakes the next one.
+struct neco_mpsc {
+    int64_t rtid;               // runtime of the receivers
+    atomic_int rc;              // reference counter
+    int msgsize;                // size of each message
+    size_t mask;                // capacity-1, capacity is a power of two
+    atomic_bool closed;
+    atomic_bool sleeping;       // a receiver is waiting on the wakeup pipe
+    struct coroutine *waiter;   // the receiver that set 'sleeping'
+    struct colist waiters;      // receivers queued behind the waiter
+    int fds[2];                 // wakeup pipe
+    atomic_size_t *seqs;        // ready position, plus one, of each slot
+    char *data;                 // message slots
+    char pad0[64];
+    atomic_size_t tail;         // next slot to reserve, shared by senders
+    char pad1[64];
+    atomic_size_t head;         // next slot to receive
+};
+
+static int mpsc_make(neco_mpsc **mpsc, size_t data_size, size_t capacity) {
+    if (!mpsc || data_size > INT_MAX || capacity == 0 || capacity > INT_MAX) {
+        return NECO_INVAL;
+    } else if (!rt) {
+        return NECO_PERM;
+    }
+    size_t cap = 1;
+    while (cap < capacity) {
+        cap *= 2;
+    }
+    struct neco_mpsc *q = malloc0(sizeof(struct neco_mpsc) + 
+        cap * sizeof(atomic_size_t) + cap * data_size);
+    if (!q) {
+        return NECO_NOMEM;
+    }
+    memset(q, 0, sizeof(struct neco_mpsc) + cap * sizeof(atomic_size_t));
+    q->rtid = rt->id;
+    q->msgsize = (int)data_size;
+    q->mask = cap-1;
+    q->seqs = (atomic_size_t*)(q+1);
+    q->data = (char*)(q->seqs+cap);
+    colist_init(&q->waiters);
+    if (pipe0(q->fds) == -1) {
+        free0(q);
+        return NECO_ERROR;
+    }
+    if (setnonblock(q->fds[0], true, 0) == -1 || 
+        setnonblock(q->fds[1], true, 0) == -1)
+    {
+        close(q->fds[0]);
+        close(q->fds[1]);
+        free0(q);
+        return NECO_ERROR;
+    }
+    *mpsc = q;
+    return NECO_OK;
 }
 
-/// Receive the next value from a generator.
+/// Create a queue for sending messages from any thread to the coroutines of
+/// the current runtime.
 ///
-/// See neco_gen_start() for an example.
-int neco_gen_next(neco_gen *gen, void *data) {
-    return neco_gen_next_dl(gen, data, INT64_MAX);
+/// The queue is a bounded lock-free ring. Other threads, such as neco_work()
+/// jobs, pool threads or foreign pthreads, send to it with neco_mpsc_sendv(),
+/// which never blocks. Coroutines of the runtime that created it receive with
+/// neco_mpsc_recvv(), which waits when the queue is empty.
+///
+/// @param mpsc The new queue
+/// @param data_size Data size of messages
+/// @param capacity Number of messages the queue holds, rounded up to a power
+///        of two
+/// @return NECO_OK Success
+/// @return NECO_NOMEM The system lacked the necessary resources
+/// @return NECO_INVAL An invalid parameter was provided
+/// @return NECO_PERM Operation called outside of a coroutine
+/// @return NECO_ERROR The wakeup pipe could not be created (check errno)
+/// @note The caller is responsible for freeing with neco_mpsc_release()
+/// @see Queues
+int neco_mpsc_make(neco_mpsc **mpsc, size_t data_size, size_t capacity) {
+    int ret = mpsc_make(mpsc, data_size, capacity);
+    error_guard(ret);
+    return ret;
 }
 
-/// Close the generator.
-/// @param gen Generator
+/// Retain a reference of the queue so that it can be shared with another
+/// thread or coroutine. This may be called from any thread.
+/// @param mpsc The queue
 /// @return NECO_OK Success
-int neco_gen_close(neco_gen *gen) {
-    return neco_chan_close((void*)gen);
+/// @return NECO_INVAL An invalid parameter was provided
+/// @see Queues
+int neco_mpsc_retain(neco_mpsc *mpsc) {
+    int ret = NECO_INVAL;
+    if (mpsc) {
+        atomic_fetch_add(&mpsc->rc, 1);
+        ret = NECO_OK;
+    }
+    error_guard(ret);
+    return ret;
 }
 
-/// Test a neco error code. 
-/// @return the provided value, unchanged.
-int neco_testcode(int errcode) {
-    int ret = errcode;
+/// Release a reference to the queue. The last release frees it.
+/// This may be called from any thread.
+/// @param mpsc The queue
+/// @return NECO_OK Success
+/// @return NECO_INVAL An invalid parameter was provided
+/// @see Queues
+int neco_mpsc_release(neco_mpsc *mpsc) {
+    int ret = NECO_INVAL;
+    if (mpsc) {
+        if (atomic_fetch_sub(&mpsc->rc, 1) == 0) {
+            close(mpsc->fds[0]);
+            close(mpsc->fds[1]);
+            free0(mpsc);
+        }
+        ret = NECO_OK;
+    }
     error_guard(ret);
     return ret;
 }
 
-/// Stop normal execution of the current coroutine, print stack trace, and exit
-/// the program immediately.
-int neco_panic(const char *fmt, ...) {
-    char buf[256];
-    va_list args;
-    va_start(args, fmt);
-    vsnprintf(buf, sizeof(buf), fmt, args);
-    va_end(args);
-    panic("%s", buf);
-    return NECO_OK;
+static void mpsc_wake(struct neco_mpsc *q) {
+    // Pairs with the receiver setting 'sleeping' before checking again.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&q->sleeping, memory_order_relaxed) && 
+        atomic_exchange(&q->sleeping, false))
+    {
+        char c = 0;
+        (void)!write0(q->fds[1], &c, 1);
+    }
 }
 
-static int suspend_dl(int64_t deadline) {
-    struct coroutine *co = coself();
-    if (!co) {
-        return NECO_PERM;
+static int mpsc_sendv(struct neco_mpsc *q, const void *data, int count) {
+    if (!q || count < 0 || (count > 0 && !data && q->msgsize > 0)) {
+        return NECO_INVAL;
+    } else if (atomic_load(&q->closed)) {
+        return NECO_CLOSED;
     }
-
-    co->suspended = true;
-    rt->nsuspended++;
-    copause(deadline);
-    rt->nsuspended--;
-    co->suspended = false;
-
-    return checkdl(co, INT64_MAX);
+    size_t cap = q->mask+1;
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t n;
+    do {
+        size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+        n = cap - (tail - head);
+        n = (size_t)count < n ? (size_t)count : n;
+        if (n == 0) {
+            return 0;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&q->tail, &tail, tail+n,
+        memory_order_relaxed, memory_order_relaxed));
+    size_t size = (size_t)q->msgsize;
+    for (size_t i = 0; i < n; i++) {
+        size_t pos = tail+i;
+        if (size > 0) {
+            memcpy(q->data + (pos & q->mask) * size, (char*)data + i * size,
+                size);
+        }
+        atomic_store_explicit(&q->seqs[pos & q->mask], pos+1, 
+            memory_order_release);
+    }
+    mpsc_wake(q);
+    return (int)n;
 }
 
-/// Same as neco_suspend() but with a deadline parameter. 
-int neco_suspend_dl(int64_t deadline) {
-    int ret = suspend_dl(deadline);
-    async_error_guard(ret);
+/// Send many messages to a queue. This may be called from any thread and
+/// never blocks.
+///
+/// The messages are read one after another from data. Messages that do not
+/// fit are not sent, so the caller decides whether to retry, drop, or back
+/// off. A receiver waiting on the queue is woken at most once per call.
+///
+/// @param mpsc The queue
+/// @param data array of count messages
+/// @param count number of messages
+/// @return The number of messages sent, zero when the queue is full
+/// @return NECO_INVAL An invalid parameter was provided
+/// @return NECO_CLOSED Queue closed
+/// @see Queues
+int neco_mpsc_sendv(neco_mpsc *mpsc, const void *data, int count) {
+    int ret = mpsc_sendv(mpsc, data, count);
+    error_guard(ret);
     return ret;
 }
 
-/// Suspend the current coroutine.
+/// Close a queue for sending. This may be called from any thread.
+///
+/// Receivers still get the messages that are in the queue, and then 
+/// NECO_CLOSED.
+///
+/// @param mpsc The queue
 /// @return NECO_OK Success
-/// @return NECO_PERM Operation called outside of a coroutine
-/// @return NECO_CANCELED Operation canceled
-/// @see neco_resume
-/// @see neco_suspend_dl
-int neco_suspend(void) {
-    return neco_suspend_dl(INT64_MAX);
+/// @return NECO_INVAL An invalid parameter was provided
+/// @return NECO_CLOSED Queue already closed
+/// @see Queues
+int neco_mpsc_close(neco_mpsc *mpsc) {
+    int ret = NECO_INVAL;
+    if (mpsc) {
+        ret = atomic_exchange(&mpsc->closed, true) ? NECO_CLOSED : NECO_OK;
+        mpsc_wake(mpsc);
+    }
+    error_guard(ret);
+    return ret;
 }
 
-static int resume(int64_t id) {
-    if (!rt) {
-        return NECO_PERM;
-    }
-    struct coroutine *co = cofind(id);
-    if (!co) {
-        return NECO_NOTFOUND;
+static int mpsc_pop(struct neco_mpsc *q, char *data, int count) {
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t size = (size_t)q->msgsize;
+    int n = 0;
+    while (n < count) {
+        size_t pos = head+(size_t)n;
+        size_t seq = atomic_load_explicit(&q->seqs[pos & q->mask], 
+            memory_order_acquire);
+        if (seq != pos+1) {
+            break;
+        }
+        if (size > 0) {
+            memcpy(data + (size_t)n * size, q->data + (pos & q->mask) * size,
+                size);
+        }
+        n++;
     }
-    if (!co->suspended) {
-        return NECO_NOTSUSPENDED;
+    if (n > 0) {
+        atomic_store_explicit(&q->head, head+(size_t)n, memory_order_release);
     }
-    sco_resume(co->id);
-    return NECO_OK;
+    return n;
 }
 
-/// Resume a suspended roroutine
-/// @return NECO_OK Success
-/// @return NECO_PERM Operation called outside of a coroutine
-/// @return NECO_NOTFOUND Coroutine not found
-/// @return NECO_NOTSUSPENDED Coroutine not suspended
-/// @see neco_suspend
-int neco_resume(int64_t id) {
-    int ret = resume(id);
-    error_guard(ret);
-    return ret;
+static bool mpsc_ready(struct neco_mpsc *q) {
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    return atomic_load(&q->seqs[head & q->mask]) == head+1;
 }
 
-#ifndef NECO_NOWORKERS
-struct iowork {
-    void(*work)(void *udata);
-    void *udata;
-    struct coroutine *co;
-    struct runtime *rt;
-};
-
-static void iowork(void *udata) {
-    struct iowork *info = udata;
-    info->work(info->udata);
-    pthread_mutex_lock(&info->rt->iomu);
-    colist_push_back(&info->rt->iolist, info->co);
-    pthread_mutex_unlock(&info->rt->iomu);
+static int mpsc_recvv0(struct neco_mpsc *q, void *data, int count, 
+    int64_t deadline)
+{
+    struct coroutine *co = coself();
+    while (1) {
+        int n = mpsc_pop(q, data, count);
+        if (n > 0 || count == 0) {
+            return n;
+        }
+        if (atomic_load(&q->closed)) {
+            // Messages may have landed right before the close.
+            n = mpsc_pop(q, data, count);
+            return n > 0 ? n : NECO_CLOSED;
+        }
+        int ret = checkdl(co, deadline);
+        if (ret != NECO_OK) {
+            return ret;
+        }
+        if (q->waiter) {
+            // A wakeup clears 'sleeping' for the waiter alone. Queue behind
+            // it until it hands over.
+            colist_push_back(&q->waiters, co);
+            copause(deadline);
+            remove_from_list(co);
+            ret = checkdl(co, deadline);
+            if (ret != NECO_OK) {
+                return ret;
+            }
+            continue;
+        }
+        q->waiter = co;
+        atomic_store(&q->sleeping, true);
+        // Check again, now that senders can see that the receiver sleeps.
+        if (!mpsc_ready(q) && !atomic_load(&q->closed)) {
+            ret = wait_dl(q->fds[0], EVREAD, deadline);
+        }
+        atomic_store(&q->sleeping, false);
+        q->waiter = NULL;
+        char buf[64];
+        while (read0(q->fds[0], buf, sizeof(buf)) > 0);
+        if (ret != NECO_OK) {
+            return ret;
+        }
+    }
 }
-#endif
 
-static int workfn(int64_t pin, void(*work)(void *udata), void *udata) {
-    (void)pin;
-    struct coroutine *co = coself();
-    if (!work) {
+static int mpsc_recvv(struct neco_mpsc *q, void *data, int count, 
+    int64_t deadline)
+{
+    if (!q || count < 0 || (count > 0 && !data && q->msgsize > 0)) {
         return NECO_INVAL;
-    }
-    if (!co) {
+    } else if (!rt || q->rtid != rt->id) {
         return NECO_PERM;
     }
-#ifdef NECO_NOWORKERS
-    // Run in foreground
-    work(udata);
-#else
-    // Run in background
-    struct iowork info = { .work = work, .udata = udata, .co = co, .rt = rt };
-    rt->niowaiters++;
-    while (!worker_submit(rt->worker, pin, iowork, &info)) {
-        sco_yield();
+    int ret = mpsc_recvv0(q, data, count, deadline);
+    if (!q->waiter && !colist_is_empty(&q->waiters)) {
+        // Let the next one in line take what's left, or wait on the pipe.
+        sco_resume(colist_pop_front(&q->waiters)->id);
     }
-    sco_pause();
-    rt->niowaiters--;
-#endif
-    return NECO_OK;
+    return ret;
 }
 
-/// Perform work in a background thread and wait until the work is done.
-/// 
-/// This operation cannot be canceled and cannot timeout. It's the responibilty
-/// of the caller to figure out a mechanism for doing those things from inside
-/// of the work function.
-/// 
-/// The work function will not be inside of a Neco context, thus all `neco_*`
-/// functions will fail if called from inside of the work function.
+/// Same as neco_mpsc_recvv() but with a deadline parameter.
+int neco_mpsc_recvv_dl(neco_mpsc *mpsc, void *data, int count, 
+    int64_t deadline)
+{
+    int ret = mpsc_recvv(mpsc, data, count, deadline);
+    async_error_guard(ret);
+    return ret;
+}
+
+/// Receive many messages from a queue.
 ///
-/// @param pin pin to a thread, or use -1 for round robin selection.
-/// @param work the work, must not be null
-/// @param udata any user data
-/// @return NECO_OK Success
-/// @return NECO_NOMEM The system lacked the necessary resources
+/// Waits for at least one message, then takes up to count messages that are
+/// ready. Only coroutines of the runtime that created the queue may receive.
+/// Any number of them may wait on an empty queue.
+///
+/// @param mpsc The queue
+/// @param data array with room for count messages
+/// @param count maximum number of messages
+/// @return The number of messages received
+/// @return NECO_PERM Not called from the runtime that created the queue
 /// @return NECO_INVAL An invalid parameter was provided
-/// @note There is no way to cancel or timeout this operation
-/// @note There is no way to cancel or timeout this operation
-int neco_work(int64_t pin, void(*work)(void *udata), void *udata) {
-    int ret = workfn(pin, work, udata);
-    error_guard(ret);
-    return ret;
+/// @return NECO_CANCELED Operation canceled
+/// @return NECO_CLOSED Queue closed and empty
+/// @see Queues
+int neco_mpsc_recvv(neco_mpsc *mpsc, void *data, int count) {
+    return neco_mpsc_recvv_dl(mpsc, data, count, INT64_MAX);
 }
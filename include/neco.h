@@ -14,9 +14,11 @@
 #include <sys/types.h>
 #ifdef _WIN32
 #include <ws2tcpip.h>
+struct iovec;
 #else
 #include <netdb.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #endif
 
 #ifdef __cplusplus
@@ -31,9 +33,17 @@ extern "C" {
 /// Neco provides standard operations for starting a coroutine, sleeping, 
 /// suspending, resuming, yielding to another coroutine, joining/waiting for
 /// child coroutines, and exiting a running coroutine.
+///
+/// Stack sizes, both NECO_STACKSIZE and those given to neco_start_sized(),
+/// are rounded up to a size class. There are four classes for each power of
+/// two from 16 KB to 512 MB, so a stack over 16 KB is less than a quarter
+/// larger than asked for.
 /// @{
 int neco_start(void(*coroutine)(int argc, void *argv[]), int argc, ...);
 int neco_startv(void(*coroutine)(int argc, void *argv[]), int argc, void *argv[]);
+int neco_start_sized(size_t stack_size, void(*coroutine)(int argc, void *argv[]), int argc, ...);
+int neco_startv_sized(size_t stack_size, void(*coroutine)(int argc, void *argv[]), int argc, void *argv[]);
+ssize_t neco_stack_highwater(int64_t id);
 int neco_yield(void);
 int neco_sleep(int64_t nanosecs);
 int neco_sleep_dl(int64_t deadline);
@@ -56,11 +66,13 @@ int64_t neco_starterid(void);
 /// Channels allow for sending and receiving values between coroutines.
 /// By default, sends and receives will block until the other side is ready.
 /// This allows the coroutines to synchronize without using locks or condition
-/// variables.
+/// variables. A channel belongs to the thread that made it, unless it was made
+/// with neco_chan_make_shared().
 /// @{
 typedef struct neco_chan neco_chan;
 
 int neco_chan_make(neco_chan **chan, size_t data_size, size_t capacity);
+int neco_chan_make_shared(neco_chan **chan, size_t data_size, size_t capacity);
 int neco_chan_retain(neco_chan *chan);
 int neco_chan_release(neco_chan *chan);
 int neco_chan_send(neco_chan *chan, void *data);
@@ -69,6 +81,10 @@ int neco_chan_broadcast(neco_chan *chan, void *data);
 int neco_chan_recv(neco_chan *chan, void *data);
 int neco_chan_recv_dl(neco_chan *chan, void *data, int64_t deadline);
 int neco_chan_tryrecv(neco_chan *chan, void *data);
+int neco_chan_sendv(neco_chan *chan, void *data, int count);
+int neco_chan_sendv_dl(neco_chan *chan, void *data, int count, int64_t deadline);
+int neco_chan_recvv(neco_chan *chan, void *data, int count);
+int neco_chan_recvv_dl(neco_chan *chan, void *data, int count, int64_t deadline);
 int neco_chan_close(neco_chan *chan);
 int neco_chan_select(int nchans, ...);
 int neco_chan_select_dl(int64_t deadline, int nchans, ...);
@@ -79,6 +95,29 @@ int neco_chan_tryselectv(int nchans, neco_chan *chans[]);
 int neco_chan_case(neco_chan *chan, void *data);
 /// @}
 
+////////////////////////////////////////////////////////////////////////////////
+// queues
+////////////////////////////////////////////////////////////////////////////////
+
+/// @defgroup Queues Cross-thread queues
+/// A queue carries messages from any number of threads to the coroutines of
+/// one runtime. Sending never blocks and takes no locks, and a waiting
+/// receiver is woken at most once per batch of messages. Any number of the
+/// runtime's coroutines may wait on an empty queue.
+/// @{
+
+typedef struct neco_mpsc neco_mpsc;
+
+int neco_mpsc_make(neco_mpsc **mpsc, size_t data_size, size_t capacity);
+int neco_mpsc_retain(neco_mpsc *mpsc);
+int neco_mpsc_release(neco_mpsc *mpsc);
+int neco_mpsc_sendv(neco_mpsc *mpsc, const void *data, int count);
+int neco_mpsc_close(neco_mpsc *mpsc);
+int neco_mpsc_recvv(neco_mpsc *mpsc, void *data, int count);
+int neco_mpsc_recvv_dl(neco_mpsc *mpsc, void *data, int count, int64_t deadline);
+
+/// @}
+
 ////////////////////////////////////////////////////////////////////////////////
 // generators
 ////////////////////////////////////////////////////////////////////////////////
@@ -115,6 +154,7 @@ typedef struct { int64_t _0; intptr_t _1[5]; } neco_mutex;
 #define NECO_MUTEX_INITIALIZER { 0 }
 
 int neco_mutex_init(neco_mutex *mutex);
+int neco_mutex_init_shared(neco_mutex *mutex);
 int neco_mutex_lock(neco_mutex *mutex);
 int neco_mutex_lock_dl(neco_mutex *mutex, int64_t deadline);
 int neco_mutex_trylock(neco_mutex *mutex);
@@ -136,6 +176,7 @@ typedef struct { int64_t _0; intptr_t _1[5]; } neco_waitgroup;
 #define NECO_WAITGROUP_INITIALIZER { 0 }
 
 int neco_waitgroup_init(neco_waitgroup *waitgroup);
+int neco_waitgroup_init_shared(neco_waitgroup *waitgroup);
 int neco_waitgroup_add(neco_waitgroup *waitgroup, int delta);
 int neco_waitgroup_done(neco_waitgroup *waitgroup);
 int neco_waitgroup_wait(neco_waitgroup *waitgroup);
@@ -174,6 +215,14 @@ int neco_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
 int neco_accept_dl(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int64_t deadline);
 int neco_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen);
 int neco_connect_dl(int sockfd, const struct sockaddr *addr, socklen_t addrlen, int64_t deadline);
+ssize_t neco_readv(int fd, const struct iovec *iov, int iovcnt);
+ssize_t neco_readv_dl(int fd, const struct iovec *iov, int iovcnt, int64_t deadline);
+ssize_t neco_writev(int fd, const struct iovec *iov, int iovcnt);
+ssize_t neco_writev_dl(int fd, const struct iovec *iov, int iovcnt, int64_t deadline);
+ssize_t neco_sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+ssize_t neco_sendfile_dl(int out_fd, int in_fd, off_t *offset, size_t count, int64_t deadline);
+ssize_t neco_splice(int fd_in, int64_t *off_in, int fd_out, int64_t *off_out, size_t len, unsigned int flags);
+ssize_t neco_splice_dl(int fd_in, int64_t *off_in, int fd_out, int64_t *off_out, size_t len, unsigned int flags, int64_t deadline);
 int neco_getaddrinfo(const char *node, const char *service,
     const struct addrinfo *hints, struct addrinfo **res);
 int neco_getaddrinfo_dl(const char *node, const char *service,
@@ -277,6 +326,43 @@ int neco_work(int64_t pin, void(*work)(void *udata), void *udata);
 
 /// @}
 
+////////////////////////////////////////////////////////////////////////////////
+// pools
+////////////////////////////////////////////////////////////////////////////////
+
+/// @defgroup Pools Thread pools
+/// A pool runs a Neco runtime on each of several threads and balances the
+/// coroutines started on it between them by work stealing. A coroutine runs
+/// on a single thread from start to finish, and may be pinned to one.
+/// Coroutines on different threads share work through shared channels,
+/// mutexes and waitgroups.
+/// @{
+
+typedef struct neco_pool neco_pool;
+
+int neco_pool_new(neco_pool **pool, int nthreads);
+int neco_pool_start(neco_pool *pool, void(*coroutine)(int argc, void *argv[]), int argc, ...);
+int neco_pool_startv(neco_pool *pool, void(*coroutine)(int argc, void *argv[]), int argc, void *argv[]);
+int neco_pool_start_on(neco_pool *pool, int thread, void(*coroutine)(int argc, void *argv[]), int argc, ...);
+int neco_pool_thread(void);
+int neco_pool_free(neco_pool *pool);
+
+/// @}
+
+////////////////////////////////////////////////////////////////////////////////
+// arenas
+////////////////////////////////////////////////////////////////////////////////
+
+/// @defgroup Arenas Arenas
+/// Each coroutine, and each background worker job, has an arena.h arena
+/// backed by a thread-local pool of blocks. Requires NECO_USEARENAS.
+/// @{
+
+struct Arena;
+struct Arena *neco_arena(void);
+
+/// @}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Stats and information
 ////////////////////////////////////////////////////////////////////////////////
@@ -302,6 +388,65 @@ int neco_getstats(neco_stats *stats);
 int neco_is_main_thread(void);
 const char *neco_switch_method(void);
 
+#define NECO_HISTBUCKETS 32
+
+/// Latency histogram. Bucket i counts the samples of [2^i, 2^(i+1)) ns, with
+/// zero going in the first bucket and anything of 2^31 ns or more in the last.
+typedef struct neco_hist {
+    uint64_t count;                     ///< Number of samples
+    uint64_t sum;                       ///< Sum of the samples, nanoseconds
+    uint64_t max;                       ///< Largest sample, nanoseconds
+    uint64_t buckets[NECO_HISTBUCKETS];
+} neco_hist;
+
+/// Runtime counters and histograms. Requires NECO_USEMETRICS, otherwise they
+/// all stay zero.
+typedef struct neco_metrics {
+    uint64_t loops;       ///< Scheduler loop iterations
+    uint64_t pausedsteps; ///< Loop iterations that handled paused coroutines
+    uint64_t evwaits;     ///< Polls of epoll, kqueue or io_uring
+    uint64_t events;      ///< I/O events and completions consumed by the polls
+    uint64_t switches;    ///< Context switches into coroutines
+    uint64_t poolhits;    ///< Coroutines started from the pool, stack included
+    uint64_t poolmisses;  ///< Coroutines started with a new stack
+    uint64_t chansends;   ///< Channel send calls, batches counting each message
+    uint64_t chanrecvs;   ///< Channel receive calls, selects excluded
+    uint64_t chanwaits;   ///< Channel sends and receives that had to wait
+    uint64_t chanmaxbuf;  ///< Most messages buffered by a single channel
+    uint64_t workerjobs;  ///< Jobs submitted to background workers
+    uint64_t workermaxq;  ///< Longest worker thread queue after a submit
+    uint64_t dnshits;     ///< Host name lookups answered by the cache
+    uint64_t dnsmisses;   ///< Host name lookups that queried the resolver
+    uint64_t dnscoalesced; ///< Host name lookups that waited on another one
+    neco_hist pausedstep; ///< Time spent in each paused step
+    neco_hist evwait;     ///< Time spent in each poll, waiting included
+    neco_hist schedlat;   ///< Time from a coroutine becoming runnable to running
+} neco_metrics;
+
+int neco_getmetrics(neco_metrics *metrics);
+int neco_resetmetrics(void);
+
+/// Kinds of trace events.
+enum neco_trace_kind {
+    NECO_TRACE_RUN = 1,    ///< A coroutine started running, arg is its latency
+    NECO_TRACE_SCHED = 2,  ///< The scheduler started running
+    NECO_TRACE_STEP = 3,   ///< A paused step ended, arg is its duration
+    NECO_TRACE_EVWAIT = 4, ///< A poll ended, arg is its duration
+};
+
+/// A trace event, as stored in the trace ring of each runtime. Requires
+/// NECO_USETRACE.
+typedef struct neco_trace_event {
+    int64_t ts;   ///< Time of the event, same clock as neco_now()
+    int64_t id;   ///< Coroutine identifier, zero for the scheduler
+    int64_t arg;  ///< Nanoseconds, depending on the kind
+    int32_t kind; ///< One of enum neco_trace_kind
+    int32_t rtid; ///< Identifier of the runtime
+} neco_trace_event;
+
+ssize_t neco_trace_read(neco_trace_event *events, size_t nevents);
+int neco_trace_chrome(int fd, const neco_trace_event *events, size_t nevents);
+
 /// @}
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -397,6 +542,7 @@ typedef struct neco_stream neco_stream;
 
 int neco_stream_make(neco_stream **stream, int fd);
 int neco_stream_make_buffered(neco_stream **stream, int fd);
+int neco_stream_make_buffered_size(neco_stream **stream, int fd, size_t buffer_size);
 int neco_stream_close(neco_stream *stream);
 int neco_stream_close_dl(neco_stream *stream, int64_t deadline);
 ssize_t neco_stream_read(neco_stream *stream, void *data, size_t nbytes);
@@ -408,6 +554,11 @@ ssize_t neco_stream_readfull_dl(neco_stream *stream, void *data, size_t nbytes,
 int neco_stream_read_byte(neco_stream *stream);
 int neco_stream_read_byte_dl(neco_stream *stream, int64_t deadline);
 int neco_stream_unread_byte(neco_stream *stream);
+ssize_t neco_stream_peek(neco_stream *stream, const void **data, size_t nbytes);
+ssize_t neco_stream_peek_dl(neco_stream *stream, const void **data, size_t nbytes, int64_t deadline);
+int neco_stream_consume(neco_stream *stream, size_t nbytes);
+ssize_t neco_stream_readuntil(neco_stream *stream, int delim, size_t maxlen, const void **data);
+ssize_t neco_stream_readuntil_dl(neco_stream *stream, int delim, size_t maxlen, const void **data, int64_t deadline);
 int neco_stream_flush(neco_stream *stream);
 int neco_stream_flush_dl(neco_stream *stream, int64_t deadline);
 ssize_t neco_stream_buffered_read_size(neco_stream *stream);
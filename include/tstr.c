@@ -4,6 +4,15 @@
 //
 // https://github.com/tidwall/tstr
 
+#ifndef TSTR_NOARENA
+// The LOGGING mode of debug.h implements uprintf, which belongs to the
+// program's own translation unit and not to this one.
+#pragma push_macro("LOGGING")
+#undef LOGGING
+#include "arena.h"
+#pragma pop_macro("LOGGING")
+#endif
+
 #include <stdlib.h>
 #include <stdatomic.h>
 #include <string.h>
@@ -13,14 +22,22 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <pthread.h>
 #include "tstr.h"
 
+enum tstr_kind { TSTR_HEAP, TSTR_ARENA, TSTR_INLINE, TSTR_INTERN };
+
 struct tstr_internal {
     atomic_int rc;
+    unsigned kind;
     size_t len;
+    atomic_uint_fast64_t hash; // zero until computed
     char data[];
 };
 
+static_assert(sizeof(struct tstr_internal) <= TSTR_HEADER, "");
+
 static void *(*_tstr_malloc)(size_t);
 static void (*_tstr_free)(void*);
 
@@ -42,7 +59,9 @@ tstr *tstr_alloc(size_t nbytes) {
     struct tstr_internal *istr = (_tstr_malloc?_tstr_malloc:malloc)(memsize);
     if (!istr) return NULL;
     istr->rc = 0;
+    istr->kind = TSTR_HEAP;
     istr->len = nbytes;
+    istr->hash = 0;
     return (tstr*)(&istr->data[0]);
 }
 
@@ -86,6 +105,15 @@ tstr *tstr_from_cstr(const char *cstr) {
 tstr *tstr_clone(tstr *str) {
     if (!str) return NULL;
     struct tstr_internal *istr = tstr_toistr(str);
+    switch (istr->kind) {
+    case TSTR_ARENA:
+    case TSTR_INTERN:
+        // shares the lifetime of its arena or intern table
+        return (tstr*)str;
+    case TSTR_INLINE:
+        // the inline buffer may go away, so clone to the heap
+        return tstr_from_bytes(str, istr->len);
+    }
     atomic_fetch_add(&istr->rc, 1);
     return (tstr*)str;
 }
@@ -93,10 +121,76 @@ tstr *tstr_clone(tstr *str) {
 void tstr_free(tstr *str) {
     if (!str) return;
     struct tstr_internal *istr = tstr_toistr(str);
+    if (istr->kind != TSTR_HEAP) return;
     if (atomic_fetch_sub(&istr->rc, 1) > 0) return;
     (_tstr_free?_tstr_free:free)(istr);
 }
 
+/// Return a tstr stored inline in buf, or NULL if nbytes > TSTR_INLINE_MAX.
+tstr *tstr_from_bytes_inline(tstr_inline *buf, const void *bytes,
+    size_t nbytes)
+{
+    if (nbytes > TSTR_INLINE_MAX) return NULL;
+    struct tstr_internal *istr = (struct tstr_internal *)buf;
+    istr->rc = 0;
+    istr->kind = TSTR_INLINE;
+    istr->len = nbytes;
+    istr->hash = 0;
+    memcpy(istr->data, bytes, nbytes);
+    istr->data[nbytes] = '\0';
+    return (tstr*)(&istr->data[0]);
+}
+
+#ifndef TSTR_NOARENA
+static tstr *tstr_alloc_arena(struct Arena *arena, size_t nbytes) {
+    struct tstr_internal *istr = arena_alloc(arena, 1,
+        _Alignof(struct tstr_internal), sizeof(struct tstr_internal)+nbytes+1,
+        NOINIT);
+    if (!istr) return NULL;
+    istr->rc = 0;
+    istr->kind = TSTR_ARENA;
+    istr->len = nbytes;
+    istr->hash = 0;
+    return (tstr*)(&istr->data[0]);
+}
+
+tstr *tstr_from_bytes_arena(struct Arena *arena, const void *bytes, 
+    size_t nbytes)
+{
+    tstr *str = tstr_alloc_arena(arena, nbytes);
+    if (!str) return NULL;
+    memcpy((char*)str, bytes, nbytes);
+    ((char*)str)[nbytes] = '\0';
+    return str;
+}
+
+tstr *tstr_from_cstr_arena(struct Arena *arena, const char *cstr) {
+    if (!cstr) return NULL;
+    return tstr_from_bytes_arena(arena, cstr, strlen(cstr));
+}
+
+tstr *tstr_from_format_arena(struct Arena *arena, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int nbytes = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    assert(nbytes >= 0);
+    tstr *str = tstr_alloc_arena(arena, nbytes);
+    if (!str) return NULL;
+    va_start(args, format);
+    nbytes = vsnprintf((char*)str, nbytes+1, format, args);
+    va_end(args);
+    assert(nbytes >= 0);
+    return str;
+}
+
+tstr *tstr_clone_arena(struct Arena *arena, tstr *str) {
+    if (!str) return NULL;
+    if (tstr_toistr(str)->kind == TSTR_ARENA) return (tstr*)str;
+    return tstr_from_bytes_arena(arena, str, tstr_len(str));
+}
+#endif
+
 size_t tstr_len(tstr *str) {
     if (!str) return 0;
     struct tstr_internal *istr = tstr_toistr(str);
@@ -114,10 +208,18 @@ const void *tstr_bytes(tstr *str) {
 }
 
 bool tstr_equal(tstr *a, tstr *b) {
+    if (a == b) return true;
     size_t alen = tstr_len(a);
     size_t blen = tstr_len(b);
     if (alen != blen) return false;
     if (alen == 0) return true;
+    // Strings that have both been hashed can usually be told apart without
+    // touching their bytes.
+    uint64_t ahash = atomic_load_explicit(&tstr_toistr(a)->hash,
+        memory_order_relaxed);
+    uint64_t bhash = atomic_load_explicit(&tstr_toistr(b)->hash,
+        memory_order_relaxed);
+    if (ahash && bhash && ahash != bhash) return false;
     return memcmp(a, b, alen) == 0;
 }
 
@@ -179,3 +281,204 @@ int tstr_compare(tstr *a, tstr *b) {
     return tstr_cmp(a, b);
 }
 
+static uint64_t tstr_mix(uint64_t x) {
+    x ^= x >> 23;
+    x *= 0x2127599bf4325c37ull;
+    x ^= x >> 47;
+    return x;
+}
+
+// Hash eight bytes at a time. Never returns zero, which marks a tstr that has
+// not been hashed yet.
+static uint64_t tstr_hash_bytes(const void *bytes, size_t nbytes) {
+    const unsigned char *p = bytes;
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ (nbytes * 0x100000001b3ull);
+    uint64_t v;
+    for (; nbytes >= 8; p += 8, nbytes -= 8) {
+        memcpy(&v, p, 8);
+        h = (h ^ tstr_mix(v)) * 0x880355f21e6d1965ull;
+    }
+    v = 0;
+    memcpy(&v, p, nbytes);
+    h = tstr_mix((h ^ v) * 0x880355f21e6d1965ull);
+    return h ? h : 1;
+}
+
+/// Return the hash of the string's bytes. The first call stores it in the
+/// header, after which it is a plain field load.
+uint64_t tstr_hash(tstr *str) {
+    if (!str) return 0;
+    struct tstr_internal *istr = tstr_toistr(str);
+    uint64_t hash = atomic_load_explicit(&istr->hash, memory_order_relaxed);
+    if (!hash) {
+        hash = tstr_hash_bytes(istr->data, istr->len);
+        atomic_store_explicit(&istr->hash, hash, memory_order_relaxed);
+    }
+    return hash;
+}
+
+bool tstr_interned(tstr *str) {
+    return str && tstr_toistr(str)->kind == TSTR_INTERN;
+}
+
+// Keys of the intern table point at the bytes of a candidate string, which is
+// either canonical (bytes == the tstr itself) or a probe on the stack.
+struct tstr_intern_key {
+    uint64_t hash;
+    size_t len;
+    const char *bytes;
+};
+
+static uint64_t tstr_intern_key_hash(struct tstr_intern_key key) {
+    return key.hash;
+}
+
+static bool tstr_intern_key_cmpr(struct tstr_intern_key a,
+    struct tstr_intern_key b)
+{
+    return a.hash == b.hash && a.len == b.len &&
+        memcmp(a.bytes, b.bytes, a.len) == 0;
+}
+
+// The table owns its strings, so it uses the heap even when arena.h is around.
+#pragma push_macro("ARENA_H")
+#undef ARENA_H
+#define NAME tstr_intern_set
+#define KEY_TY struct tstr_intern_key
+#define HASH_FN tstr_intern_key_hash
+#define CMPR_FN tstr_intern_key_cmpr
+#include "verstable.h"
+#pragma pop_macro("ARENA_H")
+
+#ifndef TSTR_INTERN_SHARDS
+#define TSTR_INTERN_SHARDS 16 // must be a power of two
+#endif
+
+struct tstr_intern_shard {
+    pthread_rwlock_t lock;
+    tstr_intern_set set;
+};
+
+struct tstr_intern {
+    bool concurrent;
+    int nshards;
+    struct tstr_intern_shard shards[];
+};
+
+/// Create an intern table. A concurrent table is split into shards that are
+/// each guarded by a read-write lock, and may be shared between threads.
+struct tstr_intern *tstr_intern_new(bool concurrent) {
+    int nshards = concurrent ? TSTR_INTERN_SHARDS : 1;
+    size_t size = sizeof(struct tstr_intern) + 
+        sizeof(struct tstr_intern_shard)*nshards;
+    struct tstr_intern *tab = (_tstr_malloc?_tstr_malloc:malloc)(size);
+    if (!tab) return NULL;
+    tab->concurrent = concurrent;
+    tab->nshards = nshards;
+    for (int i = 0; i < nshards; i++) {
+        if (concurrent) {
+            pthread_rwlock_init(&tab->shards[i].lock, NULL);
+        }
+        tstr_intern_set_init(&tab->shards[i].set);
+    }
+    return tab;
+}
+
+/// Free the table along with every string it has interned.
+void tstr_intern_free(struct tstr_intern *tab) {
+    if (!tab) return;
+    for (int i = 0; i < tab->nshards; i++) {
+        tstr_intern_set *set = &tab->shards[i].set;
+        tstr_intern_set_itr itr = tstr_intern_set_first(set);
+        for (; !tstr_intern_set_is_end(itr); itr = tstr_intern_set_next(itr)) {
+            (_tstr_free?_tstr_free:free)(tstr_toistr(itr.data->key.bytes));
+        }
+        tstr_intern_set_cleanup(set);
+        if (tab->concurrent) {
+            pthread_rwlock_destroy(&tab->shards[i].lock);
+        }
+    }
+    (_tstr_free?_tstr_free:free)(tab);
+}
+
+size_t tstr_intern_count(struct tstr_intern *tab) {
+    size_t count = 0;
+    for (int i = 0; i < tab->nshards; i++) {
+        struct tstr_intern_shard *shard = &tab->shards[i];
+        if (tab->concurrent) pthread_rwlock_rdlock(&shard->lock);
+        count += tstr_intern_set_size(&shard->set);
+        if (tab->concurrent) pthread_rwlock_unlock(&shard->lock);
+    }
+    return count;
+}
+
+static tstr *tstr_intern_find(tstr_intern_set *set, struct tstr_intern_key key)
+{
+    tstr_intern_set_itr itr = tstr_intern_set_get(set, key);
+    return tstr_intern_set_is_end(itr) ? NULL : itr.data->key.bytes;
+}
+
+static tstr *tstr_intern_insert(tstr_intern_set *set,
+    struct tstr_intern_key key)
+{
+    tstr *str = tstr_intern_find(set, key);
+    if (str) return str;
+    str = tstr_from_bytes(key.bytes, key.len);
+    if (!str) return NULL;
+    struct tstr_internal *istr = tstr_toistr(str);
+    istr->kind = TSTR_INTERN;
+    istr->hash = key.hash;
+    key.bytes = str;
+    if (tstr_intern_set_is_end(tstr_intern_set_insert(set, key))) {
+        (_tstr_free?_tstr_free:free)(istr);
+        return NULL;
+    }
+    return str;
+}
+
+static tstr *tstr_intern_key(struct tstr_intern *tab,
+    struct tstr_intern_key key);
+
+/// Return the canonical string for the bytes, adding it to the table if it
+/// is new. Two strings from the same table are equal only if they are the
+/// same pointer. The result belongs to the table: tstr_clone returns it as
+/// is, tstr_free ignores it. Returns NULL when out of memory.
+tstr *tstr_intern_bytes(struct tstr_intern *tab, const void *bytes,
+    size_t nbytes)
+{
+    struct tstr_intern_key key = {
+        tstr_hash_bytes(bytes, nbytes), nbytes, bytes
+    };
+    return tstr_intern_key(tab, key);
+}
+
+static tstr *tstr_intern_key(struct tstr_intern *tab,
+    struct tstr_intern_key key)
+{
+    if (!tab->concurrent) {
+        return tstr_intern_insert(&tab->shards[0].set, key);
+    }
+    struct tstr_intern_shard *shard = 
+        &tab->shards[(key.hash >> 32) & (tab->nshards-1)];
+    pthread_rwlock_rdlock(&shard->lock);
+    tstr *str = tstr_intern_find(&shard->set, key);
+    pthread_rwlock_unlock(&shard->lock);
+    if (str) return str;
+    pthread_rwlock_wrlock(&shard->lock);
+    str = tstr_intern_insert(&shard->set, key);
+    pthread_rwlock_unlock(&shard->lock);
+    return str;
+}
+
+tstr *tstr_intern_cstr(struct tstr_intern *tab, const char *cstr) {
+    if (!cstr) return NULL;
+    return tstr_intern_bytes(tab, cstr, strlen(cstr));
+}
+
+/// Return the canonical string with the same bytes as str. Its hash is reused
+/// if already computed.
+tstr *tstr_intern(struct tstr_intern *tab, tstr *str) {
+    if (!str) return NULL;
+    struct tstr_intern_key key = { tstr_hash(str), tstr_len(str), str };
+    return tstr_intern_key(tab, key);
+}
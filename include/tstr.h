@@ -9,6 +9,7 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 // tstr is string that tracks it's length, is null-terminated, is compatible
 // with C strings, and can optionally store binary.
@@ -31,6 +32,42 @@ int tstr_cmp_cstr(tstr *str, const char *cstr);
 int tstr_casecmp_cstr(tstr *str, const char *cstr);
 void tstr_set_allocator(void *(*malloc)(size_t), void (*free)(void*));
 
+// Strings allocated from an arena.h arena live as long as the arena does.
+// tstr_clone returns them as is, tstr_free ignores them.
+struct Arena;
+tstr *tstr_from_bytes_arena(struct Arena *arena, const void *bytes, size_t nbytes);
+tstr *tstr_from_cstr_arena(struct Arena *arena, const char *cstr);
+tstr *tstr_from_format_arena(struct Arena *arena, const char *format, ...);
+tstr *tstr_clone_arena(struct Arena *arena, tstr *str);
+
+// Short strings can be stored inline, such as in a struct or on the stack.
+// tstr_clone copies them to the heap, tstr_free ignores them.
+#define TSTR_HEADER 24
+#define TSTR_INLINE_MAX 23
+typedef struct {
+    size_t _[(TSTR_HEADER+TSTR_INLINE_MAX+1+sizeof(size_t)-1)/sizeof(size_t)];
+} tstr_inline;
+
+tstr *tstr_from_bytes_inline(tstr_inline *buf, const void *bytes, size_t nbytes);
+
+// The hash is computed once and cached in the header. tstr_equal compares
+// pointers first, then cached hashes, before comparing bytes.
+uint64_t tstr_hash(tstr *str);
+
+// An intern table maps bytes to one canonical tstr, so that interned strings
+// from the same table are equal exactly when their pointers are. The table
+// owns its strings and frees them in tstr_intern_free. A table created with
+// concurrent=true may be shared between threads.
+struct tstr_intern;
+
+struct tstr_intern *tstr_intern_new(bool concurrent);
+void tstr_intern_free(struct tstr_intern *tab);
+size_t tstr_intern_count(struct tstr_intern *tab);
+tstr *tstr_intern(struct tstr_intern *tab, tstr *str);
+tstr *tstr_intern_bytes(struct tstr_intern *tab, const void *bytes, size_t nbytes);
+tstr *tstr_intern_cstr(struct tstr_intern *tab, const char *cstr);
+bool tstr_interned(tstr *str);
+
 // DEPRECATED
 tstr *tstr_from_zeros(size_t nbytes);
 int tstr_compare(tstr *a, tstr *b);
@@ -90,6 +90,11 @@ extern int _upf_test_status;
 #define UPRINTF_MAX_STRING_LENGTH 200
 #endif
 
+// Directory in which to cache the index of compilation units of each
+// executable, keyed by its build-id, so that later runs of the same build
+// start without scanning .debug_info. Disabled unless defined, e.g.
+// #define UPRINTF_INDEX_CACHE_DIR "/tmp/uprintf"
+
 // ===================== INCLUDES =========================
 
 #define __USE_XOPEN_EXTENDED
@@ -518,6 +523,13 @@ typedef struct {
     uint64_t str_offsets_base;
     uint64_t rnglists_base;
 
+    // DIEs after the root one are only parsed once the CU is needed
+    const uint8_t *die;
+    const uint8_t *die_end;
+    const uint8_t *abbrev_table;
+    bool is64bit;
+    bool is_parsed;
+
     _upf_abbrev_vec abbrevs;
     _upf_named_type_vec types;
     _upf_function_vec functions;
@@ -604,11 +616,14 @@ struct _upf_state {
     const uint8_t *die;
     size_t die_size;
     const uint8_t *abbrev;
+    size_t abbrev_size;
     const char *str;
     const char *line_str;
     const uint8_t *str_offsets;
     const uint8_t *addr;
     const uint8_t *rnglists;
+    const uint8_t *build_id;
+    size_t build_id_size;
     // parsed DWARF info
     _upf_type_map_vec type_map;
     _upf_cu_vec cus;
@@ -1928,16 +1943,27 @@ static _upf_named_type _upf_parse_cu_variable(const _upf_cu *cu, const uint8_t *
     return var;
 }
 
-static void _upf_parse_cu(const uint8_t *cu_base, const uint8_t *die, const uint8_t *die_end, const uint8_t *abbrev_table) {
+// Only reads the root DIE, which is enough to know which PCs belong to the CU.
+// The rest of it is parsed by _upf_parse_cu when it is first needed.
+static void _upf_index_cu(const uint8_t *cu_base, const uint8_t *die, const uint8_t *die_end, const uint8_t *abbrev_table) {
     _UPF_ASSERT(cu_base != NULL && die != NULL && die_end != NULL && abbrev_table != NULL);
 
     _upf_cu cu = {
         .base = cu_base,
         .str_offsets_base = UINT64_MAX,
         .rnglists_base = UINT64_MAX,
-        .abbrevs = _upf_parse_abbrevs(abbrev_table),
+        .die_end = die_end,
+        .abbrev_table = abbrev_table,
+        .is64bit = _upf_state.is64bit,
     };
 
+    // Consecutive CUs may share an abbreviation table, e.g. with LTO.
+    if (_upf_state.cus.length > 0 && _UPF_VECTOR_TOP(&_upf_state.cus).abbrev_table == abbrev_table) {
+        cu.abbrevs = _UPF_VECTOR_TOP(&_upf_state.cus).abbrevs;
+    } else {
+        cu.abbrevs = _upf_parse_abbrevs(abbrev_table);
+    }
+
     const _upf_abbrev *abbrev;
     die += _upf_get_abbrev(&abbrev, &cu, die);
     _UPF_ASSERT(abbrev != NULL && abbrev->tag == DW_TAG_compile_unit);
@@ -1976,20 +2002,45 @@ static void _upf_parse_cu(const uint8_t *cu_base, const uint8_t *die, const uint
     }
 
     cu.scope.ranges = _upf_get_cu_ranges(&cu, low_pc_die, low_pc_attr, high_pc_die, high_pc_attr, ranges_die, ranges_attr);
+    cu.die = die;
+
+    _UPF_VECTOR_PUSH(&_upf_state.cus, cu);
+}
+
+static void _upf_parse_cu(_upf_cu *cu) {
+    _UPF_ASSERT(cu != NULL);
+
+    if (cu->is_parsed) return;
+
+    // Start over in case the previous attempt failed midway
+    cu->scope.vars.length = 0;
+    cu->scope.scopes.length = 0;
+    cu->types.length = 0;
+    cu->functions.length = 0;
+
+    // Not parsed yet if the index was loaded from the cache
+    if (cu->abbrevs.length == 0) cu->abbrevs = _upf_parse_abbrevs(cu->abbrev_table);
+
+    _upf_state.is64bit = cu->is64bit;
+    _upf_state.offset_size = cu->is64bit ? 8 : 4;
+
+    const uint8_t *die = cu->die;
+    const uint8_t *die_end = cu->die_end;
+    const _upf_abbrev *abbrev;
 
     int depth = 0;
     _upf_scope_stack scope_stack = {0};
 
     _upf_scope_stack_entry stack_entry = {
         .depth = depth,
-        .scope = &cu.scope,
+        .scope = &cu->scope,
     };
     _UPF_VECTOR_PUSH(&scope_stack, stack_entry);
 
     while (die < die_end) {
         const uint8_t *die_base = die;
 
-        die += _upf_get_abbrev(&abbrev, &cu, die);
+        die += _upf_get_abbrev(&abbrev, cu, die);
         if (abbrev == NULL) {
             _UPF_ASSERT(scope_stack.length > 0);
             if (depth == _UPF_VECTOR_TOP(&scope_stack).depth) _UPF_VECTOR_POP(&scope_stack);
@@ -2001,13 +2052,13 @@ static void _upf_parse_cu(const uint8_t *cu_base, const uint8_t *die, const uint
 
         switch (abbrev->tag) {
             case DW_TAG_subprogram: {
-                _upf_function function = _upf_parse_cu_subprogram(&cu, die, abbrev);
-                if (function.name != NULL) _UPF_VECTOR_PUSH(&cu.functions, function);
+                _upf_function function = _upf_parse_cu_subprogram(cu, die, abbrev);
+                if (function.name != NULL) _UPF_VECTOR_PUSH(&cu->functions, function);
                 __attribute__((fallthrough));
             }
             case DW_TAG_lexical_block:
             case DW_TAG_inlined_subroutine:
-                _upf_parse_cu_scope(&cu, &scope_stack, depth, die, abbrev);
+                _upf_parse_cu_scope(cu, &scope_stack, depth, die, abbrev);
                 break;
             case DW_TAG_array_type:
             case DW_TAG_enumeration_type:
@@ -2016,21 +2067,21 @@ static void _upf_parse_cu(const uint8_t *cu_base, const uint8_t *die, const uint
             case DW_TAG_typedef:
             case DW_TAG_union_type:
             case DW_TAG_base_type: {
-                const char *typename = _upf_get_typename(&cu, die, abbrev);
+                const char *typename = _upf_get_typename(cu, die, abbrev);
                 if (typename == NULL) break;
 
                 _upf_named_type type = {
                     .die = die_base,
                     .name = typename,
                 };
-                _UPF_VECTOR_PUSH(&cu.types, type);
+                _UPF_VECTOR_PUSH(&cu->types, type);
             } break;
             case DW_TAG_variable:
             case DW_TAG_formal_parameter: {
                 _upf_scope *scope = _UPF_VECTOR_TOP(&scope_stack).scope;
                 if (scope == NULL) break;
 
-                _upf_named_type var = _upf_parse_cu_variable(&cu, die, abbrev);
+                _upf_named_type var = _upf_parse_cu_variable(cu, die, abbrev);
                 if (var.name == NULL) break;
                 if (var.die == NULL) {
                     _UPF_ERROR(
@@ -2045,10 +2096,188 @@ static void _upf_parse_cu(const uint8_t *cu_base, const uint8_t *die, const uint
         die = _upf_skip_die(die, abbrev);
     }
 
-    _UPF_VECTOR_PUSH(&_upf_state.cus, cu);
+    cu->is_parsed = true;
+}
+
+// Returns the CU containing the PC, parsing it if needed.
+static _upf_cu *_upf_get_cu(uint64_t pc) {
+    for (uint32_t i = 0; i < _upf_state.cus.length; i++) {
+        _upf_cu *cu = &_upf_state.cus.data[i];
+        if (_upf_is_in_range(pc, cu->scope.ranges)) {
+            _upf_parse_cu(cu);
+            return cu;
+        }
+    }
+    return NULL;
+}
+
+#ifdef UPRINTF_INDEX_CACHE_DIR
+// The cached index is a header followed by one record per CU, with offsets
+// relative to the start of their section. Ranges of each CU follow its record.
+#define _UPF_INDEX_MAGIC 0x31584449465055ULL  // "UPFIDX1"
+
+typedef struct {
+    uint64_t magic;
+    uint64_t die_size;
+    uint64_t abbrev_size;
+    uint64_t address_size;
+    uint64_t cus_length;
+} _upf_index_header;
+
+typedef struct {
+    uint64_t base;
+    uint64_t die;
+    uint64_t die_end;
+    uint64_t abbrev_table;
+    uint64_t addr_base;
+    uint64_t str_offsets_base;
+    uint64_t rnglists_base;
+    uint64_t is64bit;
+    uint64_t ranges_length;
+} _upf_index_record;
+
+static char *_upf_get_index_path(void) {
+    if (_upf_state.build_id == NULL || _upf_state.build_id_size == 0) return NULL;
+
+    size_t dir_length = strlen(UPRINTF_INDEX_CACHE_DIR);
+    char *path = _upf_arena_alloc(&_upf_state.arena, dir_length + 2 * _upf_state.build_id_size + sizeof("/.idx"));
+    memcpy(path, UPRINTF_INDEX_CACHE_DIR, dir_length);
+    char *ptr = path + dir_length;
+    *ptr++ = '/';
+    for (size_t i = 0; i < _upf_state.build_id_size; i++) ptr += sprintf(ptr, "%02x", _upf_state.build_id[i]);
+    strcpy(ptr, ".idx");
+    return path;
+}
+
+// Returns false, leaving state untouched, if there is no valid cached index.
+static bool _upf_load_index(const char *path) {
+    _UPF_ASSERT(path != NULL);
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return false;
+
+    struct stat file_info;
+    if (fstat(fd, &file_info) == -1 || (size_t) file_info.st_size < sizeof(_upf_index_header)) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = file_info.st_size;
+    uint8_t *file = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) return false;
+
+    _upf_index_header header;
+    memcpy(&header, file, sizeof(header));
+    bool is_valid = header.magic == _UPF_INDEX_MAGIC && header.die_size == _upf_state.die_size
+                    && header.abbrev_size == _upf_state.abbrev_size;
+
+    // Validate everything before touching state to fall back to a full scan.
+    const uint8_t *ptr = file + sizeof(header);
+    const uint8_t *end = file + size;
+    for (uint64_t i = 0; is_valid && i < header.cus_length; i++) {
+        _upf_index_record record;
+        if ((size_t) (end - ptr) < sizeof(record)) {
+            is_valid = false;
+            break;
+        }
+        memcpy(&record, ptr, sizeof(record));
+        ptr += sizeof(record);
+
+        is_valid = record.base < record.die && record.die <= record.die_end && record.die_end <= _upf_state.die_size
+                   && record.abbrev_table < _upf_state.abbrev_size
+                   && record.ranges_length <= (size_t) (end - ptr) / sizeof(_upf_range);
+        if (is_valid) ptr += record.ranges_length * sizeof(_upf_range);
+    }
+    if (!is_valid || ptr != end) {
+        munmap(file, size);
+        return false;
+    }
+
+    _upf_state.address_size = header.address_size;
+    ptr = file + sizeof(header);
+    for (uint64_t i = 0; i < header.cus_length; i++) {
+        _upf_index_record record;
+        memcpy(&record, ptr, sizeof(record));
+        ptr += sizeof(record);
+
+        _upf_cu cu = {
+            .base = _upf_state.die + record.base,
+            .addr_base = record.addr_base,
+            .str_offsets_base = record.str_offsets_base,
+            .rnglists_base = record.rnglists_base,
+            .die = _upf_state.die + record.die,
+            .die_end = _upf_state.die + record.die_end,
+            .abbrev_table = _upf_state.abbrev + record.abbrev_table,
+            .is64bit = record.is64bit,
+        };
+        for (uint64_t j = 0; j < record.ranges_length; j++) {
+            _upf_range range;
+            memcpy(&range, ptr, sizeof(range));
+            ptr += sizeof(range);
+            _UPF_VECTOR_PUSH(&cu.scope.ranges, range);
+        }
+        _UPF_VECTOR_PUSH(&_upf_state.cus, cu);
+    }
+
+    munmap(file, size);
+    return true;
+}
+
+// Writes the index to a temporary file which is then renamed over the old
+// one, so concurrent runs never see a partially written index.
+static void _upf_save_index(const char *path) {
+    _UPF_ASSERT(path != NULL);
+
+    mkdir(UPRINTF_INDEX_CACHE_DIR, 0755);
+
+    size_t path_length = strlen(path);
+    char *tmp_path = _upf_arena_alloc(&_upf_state.arena, path_length + 32);
+    sprintf(tmp_path, "%s.%d.tmp", path, (int) getpid());
+
+    FILE *file = fopen(tmp_path, "wb");
+    if (file == NULL) return;
+
+    _upf_index_header header = {
+        .magic = _UPF_INDEX_MAGIC,
+        .die_size = _upf_state.die_size,
+        .abbrev_size = _upf_state.abbrev_size,
+        .address_size = _upf_state.address_size,
+        .cus_length = _upf_state.cus.length,
+    };
+    bool is_ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (uint32_t i = 0; is_ok && i < _upf_state.cus.length; i++) {
+        const _upf_cu *cu = &_upf_state.cus.data[i];
+        _upf_index_record record = {
+            .base = cu->base - _upf_state.die,
+            .die = cu->die - _upf_state.die,
+            .die_end = cu->die_end - _upf_state.die,
+            .abbrev_table = cu->abbrev_table - _upf_state.abbrev,
+            .addr_base = cu->addr_base,
+            .str_offsets_base = cu->str_offsets_base,
+            .rnglists_base = cu->rnglists_base,
+            .is64bit = cu->is64bit,
+            .ranges_length = cu->scope.ranges.length,
+        };
+        is_ok = fwrite(&record, sizeof(record), 1, file) == 1;
+        if (is_ok && record.ranges_length > 0) {
+            is_ok = fwrite(cu->scope.ranges.data, sizeof(_upf_range), record.ranges_length, file) == record.ranges_length;
+        }
+    }
+
+    if (fclose(file) != 0) is_ok = false;
+    // The cache is only an optimization, so failing to write it is not an error
+    if (!is_ok || rename(tmp_path, path) != 0) unlink(tmp_path);
 }
+#endif
+
+// Indexes CUs by their PC ranges, reusing the cached index when possible.
+static void _upf_index_dwarf(void) {
+#ifdef UPRINTF_INDEX_CACHE_DIR
+    char *index_path = _upf_get_index_path();
+    if (index_path != NULL && _upf_load_index(index_path)) return;
+#endif
 
-static void _upf_parse_dwarf(void) {
     const uint8_t *die = _upf_state.die;
     const uint8_t *die_end = die + _upf_state.die_size;
     while (die < die_end) {
@@ -2086,10 +2315,14 @@ static void _upf_parse_dwarf(void) {
         uint64_t abbrev_offset = _upf_offset_cast(die);
         die += _upf_state.offset_size;
 
-        _upf_parse_cu(cu_base, die, next, _upf_state.abbrev + abbrev_offset);
+        _upf_index_cu(cu_base, die, next, _upf_state.abbrev + abbrev_offset);
 
         die = next;
     }
+
+#ifdef UPRINTF_INDEX_CACHE_DIR
+    if (index_path != NULL) _upf_save_index(index_path);
+#endif
 }
 
 // ======================= ELF ============================
@@ -2189,6 +2422,7 @@ static void _upf_parse_elf(void) {
             _upf_state.die_size = section->sh_size;
         } else if (strcmp(name, ".debug_abbrev") == 0) {
             _upf_state.abbrev = file + section->sh_offset;
+            _upf_state.abbrev_size = section->sh_size;
         } else if (strcmp(name, ".debug_str") == 0) {
             _upf_state.str = (const char *) (file + section->sh_offset);
         } else if (strcmp(name, ".debug_line_str") == 0) {
@@ -2199,6 +2433,13 @@ static void _upf_parse_elf(void) {
             _upf_state.rnglists = file + section->sh_offset;
         } else if (strcmp(name, ".debug_addr") == 0) {
             _upf_state.addr = file + section->sh_offset;
+        } else if (strcmp(name, ".note.gnu.build-id") == 0 && section->sh_size >= sizeof(Elf64_Nhdr)) {
+            const Elf64_Nhdr *note = (const Elf64_Nhdr *) (file + section->sh_offset);
+            size_t desc_offset = sizeof(*note) + ((note->n_namesz + 3) & ~3);
+            if (note->n_type == NT_GNU_BUILD_ID && desc_offset + note->n_descsz <= section->sh_size) {
+                _upf_state.build_id = file + section->sh_offset + desc_offset;
+                _upf_state.build_id_size = note->n_descsz;
+            }
         }
 
         section++;
@@ -3002,13 +3243,7 @@ static const _upf_type *_upf_get_arg_type(const char *arg, uint64_t pc) {
     _upf_tokenizer t = {0};
     _upf_tokenize(&t, arg);
 
-    _upf_cu *cu = NULL;
-    for (uint32_t i = 0; i < _upf_state.cus.length; i++) {
-        if (_upf_is_in_range(pc, _upf_state.cus.data[i].scope.ranges)) {
-            cu = &_upf_state.cus.data[i];
-            break;
-        }
-    }
+    _upf_cu *cu = _upf_get_cu(pc);
     _UPF_ASSERT(cu != NULL);
 
     _upf_parser_state p = {
@@ -3470,11 +3705,15 @@ static void _upf_print_type(_upf_indexed_struct_vec *circular, const uint8_t *da
                 }
             }
 
-            // Find function (and cu) which matches either name(extern) or PC(local)
+            // Find function (and cu) which matches either name(extern) or PC(local).
+            // A local function can only be in the CU containing its PC, while an
+            // extern one requires parsing CUs until its definition is found.
             _upf_function *function = NULL;
             _upf_cu *cu = NULL;
             for (uint32_t i = 0; i < _upf_state.cus.length; i++) {
                 cu = &_upf_state.cus.data[i];
+                if (function_name == NULL && !_upf_is_in_range(relative_function_pc, cu->scope.ranges)) continue;
+                _upf_parse_cu(cu);
 
                 for (uint32_t j = 0; j < cu->functions.length; j++) {
                     if (function_name == NULL ? (cu->functions.data[j].pc == relative_function_pc)
@@ -3616,7 +3855,7 @@ __attribute__((constructor)) void _upf_init(void) {
 
     _upf_parse_elf();
     _upf_parse_extern_functions();
-    _upf_parse_dwarf();
+    _upf_index_dwarf();
 
     _upf_state.size = _UPF_INITIAL_BUFFER_SIZE;
     _upf_state.buffer = (char *) malloc(_upf_state.size * sizeof(*_upf_state.buffer));
@@ -3717,6 +3956,7 @@ __attribute__((noinline)) void _upf_uprintf(const char *file_path, int line, con
 #undef _upf_arena_concat
 #undef _upf_consume_any
 #undef _UPF_INITIAL_BUFFER_SIZE
+#undef _UPF_INDEX_MAGIC
 #undef _upf_bprintf
 
 #endif  // UPRINTF_IMPLEMENTATION
@@ -248,6 +248,17 @@ API:
         Otherwise, the signature should be void ( void *ptr, size_t size ).
         The default wraps stdlib.h's free.
 
+      #define SHARDED_NAME <your chosen type name>
+
+        The name of a thread-safe, sharded table type to declare alongside the NAME type (see "Sharded tables" below).
+        When using HEADER_MODE and IMPLEMENTATION_MODE, define it in both instantiations.
+        This option requires C11 atomics.
+
+      #define SHARD_COUNT <integer value>
+
+        The number of NAME tables that make up a SHARDED_NAME table, which must be a power of two no greater than 65536.
+        The default is 16.
+
       #define HEADER_MODE
       #define IMPLEMENTATION_MODE
 
@@ -333,6 +344,18 @@ API:
     NAME_itr NAME_get( NAME *table, KEY_TY key ) // C11 generic macro: vt_get.
 
       Returns a iterator to the specified key, or an end iterator if no such key exists.
+      There is deliberately no batched lookup. Hashing a block of keys and prefetching their home metadata and buckets
+      before resolving them made hits at most about 10% faster than a loop of NAME_get, and made misses up to 40%
+      slower, because a miss usually needs only the metadatum, which a loop of NAME_get already loads out of order.
+
+    size_t NAME_insert_batch( NAME *table, KEY_TY const *keys, size_t n )
+    size_t NAME_insert_batch( NAME *table, KEY_TY const *keys, VAL_TY const *vals, size_t n )
+    // C11 generic macro: vt_insert_batch.
+
+      Inserts n keys (and values, if VAL_TY was defined) as though by NAME_insert, reserving room for them up front and
+      prefetching the home buckets of later keys while earlier ones are inserted.
+      Returns the number of keys inserted, counting from the beginning of the array, which is less than n only in the
+      case of memory allocation failure.
 
     bool NAME_erase( NAME *table, KEY_TY key ) // C11 generic macro: vt_erase.
 
@@ -384,10 +407,56 @@ API:
       itr.data->key
       itr.data->val
 
-    Functions that may insert new keys (NAME_insert and NAME_get_or_insert), erase keys (NAME_erase and NAME_erase_itr),
-    or reallocate the internal bucket array (NAME_reserve and NAME_shrink) invalidate all exiting iterators.
+    Functions that may insert new keys (NAME_insert, NAME_insert_batch, and NAME_get_or_insert), erase keys (NAME_erase
+    and NAME_erase_itr), or reallocate the internal bucket array (NAME_reserve and NAME_shrink) invalidate all exiting
+    iterators.
     To delete keys during iteration and resume iterating, use the return value of NAME_erase_itr.
 
+  Sharded tables:
+
+    If SHARDED_NAME was defined, the library also declares a SHARDED_NAME type that may be shared among threads.
+    It consists of SHARD_COUNT tables of type NAME, each guarded by its own reader-writer spinlock, and selects a key's
+    shard using bits of its hash code that the shard's table does not otherwise use.
+    Operations on different shards proceed in parallel, as do lookups in the same shard.
+
+    Rather than rehashing all its keys at once, a shard that needs to grow keeps its previous table alongside a new
+    table with double the bucket count and moves a few keys across during each subsequent insertion or erasure, so that
+    no single call pays for a rehash of the whole shard.
+    Until the move is complete, lookups check both tables.
+
+    Since another thread may modify a shard at any moment, the SHARDED_NAME functions copy values out instead of
+    returning iterators:
+
+      void SHARDED_NAME_init( SHARDED_NAME *table )
+      void SHARDED_NAME_init( SHARDED_NAME *table, CTX_TY ctx )
+
+        Initializes the table for use.
+        If CTX_TY was defined, ctx sets every shard's ctx member, so MALLOC_FN and FREE_FN must be safe to call from
+        several threads at once.
+
+      size_t SHARDED_NAME_size( SHARDED_NAME *table )
+
+        Returns the number of keys in the table, counted one shard at a time.
+
+      bool SHARDED_NAME_insert( SHARDED_NAME *table, KEY_TY key )
+      bool SHARDED_NAME_insert( SHARDED_NAME *table, KEY_TY key, VAL_TY val )
+
+        Inserts the specified key (and value, if VAL_TY was defined), replacing an existing key as NAME_insert does.
+        Returns false in the case of memory allocation failure.
+
+      bool SHARDED_NAME_get( SHARDED_NAME *table, KEY_TY key )
+      bool SHARDED_NAME_get( SHARDED_NAME *table, KEY_TY key, VAL_TY *val )
+
+        Returns true if the specified key exists, in which case, if VAL_TY was defined and val is not NULL, the key's
+        value is copied to *val.
+
+      bool SHARDED_NAME_erase( SHARDED_NAME *table, KEY_TY key )
+      void SHARDED_NAME_clear( SHARDED_NAME *table )
+      void SHARDED_NAME_cleanup( SHARDED_NAME *table )
+
+        Behave like their NAME counterparts.
+        SHARDED_NAME_cleanup must not be called while other threads are still using the table.
+
 Version history:
 
   18/06/2024 2.1.1: Fixed a bug affecting iteration on big-endian platforms under MSVC.
@@ -461,6 +530,24 @@ inline static void _vt_free(void *ptr, size_t size, Arena **ctx ) { }
 #define VT_UNLIKELY( expression ) ( expression )
 #endif
 
+// Prefetch macros for NAME_insert_batch.
+#ifdef __GNUC__
+#define VT_PREFETCH( address )       __builtin_prefetch( ( address ), 0 )
+#define VT_PREFETCH_WRITE( address ) __builtin_prefetch( ( address ), 1 )
+#elif defined( _MSC_VER ) && ( defined( _M_X64 ) || defined( _M_IX86 ) )
+#include <xmmintrin.h>
+#define VT_PREFETCH( address )       _mm_prefetch( (const char *)( address ), _MM_HINT_T0 )
+#define VT_PREFETCH_WRITE( address ) _mm_prefetch( (const char *)( address ), _MM_HINT_T0 )
+#else
+#define VT_PREFETCH( address )       ( (void)( address ) )
+#define VT_PREFETCH_WRITE( address ) ( (void)( address ) )
+#endif
+
+// How many keys ahead NAME_insert_batch prefetches, and the size of the ring of precomputed hash codes, which must be
+// a power of two greater than the distance.
+#define VT_PREFETCH_DISTANCE 8
+#define VT_BATCH_RING        32
+
 // Masks for manipulating and extracting data from a bucket's uint16_t metadatum.
 #define VT_EMPTY               0x0000
 #define VT_HASH_FRAG_MASK      0xF000 // 0b1111000000000000.
@@ -693,6 +780,10 @@ VT_CAT( VT_R3_, VT_TEMPLATE_COUNT_D3 )( ty, fn )
 
 #define vt_get( table, ... ) _Generic( *( table ) VT_GENERIC_SLOTS( vt_table_, vt_get_ ) )( table, __VA_ARGS__ )
 
+#define vt_insert_batch( table, ... ) _Generic( *( table ) \
+  VT_GENERIC_SLOTS( vt_table_, vt_insert_batch_ )          \
+)( table, __VA_ARGS__ )                                    \
+
 #define vt_erase( table, ... ) _Generic( *( table ) VT_GENERIC_SLOTS( vt_table_, vt_erase_ ) )( table, __VA_ARGS__ )
 
 #define vt_next( itr ) _Generic( itr VT_GENERIC_SLOTS( vt_table_itr_, vt_next_ ) )( itr )
@@ -814,6 +905,15 @@ VT_API_FN_QUALIFIERS VT_CAT( NAME, _itr ) VT_CAT( NAME, _get )(
   KEY_TY key
 );
 
+VT_API_FN_QUALIFIERS size_t VT_CAT( NAME, _insert_batch )(
+  NAME *,
+  KEY_TY const *,
+  #ifdef VAL_TY
+  VAL_TY const *,
+  #endif
+  size_t
+);
+
 VT_API_FN_QUALIFIERS bool VT_CAT( NAME, _erase )( NAME *, KEY_TY );
 
 VT_API_FN_QUALIFIERS VT_CAT( NAME, _itr ) VT_CAT( NAME, _next )( VT_CAT( NAME, _itr ) );
@@ -1137,9 +1237,11 @@ static inline VT_CAT( NAME, _itr ) VT_CAT( NAME, _end_itr )( void )
 // inserted because of the maximum load factor or displacement limit constraints.
 // If replace is false, then the return value is as described above, except that if the key already exists, the function
 // returns an iterator to the existing key.
-static inline VT_CAT( NAME, _itr ) VT_CAT( NAME, _insert_raw )(
+// The hash code of the key is supplied by the caller, so that the batch functions can compute it ahead of time.
+static inline VT_CAT( NAME, _itr ) VT_CAT( NAME, _insert_raw_hashed )(
   NAME *table,
   KEY_TY key,
+  uint64_t hash,
   #ifdef VAL_TY
   VAL_TY *val,
   #endif
@@ -1147,7 +1249,6 @@ static inline VT_CAT( NAME, _itr ) VT_CAT( NAME, _insert_raw )(
   bool replace
 )
 {
-  uint64_t hash = HASH_FN( key );
   uint16_t hashfrag = vt_hashfrag( hash );
   size_t home_bucket = hash & table->buckets_mask;
 
@@ -1261,6 +1362,28 @@ static inline VT_CAT( NAME, _itr ) VT_CAT( NAME, _insert_raw )(
   return itr;
 }
 
+static inline VT_CAT( NAME, _itr ) VT_CAT( NAME, _insert_raw )(
+  NAME *table,
+  KEY_TY key,
+  #ifdef VAL_TY
+  VAL_TY *val,
+  #endif
+  bool unique,
+  bool replace
+)
+{
+  return VT_CAT( NAME, _insert_raw_hashed )(
+    table,
+    key,
+    HASH_FN( key ),
+    #ifdef VAL_TY
+    val,
+    #endif
+    unique,
+    replace
+  );
+}
+
 // Resizes the bucket array.
 // This function assumes that bucket_count is a power of two and large enough to accommodate all keys without violating
 // the maximum load factor.
@@ -1435,9 +1558,9 @@ VT_API_FN_QUALIFIERS VT_CAT( NAME, _itr ) VT_CAT( NAME, _get_or_insert )(
 }
 
 // Returns an iterator pointing to the specified key, or an end iterator if the key does not exist.
-VT_API_FN_QUALIFIERS VT_CAT( NAME, _itr ) VT_CAT( NAME, _get )( NAME *table, KEY_TY key )
+// As with insert_raw_hashed, the key's hash code is supplied by the caller.
+static inline VT_CAT( NAME, _itr ) VT_CAT( NAME, _get_hashed )( NAME *table, KEY_TY key, uint64_t hash )
 {
-  uint64_t hash = HASH_FN( key );
   size_t home_bucket = hash & table->buckets_mask;
 
   // If the home bucket is empty or contains a key that does not belong there, then our key does not exist.
@@ -1473,6 +1596,11 @@ VT_API_FN_QUALIFIERS VT_CAT( NAME, _itr ) VT_CAT( NAME, _get )( NAME *table, KEY
   }
 }
 
+VT_API_FN_QUALIFIERS VT_CAT( NAME, _itr ) VT_CAT( NAME, _get )( NAME *table, KEY_TY key )
+{
+  return VT_CAT( NAME, _get_hashed )( table, key, HASH_FN( key ) );
+}
+
 // Erases the key pointed to by the specified iterator.
 // The erasure always occurs at the end of the chain to which the key belongs.
 // If the key to be erased is not the last in the chain, it is swapped with the last so that erasure occurs at the end.
@@ -1482,15 +1610,20 @@ VT_API_FN_QUALIFIERS VT_CAT( NAME, _itr ) VT_CAT( NAME, _get )( NAME *table, KEY
 // This return value is necessary because at the iterator location, the erasure could result in an empty bucket, a
 // bucket containing a moved key already visited during the iteration, or a bucket containing a moved key not yet
 // visited.
-VT_API_FN_QUALIFIERS bool VT_CAT( NAME, _erase_itr_raw )( NAME *table, VT_CAT( NAME, _itr ) itr )
+// Erases the key pointed to by itr, calling the key and value destructors only if run_dtors is true.
+// The sharded variant passes false when it moves a key and value to another table.
+// Returns true if the iterator should be advanced to reach the next key.
+static inline bool VT_CAT( NAME, _erase_itr_raw_dtor )( NAME *table, VT_CAT( NAME, _itr ) itr, bool run_dtors )
 {
+  (void)run_dtors;
   --table->key_count;
   size_t itr_bucket = itr.metadatum - table->metadata;
 
   // For now, we only call the value's destructor because the key may need to be hashed below to determine the home
   // bucket.
   #ifdef VAL_DTOR_FN
-  VAL_DTOR_FN( table->buckets[ itr_bucket ].val );
+  if( run_dtors )
+    VAL_DTOR_FN( table->buckets[ itr_bucket ].val );
   #endif
 
   // Case 1: The key is the only one in its chain, so just remove it.
@@ -1500,7 +1633,8 @@ VT_API_FN_QUALIFIERS bool VT_CAT( NAME, _erase_itr_raw )( NAME *table, VT_CAT( N
   )
   {
     #ifdef KEY_DTOR_FN
-    KEY_DTOR_FN( table->buckets[ itr_bucket ].key );
+    if( run_dtors )
+      KEY_DTOR_FN( table->buckets[ itr_bucket ].key );
     #endif
     table->metadata[ itr_bucket ] = VT_EMPTY;
     return true;
@@ -1517,7 +1651,8 @@ VT_API_FN_QUALIFIERS bool VT_CAT( NAME, _erase_itr_raw )( NAME *table, VT_CAT( N
 
   // The key can now be safely destructed for cases 2 and 3.
   #ifdef KEY_DTOR_FN
-  KEY_DTOR_FN( table->buckets[ itr_bucket ].key );
+  if( run_dtors )
+    KEY_DTOR_FN( table->buckets[ itr_bucket ].key );
   #endif
 
   // Case 2: The key is the last in a multi-key chain.
@@ -1573,6 +1708,11 @@ VT_API_FN_QUALIFIERS bool VT_CAT( NAME, _erase_itr_raw )( NAME *table, VT_CAT( N
   }
 }
 
+VT_API_FN_QUALIFIERS bool VT_CAT( NAME, _erase_itr_raw )( NAME *table, VT_CAT( NAME, _itr ) itr )
+{
+  return VT_CAT( NAME, _erase_itr_raw_dtor )( table, itr, true );
+}
+
 // Erases the specified key, if it exists.
 // Returns true if a key was erased.
 VT_API_FN_QUALIFIERS bool VT_CAT( NAME, _erase )( NAME *table, KEY_TY key )
@@ -1665,6 +1805,75 @@ VT_API_FN_QUALIFIERS bool VT_CAT( NAME, _shrink )( NAME *table )
   return VT_CAT( NAME, _rehash )( table, bucket_count );
 }
 
+// Inserts n keys (and values), replacing existing keys, as NAME_insert does.
+// The table is grown to fit all of the keys first, so that hash codes and prefetches made ahead of time remain valid.
+// Each key is then hashed and its home metadatum and bucket prefetched VT_PREFETCH_DISTANCE keys before it is
+// inserted.
+// Returns the number of keys inserted before a memory allocation failure, i.e. n on success.
+VT_API_FN_QUALIFIERS size_t VT_CAT( NAME, _insert_batch )(
+  NAME *table,
+  KEY_TY const *keys,
+  #ifdef VAL_TY
+  VAL_TY const *vals,
+  #endif
+  size_t n
+)
+{
+  // Reserving space is only an optimization, as the below insertions still rehash if necessary, so a failure here is
+  // not treated as fatal.
+  if( n <= SIZE_MAX - table->key_count )
+    VT_CAT( NAME, _reserve )( table, table->key_count + n );
+
+  uint64_t hashes[ VT_BATCH_RING ];
+
+  for( size_t i = 0; i < n + VT_PREFETCH_DISTANCE; ++i )
+  {
+    if( i < n )
+    {
+      hashes[ i % VT_BATCH_RING ] = HASH_FN( keys[ i ] );
+      size_t home_bucket = hashes[ i % VT_BATCH_RING ] & table->buckets_mask;
+      VT_PREFETCH_WRITE( table->metadata + home_bucket );
+      VT_PREFETCH_WRITE( table->buckets + home_bucket );
+    }
+
+    if( i < VT_PREFETCH_DISTANCE )
+      continue;
+
+    size_t j = i - VT_PREFETCH_DISTANCE;
+    #ifdef VAL_TY
+    VAL_TY val = vals[ j ];
+    #endif
+
+    while( true )
+    {
+      VT_CAT( NAME, _itr ) itr = VT_CAT( NAME, _insert_raw_hashed )(
+        table,
+        keys[ j ],
+        hashes[ j % VT_BATCH_RING ],
+        #ifdef VAL_TY
+        &val,
+        #endif
+        false,
+        true
+      );
+
+      if( VT_LIKELY( !VT_CAT( NAME, _is_end )( itr ) ) )
+        break;
+
+      if(
+        VT_UNLIKELY(
+          !VT_CAT( NAME, _rehash )(
+            table, table->buckets_mask ? VT_CAT( NAME, _bucket_count )( table ) * 2 : VT_MIN_NONZERO_BUCKET_COUNT
+          )
+        )
+      )
+        return j;
+    }
+  }
+
+  return n;
+}
+
 VT_API_FN_QUALIFIERS VT_CAT( NAME, _itr ) VT_CAT( NAME, _first )( NAME *table )
 {
   if( !table->key_count )
@@ -1823,6 +2032,25 @@ static inline VT_CAT( NAME, _itr ) VT_CAT( vt_get_, VT_TEMPLATE_COUNT )( NAME *t
   return VT_CAT( NAME, _get )( table, key );
 }
 
+static inline size_t VT_CAT( vt_insert_batch_, VT_TEMPLATE_COUNT )(
+  NAME *table,
+  KEY_TY const *keys,
+  #ifdef VAL_TY
+  VAL_TY const *vals,
+  #endif
+  size_t n
+)
+{
+  return VT_CAT( NAME, _insert_batch )(
+    table,
+    keys,
+    #ifdef VAL_TY
+    vals,
+    #endif
+    n
+  );
+}
+
 static inline bool VT_CAT( vt_erase_, VT_TEMPLATE_COUNT )( NAME *table, KEY_TY key )
 {
   return VT_CAT( NAME, _erase )( table, key );
@@ -1942,6 +2170,439 @@ C99 prefixed function API to circumvent this restriction.
 
 #endif
 
+/*--------------------------------------------------------------------------------------------------------------------*/
+/*                                             Sharded concurrent variant                                             */
+/*--------------------------------------------------------------------------------------------------------------------*/
+
+#ifdef SHARDED_NAME
+
+#if !defined( __STDC_VERSION__ ) || __STDC_VERSION__ < 201112L || defined( __STDC_NO_ATOMICS__ )
+#error SHARDED_NAME requires C11 atomics.
+#endif
+
+#ifndef SHARD_COUNT
+#define SHARD_COUNT 16
+#endif
+
+#if SHARD_COUNT < 1 || SHARD_COUNT > 65536 || ( SHARD_COUNT & ( SHARD_COUNT - 1 ) )
+#error SHARD_COUNT must be a power of two no greater than 65536.
+#endif
+
+#ifndef VT_SHARD_LOCK
+#define VT_SHARD_LOCK
+
+#include <stdatomic.h>
+#if defined( __unix__ ) || defined( __APPLE__ )
+#include <sched.h>
+#endif
+
+// The number of keys that each insertion or erasure moves from a growing shard's previous table into its new one.
+// Since the new table has double the bucket count, any value above one finishes the move before the new table fills.
+#define VT_SHARD_MIGRATE_STEP 16
+
+// Each shard's reader-writer spinlock is a single atomic word: the low bits count the active readers, VT_RW_WRITER
+// marks an active writer, and VT_RW_PENDING marks a waiting writer so that a steady stream of readers cannot starve it.
+#define VT_RW_WRITER  0x80000000u
+#define VT_RW_PENDING 0x40000000u
+
+// Pauses briefly between attempts to take a lock, yielding the thread if the lock stays contended.
+static inline void vt_rw_relax( unsigned int *spins )
+{
+  if( ++*spins < 64 )
+  {
+    #if defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __i386__ ) )
+    __builtin_ia32_pause();
+    #elif defined( __GNUC__ ) && defined( __aarch64__ )
+    __asm__ __volatile__( "yield" );
+    #endif
+    return;
+  }
+
+  *spins = 0;
+  #if defined( __unix__ ) || defined( __APPLE__ )
+  sched_yield();
+  #endif
+}
+
+static inline void vt_rw_read_lock( atomic_uint *lock )
+{
+  unsigned int spins = 0;
+  unsigned int state = atomic_load_explicit( lock, memory_order_relaxed );
+  while( true )
+  {
+    if( !( state & ( VT_RW_WRITER | VT_RW_PENDING ) ) )
+    {
+      // On failure, the exchange reloads state, so retry immediately.
+      if(
+        atomic_compare_exchange_weak_explicit( lock, &state, state + 1, memory_order_acquire, memory_order_relaxed )
+      )
+        return;
+
+      continue;
+    }
+
+    vt_rw_relax( &spins );
+    state = atomic_load_explicit( lock, memory_order_relaxed );
+  }
+}
+
+static inline void vt_rw_read_unlock( atomic_uint *lock )
+{
+  atomic_fetch_sub_explicit( lock, 1, memory_order_release );
+}
+
+static inline void vt_rw_write_lock( atomic_uint *lock )
+{
+  unsigned int spins = 0;
+  unsigned int state = atomic_load_explicit( lock, memory_order_relaxed );
+  while( true )
+  {
+    if( !( state & ~VT_RW_PENDING ) )
+    {
+      if(
+        atomic_compare_exchange_weak_explicit(
+          lock, &state, VT_RW_WRITER, memory_order_acquire, memory_order_relaxed
+        )
+      )
+        return;
+
+      continue;
+    }
+
+    if( !( state & VT_RW_PENDING ) )
+      atomic_fetch_or_explicit( lock, VT_RW_PENDING, memory_order_relaxed );
+
+    vt_rw_relax( &spins );
+    state = atomic_load_explicit( lock, memory_order_relaxed );
+  }
+}
+
+// Other waiting writers may have set VT_RW_PENDING in the meantime, so only the writer bit is cleared.
+static inline void vt_rw_write_unlock( atomic_uint *lock )
+{
+  atomic_fetch_and_explicit( lock, ~VT_RW_WRITER, memory_order_release );
+}
+
+#endif
+
+#ifndef IMPLEMENTATION_MODE
+
+typedef struct
+{
+  _Alignas( 64 ) atomic_uint lock; // Each shard starts on its own cache line so that shards' locks do not share lines.
+  NAME table;
+  NAME old;      // The shard's previous table while its keys are being moved into table, or else an empty table.
+  size_t cursor; // Every bucket in old before this index is empty.
+} VT_CAT( SHARDED_NAME, _shard );
+
+typedef struct
+{
+  VT_CAT( SHARDED_NAME, _shard ) shards[ SHARD_COUNT ];
+} SHARDED_NAME;
+
+VT_API_FN_QUALIFIERS void VT_CAT( SHARDED_NAME, _init )(
+  SHARDED_NAME *
+  #ifdef CTX_TY
+  , CTX_TY
+  #endif
+);
+
+VT_API_FN_QUALIFIERS size_t VT_CAT( SHARDED_NAME, _size )( SHARDED_NAME * );
+
+VT_API_FN_QUALIFIERS bool VT_CAT( SHARDED_NAME, _insert )(
+  SHARDED_NAME *,
+  KEY_TY
+  #ifdef VAL_TY
+  , VAL_TY
+  #endif
+);
+
+VT_API_FN_QUALIFIERS bool VT_CAT( SHARDED_NAME, _get )(
+  SHARDED_NAME *,
+  KEY_TY
+  #ifdef VAL_TY
+  , VAL_TY *
+  #endif
+);
+
+VT_API_FN_QUALIFIERS bool VT_CAT( SHARDED_NAME, _erase )( SHARDED_NAME *, KEY_TY );
+
+VT_API_FN_QUALIFIERS void VT_CAT( SHARDED_NAME, _clear )( SHARDED_NAME * );
+
+VT_API_FN_QUALIFIERS void VT_CAT( SHARDED_NAME, _cleanup )( SHARDED_NAME * );
+
+#endif
+
+#ifndef HEADER_MODE
+
+// Selects a shard using the 16 bits immediately below the four that form the hash fragment.
+// Within a shard, the low bits that index buckets and the fragment bits therefore remain as varied as they are across
+// the whole table.
+static inline VT_CAT( SHARDED_NAME, _shard ) *VT_CAT( SHARDED_NAME, _shard_for )( SHARDED_NAME *table, uint64_t hash )
+{
+  return table->shards + ( ( hash >> 44 ) & ( SHARD_COUNT - 1 ) );
+}
+
+// Moves up to max_keys keys from the shard's old table into its current table and frees the old table once it is
+// empty.
+// Keys are moved in bucket order, and since erasing a key only ever relocates another key into the erased key's bucket,
+// the buckets before the cursor stay empty.
+static inline void VT_CAT( SHARDED_NAME, _migrate )( VT_CAT( SHARDED_NAME, _shard ) *shard, size_t max_keys )
+{
+  size_t moved = 0;
+  while( shard->old.key_count && moved < max_keys )
+  {
+    while( shard->old.metadata[ shard->cursor ] == VT_EMPTY )
+      ++shard->cursor;
+
+    VT_CAT( NAME, _bucket ) *bucket = shard->old.buckets + shard->cursor;
+    uint64_t hash = HASH_FN( bucket->key );
+
+    // The key cannot already exist in the current table, so skip the lookup.
+    VT_CAT( NAME, _itr ) itr = VT_CAT( NAME, _insert_raw_hashed )(
+      &shard->table,
+      bucket->key,
+      hash,
+      #ifdef VAL_TY
+      &bucket->val,
+      #endif
+      true,
+      false
+    );
+
+    // The current table can only fill up before the move is complete if it hits the displacement limit, in which case
+    // it grows the ordinary way.
+    if( VT_UNLIKELY( VT_CAT( NAME, _is_end )( itr ) ) )
+    {
+      if( !VT_CAT( NAME, _rehash )( &shard->table, VT_CAT( NAME, _bucket_count )( &shard->table ) * 2 ) )
+        return;
+
+      continue;
+    }
+
+    VT_CAT( NAME, _itr ) old_itr = {
+      bucket,
+      shard->old.metadata + shard->cursor,
+      shard->old.metadata + shard->old.buckets_mask + 1,
+      hash & shard->old.buckets_mask
+    };
+    VT_CAT( NAME, _erase_itr_raw_dtor )( &shard->old, old_itr, false );
+    ++moved;
+  }
+
+  if( !shard->old.key_count && shard->old.buckets_mask )
+  {
+    VT_CAT( NAME, _cleanup )( &shard->old );
+    shard->cursor = 0;
+  }
+}
+
+// Makes room in a shard whose current table is full by swapping in a new table with double the bucket count.
+// The keys are then moved across by later calls to SHARDED_NAME_migrate.
+// Returns false in the case of memory allocation failure.
+static inline bool VT_CAT( SHARDED_NAME, _grow )( VT_CAT( SHARDED_NAME, _shard ) *shard )
+{
+  if( !shard->table.buckets_mask )
+    return VT_CAT( NAME, _rehash )( &shard->table, VT_MIN_NONZERO_BUCKET_COUNT );
+
+  // A previous move is only still in progress if the table hit the displacement limit, so finish it first.
+  VT_CAT( SHARDED_NAME, _migrate )( shard, SIZE_MAX );
+  if( VT_UNLIKELY( shard->old.key_count ) )
+    return false;
+
+  NAME table;
+  VT_CAT( NAME, _init )(
+    &table
+    #ifdef CTX_TY
+    , shard->table.ctx
+    #endif
+  );
+
+  if( VT_UNLIKELY( !VT_CAT( NAME, _rehash )( &table, VT_CAT( NAME, _bucket_count )( &shard->table ) * 2 ) ) )
+    return false;
+
+  shard->old = shard->table;
+  shard->table = table;
+  shard->cursor = 0;
+  return true;
+}
+
+VT_API_FN_QUALIFIERS void VT_CAT( SHARDED_NAME, _init )(
+  SHARDED_NAME *table
+  #ifdef CTX_TY
+  , CTX_TY ctx
+  #endif
+)
+{
+  for( size_t i = 0; i < SHARD_COUNT; ++i )
+  {
+    VT_CAT( SHARDED_NAME, _shard ) *shard = table->shards + i;
+    atomic_init( &shard->lock, 0 );
+    VT_CAT( NAME, _init )(
+      &shard->table
+      #ifdef CTX_TY
+      , ctx
+      #endif
+    );
+    VT_CAT( NAME, _init )(
+      &shard->old
+      #ifdef CTX_TY
+      , ctx
+      #endif
+    );
+    shard->cursor = 0;
+  }
+}
+
+VT_API_FN_QUALIFIERS size_t VT_CAT( SHARDED_NAME, _size )( SHARDED_NAME *table )
+{
+  size_t size = 0;
+  for( size_t i = 0; i < SHARD_COUNT; ++i )
+  {
+    VT_CAT( SHARDED_NAME, _shard ) *shard = table->shards + i;
+    vt_rw_read_lock( &shard->lock );
+    size += shard->table.key_count + shard->old.key_count;
+    vt_rw_read_unlock( &shard->lock );
+  }
+
+  return size;
+}
+
+VT_API_FN_QUALIFIERS bool VT_CAT( SHARDED_NAME, _insert )(
+  SHARDED_NAME *table,
+  KEY_TY key
+  #ifdef VAL_TY
+  , VAL_TY val
+  #endif
+)
+{
+  uint64_t hash = HASH_FN( key );
+  VT_CAT( SHARDED_NAME, _shard ) *shard = VT_CAT( SHARDED_NAME, _shard_for )( table, hash );
+  bool inserted = true;
+
+  vt_rw_write_lock( &shard->lock );
+  VT_CAT( SHARDED_NAME, _migrate )( shard, VT_SHARD_MIGRATE_STEP );
+
+  // If the key has yet to be moved out of the old table, replace it there.
+  VT_CAT( NAME, _itr ) itr = shard->old.key_count ?
+    VT_CAT( NAME, _get_hashed )( &shard->old, key, hash ) : VT_CAT( NAME, _end_itr )();
+  if( !VT_CAT( NAME, _is_end )( itr ) )
+  {
+    #ifdef KEY_DTOR_FN
+    KEY_DTOR_FN( itr.data->key );
+    #endif
+    itr.data->key = key;
+
+    #ifdef VAL_TY
+    #ifdef VAL_DTOR_FN
+    VAL_DTOR_FN( itr.data->val );
+    #endif
+    itr.data->val = val;
+    #endif
+  }
+  else
+    while(
+      VT_CAT( NAME, _is_end )(
+        VT_CAT( NAME, _insert_raw_hashed )(
+          &shard->table,
+          key,
+          hash,
+          #ifdef VAL_TY
+          &val,
+          #endif
+          false,
+          true
+        )
+      )
+    )
+      if( VT_UNLIKELY( !VT_CAT( SHARDED_NAME, _grow )( shard ) ) )
+      {
+        inserted = false;
+        break;
+      }
+
+  vt_rw_write_unlock( &shard->lock );
+  return inserted;
+}
+
+VT_API_FN_QUALIFIERS bool VT_CAT( SHARDED_NAME, _get )(
+  SHARDED_NAME *table,
+  KEY_TY key
+  #ifdef VAL_TY
+  , VAL_TY *val
+  #endif
+)
+{
+  uint64_t hash = HASH_FN( key );
+  VT_CAT( SHARDED_NAME, _shard ) *shard = VT_CAT( SHARDED_NAME, _shard_for )( table, hash );
+
+  vt_rw_read_lock( &shard->lock );
+
+  VT_CAT( NAME, _itr ) itr = VT_CAT( NAME, _get_hashed )( &shard->table, key, hash );
+  if( VT_CAT( NAME, _is_end )( itr ) && shard->old.key_count )
+    itr = VT_CAT( NAME, _get_hashed )( &shard->old, key, hash );
+
+  bool found = !VT_CAT( NAME, _is_end )( itr );
+  #ifdef VAL_TY
+  if( found && val )
+    *val = itr.data->val;
+  #endif
+
+  vt_rw_read_unlock( &shard->lock );
+  return found;
+}
+
+VT_API_FN_QUALIFIERS bool VT_CAT( SHARDED_NAME, _erase )( SHARDED_NAME *table, KEY_TY key )
+{
+  uint64_t hash = HASH_FN( key );
+  VT_CAT( SHARDED_NAME, _shard ) *shard = VT_CAT( SHARDED_NAME, _shard_for )( table, hash );
+
+  vt_rw_write_lock( &shard->lock );
+  VT_CAT( SHARDED_NAME, _migrate )( shard, VT_SHARD_MIGRATE_STEP );
+
+  NAME *owner = &shard->table;
+  VT_CAT( NAME, _itr ) itr = VT_CAT( NAME, _get_hashed )( owner, key, hash );
+  if( VT_CAT( NAME, _is_end )( itr ) && shard->old.key_count )
+  {
+    owner = &shard->old;
+    itr = VT_CAT( NAME, _get_hashed )( owner, key, hash );
+  }
+
+  bool erased = !VT_CAT( NAME, _is_end )( itr );
+  if( erased )
+    VT_CAT( NAME, _erase_itr_raw )( owner, itr );
+
+  vt_rw_write_unlock( &shard->lock );
+  return erased;
+}
+
+VT_API_FN_QUALIFIERS void VT_CAT( SHARDED_NAME, _clear )( SHARDED_NAME *table )
+{
+  for( size_t i = 0; i < SHARD_COUNT; ++i )
+  {
+    VT_CAT( SHARDED_NAME, _shard ) *shard = table->shards + i;
+    vt_rw_write_lock( &shard->lock );
+    VT_CAT( NAME, _clear )( &shard->table );
+    VT_CAT( NAME, _cleanup )( &shard->old );
+    shard->cursor = 0;
+    vt_rw_write_unlock( &shard->lock );
+  }
+}
+
+VT_API_FN_QUALIFIERS void VT_CAT( SHARDED_NAME, _cleanup )( SHARDED_NAME *table )
+{
+  for( size_t i = 0; i < SHARD_COUNT; ++i )
+  {
+    VT_CAT( NAME, _cleanup )( &table->shards[ i ].table );
+    VT_CAT( NAME, _cleanup )( &table->shards[ i ].old );
+    table->shards[ i ].cursor = 0;
+  }
+}
+
+#endif
+
+#endif
+
 #undef NAME
 #undef KEY_TY
 #undef VAL_TY
@@ -1953,6 +2614,8 @@ C99 prefixed function API to circumvent this restriction.
 #undef CTX_TY
 #undef MALLOC_FN
 #undef FREE_FN
+#undef SHARDED_NAME
+#undef SHARD_COUNT
 #undef HEADER_MODE
 #undef IMPLEMENTATION_MODE
 #undef VT_API_FN_QUALIFIERS
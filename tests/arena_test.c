@@ -0,0 +1,68 @@
+// Regression tests for chained arenas and their scratches.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "arena.h"
+
+// A scratch of an ARENA_PUSH copy that outgrows its block moves into a block
+// of its own rather than into the copy's end, which the copy still bumps.
+static void test_push_scratch_grow(void) {
+  ArenaChain c = {0};
+  Arena a = newchain(&c, 4096);
+  arena_alloc(&a, 1, 1, 16, 0);
+  {
+    ARENA_PUSH(a);
+    Arena s = getscratch(&a);
+    byte *p = arena_alloc(&s, 1, 1, 8000, 0);
+    byte *q = arena_alloc(&a, 1, 1, 6000, 0);
+    memset(p, 1, 8000);
+    memset(q, 2, 6000);
+    for (int i = 0; i < 8000; i++) assert(p[i] == 1);
+  }
+  arena_release(&a);
+}
+
+// Rewinding a scratch that moved into its own block sends it back to its
+// parent's end, as it was at the mark.
+static void test_push_scratch_rewind(void) {
+  ArenaChain c = {0};
+  Arena a = newchain(&c, 4096);
+  arena_alloc(&a, 1, 1, 16, 0);
+  {
+    ARENA_PUSH(a);
+    Arena s = getscratch(&a);
+    byte *end = a.end;
+    ArenaMark m = arena_mark(&s);
+    arena_alloc(&s, 1, 1, 8000, 0);
+    arena_rewind(&s, m);
+    assert(s.beg == &a.end && s.parent == &a);
+    assert(a.end == end);
+    byte *p = arena_alloc(&s, 1, 1, 16, 0);
+    assert(p == end - 16);
+  }
+  arena_release(&a);
+}
+
+// Rewinding the owner frees what its scratch allocated since the mark too.
+static void test_chain_rewind_scratch_end(void) {
+  ArenaChain c = {0};
+  Arena a = newchain(&c, 4096);
+  arena_alloc(&a, 1, 1, 16, 0);
+  byte *end = c.end;
+  ArenaMark m = arena_mark(&a);
+  Arena s = getscratch(&a);
+  arena_alloc(&s, 1, 1, 64, 0);
+  assert(c.end == end - 64);
+  arena_rewind(&a, m);
+  assert(c.end == end && a.end == end);
+  arena_release(&a);
+}
+
+int main(void) {
+  test_push_scratch_grow();
+  test_push_scratch_rewind();
+  test_chain_rewind_scratch_end();
+  puts("arena_test: ok");
+  return 0;
+}
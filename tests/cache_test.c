@@ -0,0 +1,66 @@
+// Budget tests for the object cache in both eviction modes.
+
+#include <stdio.h>
+
+#include "cache.h"
+#include "debug.h"
+
+struct obj {
+  uint64_t id;
+  struct cache_node node;
+};
+
+#define CACHE_NAME   lru_cache
+#define CACHE_TY     struct obj
+#define CACHE_KEY_TY uint64_t
+#define CACHE_KEY    id
+#define CACHE_NODE   node
+#include "cache.h"
+
+#define CACHE_NAME   clock_cache
+#define CACHE_TY     struct obj
+#define CACHE_KEY_TY uint64_t
+#define CACHE_KEY    id
+#define CACHE_NODE   node
+#define CACHE_CLOCK
+#include "cache.h"
+
+// Fill to the budget, reference every element, then insert one more. The
+// new element must stay and the budget must still hold.
+#define TEST_OVERFLOW(cache)                                                   \
+  static void test_##cache##_overflow(void) {                                 \
+    cache c;                                                                   \
+    cache##_init(&c, 4, NULL);                                                 \
+    for (uint64_t id = 0; id < 5; id++) {                                      \
+      for (uint64_t k = 0; k < id; k++) assert(cache##_get(&c, k));            \
+      struct obj *o = cache##_alloc(&c);                                       \
+      o->id = id;                                                              \
+      assert(cache##_insert(&c, o));                                           \
+      assert(cache##_get(&c, id) == o);                                        \
+      assert(c.used <= c.budget);                                              \
+    }                                                                          \
+    assert(cache##_size(&c) == 4);                                             \
+    cache##_cleanup(&c);                                                       \
+  }
+
+TEST_OVERFLOW(lru_cache)
+TEST_OVERFLOW(clock_cache)
+
+// A sole element over the budget stays cached alone.
+static void test_clock_cache_alone(void) {
+  clock_cache c;
+  clock_cache_init(&c, 0, NULL);
+  struct obj *o = clock_cache_alloc(&c);
+  o->id = 1;
+  assert(clock_cache_insert(&c, o));
+  assert(clock_cache_size(&c) == 1);
+  clock_cache_cleanup(&c);
+}
+
+int main(void) {
+  test_lru_cache_overflow();
+  test_clock_cache_overflow();
+  test_clock_cache_alone();
+  puts("cache_test: ok");
+  return 0;
+}
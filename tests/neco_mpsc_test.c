@@ -0,0 +1,84 @@
+// Several coroutines receiving from a queue that a foreign thread sends to.
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "neco.h"
+
+#define NRECEIVERS 8
+#define NMSGS      100000
+
+#define OK(x) assert((x) == NECO_OK)
+
+static neco_mpsc *q;
+static int seen[NMSGS];
+static int nclosed;
+
+static void *sender(void *arg) {
+  (void)arg;
+  int batch[33];
+  for (int i = 0; i < NMSGS;) {
+    int n = 0;
+    while (n < 33 && i + n < NMSGS) {
+      batch[n] = i + n;
+      n++;
+    }
+    int sent = neco_mpsc_sendv(q, batch, n);
+    assert(sent >= 0);
+    i += sent;
+    if (sent == 0 || i % 1000 < 33) sched_yield();
+  }
+  OK(neco_mpsc_close(q));
+  return NULL;
+}
+
+static void receiver(int argc, void *argv[]) {
+  neco_waitgroup *wg = argv[0];
+  int batch[16];
+  while (1) {
+    int n = neco_mpsc_recvv(q, batch, 16);
+    if (n == NECO_CLOSED) break;
+    assert(n > 0);
+    for (int i = 0; i < n; i++) seen[batch[i]]++;
+  }
+  nclosed++;
+  OK(neco_waitgroup_done(wg));
+}
+
+// A receiver that gives up waiting must not hold up the others.
+static void quitter(int argc, void *argv[]) {
+  neco_waitgroup *wg = argv[0];
+  int v;
+  int ret = neco_mpsc_recvv_dl(q, &v, 1, neco_now() + NECO_MICROSECOND * 100);
+  assert(ret == NECO_TIMEDOUT || ret == 1);
+  if (ret == 1) seen[v]++;
+  OK(neco_waitgroup_done(wg));
+}
+
+static void test_main(int argc, void *argv[]) {
+  OK(neco_mpsc_make(&q, sizeof(int), 64));
+  neco_waitgroup wg;
+  OK(neco_waitgroup_init(&wg));
+  OK(neco_waitgroup_add(&wg, NRECEIVERS * 2));
+  for (int i = 0; i < NRECEIVERS; i++) {
+    OK(neco_start(receiver, 1, &wg));
+    OK(neco_start(quitter, 1, &wg));
+  }
+  // Let every receiver wait on the empty queue before sending.
+  neco_sleep(NECO_MILLISECOND);
+  pthread_t th;
+  assert(pthread_create(&th, NULL, sender, NULL) == 0);
+  OK(neco_waitgroup_wait(&wg));
+  assert(pthread_join(th, NULL) == 0);
+  assert(nclosed == NRECEIVERS);
+  for (int i = 0; i < NMSGS; i++) assert(seen[i] == 1);
+  OK(neco_mpsc_release(q));
+}
+
+int main(void) {
+  OK(neco_start(test_main, 0));
+  fprintf(stderr, "neco_mpsc_test: ok\n");
+  return 0;
+}
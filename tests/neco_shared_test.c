@@ -0,0 +1,312 @@
+// Shared channels, mutexes and waitgroups used by the threads of a pool.
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "neco.h"
+
+#define NTHREADS 4
+#define NJOBS    16
+#define NITER    2000
+
+#define OK(x) assert((x) == NECO_OK)
+
+static neco_pool *pool;
+static neco_waitgroup done;
+
+// Starts n jobs across the pool, one thread after another, and waits for
+// them. Each job gets its index and calls neco_waitgroup_done(&done) when it
+// finishes.
+static void run_jobs(int n, void (*job)(int, void **)) {
+  OK(neco_waitgroup_add(&done, n));
+  for (int i = 0; i < n; i++) {
+    OK(neco_pool_start_on(pool, i % NTHREADS, job, 1, (void *)(intptr_t)i));
+  }
+  OK(neco_waitgroup_wait(&done));
+}
+
+// A shared mutex guards a counter that jobs on every thread increment, and
+// yield while holding it so that the lock is contended.
+static neco_mutex counter_mu;
+static long counter;
+
+static void counter_job(int argc, void *argv[]) {
+  for (int i = 0; i < NITER; i++) {
+    OK(neco_mutex_lock(&counter_mu));
+    long c = counter;
+    if (i % 7 == 0) neco_yield();
+    counter = c + 1;
+    OK(neco_mutex_unlock(&counter_mu));
+  }
+  OK(neco_waitgroup_done(&done));
+}
+
+static void test_mutex_counter(void) {
+  OK(neco_mutex_init_shared(&counter_mu));
+  counter = 0;
+  run_jobs(NJOBS, counter_job);
+  assert(counter == (long)NJOBS * NITER);
+}
+
+// Every message is a distinct number, which receivers tick off, so that a
+// lost or duplicated message shows up as a count other than one.
+static neco_chan *msgs;
+static atomic_int seen[NJOBS / 2 * NITER];
+static neco_waitgroup senders;
+
+static void send_job(int argc, void *argv[]) {
+  int id = (int)(intptr_t)argv[0] / 2;
+  int base = id * NITER;
+  if (id % 2 == 0) {
+    for (int i = 0; i < NITER; i++) OK(neco_chan_send(msgs, &(int){base + i}));
+  } else {
+    int batch[50];
+    for (int i = 0; i < NITER; i += 50) {
+      for (int j = 0; j < 50; j++) batch[j] = base + i + j;
+      assert(neco_chan_sendv(msgs, batch, 50) == 50);
+    }
+  }
+  OK(neco_waitgroup_done(&senders));
+  OK(neco_waitgroup_done(&done));
+}
+
+static void recv_job(int argc, void *argv[]) {
+  bool single = (intptr_t)argv[0] / 2 % 2 == 0;
+  int batch[16];
+  while (1) {
+    int n = single ? neco_chan_recv(msgs, batch) : neco_chan_recvv(msgs, batch, 16);
+    if (n == NECO_CLOSED) break;
+    if (single) {
+      OK(n);
+      n = 1;
+    }
+    assert(n > 0);
+    for (int i = 0; i < n; i++) atomic_fetch_add(&seen[batch[i]], 1);
+  }
+  OK(neco_waitgroup_done(&done));
+}
+
+// Odd jobs send and even jobs receive, each half of them one message at a
+// time and the other half in batches. The closer waits for the senders.
+static void chan_job(int argc, void *argv[]) {
+  if ((intptr_t)argv[0] % 2 == 0) {
+    recv_job(argc, argv);
+  } else {
+    send_job(argc, argv);
+  }
+}
+
+static void closer(int argc, void *argv[]) {
+  OK(neco_waitgroup_wait(&senders));
+  OK(neco_chan_close(msgs));
+  OK(neco_waitgroup_done(&done));
+}
+
+static void test_chan_exactly_once(size_t capacity) {
+  OK(neco_chan_make_shared(&msgs, sizeof(int), capacity));
+  for (int i = 0; i < NJOBS / 2 * NITER; i++) atomic_store(&seen[i], 0);
+  OK(neco_waitgroup_init_shared(&senders));
+  OK(neco_waitgroup_add(&senders, NJOBS / 2));
+  OK(neco_waitgroup_add(&done, 1));
+  OK(neco_pool_start(pool, closer, 0));
+  run_jobs(NJOBS, chan_job);
+  for (int i = 0; i < NJOBS / 2 * NITER; i++) assert(atomic_load(&seen[i]) == 1);
+  OK(neco_chan_release(msgs));
+}
+
+// A coroutine selects over a shared channel, which a job on another thread
+// sends to and then closes, and over a channel local to its own thread.
+static neco_chan *remote;
+
+static void remote_sender(int argc, void *argv[]) {
+  for (int i = 0; i < NITER; i++) OK(neco_chan_send(remote, &(int){1}));
+  OK(neco_chan_close(remote));
+  OK(neco_waitgroup_done(&done));
+}
+
+static void local_sender(int argc, void *argv[]) {
+  neco_chan *local = argv[0];
+  for (int i = 0; i < NITER; i++) {
+    OK(neco_chan_send(local, &(int){2}));
+    if (i % 3 == 0) neco_yield();
+  }
+  OK(neco_chan_close(local));
+  OK(neco_chan_release(local));
+}
+
+static void selector(int argc, void *argv[]) {
+  neco_chan *local;
+  OK(neco_chan_make(&local, sizeof(int), 0));
+  OK(neco_chan_retain(local));
+  OK(neco_start(local_sender, 1, local));
+  OK(neco_pool_start_on(pool, 1, remote_sender, 0));
+  long sums[2] = {0};
+  while (1) {
+    int idx = neco_chan_select(2, remote, local);
+    assert(idx == 0 || idx == 1);
+    int v;
+    int ret = neco_chan_case(idx == 0 ? remote : local, &v);
+    if (ret == NECO_CLOSED) {
+      // Keep receiving from the one left open.
+      neco_chan *other = idx == 0 ? local : remote;
+      while ((ret = neco_chan_recv(other, &v)) == NECO_OK) sums[!idx] += v;
+      assert(ret == NECO_CLOSED);
+      break;
+    }
+    OK(ret);
+    sums[idx] += v;
+  }
+  assert(sums[0] == NITER && sums[1] == 2 * NITER);
+  OK(neco_chan_release(local));
+  OK(neco_waitgroup_done(&done));
+}
+
+static void test_select_mixed(void) {
+  OK(neco_chan_make_shared(&remote, sizeof(int), 0));
+  OK(neco_waitgroup_add(&done, 2));
+  OK(neco_pool_start_on(pool, 0, selector, 0));
+  OK(neco_waitgroup_wait(&done));
+  OK(neco_chan_release(remote));
+}
+
+// Jobs on every thread wait on a waitgroup that this thread completes.
+static neco_waitgroup gate;
+static atomic_int passed;
+
+static void gate_job(int argc, void *argv[]) {
+  OK(neco_waitgroup_wait(&gate));
+  atomic_fetch_add(&passed, 1);
+  OK(neco_waitgroup_done(&done));
+}
+
+static void test_waitgroup_wait(void) {
+  OK(neco_waitgroup_init_shared(&gate));
+  OK(neco_waitgroup_add(&gate, 1));
+  OK(neco_waitgroup_add(&done, NJOBS));
+  for (int i = 0; i < NJOBS; i++) OK(neco_pool_start(pool, gate_job, 0));
+  neco_sleep(NECO_MILLISECOND * 10);
+  assert(atomic_load(&passed) == 0);
+  OK(neco_waitgroup_done(&gate));
+  OK(neco_waitgroup_wait(&done));
+  assert(atomic_load(&passed) == NJOBS);
+}
+
+// Deadlines that expire just as a wake from another thread lands. A coroutine
+// may be resumed only once per wait, so a sleep right after each timed
+// operation must last its full length. Every message that a send reported as
+// sent must be received, and a mutex handed to a waiter that gave up must
+// still be released.
+static neco_chan *racy;
+static atomic_long racy_sent, racy_recvd;
+static neco_mutex racy_mu;
+
+static int64_t short_deadline(void) {
+  return neco_now() + NECO_MICROSECOND * (rand() % 50);
+}
+
+static void check_sleep(void) {
+  int64_t start = neco_now();
+  neco_sleep(NECO_MICROSECOND * 200);
+  assert(neco_now() - start >= NECO_MICROSECOND * 200);
+}
+
+static void racy_sender(int argc, void *argv[]) {
+  for (int i = 0; i < NITER; i++) {
+    int ret = neco_chan_send_dl(racy, &(int){1}, short_deadline());
+    assert(ret == NECO_OK || ret == NECO_TIMEDOUT);
+    if (ret == NECO_OK) atomic_fetch_add(&racy_sent, 1);
+    if (i % 64 == 0) check_sleep();
+  }
+  OK(neco_waitgroup_done(&done));
+}
+
+static void racy_receiver(int argc, void *argv[]) {
+  for (int i = 0; i < NITER; i++) {
+    int v;
+    int ret = neco_chan_recv_dl(racy, &v, short_deadline());
+    assert(ret == NECO_OK || ret == NECO_TIMEDOUT);
+    if (ret == NECO_OK) atomic_fetch_add(&racy_recvd, 1);
+    if (i % 64 == 0) check_sleep();
+  }
+  // Drain what the senders may still hand over.
+  int v;
+  while (neco_chan_recv_dl(racy, &v, neco_now() + NECO_MILLISECOND * 20) == NECO_OK) {
+    atomic_fetch_add(&racy_recvd, 1);
+  }
+  OK(neco_waitgroup_done(&done));
+}
+
+static void racy_locker(int argc, void *argv[]) {
+  for (int i = 0; i < NITER; i++) {
+    int ret = neco_mutex_lock_dl(&racy_mu, short_deadline());
+    assert(ret == NECO_OK || ret == NECO_TIMEDOUT);
+    if (ret == NECO_OK) {
+      if (i % 2) neco_yield();
+      OK(neco_mutex_unlock(&racy_mu));
+    }
+    if (i % 64 == 0) check_sleep();
+  }
+  OK(neco_waitgroup_done(&done));
+}
+
+static void racy_waiter(int argc, void *argv[]) {
+  neco_waitgroup *wg = argv[0];
+  int ret = neco_waitgroup_wait_dl(wg, short_deadline());
+  assert(ret == NECO_OK || ret == NECO_TIMEDOUT);
+  check_sleep();
+  // Whether or not the wait timed out, the group completes.
+  OK(neco_waitgroup_wait(wg));
+  OK(neco_waitgroup_done(&done));
+}
+
+static void racy_done(int argc, void *argv[]) {
+  neco_sleep(NECO_MICROSECOND * (rand() % 50));
+  OK(neco_waitgroup_done(argv[0]));
+  OK(neco_waitgroup_done(&done));
+}
+
+static void test_deadline_races(void) {
+  OK(neco_chan_make_shared(&racy, sizeof(int), 0));
+  OK(neco_waitgroup_add(&done, NJOBS));
+  for (int i = 0; i < NJOBS; i++) {
+    OK(neco_pool_start_on(pool, i % NTHREADS, i % 2 ? racy_sender : racy_receiver, 0));
+  }
+  OK(neco_waitgroup_wait(&done));
+  assert(atomic_load(&racy_sent) == atomic_load(&racy_recvd));
+  OK(neco_chan_release(racy));
+
+  OK(neco_mutex_init_shared(&racy_mu));
+  run_jobs(NJOBS, racy_locker);
+  OK(neco_mutex_trylock(&racy_mu));
+  OK(neco_mutex_unlock(&racy_mu));
+
+  for (int round = 0; round < 100; round++) {
+    neco_waitgroup wg;
+    OK(neco_waitgroup_init_shared(&wg));
+    OK(neco_waitgroup_add(&wg, 1));
+    OK(neco_waitgroup_add(&done, NTHREADS + 1));
+    for (int i = 0; i < NTHREADS; i++) OK(neco_pool_start_on(pool, i, racy_waiter, 1, &wg));
+    OK(neco_pool_start(pool, racy_done, 1, &wg));
+    OK(neco_waitgroup_wait(&done));
+  }
+}
+
+static void test_main(int argc, void *argv[]) {
+  OK(neco_pool_new(&pool, NTHREADS));
+  OK(neco_waitgroup_init_shared(&done));
+  test_mutex_counter();
+  test_chan_exactly_once(0);
+  test_chan_exactly_once(8);
+  test_select_mixed();
+  test_waitgroup_wait();
+  test_deadline_races();
+  OK(neco_pool_free(pool));
+}
+
+int main(void) {
+  OK(neco_start(test_main, 0));
+  fprintf(stderr, "neco_shared_test: ok\n");
+  return 0;
+}